@@ -0,0 +1,1471 @@
+/*
+  Drives the filesystem engine directly, without fuse, through a set of
+  reproducible workloads and prints one JSON object per workload on stdout.
+
+  userfs_bench [--image file] [--size bytes] [--block-size list] [--bytes-per-inode n] [--data-checksums] [--encrypt] [--seed n] [--workload name]
+
+  Every workload starts from a freshly formatted image. Latencies are per
+  engine call, throughput counts engine calls and file bytes moved.
+  --block-size takes a comma separated list of sizes (4K,16K,64K) and runs
+  every workload once per size. Space efficiency is the bytes of the files
+  left on the image over the bytes of the data blocks they hold.
+  --data-checksums formats every image with checksums on the data blocks,
+  the *_csum workloads always do so the two can be compared in one run.
+  --encrypt and the *_crypt workloads do the same for encryption.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <unistd.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "../src/userfs.h"
+#include "../src/blocks.h"
+#include "../src/file.h"
+#include "../src/dir.h"
+#include "../src/inode.h"
+#include "../src/sb.h"
+#include "../src/util.h"
+#include "../src/stats.h"
+#include "../src/ops.h"
+#include "../src/crc.h"
+#include "../src/disk.h"
+#include "../src/defrag.h"
+#include "../src/build.h"
+#include "../src/recover.h"
+#include "../src/reclaim.h"
+#include "../src/crypt.h"
+
+typedef struct result_s {
+	const char * workload;
+	uint64_t * latencies;
+	int ops;
+	int cap;
+	uint64_t bytes;
+	uint64_t start_ns;
+	uint64_t end_ns;
+	uint64_t file_bytes;
+	uint64_t alloc_bytes;
+	uint64_t disk_bytes; //written to the image by the timed calls
+	int files;
+	int extents; //runs of neighbouring blocks in those files
+	uint64_t image_bytes; //the host keeps for the image after unmounting
+} result;
+
+#define MAX_SIZES 8
+
+static char * image = "/tmp/userfs_bench.img";
+static char * meta_image = "/dev/shm/userfs_bench.meta";
+static char * source_dir = "/tmp/userfs_bench_src";
+static int64_t image_size = 4 * 1024 * 1024 - 4096;
+static int block_sizes[MAX_SIZES] = { DEFAULT_BLOCK_SIZE };
+static int num_block_sizes = 1;
+static int block_size;
+static int bytes_per_inode = DEFAULT_BYTES_PER_INODE;
+static bool data_checksums = false;
+static bool encrypt = false;
+static DISK_LBA formatted_free;
+static char * only = NULL;
+
+static void add_latency(result * r, uint64_t ns) {
+	if (r->ops == r->cap) {
+		r->cap = r->cap ? r->cap * 2 : 1024;
+		r->latencies = realloc(r->latencies, r->cap * sizeof(uint64_t));
+	}
+	r->latencies[r->ops++] = ns;
+}
+
+static void sample(result * r, uint64_t start) {
+	add_latency(r, stats_now() - start);
+}
+
+/* times one engine call, counts what it wrote to disk and evaluates to its return value */
+#define TIME(r, call) ({ \
+	uint64_t _written = disk_bytes_written; \
+	uint64_t _start = stats_now(); \
+	int _res = (call); \
+	sample((r), _start); \
+	(r)->disk_bytes += disk_bytes_written - _written; \
+	_res; \
+	})
+
+static int by_value(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static double pct(result * r, double p) {
+	if (r->ops == 0)
+		return 0;
+	return r->latencies[(int)((r->ops - 1) * p)] / 1000.0;
+}
+
+static void report(result * r) {
+	double seconds = (r->end_ns - r->start_ns) / 1e9;
+	qsort(r->latencies, r->ops, sizeof(uint64_t), by_value);
+	printf("{\"workload\":\"%s\",\"block_size\":%d,\"ops\":%d,\"bytes\":%lu,\"seconds\":%.6f,"
+		"\"ops_per_sec\":%.1f,\"mb_per_sec\":%.3f,"
+		"\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f,"
+		"\"file_bytes\":%lu,\"alloc_bytes\":%lu,\"space_eff\":%.3f,\"disk_bytes_per_op\":%.1f,"
+		"\"extents_per_file\":%.2f,\"image_bytes\":%lu}\n",
+		r->workload, block_size, r->ops, r->bytes, seconds,
+		seconds > 0 ? r->ops / seconds : 0,
+		seconds > 0 ? r->bytes / seconds / (1024 * 1024) : 0,
+		pct(r, 0.50), pct(r, 0.90), pct(r, 0.99), pct(r, 1.0),
+		r->file_bytes, r->alloc_bytes,
+		r->alloc_bytes ? (double)r->file_bytes / r->alloc_bytes : 0,
+		r->ops ? (double)r->disk_bytes / r->ops : 0,
+		r->files ? (double)r->extents / r->files : 0, r->image_bytes);
+	fflush(stdout);
+	free(r->latencies);
+}
+
+/* formats and mounts disk, one image file or a list to stripe over a chunk at a time */
+static void fresh_disk(char * disk, int chunk) {
+	format_options opts;
+	init_format_options(&opts, image_size);
+	opts.block_size = block_size;
+	opts.bytes_per_inode = bytes_per_inode;
+	opts.data_checksums = data_checksums;
+	opts.encrypt = encrypt;
+	opts.stripe_chunk = chunk;
+	if (!u_format(&opts, disk) || !u_mount(disk)) {
+		fprintf(stderr, "Unable to format %s\n", disk);
+		exit(-1);
+	}
+	formatted_free = u_quota();
+}
+
+static void fresh_image() {
+	unlink(image);
+	fresh_disk(image, DEFAULT_STRIPE_CHUNK > block_size ? DEFAULT_STRIPE_CHUNK : block_size);
+}
+
+static int add_size(const dir_entry * e, void * arg) {
+	result * r = arg;
+	struct stat st;
+	inode in;
+	int b;
+	if (u_getattr(e->file_name, &st) == 0)
+		r->file_bytes += st.st_size;
+	if (read_inode(e->inode_number, &in) && in.no_blocks > 0) {
+		r->files++;
+		for (b = 0; b < in.no_blocks; b++)
+			r->extents += b == 0 || in.blocks[b] != in.blocks[b - 1] + 1;
+	}
+	return 0;
+}
+
+/* file bytes, data block bytes and extents on the mounted image, call before unmounting */
+static void space(result * r) {
+	r->file_bytes = 0;
+	r->files = r->extents = 0;
+	dir_for_each(add_size, r);
+	r->alloc_bytes = (uint64_t)(formatted_free - u_quota()) * BLOCK_SIZE_BYTES;
+}
+
+static void name_of(char * name, int i) {
+	snprintf(name, MAX_FILE_NAME_SIZE + 1, "/f%d", i);
+}
+
+/* as many empty files as the inode table holds */
+static void create_storm(result * r) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	int i;
+	fresh_image();
+	r->start_ns = stats_now();
+	for (i = 0; ; i++) {
+		name_of(name, i);
+		if (TIME(r, u_create(name, 0666)) < 0)
+			break;
+	}
+	r->end_ns = stats_now();
+	r->ops--; //the failing create
+	u_unmount();
+}
+
+/* appends io_size bytes at a time until each file reaches its size limit */
+static void sequential_write(result * r, int io_size, int files) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	char * buf = malloc(io_size);
+	int f, res;
+	off_t offset;
+	memset(buf, 'w', io_size);
+	fresh_image();
+	r->start_ns = stats_now();
+	for (f = 0; f < files; f++) {
+		name_of(name, f);
+		u_create(name, 0666);
+		for (offset = 0; ; offset += res) {
+			res = TIME(r, u_write(name, buf, io_size, offset));
+			if (res <= 0)
+				break;
+			r->bytes += res;
+		}
+		r->ops--;
+	}
+	r->end_ns = stats_now();
+	free(buf);
+	space(r);
+	u_unmount();
+}
+
+static void seq_write_small(result * r) {
+	sequential_write(r, 512, 2);
+}
+
+static void seq_write_large(result * r) {
+	sequential_write(r, 64 * 1024, 8);
+}
+
+/* 4 KB reads at uniformly random offsets of one full file */
+static void random_read(result * r) {
+	char buf[4096];
+	struct stat st;
+	int i, res;
+	off_t offset;
+	sequential_write(r, sizeof(buf), 1);
+	memset(r, 0, sizeof(result));
+	r->workload = "random_read";
+
+	u_mount(image);
+	u_getattr("/f0", &st);
+	r->start_ns = stats_now();
+	for (i = 0; i < 20000; i++) {
+		offset = lrand48() % (st.st_size - sizeof(buf));
+		res = TIME(r, u_read("/f0", buf, sizeof(buf), offset));
+		if (res > 0)
+			r->bytes += res;
+	}
+	r->end_ns = stats_now();
+	u_unmount();
+}
+
+/* runs a workload on images with data block checksums, under its own name */
+static void with_data_checksums(result * r, void (*run)(result *)) {
+	const char * name = r->workload;
+	bool was = data_checksums;
+	data_checksums = true;
+	run(r);
+	data_checksums = was;
+	r->workload = name;
+}
+
+static void seq_write_small_csum(result * r) {
+	with_data_checksums(r, seq_write_small);
+}
+
+static void seq_write_large_csum(result * r) {
+	with_data_checksums(r, seq_write_large);
+}
+
+static void random_read_csum(result * r) {
+	with_data_checksums(r, random_read);
+}
+
+/* runs a workload on encrypted images, under its own name */
+static void with_encryption(result * r, void (*run)(result *)) {
+	const char * name = r->workload;
+	bool was = encrypt;
+	encrypt = true;
+	run(r);
+	encrypt = was;
+	r->workload = name;
+}
+
+static void seq_write_small_crypt(result * r) {
+	with_encryption(r, seq_write_small);
+}
+
+static void seq_write_large_crypt(result * r) {
+	with_encryption(r, seq_write_large);
+}
+
+static void random_read_crypt(result * r) {
+	with_encryption(r, random_read);
+}
+
+/* 
+   crc32c of one block of random bytes per timed call, with the crc32
+   instruction when the cpu has it or with the slicing by 8 tables
+*/
+static void checksum_blocks(result * r, uint32_t (*crc)(uint32_t, const void *, size_t)) {
+	unsigned char * buf = malloc(block_size);
+	volatile uint32_t sink;
+	uint64_t start;
+	int i;
+	for (i = 0; i < block_size; i++)
+		buf[i] = lrand48();
+	r->start_ns = stats_now();
+	for (i = 0; i < 100000; i++) {
+		start = stats_now();
+		sink = crc(0, buf, block_size);
+		sample(r, start);
+		r->bytes += block_size;
+	}
+	r->end_ns = stats_now();
+	(void)sink;
+	free(buf);
+}
+
+static void checksum(result * r) {
+	checksum_blocks(r, crc32c);
+}
+
+static void checksum_sw(result * r) {
+	checksum_blocks(r, crc32c_sw);
+}
+
+/* XTS of count blocks in memory, with the keys of a freshly formatted encrypted image */
+static void encrypt_blocks(result * r, void (*xts)(uint64_t, void *, size_t), int count) {
+	unsigned char * buf = malloc(block_size);
+	uint64_t start;
+	bool was = encrypt;
+	int i;
+	encrypt = true;
+	fresh_image();
+	encrypt = was;
+	for (i = 0; i < block_size; i++)
+		buf[i] = lrand48();
+	r->start_ns = stats_now();
+	for (i = 0; i < count; i++) {
+		start = stats_now();
+		xts(i * (block_size / CRYPT_UNIT), buf, block_size);
+		sample(r, start);
+		r->bytes += block_size;
+	}
+	r->end_ns = stats_now();
+	free(buf);
+	u_unmount();
+}
+
+static void encrypt_hw(result * r) {
+	encrypt_blocks(r, xts_encrypt, 100000);
+}
+
+static void encrypt_sw(result * r) {
+	//the software cipher is a hundred times slower
+	encrypt_blocks(r, xts_encrypt_sw, 1000);
+}
+
+/* create, write a few blocks and unlink over a small working set */
+static void unlink_churn(result * r) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	char buf[3 * 4096];
+	int i;
+	memset(buf, 'u', sizeof(buf));
+	fresh_image();
+	r->start_ns = stats_now();
+	for (i = 0; i < 2000; i++) {
+		name_of(name, lrand48() % 16);
+		if (u_open(name) == 0) {
+			TIME(r, u_unlink(name));
+		} else if (u_create(name, 0666) == 0) {
+			r->bytes += u_write(name, buf, sizeof(buf), 0);
+		}
+	}
+	r->end_ns = stats_now();
+	space(r);
+	u_unmount();
+}
+
+/* 
+   Unlinks every other file of the largest size and truncates the rest to
+   a byte, with the blocks freed in the call or left on the orphan list.
+   What the reclaimer does between the rounds is not timed.
+*/
+static void drop_large(result * r, bool deferred) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	size_t size = (size_t)MAX_BLOCKS_PER_FILE * block_size;
+	char * buf = malloc(size);
+	int round, i, files;
+	memset(buf, 'l', size);
+	fresh_image();
+	reclaim_set_background(deferred);
+	r->start_ns = stats_now();
+	for (round = 0; round < 8; round++) {
+		for (files = 0; files < 64; files++) {
+			name_of(name, files);
+			u_create(name, 0666);
+			if (u_write(name, buf, size, 0) != size)
+				break;
+		}
+		for (i = 0; i < files; i++) {
+			name_of(name, i);
+			if (i % 2)
+				TIME(r, u_truncate(name, 1));
+			else
+				TIME(r, u_unlink(name));
+		}
+		reclaim_all();
+	}
+	r->end_ns = stats_now();
+	reclaim_set_background(false);
+	free(buf);
+	u_unmount();
+}
+
+static void drop_large_sync(result * r) {
+	drop_large(r, false);
+}
+
+static void drop_large_async(result * r) {
+	drop_large(r, true);
+}
+
+/* 
+   Fills the image with files whose sizes are mostly small with a long
+   tail, each written in one call, until the directory or the disk is
+   full. The sizes only depend on the seed so every block size stores the
+   same files.
+*/
+static void mixed_fill(result * r) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	int max_size = MAX_BLOCKS_PER_FILE * MIN_BLOCK_SIZE;
+	char * buf = malloc(max_size);
+	int i, size, res;
+	long pick;
+	memset(buf, 'm', max_size);
+	fresh_image();
+	r->start_ns = stats_now();
+	for (i = 0; ; i++) {
+		pick = lrand48() % 100;
+		if (pick < 70)
+			size = 1 + lrand48() % 4096;
+		else if (pick < 95)
+			size = 4096 + lrand48() % (60 * 1024);
+		else
+			size = 64 * 1024 + lrand48() % (max_size - 64 * 1024);
+		name_of(name, i);
+		if (u_create(name, 0666) < 0)
+			break;
+		res = TIME(r, u_write(name, buf, size, 0));
+		if (res < size) {
+			u_unlink(name);
+			break;
+		}
+		r->bytes += res;
+	}
+	r->end_ns = stats_now();
+	free(buf);
+	space(r);
+	u_unmount();
+}
+
+typedef struct page_s {
+	int used; //bytes of the page taken, like a fuse readdir buffer
+	off_t last; //offset to resume from
+	int entries;
+} page;
+
+#define PAGE_BYTES 4096
+
+static int fill_page(void * buf, const char * name, const struct stat * stbuf, off_t offset) {
+	page * p = buf;
+	int size = (24 + strlen(name) + 7) & ~7;
+	if (p->used + size > PAGE_BYTES)
+		return 1;
+	p->used += size;
+	p->last = offset;
+	p->entries++;
+	return 0;
+}
+
+/* lists a full directory a page at a time, each timed call is one page */
+static void list_dir(result * r) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	page p;
+	int i, files, listed;
+	fresh_image();
+	for (files = 0; files < 4096; files++) {
+		name_of(name, files);
+		if (u_create(name, 0666) < 0)
+			break;
+	}
+	r->start_ns = stats_now();
+	for (i = 0; i < 20; i++) {
+		p.last = 0;
+		listed = 0;
+		do {
+			p.used = 0;
+			p.entries = 0;
+			TIME(r, u_readdir("/", &p, fill_page, p.last));
+			listed += p.entries;
+		} while (p.entries > 0);
+		r->ops--; //the empty page that ends the listing
+		if (listed != files + 4)
+			fprintf(stderr, "list_dir: listed %d of %d entries\n", listed, files + 4);
+	}
+	r->end_ns = stats_now();
+	u_unmount();
+}
+
+/* files of blocks 4 KB blocks each, filled with c */
+static void populate(int files, int blocks, char c) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	char buf[4096];
+	int f, b;
+	memset(buf, c, sizeof(buf));
+	for (f = 0; f < files; f++) {
+		name_of(name, f);
+		u_create(name, 0666);
+		for (b = 0; b < blocks; b++)
+			u_write(name, buf, sizeof(buf), b * sizeof(buf));
+	}
+}
+
+/* 
+   4 KB overwrites at random block aligned offsets of 64 files, after a
+   snapshot when snap is set. The first write to a block a snapshot
+   shares copies the block and the inode block in front of it.
+*/
+static void overwrite_files(result * r, bool snap) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	char buf[4096];
+	int i, res;
+	memset(buf, 'o', sizeof(buf));
+	fresh_image();
+	populate(64, 4, 'p');
+	if (snap)
+		u_snapshot("bench");
+	r->start_ns = stats_now();
+	for (i = 0; i < 4000; i++) {
+		name_of(name, lrand48() % 64);
+		res = TIME(r, u_write(name, buf, sizeof(buf), (lrand48() % 4) * sizeof(buf)));
+		if (res > 0)
+			r->bytes += res;
+	}
+	r->end_ns = stats_now();
+	space(r);
+	u_unmount();
+}
+
+static void overwrite(result * r) {
+	overwrite_files(r, false);
+}
+
+static void snapshot_overwrite(result * r) {
+	overwrite_files(r, true);
+}
+
+/* 
+   Snapshots of a populated image, each after a round of overwrites, all
+   of them deleted again once there are MAX_SNAPSHOTS. Only creation is
+   timed, it copies the inode map root whatever the number of files.
+*/
+static void snapshot_take(result * r) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	char buf[4096];
+	int round, i, f;
+	memset(buf, 's', sizeof(buf));
+	fresh_image();
+	populate(256, 1, 'p');
+	r->start_ns = stats_now();
+	for (round = 0; round < 4; round++) {
+		for (i = 0; i < MAX_SNAPSHOTS; i++) {
+			for (f = 0; f < 8; f++) {
+				name_of(name, lrand48() % 256);
+				u_write(name, buf, 100, 0);
+			}
+			snprintf(name, sizeof(name), "s%d", i);
+			TIME(r, u_snapshot(name));
+		}
+		for (i = 0; i < MAX_SNAPSHOTS; i++) {
+			snprintf(name, sizeof(name), "s%d", i);
+			u_delete_snapshot(name);
+		}
+	}
+	r->end_ns = stats_now();
+	u_unmount();
+}
+
+/* recovery of a populated image that was not shut down cleanly */
+static void fsck_dirty(result * r) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	char buf[16 * 4096];
+	int i;
+	memset(buf, 'f', sizeof(buf));
+	fresh_image();
+	for (i = 0; i < 32; i++) {
+		name_of(name, i);
+		if (u_create(name, 0666) < 0)
+			break;
+		u_write(name, buf, sizeof(buf), 0);
+	}
+	//leave the image dirty, as if we crashed
+	disk_close();
+
+	r->start_ns = stats_now();
+	for (i = 0; i < 20; i++) {
+		if (!TIME(r, recover_file_system(image)))
+			break;
+		disk_close();
+	}
+	r->end_ns = stats_now();
+	u_mount(image);
+	u_unmount();
+}
+
+/* the mount of a dirty image as a background recovery does it, up to the first read of a file */
+static int mount_and_read(char * name, char * buf, size_t size) {
+	struct stat st;
+	if (!recover_file_system(image) || u_getattr(name, &st) < 0)
+		return 0;
+	return u_read(name, buf, size, 0) > 0;
+}
+
+/* like fsck_dirty, but the check is left to run behind the mount */
+static void mount_dirty_background(result * r) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	char buf[16 * 4096];
+	int i;
+	memset(buf, 'f', sizeof(buf));
+	fresh_image();
+	for (i = 0; i < 32; i++) {
+		name_of(name, i);
+		if (u_create(name, 0666) < 0)
+			break;
+		u_write(name, buf, sizeof(buf), 0);
+	}
+	disk_close();
+
+	recovery_set_background(true);
+	name_of(name, 31);
+	r->start_ns = stats_now();
+	for (i = 0; i < 20; i++) {
+		if (!TIME(r, mount_and_read(name, buf, 4096)))
+			break;
+		//what the background thread does after the mount is not timed
+		recovery_finish();
+		disk_close();
+	}
+	r->end_ns = stats_now();
+	recovery_set_background(false);
+	u_mount(image);
+	u_unmount();
+}
+
+/* 
+   Writers appending 4 KB at a time to their own files in turn, as
+   concurrent writers would, until the files reach their size limit
+*/
+static void interleaved_write(result * r) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	char buf[4096];
+	int f, files = 8, res, done = 0;
+	off_t offset;
+	memset(buf, 'i', sizeof(buf));
+	fresh_image();
+	for (f = 0; f < files; f++) {
+		name_of(name, f);
+		u_create(name, 0666);
+	}
+	r->start_ns = stats_now();
+	for (offset = 0; !done; offset += sizeof(buf)) {
+		for (f = 0; f < files; f++) {
+			name_of(name, f);
+			res = TIME(r, u_write(name, buf, sizeof(buf), offset));
+			if (res <= 0)
+				done = 1;
+			else
+				r->bytes += res;
+		}
+	}
+	r->end_ns = stats_now();
+	space(r);
+	u_unmount();
+}
+
+/*
+   Forks as a mount without -f does once the disk is open, the rest of the
+   bench runs in the child. The parent waits for it and exits as it did.
+*/
+static void daemonize() {
+	int status;
+	pid_t pid;
+	fflush(stdout);
+	if ((pid = fork()) == 0)
+		return;
+	waitpid(pid, &status, 0);
+	exit(WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+}
+
+/* 
+   Whole files written with one call each, or read back ten times over,
+   on an image striped over members files next to the image. The chunk
+   is a block, so every call keeps every member busy. With daemon the
+   files are written and read after a fork, as through a mount.
+*/
+static void striped(result * r, int members, bool read, bool daemon) {
+	char disk[MAX_DISK_MEMBERS * (PATH_MAX + 1)], member[PATH_MAX];
+	char name[MAX_FILE_NAME_SIZE + 1];
+	int size = MAX_BLOCKS_PER_FILE * block_size;
+	char * buf = malloc(size);
+	int m, f, files, pass, res;
+
+	disk[0] = '\0';
+	for (m = 0; m < members; m++) {
+		snprintf(member, sizeof(member), "%s%s.%d", m ? "," : "", image, m);
+		strcat(disk, member);
+		unlink(member + (m ? 1 : 0));
+	}
+	memset(buf, 's', size);
+	fresh_disk(disk, block_size);
+	if (daemon)
+		daemonize();
+	if (!read)
+		r->start_ns = stats_now();
+	for (files = 0; ; files++) {
+		name_of(name, files);
+		if (u_create(name, 0666) < 0)
+			break;
+		res = read ? u_write(name, buf, size, 0) : TIME(r, u_write(name, buf, size, 0));
+		if (res < size)
+			break;
+		r->bytes += read ? 0 : res;
+	}
+	if (read) {
+		r->start_ns = stats_now();
+		for (pass = 0; pass < 10; pass++) {
+			for (f = 0; f < files; f++) {
+				name_of(name, f);
+				res = TIME(r, u_read(name, buf, size, 0));
+				if (res > 0)
+					r->bytes += res;
+			}
+		}
+	}
+	r->end_ns = stats_now();
+	space(r);
+	u_unmount();
+	for (m = 0; m < members; m++) {
+		snprintf(member, sizeof(member), "%s.%d", image, m);
+		unlink(member);
+	}
+	free(buf);
+}
+
+static void stripe_write_1(result * r) {
+	striped(r, 1, false, false);
+}
+
+static void stripe_write_2(result * r) {
+	striped(r, 2, false, false);
+}
+
+static void stripe_write_4(result * r) {
+	striped(r, 4, false, false);
+}
+
+static void stripe_read_1(result * r) {
+	striped(r, 1, true, false);
+}
+
+static void stripe_read_2(result * r) {
+	striped(r, 2, true, false);
+}
+
+static void stripe_read_4(result * r) {
+	striped(r, 4, true, false);
+}
+
+static void stripe_daemon_4(result * r) {
+	striped(r, 4, true, true);
+}
+
+/* 
+   Files created and synced one at a time, with a large file appended to
+   now and then, on one image or with the metadata on meta_image. The
+   fsyncs after the creates are timed.
+*/
+static void create_sync(result * r, bool separate) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	char * buf = malloc(64 * 1024);
+	int i;
+	memset(buf, 'm', 64 * 1024);
+	if (separate) {
+		unlink(meta_image);
+		disk_set_meta(meta_image);
+	}
+	fresh_image();
+	u_create("large", 0666);
+	r->start_ns = stats_now();
+	for (i = 0; i < 200; i++) {
+		if (i % 10 == 0)
+			u_write("large", buf, 64 * 1024, (i / 10 % 4) * 64 * 1024);
+		name_of(name, i);
+		u_create(name, 0666);
+		TIME(r, u_fsync(name));
+	}
+	r->end_ns = stats_now();
+	space(r);
+	u_unmount();
+	disk_set_meta(NULL);
+	unlink(meta_image);
+	free(buf);
+}
+
+static void create_sync_shared(result * r) {
+	create_sync(r, false);
+}
+
+static void create_sync_separate(result * r) {
+	create_sync(r, true);
+}
+
+/* 
+   Files grown a block at a time in turn, so their blocks alternate, then
+   read whole, as they are or after a defragmentation pass moved them
+*/
+static void fragmented(result * r, bool defrag) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	int files = 8, blocks = 50, size = blocks * block_size;
+	char * buf = malloc(size);
+	defrag_report report;
+	int b, f, pass, res;
+
+	memset(buf, 'f', size);
+	fresh_image();
+	for (f = 0; f < files; f++) {
+		name_of(name, f);
+		u_create(name, 0666);
+	}
+	for (b = 0; b < blocks; b++) {
+		for (f = 0; f < files; f++) {
+			name_of(name, f);
+			u_write(name, buf, block_size, (off_t)b * block_size);
+		}
+	}
+	if (defrag)
+		defrag_pass(&report, 0, NULL, NULL);
+	r->start_ns = stats_now();
+	for (pass = 0; pass < 10; pass++) {
+		for (f = 0; f < files; f++) {
+			name_of(name, f);
+			res = TIME(r, u_read(name, buf, size, 0));
+			if (res > 0)
+				r->bytes += res;
+		}
+	}
+	r->end_ns = stats_now();
+	space(r);
+	u_unmount();
+	free(buf);
+}
+
+static void fragmented_read(result * r) {
+	fragmented(r, false);
+}
+
+static void defragmented_read(result * r) {
+	fragmented(r, true);
+}
+
+/* 
+   Rounds of files written and mostly unlinked again, synced after each.
+   Freed blocks are punched out of the image, so what the host keeps for
+   it follows what the files hold.
+*/
+static void churn_space(result * r) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	char buf[200 * 1024];
+	struct stat st;
+	int round, f, files = 14;
+	memset(buf, 'h', sizeof(buf));
+	fresh_image();
+	r->start_ns = stats_now();
+	for (round = 0; round < 20; round++) {
+		for (f = 0; f < files; f++) {
+			name_of(name, round * files + f);
+			if (u_create(name, 0666) == 0)
+				r->bytes += u_write(name, buf, sizeof(buf), 0);
+		}
+		//one file every fifth round is kept
+		for (f = round % 5 == 0; f < files; f++) {
+			name_of(name, round * files + f);
+			u_unlink(name);
+		}
+		name_of(name, round / 5 * 5 * files);
+		TIME(r, u_fsync(name));
+	}
+	r->end_ns = stats_now();
+	space(r);
+	u_unmount();
+	if (stat(image, &st) == 0)
+		r->image_bytes = (uint64_t)st.st_blocks * 512;
+}
+
+/* host files of up to 16 blocks of 4 KB, together half the image size, to fill an image with */
+static int make_source(uint64_t * bytes) {
+	char path[PATH_MAX];
+	char * buf = malloc(64 * 1024);
+	int files, size;
+	FILE * f;
+	mkdir(source_dir, 0700);
+	*bytes = 0;
+	for (files = 0; *bytes < image_size / 2; files++) {
+		size = (1 + lrand48() % 16) * 4096 - lrand48() % 4096;
+		memset(buf, 'a' + files % 26, size);
+		snprintf(path, sizeof(path), "%s/f%d", source_dir, files);
+		if ((f = fopen(path, "w")) == NULL)
+			break;
+		fwrite(buf, 1, size, f);
+		fclose(f);
+		*bytes += size;
+	}
+	free(buf);
+	return files;
+}
+
+static void remove_source(int files) {
+	char path[PATH_MAX];
+	int i;
+	for (i = 0; i < files; i++) {
+		snprintf(path, sizeof(path), "%s/f%d", source_dir, i);
+		unlink(path);
+	}
+	rmdir(source_dir);
+}
+
+/* 
+   An image filled from a host directory, file by file through the engine
+   a block at a time as a copy onto a mount would, or by the bulk builder.
+   The time runs until the image is unmounted.
+*/
+static void fill_image(result * r, bool build) {
+	char name[MAX_FILE_NAME_SIZE + 1], path[PATH_MAX];
+	char * buf = malloc(64 * 1024);
+	int files = make_source(&r->bytes), f, n, at;
+	format_options opts;
+	uint64_t start;
+	FILE * in;
+
+	//formatted the same way by both, for the free count space() starts from
+	fresh_image();
+	if (build) {
+		u_unmount();
+		init_format_options(&opts, image_size);
+		opts.block_size = block_size;
+		opts.bytes_per_inode = bytes_per_inode;
+		opts.data_checksums = data_checksums;
+		opts.encrypt = encrypt;
+		r->start_ns = stats_now();
+		TIME(r, u_build(&opts, image, source_dir, DEFAULT_BUILD_THREADS));
+	} else {
+		r->start_ns = stats_now();
+		for (f = 0; f < files; f++) {
+			start = stats_now();
+			snprintf(path, sizeof(path), "%s/f%d", source_dir, f);
+			if ((in = fopen(path, "r")) == NULL)
+				continue;
+			n = fread(buf, 1, 64 * 1024, in);
+			fclose(in);
+			snprintf(name, sizeof(name), "/f%d", f);
+			u_create(name, 0666);
+			for (at = 0; at < n; at += 4096)
+				u_write(name, buf + at, n - at < 4096 ? n - at : 4096, at);
+			sample(r, start);
+		}
+		u_unmount();
+	}
+	r->end_ns = stats_now();
+	u_mount(image);
+	space(r);
+	u_unmount();
+	remove_source(files);
+	free(buf);
+}
+
+static void populate_files(result * r) {
+	fill_image(r, false);
+}
+
+static void build_image(result * r) {
+	fill_image(r, true);
+}
+
+/* one of the writers of alloc_threads, with the blocks it holds */
+typedef struct allocator_s {
+	pthread_t thread;
+	int home;
+	int count;
+	DISK_LBA * blocks;
+	result r;
+} allocator;
+
+/* claims its blocks one after the other from its home shard on and gives them back, a few times over */
+static void * allocate_blocks(void * arg) {
+	allocator * a = arg;
+	DISK_LBA goal;
+	uint64_t start;
+	int i, pass;
+	for (pass = 0; pass < 10; pass++) {
+		if (pass > 0) {
+			for (i = 0; i < a->count; i++)
+				free_block(a->blocks[i]);
+		}
+		goal = shard_start(0, a->home);
+		for (i = 0; i < a->count; i++) {
+			start = stats_now();
+			goal = a->blocks[i] = claim_block(goal);
+			sample(&a->r, start);
+			if (goal < 0) {
+				a->count = i;
+				break;
+			}
+			goal++;
+		}
+	}
+	return NULL;
+}
+
+/* 
+   Half the free space claimed block by block by writers in threads of
+   their own, each from its own home shard, the way the writers of a
+   multithreaded mount would grow their files. Their extents are the
+   runs of neighbouring blocks each writer ended up with.
+*/
+static void alloc_threads(result * r, int threads) {
+	allocator a[4];
+	int t, i;
+	fresh_image();
+	for (t = 0; t < threads; t++) {
+		memset(&a[t], 0, sizeof(a[t]));
+		a[t].home = t;
+		a[t].count = u_quota() / 2 / threads;
+		a[t].blocks = malloc(a[t].count * sizeof(DISK_LBA));
+	}
+	r->start_ns = stats_now();
+	for (t = 0; t < threads; t++)
+		pthread_create(&a[t].thread, NULL, allocate_blocks, &a[t]);
+	for (t = 0; t < threads; t++)
+		pthread_join(a[t].thread, NULL);
+	r->end_ns = stats_now();
+	for (t = 0; t < threads; t++) {
+		for (i = 0; i < a[t].r.ops; i++)
+			add_latency(r, a[t].r.latencies[i]);
+		r->files++;
+		for (i = 0; i < a[t].count; i++) {
+			r->extents += i == 0 || a[t].blocks[i] != a[t].blocks[i - 1] + 1;
+			free_block(a[t].blocks[i]);
+		}
+		free(a[t].blocks);
+		free(a[t].r.latencies);
+	}
+	u_unmount();
+}
+
+static void alloc_threads_1(result * r) {
+	alloc_threads(r, 1);
+}
+
+static void alloc_threads_2(result * r) {
+	alloc_threads(r, 2);
+}
+
+static void alloc_threads_4(result * r) {
+	alloc_threads(r, 4);
+}
+
+/* one of the writers of write_threads, with files of its own */
+typedef struct file_writer_s {
+	pthread_t thread;
+	pthread_rwlock_t * engine;
+	bool shared; //writes share the engine as in a mount, else each has it to itself
+	int first; //its files are numbered from here
+	int files;
+	result r;
+} file_writer;
+
+/* creates its files and fills each with 16 writes of 16K, taking the engine the way fs_write does */
+static void * write_files(void * arg) {
+	file_writer * w = arg;
+	char name[MAX_FILE_NAME_SIZE + 1];
+	char buf[16 * 1024];
+	uint64_t start;
+	int f, i, res;
+	memset(buf, 'w', sizeof(buf));
+	for (f = w->first; f < w->first + w->files; f++) {
+		name_of(name, f);
+		pthread_rwlock_wrlock(w->engine);
+		u_create(name, 0666);
+		pthread_rwlock_unlock(w->engine);
+		for (i = 0; i < 16; i++) {
+			start = stats_now();
+			res = -EAGAIN;
+			if (w->shared) {
+				pthread_rwlock_rdlock(w->engine);
+				res = u_write_shared(name, buf, sizeof(buf), (off_t)i * sizeof(buf));
+				pthread_rwlock_unlock(w->engine);
+			}
+			if (res == -EAGAIN) {
+				pthread_rwlock_wrlock(w->engine);
+				res = u_write(name, buf, sizeof(buf), (off_t)i * sizeof(buf));
+				pthread_rwlock_unlock(w->engine);
+			}
+			sample(&w->r, start);
+			if (res > 0)
+				w->r.bytes += res;
+		}
+	}
+	return NULL;
+}
+
+/* 
+   Half the free space written as files of 256K by writers in threads of
+   their own, each file by one writer. Shared is how a mount runs them,
+   the writes to different files in the engine at once with their blocks
+   claimed without locks, locked is each write with the engine to itself.
+*/
+static void write_threads(result * r, int threads, bool shared) {
+	pthread_rwlock_t engine = PTHREAD_RWLOCK_INITIALIZER;
+	file_writer w[4];
+	int t, i, files;
+	fresh_image();
+	files = u_quota() / 2 / (16 * 16 * 1024 / BLOCK_SIZE_BYTES) / threads;
+	for (t = 0; t < threads; t++) {
+		memset(&w[t], 0, sizeof(w[t]));
+		w[t].engine = &engine;
+		w[t].shared = shared;
+		w[t].first = t * files;
+		w[t].files = files > 0 ? files : 1;
+	}
+	r->start_ns = stats_now();
+	for (t = 0; t < threads; t++)
+		pthread_create(&w[t].thread, NULL, write_files, &w[t]);
+	for (t = 0; t < threads; t++)
+		pthread_join(w[t].thread, NULL);
+	r->end_ns = stats_now();
+	for (t = 0; t < threads; t++) {
+		for (i = 0; i < w[t].r.ops; i++)
+			add_latency(r, w[t].r.latencies[i]);
+		r->bytes += w[t].r.bytes;
+		free(w[t].r.latencies);
+	}
+	space(r);
+	u_unmount();
+}
+
+static void write_threads_1(result * r) {
+	write_threads(r, 1, true);
+}
+
+static void write_threads_4(result * r) {
+	write_threads(r, 4, true);
+}
+
+static void write_threads_4_locked(result * r) {
+	write_threads(r, 4, false);
+}
+
+typedef struct churner_s {
+	pthread_t thread;
+	pthread_mutex_t * engine; //NULL when the readers take no lock
+	bool stop;
+	int seed;
+	result r;
+} churner;
+
+static int list_page(const dir_entry * e, void * arg) {
+	return ++*(int *)arg == 32;
+}
+
+/* lookups of names that are mostly there, with a page of a listing every 16th call */
+static void * look_up(void * arg) {
+	churner * c = arg;
+	char name[MAX_FILE_NAME_SIZE + 1];
+	unsigned short seed[3] = { c->seed, c->seed >> 16, 1 };
+	file_struct file;
+	uint64_t start;
+	int i, listed;
+	for (i = 0; i < 20000; i++) {
+		start = stats_now();
+		if (c->engine)
+			pthread_mutex_lock(c->engine);
+		if (i % 16 == 0) {
+			listed = 0;
+			dir_for_each_from(nrand48(seed) * 2ULL << 32, list_page, &listed);
+		} else {
+			name_of(name, nrand48(seed) % 2560);
+			find_file(name, &file);
+		}
+		if (c->engine)
+			pthread_mutex_unlock(c->engine);
+		sample(&c->r, start);
+	}
+	return NULL;
+}
+
+/* creates and unlinks files under the engine until stopped */
+static void * churn(void * arg) {
+	churner * c = arg;
+	char name[MAX_FILE_NAME_SIZE + 1];
+	int i;
+	for (i = 0; !__atomic_load_n(&c->stop, __ATOMIC_RELAXED); i++) {
+		name_of(name, 2048 + i % 512);
+		pthread_mutex_lock(c->engine);
+		if (u_open(name) == 0)
+			u_unlink(name);
+		else
+			u_create(name, 0666);
+		pthread_mutex_unlock(c->engine);
+		c->r.ops++;
+	}
+	return NULL;
+}
+
+/* 
+   Four threads look names up and list pages of a directory of 2048
+   files while another creates and unlinks 512 more as fast as it can.
+   Locked does it as it was done before the directory versions: every
+   call takes the engine and lookups read the nodes of the tree. Only
+   the readers' calls are timed, the creates and unlinks are counted in
+   bytes.
+*/
+static void lookup_churn(result * r, bool locked) {
+	pthread_mutex_t engine = PTHREAD_MUTEX_INITIALIZER;
+	churner readers[4], writer;
+	int t, i;
+	fresh_image();
+	populate(2048, 0, 'l');
+	if (locked)
+		dir_unload();
+	memset(&writer, 0, sizeof(writer));
+	writer.engine = &engine;
+	pthread_create(&writer.thread, NULL, churn, &writer);
+	r->start_ns = stats_now();
+	for (t = 0; t < 4; t++) {
+		memset(&readers[t], 0, sizeof(readers[t]));
+		readers[t].engine = locked ? &engine : NULL;
+		readers[t].seed = lrand48();
+		pthread_create(&readers[t].thread, NULL, look_up, &readers[t]);
+	}
+	for (t = 0; t < 4; t++)
+		pthread_join(readers[t].thread, NULL);
+	r->end_ns = stats_now();
+	__atomic_store_n(&writer.stop, true, __ATOMIC_RELAXED);
+	pthread_join(writer.thread, NULL);
+	r->bytes = writer.r.ops;
+	for (t = 0; t < 4; t++) {
+		for (i = 0; i < readers[t].r.ops; i++)
+			add_latency(r, readers[t].r.latencies[i]);
+		free(readers[t].r.latencies);
+	}
+	u_unmount();
+}
+
+static void lookup_churn_free(result * r) {
+	lookup_churn(r, false);
+}
+
+static void lookup_churn_locked(result * r) {
+	lookup_churn(r, true);
+}
+
+/* files of 16 blocks each, numbered on from *files, until no more than keep blocks are free */
+static void fill_to(int * files, DISK_LBA keep, char * buf, size_t size) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	while (u_quota() > keep) {
+		name_of(name, *files);
+		if (u_create(name, 0666) != 0 || u_write(name, buf, size, 0) != size)
+			break;
+		(*files)++;
+	}
+}
+
+/* 
+   Doubles the image four times, filling it to seven eighths before each.
+   Online grows the mounted disk in place, otherwise every file is read
+   out, an image of the new size is formatted and they are written back,
+   the way it had to be done before. Only growing is timed, the files
+   written into the new space after it show it is usable at once.
+*/
+static void grow(result * r, bool online) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	size_t size = 16 * block_size;
+	char * buf = malloc(size), * copy = NULL;
+	int64_t formatted = image_size;
+	int round, files = 0, f;
+	uint64_t start;
+	memset(buf, 'g', size);
+	fresh_image();
+	r->start_ns = stats_now();
+	for (round = 0; round < 4; round++) {
+		fill_to(&files, u_quota() / 8, buf, size);
+		image_size *= 2;
+		r->bytes += (uint64_t)files * size;
+		if (online) {
+			TIME(r, u_grow(image_size));
+			continue;
+		}
+		start = stats_now();
+		copy = realloc(copy, files * size);
+		for (f = 0; f < files; f++) {
+			name_of(name, f);
+			u_read(name, copy + f * size, size, 0);
+		}
+		u_unmount();
+		fresh_image();
+		for (f = 0; f < files; f++) {
+			name_of(name, f);
+			u_create(name, 0666);
+			u_write(name, copy + f * size, size, 0);
+		}
+		sample(r, start);
+	}
+	fill_to(&files, 0, buf, size);
+	r->end_ns = stats_now();
+	image_size = formatted;
+	free(copy);
+	free(buf);
+	u_unmount();
+}
+
+static void grow_online(result * r) {
+	grow(r, true);
+}
+
+static void grow_by_copy(result * r) {
+	grow(r, false);
+}
+
+/* 
+   Grows the image to twice its size, fills it to three quarters and
+   unlinks every other file, then shrinks it back unmounted, which moves
+   the files in the half cut off into the gaps left before it. Only the
+   shrink is timed, disk_bytes_per_op is what it copied and wrote.
+*/
+static void shrink_offline(result * r) {
+	char name[MAX_FILE_NAME_SIZE + 1];
+	size_t size = 16 * block_size;
+	char * buf = malloc(size);
+	int files = 0, f;
+	memset(buf, 's', size);
+	fresh_image();
+	u_grow(image_size * 2);
+	fill_to(&files, u_quota() / 4, buf, size);
+	for (f = 0; f < files; f += 2) {
+		name_of(name, f);
+		u_unlink(name);
+	}
+	reclaim_all();
+	r->bytes = (uint64_t)(files / 2) * size;
+	r->start_ns = stats_now();
+	if (TIME(r, u_shrink(image_size)) != 0)
+		fprintf(stderr, "shrink_offline: the files did not fit\n");
+	r->end_ns = stats_now();
+	free(buf);
+	u_unmount();
+}
+
+static struct {
+	const char * name;
+	void (*run)(result *);
+} workloads[] = {
+	{ "create_storm", create_storm },
+	{ "seq_write_small", seq_write_small },
+	{ "seq_write_large", seq_write_large },
+	{ "random_read", random_read },
+	{ "unlink_churn", unlink_churn },
+	{ "drop_large_sync", drop_large_sync },
+	{ "drop_large_async", drop_large_async },
+	{ "mixed_fill", mixed_fill },
+	{ "list_dir", list_dir },
+	{ "fsck_dirty", fsck_dirty },
+	{ "mount_dirty_background", mount_dirty_background },
+	{ "overwrite", overwrite },
+	{ "snapshot_overwrite", snapshot_overwrite },
+	{ "snapshot_take", snapshot_take },
+	{ "seq_write_small_csum", seq_write_small_csum },
+	{ "seq_write_large_csum", seq_write_large_csum },
+	{ "random_read_csum", random_read_csum },
+	{ "seq_write_small_crypt", seq_write_small_crypt },
+	{ "seq_write_large_crypt", seq_write_large_crypt },
+	{ "random_read_crypt", random_read_crypt },
+	{ "encrypt", encrypt_hw },
+	{ "encrypt_sw", encrypt_sw },
+	{ "checksum", checksum },
+	{ "checksum_sw", checksum_sw },
+	{ "interleaved_write", interleaved_write },
+	{ "stripe_write_1", stripe_write_1 },
+	{ "stripe_write_2", stripe_write_2 },
+	{ "stripe_write_4", stripe_write_4 },
+	{ "stripe_read_1", stripe_read_1 },
+	{ "stripe_read_2", stripe_read_2 },
+	{ "stripe_read_4", stripe_read_4 },
+	{ "stripe_daemon_4", stripe_daemon_4 },
+	{ "alloc_threads_1", alloc_threads_1 },
+	{ "alloc_threads_2", alloc_threads_2 },
+	{ "alloc_threads_4", alloc_threads_4 },
+	{ "write_threads_1", write_threads_1 },
+	{ "write_threads_4", write_threads_4 },
+	{ "write_threads_4_locked", write_threads_4_locked },
+	{ "create_sync_shared", create_sync_shared },
+	{ "create_sync_separate", create_sync_separate },
+	{ "churn_space", churn_space },
+	{ "fragmented_read", fragmented_read },
+	{ "defragmented_read", defragmented_read },
+	{ "populate_files", populate_files },
+	{ "build_image", build_image },
+	{ "grow_online", grow_online },
+	{ "grow_by_copy", grow_by_copy },
+	{ "shrink_offline", shrink_offline },
+	{ "lookup_churn", lookup_churn_free },
+	{ "lookup_churn_locked", lookup_churn_locked },
+};
+
+int main(int argc, char **argv) {
+	long seed = 444;
+	int argi, w, s;
+	char * size, * sizes;
+	result r;
+
+	//the encrypted images are the bench's own
+	crypt_set_passphrase("userfs_bench");
+	for (argi = 1; argi < argc; argi++) {
+		if (strcmp(argv[argi], "--image") == 0 && argi + 1 < argc) {
+			image = argv[++argi];
+		} else if (strcmp(argv[argi], "--meta-image") == 0 && argi + 1 < argc) {
+			meta_image = argv[++argi];
+		} else if (strcmp(argv[argi], "--size") == 0 && argi + 1 < argc) {
+			image_size = parse_size(argv[++argi]);
+		} else if (strcmp(argv[argi], "--block-size") == 0 && argi + 1 < argc) {
+			sizes = argv[++argi];
+			for (num_block_sizes = 0; (size = strsep(&sizes, ",")) != NULL && num_block_sizes < MAX_SIZES; )
+				block_sizes[num_block_sizes++] = parse_size(size);
+		} else if (strcmp(argv[argi], "--bytes-per-inode") == 0 && argi + 1 < argc) {
+			bytes_per_inode = parse_size(argv[++argi]);
+		} else if (strcmp(argv[argi], "--data-checksums") == 0) {
+			data_checksums = true;
+		} else if (strcmp(argv[argi], "--encrypt") == 0) {
+			encrypt = true;
+		} else if (strcmp(argv[argi], "--seed") == 0 && argi + 1 < argc) {
+			seed = atol(argv[++argi]);
+		} else if (strcmp(argv[argi], "--workload") == 0 && argi + 1 < argc) {
+			only = argv[++argi];
+		} else {
+			fprintf(stderr, "Usage: %s [--image file] [--meta-image file] [--size bytes] [--block-size list] [--bytes-per-inode n] [--data-checksums] [--encrypt] [--seed n] [--workload name]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	for (s = 0; s < num_block_sizes; s++) {
+		block_size = block_sizes[s];
+		for (w = 0; w < sizeof(workloads) / sizeof(workloads[0]); w++) {
+			if (only != NULL && strcmp(only, workloads[w].name) != 0)
+				continue;
+			srand48(seed);
+			memset(&r, 0, sizeof(r));
+			r.workload = workloads[w].name;
+			workloads[w].run(&r);
+			report(&r);
+		}
+	}
+	unlink(image);
+	return 0;
+}
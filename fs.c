@@ -9,6 +9,7 @@ http://fuse.sourceforge.net/doxygen/structfuse__operations.html
 man errno.h
 */
 
+#define _GNU_SOURCE
 #define FUSE_USE_VERSION 26
 
 #include <fuse.h>
@@ -20,6 +21,8 @@ man errno.h
 #include <stdbool.h>
 #include <assert.h>
 #include <math.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "src/userfs.h"
 #include "src/dir.h"
@@ -27,342 +30,233 @@ man errno.h
 #include "src/blocks.h"
 #include "src/sb.h"
 #include "src/bitmap.h"
+#include "src/trace.h"
+#include "src/stats.h"
+#include "src/record.h"
+#include "src/crash.h"
+#include "src/util.h"
+#include "src/disk.h"
+#include "src/defrag.h"
+#include "src/build.h"
+#include "src/recover.h"
+#include "src/reclaim.h"
+#include "src/crypt.h"
+#include "src/ops.h"
 #include "fs.h"
 
-int min(int x, int y){
-	return x < y ? x : y;
-}
+/* 
+   The filesystem engine lives in src/ops.c, everything here is the glue
+   that hands fuse requests to it, times them for the stats file and
+   records them when --record is given. Once recovery has checked every
+   inode, lookups, getattr, readdir and opens are safe for several
+   threads at once. Writes to different files share the engine, see
+   u_write_shared. The other calls of a multithreaded mount take turns
+   in the engine, each with it to itself.
+*/
+//a call waiting for the engine to itself holds back new writes, or a stream of them would keep it out
+static pthread_rwlock_t engine_lock = PTHREAD_RWLOCK_WRITER_NONRECURSIVE_INITIALIZER_NP;
+
+#define TIMED_LOCKED(locked, id, path, new_path, offset, size, call) do { \
+	uint64_t start = stats_now(); \
+	bool lock = locked; \
+	if (lock) \
+		pthread_rwlock_wrlock(&engine_lock); \
+	int res = call; \
+	if (lock) \
+		pthread_rwlock_unlock(&engine_lock); \
+	stats_record(id, start); \
+	if (recording) \
+		record_op(id, path, new_path, offset, size, start, res); \
+	return res; \
+	} while (0)
 
-int max(int x, int y){
-	return x > y ? x : y;
+#define TIMED(id, path, new_path, offset, size, call) \
+	TIMED_LOCKED(true, id, path, new_path, offset, size, call)
+
+/* the stats file is rendered from the counters alone, reading or resetting it never waits for the engine */
+static bool engine_file(const char * path) {
+	return strcmp(path, STATS_FILE) != 0;
 }
 
-/* Sets stbuf's properties based on file path
-   man 3 stat
-   man stat.h
-   
-   st_mode      Filemode 0666 rw-rw-rw
-   st_nlink     Number of hard links to the file (1)
-   st_mtime     Modified Time
-   st_ctime     Created Time
-   st_size      File size in bytes
-*/
 static int fs_getattr(const char *path, struct stat *stbuf)
 {
-	int res = 0;
-	file_struct dummyFile;
-	memset(stbuf, 0, sizeof(struct stat));
-	if (strcmp(path, "/") == 0) {
-		stbuf->st_mode = S_IFDIR | 0755;
-		stbuf->st_nlink = 2;
-		stbuf->st_mtime = time(NULL);
-		stbuf->st_ctime = time(NULL);
-	}
-	else if(find_file(path, &dummyFile)){
-		inode dummyInode;
-		read_inode(dummyFile.inode_number, &dummyInode);
-		stbuf->st_mode = S_IFREG | 0666;
-		stbuf->st_nlink = 1;
-		stbuf->st_mtime = time(NULL);
-		stbuf->st_ctime = time(NULL);
-		stbuf->st_size = dummyInode.file_size_bytes;
-	}
-	else {
-		res = -ENOENT;
-	}
-	
-	return res;
+	//an inode read retries when the engine changed it meanwhile, see read_inode
+	TIMED_LOCKED(recovery_active() && engine_file(path), S_GETATTR, path, NULL, 0, 0, u_getattr(path, stbuf));
 }
 
-/* Reads all of the files in path into buf using the filler function
-   int (*fuse_fill_dir_t)(void *buffer, char* filename, NULL, int offset 0);
-   	filler will add a file to the result buffer (buf)
-   
-*/
 static int fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi)
 {
-	(void) offset;
-	(void) fi;
-
-	if (strcmp(path, "/") != 0)
-		return -ENOENT;
-
-	filler(buf, ".", NULL, 0);
-	filler(buf, "..", NULL, 0);
-	/* === Loop through all of the files in the root directory == */
-	int i,j;
-	for(i=0; i<MAX_FILES_PER_DIRECTORY; i++){
-		if(root_dir.u_file[i].free == 0){
-				char no_path[MAX_FILE_NAME_SIZE];
-				for(j=0; j<strlen(root_dir.u_file[i].file_name); j++){
-					no_path[j]=root_dir.u_file[i].file_name[j+1];
-				}
-			filler(buf, no_path, NULL, offset);
-			}
-	}
-	return 0;
+	//the listing walks the directory version readers see, recovery may still drop entries from it
+	TIMED_LOCKED(recovery_active(), S_READDIR, path, NULL, offset, 0, u_readdir(path, buf, filler, offset));
 }
 
-/* Create a empty file named path 
-   
-   Find a free inode
-   Mark it as allocated
-   Allocate file as our inode in root dir
-   Writes relevent blocks
-*/
 static int fs_create(const char *path, mode_t mode, struct fuse_file_info * fi) {
-	
-	if(strlen(path) > MAX_FILE_NAME_SIZE) {
-		return -ENAMETOOLONG;
-	}
-	
-	if(is_dir_full()) {
-		return -1;
-	}
-	
-	inode writing_inode;
-	
-	int freeinode = free_inode();
-	
-	if(freeinode < 0){
-		printf("Not enough inodes\n");
-		return -1;
-	}
-	read_inode(freeinode, &writing_inode);
-	allocate_inode(&writing_inode, 0, 0);
-	
-	write_inode(freeinode, &writing_inode);
-	printf("FREEINODE %i\n", freeinode);
-	dir_allocate_file(freeinode, path);
-	write_dir();
-	
-	return 0;
+	TIMED(S_CREATE, path, NULL, 0, 0, u_create(path, mode));
 }
 
-/* Checks that a file can be opened */
 static int fs_open(const char *path, struct fuse_file_info *fi)
 {
-	file_struct file;
-	
-	if (find_file(path, &file)) {
-		return 0;
-	}
-	return -1;
+	//the stats and control files change between getattr and read
+	if (strcmp(path, STATS_FILE) == 0 || strcmp(path, CTL_FILE) == 0)
+		fi->direct_io = 1;
+	//an open only looks the name up, which waits for nothing once recovery has checked every inode
+	TIMED_LOCKED(recovery_active() && engine_file(path), S_OPEN, path, NULL, 0, 0, u_open(path));
 }
 
-/* Reads the contents of file into buf
-   man 3 read
-   
-   finds the file for path
-   reads contents of file into buf starting at offset  (recommended: implement offset after you have the rest working)
-   returns the number of bytes read
-NOT WORKING AND I DON'T KNOW WHY'*/
 static int fs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi)
 {
+	TIMED_LOCKED(engine_file(path), S_READ, path, NULL, offset, size, u_read(path, buf, size, offset));
+}
 
-	size_t len;
-	(void) fi;
-	
-	int i;
-	int read_bytes;
-	int current_bytes;
-	inode inode;
-	
-	
-	file_struct file;
-	//FUSE Should have called open to check that the file exists ahead of time
-	assert(find_file(path, &file));
-	read_bytes = 0;
-	printf("SIZE: %i\n", size);
-	
-	
-	read_inode(file.inode_number, &inode);
-	
-	read_bytes=0;
-	
-	printf("NUMBER OF BLOCKS IN READING INODE: %i\n",inode.no_blocks);
-	printf("FILE SIZE IN INODE: %i\n", inode.file_size_bytes);
-	printf("READ OFFSET: %i\n", offset);
-
-
-
-	
-	
-	//Offset inside the free block
-	int offset_in_block = offset % BLOCK_SIZE_BYTES;
-	int blockindex = (offset - offset_in_block) / BLOCK_SIZE_BYTES;
-	int bytes_to_read = min(BLOCK_SIZE_BYTES - offset_in_block, inode.file_size_bytes);
-	
-	printf("READING BLOCK: %i\n",inode.blocks[blockindex]);
-	
-	fprintf(stderr, "OFFSET IN BLOCK: %i\n", offset_in_block);
-	fprintf(stderr, "BLOCKINDEX: %i\n", blockindex);
-	fprintf(stderr, "BYTES_TO_READ: %i\n", bytes_to_read);
-	
-	
-	read_block_offset(inode.blocks[blockindex], buf, bytes_to_read, offset_in_block);
-	fprintf(stderr, "THIS IS SIZE:\n%i\n", inode.file_size_bytes);
-	
-	read_bytes+=inode.file_size_bytes;
-	
-	return bytes_to_read;
+/* the engine shared with the other writers, or to itself when the write needs that */
+static int write_shared(const char * path, const char * buf, size_t size, off_t offset) {
+	int res;
+	pthread_rwlock_rdlock(&engine_lock);
+	res = u_write_shared(path, buf, size, offset);
+	pthread_rwlock_unlock(&engine_lock);
+	if (res != -EAGAIN)
+		return res;
+	pthread_rwlock_wrlock(&engine_lock);
+	res = u_write(path, buf, size, offset);
+	pthread_rwlock_unlock(&engine_lock);
+	return res;
 }
 
-/* Writes contents of buf to file
-   man 3 write
-   
-   find file for path
-   writes contents of buf into file starting at offset  (recommended: implement offset after you have the rest working)
-      figure out how many blocks you need
-      for each required block
-      	find a free block
-      	update inode to have new block
-		write buf to blocks
-	write relevent blocks
-*/
 static int fs_write(const char * path, const char * buf, size_t buff_size, off_t offset, struct fuse_file_info * fi) {
-	inode inode;
-	int i;
-	DISK_LBA current_block;	
-	
-	
-	file_struct file;
-	assert(find_file(path, &file));
-	
-	printf("FILE.INODE_NUMBER %i\n", file.inode_number);
-	printf("OFFSET: %i\n", offset);
-	read_inode(file.inode_number, &inode);
-	
-	int new_size = inode.file_size_bytes + buff_size;
-	int new_blockno = floor(new_size/BLOCK_SIZE_BYTES) + 1;
-	
-	if (new_blockno - inode.no_blocks > u_quota()) {
-		return -ENOSPC;
-	}
-	
-	if (!valid_file_size(new_blockno)) {
-		return -EFBIG;
-	}
-	
-	printf("BUFF_SIZE: %i ------- BLOCK_SIZE_BYTES: %i\n", buff_size, BLOCK_SIZE_BYTES);
-	//update inode block list
-	printf("INODE NUMBER OF BLOCKS: %i\n", inode.no_blocks);
-	
-		
-	assert(inode.no_blocks != MAX_BLOCKS_PER_FILE);
-	
-	
-	int current_block_max = inode.no_blocks * BLOCK_SIZE_BYTES;
-	int blockindex = 0;
-	
-	//Offset inside the free block
-	int offset_in_block = offset % BLOCK_SIZE_BYTES;
-	
-	if (offset < current_block_max-1) {
-		//we are inside the inode's range
-		blockindex = (offset - offset_in_block) / BLOCK_SIZE_BYTES;
-	} else {
-		//beyond end of inode
-		inode.no_blocks++;
-		blockindex = inode.no_blocks - 1;
-		int freeblock = find_free_block();
-		if(freeblock != -1)
-			inode.blocks[blockindex] = find_free_block();
-		else {
-			printf("Error in find_free_block.\n");
-			return -1;
-			}
-	}
-	int freeblock = inode.blocks[blockindex];
-	
-	int bytes_to_write = min(BLOCK_SIZE_BYTES - offset_in_block, buff_size);
-	
-	fprintf(stderr, "OFFSET IN BLOCK: %i\n", offset_in_block);
-	fprintf(stderr, "BLOCKINDEX: %i\n", blockindex);
-	fprintf(stderr, "BYTES_TO_WRITE: %i\n", bytes_to_write);
-	fprintf(stderr, "WRITING TO BLOCK: %i\n",freeblock);
-	
-	write_block_offset(freeblock, buf, bytes_to_write, offset_in_block);
-	
-	inode.file_size_bytes = max(offset + bytes_to_write, inode.file_size_bytes);
-	
-	write_inode(file.inode_number, &inode);
-	
-	//write blocks
-	allocate_block(freeblock);
-	write_dir();
-	write_bitmap();
-	
-	return bytes_to_write;
+	TIMED_LOCKED(false, S_WRITE, path, NULL, offset, buff_size, write_shared(path, buf, buff_size, offset));
 }
 
-/* Trims file to offset length
-   figure out which blocks to free
-   free relevent blocks
-   update inode
-*/
 static int fs_truncate(const char * path, off_t offset) {
-	inode inode;
-	int i;
-	int fh;
-	int endblock;
-	DISK_LBA current_block;
-	file_struct file;
-	assert(find_file(path, &file));
-	
-	read_inode(file.inode_number, &inode);
-	int blocknumber = (inode.file_size_bytes / BLOCK_SIZE_BYTES)+1;
-	printf("BLOCKNUMBER %i\n", blocknumber);
-	endblock = inode.no_blocks;
-	inode.no_blocks = blocknumber;
-	for(i=blocknumber; i<endblock; i++){
-		free_block(inode.blocks[i-1]);
-	}
-	write_inode(file.inode_number, &inode);
-	write_bitmap();
-	return 0;
+	TIMED_LOCKED(engine_file(path), S_TRUNCATE, path, NULL, offset, 0, u_truncate(path, offset));
 }
 
-/* Remove file 
-   Save relevent blocks
-*/
 int fs_unlink(const char * path) {
-	file_struct file;
-	if (find_file(path, &file)) {
-		dir_remove_file(file);
-		write_dir();
-		return 0;
-	}
-	return -ENOENT;
+	TIMED(S_UNLINK, path, NULL, 0, 0, u_unlink(path));
 }
 
 //Extra credit
 static int fs_chown(const char * path, uid_t uid, gid_t gid) {
-	return 0;
+	TIMED(S_CHOWN, path, NULL, 0, 0, 0);
 }
 
 //Extra credit
 static int fs_chmod(const char * path, mode_t mode) {
-	return 0;
+	TIMED(S_CHMOD, path, NULL, 0, 0, 0);
 }
 
 //Extra credit
 static int fs_utimens(const char * path, const struct timespec tv[2] ) {
-	return 0;
+	TIMED(S_UTIMENS, path, NULL, 0, 0, 0);
 }
 
 static int fs_rename(const char * oldpath, const char * newpath) {
-	file_struct file;
-	
-	if(strlen(newpath) > MAX_FILE_NAME_SIZE) {
-		return -ENAMETOOLONG;
+	TIMED(S_RENAME, oldpath, newpath, 0, 0, u_rename(oldpath, newpath));
+}
+
+static int fs_fsync(const char * path, int datasync, struct fuse_file_info * fi) {
+	TIMED(S_FSYNC, path, NULL, 0, 0, u_fsync(path));
+}
+
+/* 
+   With --defrag a thread moves fragmented files into runs of free blocks,
+   a pass every DEFRAG_INTERVAL seconds at no more than the given blocks a
+   second, taking the engine for one file at a time. It starts once fuse
+   has forked into the background.
+*/
+#define DEFRAG_INTERVAL 300
+
+static int defrag_rate = -1; //blocks a second, -1 without --defrag
+static pthread_t defrag_thread;
+static pthread_mutex_t defrag_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t defrag_wake = PTHREAD_COND_INITIALIZER;
+static bool defrag_stop;
+
+static void * defrag_loop(void * arg) {
+	char json[256];
+	defrag_report r;
+	struct timespec until;
+	bool recovering;
+	pthread_mutex_lock(&defrag_lock);
+	while (!defrag_stop) {
+		pthread_mutex_unlock(&defrag_lock);
+		//files are not moved before recovery has checked them
+		pthread_rwlock_wrlock(&engine_lock);
+		recovering = recovery_active();
+		pthread_rwlock_unlock(&engine_lock);
+		if (!recovering) {
+			defrag_pass(&r, defrag_rate, &engine_lock, &defrag_stop);
+			defrag_report_json(&r, json, sizeof(json));
+			fprintf(stderr, "defrag: %s", json);
+		}
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec += DEFRAG_INTERVAL;
+		pthread_mutex_lock(&defrag_lock);
+		while (!defrag_stop && pthread_cond_timedwait(&defrag_wake, &defrag_lock, &until) != ETIMEDOUT)
+			;
 	}
-	
-	if (find_file(oldpath, &file)) {
-		dir_rename_file(oldpath, newpath);
-		return 0;
+	pthread_mutex_unlock(&defrag_lock);
+	return NULL;
+}
+
+/*
+   After an unclean shutdown the mount does not wait for the check of the
+   inode table, a thread does it a few blocks at a time while the
+   operations go on. --fsck-now checks everything before mounting instead.
+*/
+static bool recovery_running;
+static pthread_t recovery_thread;
+static bool recovery_stop;
+
+static void * recovery_loop(void * arg) {
+	recovery_run(&engine_lock, &recovery_stop);
+	return NULL;
+}
+
+/*
+   Unlink and truncate leave the blocks they free to a thread that frees
+   them a batch at a time, the call returns at once. --sync-unlink frees
+   them in the call instead.
+*/
+static bool reclaim_running;
+static pthread_t reclaim_thread;
+static bool reclaim_stop;
+
+static void * reclaim_loop(void * arg) {
+	reclaim_run(&engine_lock, &reclaim_stop);
+	return NULL;
+}
+
+static void * fs_init(struct fuse_conn_info * conn) {
+	recovery_running = recovery_active();
+	if (recovery_running)
+		pthread_create(&recovery_thread, NULL, recovery_loop, NULL);
+	reclaim_running = reclaim_background();
+	if (reclaim_running)
+		pthread_create(&reclaim_thread, NULL, reclaim_loop, NULL);
+	if (defrag_rate >= 0)
+		pthread_create(&defrag_thread, NULL, defrag_loop, NULL);
+	return NULL;
+}
+
+static void fs_destroy(void * private_data) {
+	//an unmount before recovery is done leaves the disk to be recovered again
+	if (recovery_running) {
+		__atomic_store_n(&recovery_stop, true, __ATOMIC_RELAXED);
+		pthread_join(recovery_thread, NULL);
 	}
-	return -ENOENT;
+	//what is left on the orphan list is freed after the next mount
+	if (reclaim_running) {
+		__atomic_store_n(&reclaim_stop, true, __ATOMIC_RELAXED);
+		reclaim_wake();
+		pthread_join(reclaim_thread, NULL);
+	}
+	if (defrag_rate < 0)
+		return;
+	pthread_mutex_lock(&defrag_lock);
+	__atomic_store_n(&defrag_stop, true, __ATOMIC_RELAXED);
+	pthread_cond_signal(&defrag_wake);
+	pthread_mutex_unlock(&defrag_lock);
+	pthread_join(defrag_thread, NULL);
 }
 
 //Creates a structure to tell fuse about the operations we have implemented
@@ -379,22 +273,26 @@ static struct fuse_operations fs_oper = {
 	.write	= fs_write,
 	.unlink	= fs_unlink,
 	.rename	= fs_rename,
+	.fsync	= fs_fsync,
+	.init	= fs_init,
+	.destroy	= fs_destroy,
 };
 
-int u_quota() {
-	int freeCount=0;
-	int i;
-	
-	assert(BIT_MAP_SIZE > sb.disk_size_blocks);
-	
-	for (i=0; i < sb.disk_size_blocks; i++ )
-	{
-		if (bit_map[i]==0)
-		{
-			freeCount++;
-		}
+/* the first line of file is the passphrase of an encrypted disk */
+static bool read_passphrase(const char * file) {
+	char line[1024];
+	FILE * f = fopen(file, "r");
+	if (f == NULL || fgets(line, sizeof(line), f) == NULL) {
+		fprintf(stderr, "Unable to read a passphrase from %s\n", file);
+		if (f != NULL)
+			fclose(f);
+		return false;
 	}
-	return freeCount;
+	fclose(f);
+	line[strcspn(line, "\r\n")] = '\0';
+	crypt_set_passphrase(line);
+	memset(line, 0, sizeof(line));
+	return true;
 }
 
 int main(int argc, char **argv)
@@ -404,16 +302,29 @@ int main(int argc, char **argv)
 	int fuse_argc = 0;
 	
 	bool do_format = false;
-	int size_format = 0;
+	format_options format;
 	
 	int argi;
 	char * arg;
 	char * disk = NULL;
 	
 	bool disable_crash = false;
-	
-	//Copy prog name
-	fuse_argv = malloc(sizeof(char *) * argc);
+	int crash_at_mode = CRASH_OFF;
+	uint64_t crash_at = 0;
+	char * crash_at_point = NULL;
+	int trace = TRACE_OFF;
+	char * trace_file = "userfs.trace";
+	char * record_file = NULL;
+	char * snapshot = NULL;
+	char * build_from = NULL;
+	int build_threads = DEFAULT_BUILD_THREADS;
+	
+	init_format_options(&format, 0);
+	recovery_set_background(true);
+	reclaim_set_background(true);
+	
+	//Copy prog name, leave room for -o ro
+	fuse_argv = malloc(sizeof(char *) * (argc + 2));
 	fuse_argv[0] = argv[0];
 	fuse_argc++;
 	
@@ -422,20 +333,100 @@ int main(int argc, char **argv)
 		
 		if (strcmp(arg, "--help") == 0) {
 			printf("Usage:\n");
-			printf("\t--disk [diskfile]\n");
-			printf("\t--format [size]\n");
+			printf("\t--disk [diskfile[,diskfile...]]\n");
+			printf("\t--meta-disk [metadatafile]\n");
+			printf("\t--format [size[K|M|G|T]]\n");
+			printf("\t--from [directory to copy the files of at format]\n");
+			printf("\t--build-threads [n]\n");
+			printf("\t--block-size [4K-64K]\n");
+			printf("\t--bytes-per-inode [size]\n");
+			printf("\t--fixed-inodes\n");
+			printf("\t--data-checksums\n");
+			printf("\t--stripe-chunk [size]\n");
+			printf("\t--encrypt\n");
+			printf("\t--max-size [size the disk can grow to]\n");
+			printf("\t--passphrase-file [file]\n");
+			printf("\t--defrag [blocks per second, 0 for no limit]\n");
+			printf("\t--fsck-now\n");
+			printf("\t--sync-unlink\n");
 			printf("\t--no-crash\n");
+			printf("\t--crash-at [n] | --crash-tear [n] | --crash-drop [n]\n");
+			printf("\t--crash-point [name] [n]\n");
+			printf("\t--trace [level 0-%d]\n", TRACE_LEVEL);
+			printf("\t--trace-file [file]\n");
+			printf("\t--record [file]\n");
+			printf("\t--snapshot [name]\n");
 			printf("\t--help\n");
 			return 0;
 		} else if (strcmp(arg, "--disk") == 0) {
 			argi++;
 			disk = argv[argi];
+		} else if (strcmp(arg, "--meta-disk") == 0) {
+			argi++;
+			disk_set_meta(argv[argi]);
 		} else if (strcmp(arg, "--format") == 0) {
 			do_format = true;
 			argi++;
-			size_format = atoi(argv[argi]);
+			format.disk_size_bytes = parse_size(argv[argi]);
+		} else if (strcmp(arg, "--from") == 0) {
+			argi++;
+			build_from = argv[argi];
+		} else if (strcmp(arg, "--build-threads") == 0) {
+			argi++;
+			build_threads = atoi(argv[argi]);
+		} else if (strcmp(arg, "--block-size") == 0) {
+			argi++;
+			format.block_size = parse_size(argv[argi]);
+		} else if (strcmp(arg, "--bytes-per-inode") == 0) {
+			argi++;
+			format.bytes_per_inode = parse_size(argv[argi]);
+		} else if (strcmp(arg, "--fixed-inodes") == 0) {
+			format.fixed_inodes = true;
+		} else if (strcmp(arg, "--data-checksums") == 0) {
+			format.data_checksums = true;
+		} else if (strcmp(arg, "--stripe-chunk") == 0) {
+			argi++;
+			format.stripe_chunk = parse_size(argv[argi]);
+		} else if (strcmp(arg, "--encrypt") == 0) {
+			format.encrypt = true;
+		} else if (strcmp(arg, "--max-size") == 0) {
+			argi++;
+			format.max_size_bytes = parse_size(argv[argi]);
+		} else if (strcmp(arg, "--passphrase-file") == 0) {
+			argi++;
+			if (!read_passphrase(argv[argi]))
+				return -1;
+		} else if (strcmp(arg, "--defrag") == 0) {
+			argi++;
+			defrag_rate = atoi(argv[argi]);
+		} else if (strcmp(arg, "--fsck-now") == 0) {
+			recovery_set_background(false);
+		} else if (strcmp(arg, "--sync-unlink") == 0) {
+			reclaim_set_background(false);
 		} else if (strcmp(arg, "--no-crash") == 0) {
 			disable_crash = true;
+		} else if (strcmp(arg, "--crash-at") == 0 || strcmp(arg, "--crash-tear") == 0
+				|| strcmp(arg, "--crash-drop") == 0) {
+			crash_at_mode = strcmp(arg, "--crash-at") == 0 ? CRASH_AT_WRITE
+				: strcmp(arg, "--crash-tear") == 0 ? CRASH_TEAR_WRITE : CRASH_DROP_WRITE;
+			argi++;
+			crash_at = strtoull(argv[argi], NULL, 10);
+		} else if (strcmp(arg, "--crash-point") == 0) {
+			crash_at_mode = CRASH_AT_POINT;
+			crash_at_point = argv[++argi];
+			crash_at = strtoull(argv[++argi], NULL, 10);
+		} else if (strcmp(arg, "--trace") == 0) {
+			argi++;
+			trace = atoi(argv[argi]);
+		} else if (strcmp(arg, "--trace-file") == 0) {
+			argi++;
+			trace_file = argv[argi];
+		} else if (strcmp(arg, "--record") == 0) {
+			argi++;
+			record_file = argv[argi];
+		} else if (strcmp(arg, "--snapshot") == 0) {
+			argi++;
+			snapshot = argv[argi];
 		} else {
 			fuse_argv[fuse_argc] = arg;
 			fuse_argc++;
@@ -447,26 +438,50 @@ int main(int argc, char **argv)
 		return -1;
 	}
 	
+	trace_init(trace, trace_file);
+	
 	if (do_format) {
-		fprintf(stderr, "Formatting %s (size %i)\n", disk, size_format);
-		u_format(size_format, disk);
+		fprintf(stderr, "Formatting %s (size %ld, blocks of %d)\n", disk, format.disk_size_bytes, format.block_size);
+		//with --from the new disk is filled with the files of a host directory
+		if (build_from != NULL)
+			return u_build(&format, disk, build_from, build_threads) ? 0 : -1;
+		u_format(&format, disk);
 		return 0;
 	}
 	
-	recover_file_system(disk);
-	//We are not clean
-	sb.clean_shutdown = 0;
-	write_block(SUPERBLOCK_BLOCK, &sb, sizeof(superblock));
-	sync();
+	//a snapshot is mounted read only and nothing is written to the disk
+	if (snapshot != NULL) {
+		if (!u_mount_snapshot(disk, snapshot))
+			return -1;
+		fuse_argv[fuse_argc++] = "-o";
+		fuse_argv[fuse_argc++] = "ro";
+		disable_crash = true;
+		defrag_rate = -1;
+		reclaim_set_background(false);
+	} else if (!u_mount(disk)) {
+		return -1;
+	}
+	//the keys are set, the passphrase is not needed again
+	crypt_set_passphrase(NULL);
+	
+	if (record_file != NULL && !record_open(record_file)) {
+		return -1;
+	}
 	
-	if (!disable_crash) {
+	if (crash_at_mode == CRASH_AT_POINT) {
+		init_crash_point(crash_at_point, crash_at);
+	} else if (crash_at_mode != CRASH_OFF) {
+		init_crash_at(crash_at_mode, crash_at);
+	} else if (!disable_crash) {
 		init_crasher();
 	}
 	
 	ret = fuse_main(fuse_argc, fuse_argv, &fs_oper, NULL);
 	//We are unmounted. clean shutdown
 	fprintf(stderr, "Clean shutdown\n");
-	u_clean_shutdown();
+	u_unmount();
+	trace_dump();
+	record_close();
 	
 	free(fuse_argv);
 	return ret;
@@ -1,21 +1,232 @@
 #include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
 #include <assert.h>
 #include <stdio.h>
+#include <pthread.h>
 #include "userfs.h"
 #include "crash.h"
 #include "sb.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "group.h"
+#include "crc.h"
 
-BIT_FIELD bit_map[BIT_MAP_SIZE];
+BIT_FIELD * bit_map;
+BIT_FIELD * fresh_map;
+BIT_FIELD * discard_map;
+bool * discard_pending;
+
+/* the sectors of a group's bitmap and fresh map changed since they were written */
+typedef struct map_dirt_s {
+	uint64_t map[SECTOR_WORDS];
+	uint64_t fresh[SECTOR_WORDS];
+} map_dirt;
+
+/* 
+   Groups whose descriptor, and maybe map sectors, have to be written.
+   Writers allocating at once share these, and the fresh maps, under
+   dirt_lock, the bits of the bitmap itself are set without it.
+*/
+static pthread_mutex_t dirt_lock = PTHREAD_MUTEX_INITIALIZER;
+static int * dirty_groups;
+static bool * group_dirty;
+static map_dirt * dirt;
+static int num_dirty;
 
 void init_bit_map() {
-	DISK_LBA i;
-	for (i = 0; i < BIT_MAP_SIZE; i++) {
-		bit_map[i] = 0;
+	free(bit_map);
+	free(fresh_map);
+	free(discard_map);
+	free(discard_pending);
+	free(dirty_groups);
+	free(group_dirty);
+	free(dirt);
+	bit_map = calloc((size_t)sb.num_groups * BIT_MAP_SIZE, sizeof(BIT_FIELD));
+	fresh_map = calloc((size_t)sb.num_groups * BIT_MAP_SIZE, sizeof(BIT_FIELD));
+	discard_map = calloc((size_t)sb.num_groups * BIT_MAP_SIZE, sizeof(BIT_FIELD));
+	discard_pending = calloc(sb.num_groups, sizeof(bool));
+	dirty_groups = calloc(sb.num_groups, sizeof(int));
+	group_dirty = calloc(sb.num_groups, sizeof(bool));
+	dirt = calloc(sb.num_groups, sizeof(map_dirt));
+	num_dirty = 0;
+}
+
+static void * grow_array(void * array, size_t size, size_t old_count, size_t count) {
+	array = realloc(array, size * count);
+	memset((char *)array + size * old_count, 0, size * (count - old_count));
+	return array;
+}
+
+/*
+   Makes room in the maps for count groups, before sb.num_groups is
+   raised to it. The new groups' words start out clear. Nothing may be
+   allocating at the same time, the maps move.
+*/
+void grow_bit_map(int count) {
+	size_t words = (size_t)sb.num_groups * BIT_MAP_SIZE, new_words = (size_t)count * BIT_MAP_SIZE;
+	pthread_mutex_lock(&dirt_lock);
+	bit_map = grow_array(bit_map, sizeof(BIT_FIELD), words, new_words);
+	fresh_map = grow_array(fresh_map, sizeof(BIT_FIELD), words, new_words);
+	discard_map = grow_array(discard_map, sizeof(BIT_FIELD), words, new_words);
+	discard_pending = grow_array(discard_pending, sizeof(bool), sb.num_groups, count);
+	dirty_groups = grow_array(dirty_groups, sizeof(int), sb.num_groups, count);
+	group_dirty = grow_array(group_dirty, sizeof(bool), sb.num_groups, count);
+	dirt = grow_array(dirt, sizeof(map_dirt), sb.num_groups, count);
+	pthread_mutex_unlock(&dirt_lock);
+}
+
+/* the sector of a group's map holding the bit of block */
+static void mark_bit(uint64_t * dirty, DISK_LBA block) {
+	DISK_LBA b = block % BLOCKS_PER_GROUP;
+	mark_sectors(dirty, b / BITS_PER_FIELD * sizeof(BIT_FIELD), sizeof(BIT_FIELD));
+}
+
+/* dirt_lock is held */
+static void note_group(int group) {
+	if (!group_dirty[group]) {
+		group_dirty[group] = true;
+		dirty_groups[num_dirty++] = group;
 	}
 }
 
+bool block_in_use(DISK_LBA block) {
+	return bit_map[block / BITS_PER_FIELD] & (1U << (block % BITS_PER_FIELD));
+}
+
+/* a snapshot taken since the group's fresh map was written empties it */
+static BIT_FIELD * group_fresh(int group) {
+	BIT_FIELD * words = fresh_map + (size_t)group * BIT_MAP_SIZE;
+	if (groups[group].fresh_gen != sb.generation) {
+		memset(words, 0, sizeof(BIT_FIELD) * BIT_MAP_SIZE);
+		groups[group].fresh_gen = sb.generation;
+		mark_sectors(dirt[group].fresh, 0, BLOCK_SIZE_BYTES);
+		note_group(group);
+	}
+	return words;
+}
+
+/* whether the block was allocated after the newest snapshot was taken */
+bool block_fresh(DISK_LBA block) {
+	BIT_FIELD * words;
+	DISK_LBA b = block % BLOCKS_PER_GROUP;
+	bool fresh;
+	pthread_mutex_lock(&dirt_lock);
+	words = group_fresh(group_of(block));
+	fresh = USED(words, b);
+	pthread_mutex_unlock(&dirt_lock);
+	return fresh;
+}
+
+void set_fresh(DISK_LBA block, bool fresh) {
+	int group = group_of(block);
+	BIT_FIELD * words;
+	DISK_LBA b = block % BLOCKS_PER_GROUP;
+	pthread_mutex_lock(&dirt_lock);
+	words = group_fresh(group);
+	if (fresh)
+		SET_USED(words, b);
+	else
+		words[b / BITS_PER_FIELD] &= ~(1U << (b % BITS_PER_FIELD));
+	mark_bit(dirt[group].fresh, block);
+	note_group(group);
+	pthread_mutex_unlock(&dirt_lock);
+}
+
+/* rebuilds every fresh map: blocks the live file system uses that no snapshot holds */
+void set_fresh_map(const BIT_FIELD * live, const BIT_FIELD * held) {
+	size_t i;
+	int g;
+	for (i = 0; i < (size_t)sb.num_groups * BIT_MAP_SIZE; i++)
+		fresh_map[i] = live[i] & ~held[i];
+	for (g = 0; g < sb.num_groups; g++) {
+		groups[g].fresh_gen = sb.generation;
+		mark_bitmap_dirty(g);
+	}
+}
+
+/* only the descriptor changed, its counts */
+void mark_group_dirty(int group) {
+	pthread_mutex_lock(&dirt_lock);
+	note_group(group);
+	pthread_mutex_unlock(&dirt_lock);
+}
+
+/* the sector holding block's bit and the descriptor with the counts */
+void mark_block_dirty(DISK_LBA block) {
+	int group = group_of(block);
+	pthread_mutex_lock(&dirt_lock);
+	mark_bit(dirt[group].map, block);
+	note_group(group);
+	pthread_mutex_unlock(&dirt_lock);
+}
+
+/* all of the group's maps and its descriptor */
+void mark_bitmap_dirty(int group) {
+	pthread_mutex_lock(&dirt_lock);
+	mark_sectors(dirt[group].map, 0, BLOCK_SIZE_BYTES);
+	mark_sectors(dirt[group].fresh, 0, BLOCK_SIZE_BYTES);
+	note_group(group);
+	pthread_mutex_unlock(&dirt_lock);
+}
+
+static uint32_t map_checksum(const BIT_FIELD * map, int group) {
+	return crc32c(0, map + (size_t)group * BIT_MAP_SIZE, sizeof(BIT_FIELD)*BIT_MAP_SIZE);
+}
+
+/* the maps are checked against the checksums in the group descriptors, fsck rebuilds both */
+int read_bitmap() {
+	int g;
+	init_bit_map();
+	for (g = 0; g < sb.num_groups; g++) {
+		read_block(groups[g].bitmap_block, bit_map + (size_t)g * BIT_MAP_SIZE,
+			sizeof(BIT_FIELD)*BIT_MAP_SIZE);
+		if (map_checksum(bit_map, g) != groups[g].bitmap_csum)
+			checksum_failed("bitmap of group", g);
+		if (sb.num_snapshots > 0 && groups[g].fresh_gen == sb.generation) {
+			read_block(groups[g].fresh_block, fresh_map + (size_t)g * BIT_MAP_SIZE,
+				sizeof(BIT_FIELD)*BIT_MAP_SIZE);
+			if (map_checksum(fresh_map, g) != groups[g].fresh_csum)
+				checksum_failed("fresh map of group", g);
+		}
+	}
+	return 1;
+}
+
+static int group_cmp(const void * a, const void * b) {
+	return *(const int *)a - *(const int *)b;
+}
+
+/* 
+   Writes the changed sectors of the maps of every group changed since
+   the last call, the fresh map only when there are snapshots, then the
+   descriptors, neighbouring ones in one write. The maps go before the
+   descriptors that hold their checksums and say which generation the
+   fresh map is for.
+*/
 void write_bitmap() {
-	write_block(BIT_MAP_BLOCK, bit_map, sizeof(BIT_FIELD)*BIT_MAP_SIZE);
+	int i, j, g;
+	pthread_mutex_lock(&dirt_lock);
+	qsort(dirty_groups, num_dirty, sizeof(int), group_cmp);
+	for (i = 0; i < num_dirty; i++) {
+		g = dirty_groups[i];
+		write_sectors(groups[g].bitmap_block, bit_map + (size_t)g * BIT_MAP_SIZE, dirt[g].map);
+		groups[g].bitmap_csum = map_checksum(bit_map, g);
+		if (sb.num_snapshots > 0) {
+			write_sectors(groups[g].fresh_block, fresh_map + (size_t)g * BIT_MAP_SIZE, dirt[g].fresh);
+			groups[g].fresh_csum = map_checksum(fresh_map, g);
+		}
+		memset(dirt[g].fresh, 0, sizeof(dirt[g].fresh));
+	}
+	for (i = 0; i < num_dirty; i = j) {
+		g = dirty_groups[i];
+		for (j = i + 1; j < num_dirty && dirty_groups[j] == g + (j - i)
+				&& dirty_groups[j] % GROUP_DESCS_PER_BLOCK != 0; j++)
+			;
+		write_groups(g, j - i);
+	}
+	for (i = 0; i < num_dirty; i++)
+		group_dirty[dirty_groups[i]] = false;
+	num_dirty = 0;
+	pthread_mutex_unlock(&dirt_lock);
 }
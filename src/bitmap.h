@@ -1,17 +1,42 @@
 #ifndef U_BITMAP
 #define U_BITMAP
 
+#include <stdbool.h>
+#include "userfs.h"
 #include "blocks.h"
 
 #define BIT_FIELD unsigned
-#define BIT_MAP_BLOCK 1
-#define BIT_MAP_SIZE (BLOCK_SIZE_BYTES/sizeof(BIT_FIELD))
+#define BIT_MAP_SIZE (BLOCK_SIZE_BYTES/sizeof(BIT_FIELD)) //words in one group's bitmap block
 #define BITS_PER_FIELD (sizeof(unsigned) * 8)
+#define USED(map, b) ((map)[(b) / BITS_PER_FIELD] & (1U << ((b) % BITS_PER_FIELD)))
+/* 
+   The blocks one sector of a group's bitmap describes make an allocation
+   shard. Files start in a home shard picked by inode number and grow
+   from their last block, so files written at the same time each keep to
+   a run of their own.
+*/
+#define SHARD_BLOCKS ((DISK_LBA)SECTOR_SIZE * 8)
+#define SHARDS_PER_GROUP ((int)(BIT_MAP_SIZE * BITS_PER_FIELD / SHARD_BLOCKS))
+#define SET_USED(map, b) ((map)[(b) / BITS_PER_FIELD] |= 1U << ((b) % BITS_PER_FIELD))
 
-extern BIT_FIELD bit_map[BIT_MAP_SIZE];
+/* one bitmap for the whole disk, group g owns words [g*BIT_MAP_SIZE, (g+1)*BIT_MAP_SIZE) */
+extern BIT_FIELD * bit_map;
+/* laid out the same, the blocks no snapshot holds, only kept while there are snapshots */
+extern BIT_FIELD * fresh_map;
+/* laid out the same, blocks freed since the last discard, with the groups that have any */
+extern BIT_FIELD * discard_map;
+extern bool * discard_pending;
 
 void init_bit_map();
+void grow_bit_map(int count);
+bool block_in_use(DISK_LBA block);
+bool block_fresh(DISK_LBA block);
+void set_fresh(DISK_LBA block, bool fresh);
+void set_fresh_map(const BIT_FIELD * live, const BIT_FIELD * held);
+void mark_group_dirty(int group);
+void mark_block_dirty(DISK_LBA block);
+void mark_bitmap_dirty(int group);
+int read_bitmap();
 void write_bitmap();
 
 #endif
-
@@ -1,65 +1,314 @@
 #include <stdbool.h>
 #include <assert.h>
 #include <stdio.h>
+#include <string.h>
 #include "userfs.h"
 #include "crash.h"
 #include "sb.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "stats.h"
+#include "group.h"
+#include "disk.h"
+#include "recover.h"
 
 #define BPF BITS_PER_FIELD
 
-//hardinc modified
-void allocate_block(int blockNum)
+/* block sizes are powers of two from MIN_BLOCK_SIZE to MAX_BLOCK_SIZE */
+bool valid_block_size(int64_t size) {
+	return size >= MIN_BLOCK_SIZE && size <= MAX_BLOCK_SIZE && (size & (size - 1)) == 0;
+}
+
+/* the disk's and the group's free counts and the dirty and fresh maps of a block just taken or given back */
+static void account(DISK_LBA blockNum, int delta) {
+	__atomic_add_fetch(&groups[group_of(blockNum)].free_blocks, delta, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&sb.num_free_blocks, delta, __ATOMIC_RELAXED);
+	mark_block_dirty(blockNum);
+	if (sb.num_snapshots > 0)
+		set_fresh(blockNum, delta < 0);
+}
+
+/* 
+   Marks a block used and keeps its group's and the disk's free counts.
+   The bit is set atomically, so only one of several callers gets it.
+   Returns whether this call took it.
+*/
+static bool take_block(DISK_LBA blockNum)
 {
-	int bit = blockNum & (BPF - 1);
-	int ind = blockNum / BPF;
+	BIT_FIELD bit = 1U << (blockNum & (BPF - 1));
 
-	assert(blockNum < BIT_MAP_SIZE * BPF);
-	bit_map[ind] |= 1 << bit;
+	assert(blockNum < sb.disk_size_blocks);
+	if (__atomic_fetch_or(&bit_map[blockNum / BPF], bit, __ATOMIC_ACQ_REL) & bit)
+		return false;
+	__atomic_fetch_and(&discard_map[blockNum / BPF], ~bit, __ATOMIC_RELAXED);
+	account(blockNum, -1);
+	recovery_taken(blockNum);
+	return true;
 }
 
-//hardinc modified
-void free_block(int blockNum)
+void allocate_block(DISK_LBA blockNum)
 {
-	int bit = blockNum & (BPF - 1);
-	int ind = blockNum / BPF;
-	assert(blockNum < BIT_MAP_SIZE * BPF);
-	bit_map[ind] &= ~(1 << bit);
-}
-//hardinc modified
-int find_free_block() {
-	int i,j;
-	
-	// search for bit field with clear bit
-	for(i=0;i < sb.disk_size_blocks; i++) {
-		if(bit_map[i] != ~0) {
-			// search for clear bit in bit field
-			for (j = 0; j < BPF; j++) {
-				if (~bit_map[i] & (1 << j)) {
-					return i * BPF + j;
-				}
+	take_block(blockNum);
+}
+
+void free_block(DISK_LBA blockNum)
+{
+	BIT_FIELD bit = 1U << (blockNum & (BPF - 1));
+
+	assert(blockNum < sb.disk_size_blocks);
+	if (__atomic_fetch_and(&bit_map[blockNum / BPF], ~bit, __ATOMIC_ACQ_REL) & bit) {
+		account(blockNum, 1);
+		__atomic_fetch_or(&discard_map[blockNum / BPF], bit, __ATOMIC_RELAXED);
+		discard_pending[group_of(blockNum)] = true;
+	}
+}
+
+/* 
+   Gives the host back the space of free blocks, those freed since the
+   last call, or every free block with all. Only called once what freed
+   them is on disk, so a crash cannot bring back a file whose blocks are
+   holes. Neighbouring blocks go in one hole. Returns the blocks discarded.
+*/
+DISK_LBA discard_blocks(bool all) {
+	DISK_LBA b, end, run, total = 0;
+	BIT_FIELD * pending;
+	bool punch;
+	int g;
+	for (g = 0; g < sb.num_groups; g++) {
+		if (!all && !discard_pending[g])
+			continue;
+		discard_pending[g] = false;
+		pending = discard_map + (size_t)g * BIT_MAP_SIZE;
+		end = group_end(g);
+		for (b = group_start(g), run = -1; b <= end; b++) {
+			//words with nothing freed in them are skipped whole
+			if (!all && run < 0 && b < end && b % BPF == 0 && pending[b % BLOCKS_PER_GROUP / BPF] == 0) {
+				b += BPF - 1;
+				continue;
+			}
+			punch = b < end && !block_in_use(b) && (all || USED(pending, b % BLOCKS_PER_GROUP));
+			if (punch && run < 0)
+				run = b;
+			if (!punch && run >= 0) {
+				disk_discard((off_t)BLOCK_SIZE_BYTES * run, (int64_t)BLOCK_SIZE_BYTES * (b - run));
+				total += b - run;
+				run = -1;
 			}
-			assert(0);
 		}
+		memset(pending, 0, sizeof(BIT_FIELD) * BIT_MAP_SIZE);
+	}
+	return total;
+}
+
+/* 
+   A block in use before the newest snapshot was taken belongs to that
+   snapshot too and must not be changed in place
+*/
+bool block_shared(DISK_LBA blockNum)
+{
+	return sb.num_snapshots > 0 && !block_fresh(blockNum);
+}
+
+/* the live file system stops using a block, it stays allocated while a snapshot holds it */
+void release_block(DISK_LBA blockNum)
+{
+	if (!block_shared(blockNum))
+		free_block(blockNum);
+}
+
+/* 
+   Gives the live file system its own copy of a shared block, near the
+   original, with the contents copied over when keep is set. Returns the
+   new block or -1 when the disk is full.
+*/
+DISK_LBA copy_block(DISK_LBA blockNum, bool keep)
+{
+	static char data[MAX_BLOCK_SIZE];
+	DISK_LBA copy = claim_block(blockNum);
+	if (copy < 0)
+		return -1;
+	if (keep) {
+		read_data_block(blockNum, data, BLOCK_SIZE_BYTES);
+		write_data_block(copy, data, BLOCK_SIZE_BYTES);
+	}
+	return copy;
+}
+
+/* takes the first free block of [from, end), or returns -1 */
+static DISK_LBA claim_between(DISK_LBA from, DISK_LBA end) {
+	DISK_LBA b = from;
+	BIT_FIELD word, clear;
+	while (b < end) {
+		word = __atomic_load_n(&bit_map[b / BPF], __ATOMIC_RELAXED);
+		clear = ~word & (~0U << (b & (BPF - 1)));
+		if (clear == 0) {
+			b = (b | (BPF - 1)) + 1;
+			continue;
+		}
+		b = b / BPF * BPF + __builtin_ctz(clear);
+		if (b >= end)
+			break;
+		//another writer may take it first, then the search goes on past it
+		if (take_block(b))
+			return b;
 	}
 	return -1;
 }
 
+/* the first block of the n-th shard of a group, counting round the shards it has */
+DISK_LBA shard_start(int group, int n) {
+	DISK_LBA shards = (group_end(group) - group_start(group) + SHARD_BLOCKS - 1) / SHARD_BLOCKS;
+	return group_start(group) + n % shards * SHARD_BLOCKS;
+}
+
+/* one past the last block of the shard starting at first */
+static DISK_LBA shard_end(DISK_LBA first) {
+	DISK_LBA end = group_end(group_of(first));
+	return first + SHARD_BLOCKS < end ? first + SHARD_BLOCKS : end;
+}
+
+/* 
+   Allocates a free block as close after goal as it can: in goal's
+   shard from goal on and then before it, then in the group's other
+   shards in turn, then in the following groups, which is how a writer
+   whose home shard is full steals from the others. Writers with goals in
+   different shards take bits of different bitmap words, without locks.
+   Returns the block or -1 when the disk is full.
+*/
+DISK_LBA claim_block(DISK_LBA goal) {
+	int g, tries, s, home;
+	DISK_LBA first, b;
+
+	recovery_allocating();
+
+	if (goal < 0 || goal >= sb.disk_size_blocks)
+		goal = 0;
+	first = goal / SHARD_BLOCKS * SHARD_BLOCKS;
+	if ((b = claim_between(goal, shard_end(first))) >= 0
+			|| (b = claim_between(first, goal)) >= 0)
+		return b;
+	home = (goal - group_start(group_of(goal))) / SHARD_BLOCKS;
+	for (tries = 0, g = group_of(goal); tries < sb.num_groups; tries++, g = (g + 1) % sb.num_groups) {
+		if (__atomic_load_n(&groups[g].free_blocks, __ATOMIC_RELAXED) <= 0)
+			continue;
+		for (s = 1; s <= SHARDS_PER_GROUP; s++) {
+			first = shard_start(g, home + s);
+			if ((b = claim_between(first, shard_end(first))) >= 0)
+				return b;
+		}
+	}
+	return -1;
+}
+
+/* 
+   Returns the first of count free blocks in a row, looking in the given
+   group first and then in the following ones, or -1
+*/
+DISK_LBA find_free_run(int group, int count) {
+	int g, tries;
+	DISK_LBA b, run;
+	recovery_allocating();
+	for (tries = 0, g = group; tries < sb.num_groups; tries++, g = (g + 1) % sb.num_groups) {
+		if (groups[g].free_blocks < count)
+			continue;
+		run = 0;
+		for (b = group_start(g); b < group_end(g); b++) {
+			run = block_in_use(b) ? 0 : run + 1;
+			if (run == count)
+				return b - count + 1;
+		}
+	}
+	return -1;
+}
+
+/* 
+   write_block, read_block and the rest are for metadata, which is on
+   the metadata disk when there is one. File data goes through the
+   _data_ calls and the batches.
+*/
+static void block_write(DISK_LBA block, const void * data, int size, int offset) {
+	disk_meta_write((off_t)BLOCK_SIZE_BYTES * block + offset, data, size);
+}
+
+static void block_read(DISK_LBA block, void * data, int size, int offset) {
+	disk_meta_read((off_t)BLOCK_SIZE_BYTES * block + offset, data, size);
+}
+
 void write_block(DISK_LBA block, const void * data, int size) {
-	write_block_offset(block, data, size, 0);
+	uint64_t start = stats_now();
+	block_write(block, data, size, 0);
+	stats_record(S_WRITE_BLOCK, start);
 }
 
 void write_block_offset(DISK_LBA block, const void * data, int size, int offset) {
-	lseek(virtual_disk, BLOCK_SIZE_BYTES * block + offset, SEEK_SET);
-	crash_write(virtual_disk, data, size);
+	uint64_t start = stats_now();
+	block_write(block, data, size, offset);
+	stats_record(S_WRITE_BLOCK_OFFSET, start);
 }
 
 void read_block(DISK_LBA block, void * data, int size) {
-	lseek(virtual_disk, BLOCK_SIZE_BYTES * block, SEEK_SET);
-	read(virtual_disk, data, size);
+	uint64_t start = stats_now();
+	block_read(block, data, size, 0);
+	stats_record(S_READ_BLOCK, start);
 }
+
 void read_block_offset(DISK_LBA block, void * data, int size, int offset) {
-	lseek(virtual_disk, BLOCK_SIZE_BYTES * block + offset, SEEK_SET);
-	read(virtual_disk, data, size);
+	uint64_t start = stats_now();
+	block_read(block, data, size, offset);
+	stats_record(S_READ_BLOCK_OFFSET, start);
+}
+
+void write_data_block(DISK_LBA block, const void * data, int size) {
+	uint64_t start = stats_now();
+	disk_write((off_t)BLOCK_SIZE_BYTES * block, data, size);
+	stats_record(S_WRITE_BLOCK, start);
+}
+
+void read_data_block(DISK_LBA block, void * data, int size) {
+	uint64_t start = stats_now();
+	disk_read((off_t)BLOCK_SIZE_BYTES * block, data, size);
+	stats_record(S_READ_BLOCK, start);
+}
+
+/* writes pieces of several blocks of file data, in parallel when the disk is striped */
+void write_blocks(block_io * ios, int count) {
+	disk_write_batch(ios, count);
+}
+
+void read_blocks(block_io * ios, int count) {
+	disk_read_batch(ios, count);
+}
+
+/* sets the bits of the sectors holding bytes [offset, offset + size) of a block */
+void mark_sectors(uint64_t * dirty, int offset, int size) {
+	int s;
+	if (size <= 0)
+		return;
+	for (s = offset / SECTOR_SIZE; s <= (offset + size - 1) / SECTOR_SIZE; s++)
+		dirty[s / 64] |= 1ULL << (s % 64);
+}
+
+/* 
+   Writes the dirty sectors of a block from data, which holds all of it,
+   one write per run of neighbouring sectors, and clears the mask. Runs
+   go from the end of the block back, so a header at its start is last.
+*/
+void write_sectors(DISK_LBA block, const void * data, uint64_t * dirty) {
+	int s = BLOCK_SIZE_BYTES / SECTOR_SIZE, end;
+	while (s > 0) {
+		if (!(dirty[(s - 1) / 64] & (1ULL << ((s - 1) % 64)))) {
+			s--;
+			continue;
+		}
+		for (end = s; s > 0 && dirty[(s - 1) / 64] & (1ULL << ((s - 1) % 64)); s--)
+			;
+		write_block_offset(block, (const char *)data + s * SECTOR_SIZE, (end - s) * SECTOR_SIZE, s * SECTOR_SIZE);
+	}
+	memset(dirty, 0, SECTOR_WORDS * sizeof(uint64_t));
+}
+
+void sync_blocks() {
+	uint64_t start = stats_now();
+	disk_sync();
+	stats_record(S_SYNC, start);
 }
@@ -1,14 +1,46 @@
 #ifndef U_BLOCKS
 #define U_BLOCKS
 
-#define BLOCK_SIZE_BYTES 4096
+#include "userfs.h"
+#include "sb.h"
+
+/* the block size is picked at format time and read from the superblock */
+#define BLOCK_SIZE_BYTES (sb.block_size_bytes)
+#define DEFAULT_BLOCK_SIZE 4096
+#define MIN_BLOCK_SIZE 4096
+#define MAX_BLOCK_SIZE (64 * 1024)
+#define SECTOR_SIZE 512 //the unit partial writes of metadata are rounded to
+#define SECTOR_WORDS (MAX_BLOCK_SIZE / SECTOR_SIZE / 64) //a mask of the dirty sectors of a block
+
+/* one piece of a read or write of several blocks, within one block */
+typedef struct block_io_s {
+	DISK_LBA block;
+	int offset;
+	int size;
+	void * data;
+} block_io;
+
+bool valid_block_size(int64_t);
 
 void allocate_block(DISK_LBA);
 void free_block(DISK_LBA);
-int find_block();
+DISK_LBA shard_start(int group, int n);
+DISK_LBA claim_block(DISK_LBA goal);
+DISK_LBA find_free_run(int group, int count);
+bool block_shared(DISK_LBA);
+void release_block(DISK_LBA);
+DISK_LBA discard_blocks(bool all);
+DISK_LBA copy_block(DISK_LBA, bool keep);
 void write_block(DISK_LBA, const void *, int);
 void write_block_offset(DISK_LBA block, const void * data, int size, int offset);
 void read_block(DISK_LBA, void *, int);
 void read_block_offset(DISK_LBA block, void * data, int size, int offset);
+void write_data_block(DISK_LBA block, const void * data, int size);
+void read_data_block(DISK_LBA block, void * data, int size);
+void write_blocks(block_io * ios, int count);
+void read_blocks(block_io * ios, int count);
+void mark_sectors(uint64_t * dirty, int offset, int size);
+void write_sectors(DISK_LBA block, const void * data, uint64_t * dirty);
+void sync_blocks();
 
 #endif
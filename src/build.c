@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "userfs.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "group.h"
+#include "imap.h"
+#include "inode.h"
+#include "dir.h"
+#include "sb.h"
+#include "crc.h"
+#include "disk.h"
+#include "stats.h"
+#include "ops.h"
+#include "build.h"
+
+/* a source file and where it goes */
+typedef struct build_file_s {
+	char name[MAX_FILE_NAME_SIZE + 1]; //with the leading /
+	char * path;
+	int64_t size;
+	time_t mtime;
+	int inode_number;
+	inode * in; //in the image of the inode table
+	char * data; //in the buffer of its window
+} build_file;
+
+/* files in a row read into one buffer by the reader threads */
+typedef struct window_s {
+	build_file * files;
+	int count;
+	int blocks;
+	int next; //the readers take the files in turn
+	bool failed;
+	pthread_t * threads;
+	int num_threads;
+} window;
+
+static int by_name(const void * a, const void * b) {
+	return strcmp(((const build_file *)a)->name, ((const build_file *)b)->name);
+}
+
+/* the order of the directory's keys, the hash and then the name */
+static int by_key(const void * a, const void * b) {
+	const dir_entry * x = a, * y = b;
+	if (x->hash != y->hash)
+		return x->hash < y->hash ? -1 : 1;
+	return strcmp(x->file_name, y->file_name);
+}
+
+/*
+   The regular files directly in from, sorted by name. Anything else, and
+   files whose name or size userfs cannot hold, are skipped with a warning.
+*/
+static bool scan_source(const char * from, int block_size, build_file ** out, int * count) {
+	DIR * d = opendir(from);
+	struct dirent * e;
+	struct stat st;
+	build_file * files = NULL;
+	char * path;
+	int cap = 0;
+
+	*count = 0;
+	if (d == NULL) {
+		fprintf(stderr, "Unable to open directory %s\n", from);
+		return false;
+	}
+	while ((e = readdir(d)) != NULL) {
+		if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0)
+			continue;
+		path = malloc(strlen(from) + strlen(e->d_name) + 2);
+		sprintf(path, "%s/%s", from, e->d_name);
+		if (stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+			fprintf(stderr, "Skipping %s, not a regular file\n", path);
+		} else if (strlen(e->d_name) + 1 > MAX_FILE_NAME_SIZE) {
+			fprintf(stderr, "Skipping %s, names are limited to %d characters\n", path, MAX_FILE_NAME_SIZE - 1);
+		} else if (st.st_size > (int64_t)MAX_BLOCKS_PER_FILE * block_size) {
+			fprintf(stderr, "Skipping %s, files are limited to %d bytes\n", path, MAX_BLOCKS_PER_FILE * block_size);
+		} else {
+			if (*count == cap) {
+				cap = cap ? cap * 2 : 256;
+				files = realloc(files, cap * sizeof(build_file));
+			}
+			memset(&files[*count], 0, sizeof(build_file));
+			files[*count].name[0] = '/';
+			strcpy(files[*count].name + 1, e->d_name);
+			files[*count].path = path;
+			files[*count].size = st.st_size;
+			files[*count].mtime = st.st_mtime;
+			//the names of the special files are taken
+			if (strcmp(files[*count].name, STATS_FILE) != 0 && strcmp(files[*count].name, CTL_FILE) != 0) {
+				(*count)++;
+				continue;
+			}
+			fprintf(stderr, "Skipping %s, the name is reserved\n", path);
+		}
+		free(path);
+	}
+	closedir(d);
+	qsort(files, *count, sizeof(build_file), by_name);
+	*out = files;
+	return true;
+}
+
+/*
+   Numbers the inodes from the start of the table, which is all free on a
+   new disk, growing the table when it is full. Returns the table blocks
+   used, or -1.
+*/
+static int assign_inodes(build_file * files, int count) {
+	int i;
+	for (i = 0; i < count; i++) {
+		if (i / INODES_PER_BLOCK >= sb.num_inode_blocks && grow_inode_table(i ? inode_group(i - 1) : 0) < 0) {
+			fprintf(stderr, "No inode left for %s\n", files[i].path);
+			return -1;
+		}
+		files[i].inode_number = i;
+		groups[inode_group(i)].free_inodes--;
+		mark_group_dirty(inode_group(i));
+	}
+	return (count + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+}
+
+/* fills in the inodes, every file's blocks following on from the last file's */
+static bool plan_blocks(build_file * files, int count, char * table) {
+	DISK_LBA goal = -1;
+	int i, b, n;
+	inode * in;
+	for (i = 0; i < count; i++) {
+		n = files[i].inode_number;
+		in = files[i].in = (inode *)(table + (size_t)(n / INODES_PER_BLOCK) * BLOCK_SIZE_BYTES) + n % INODES_PER_BLOCK;
+		allocate_inode(in, (files[i].size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES, files[i].size);
+		in->last_modified = files[i].mtime;
+		for (b = 0; b < in->no_blocks; b++) {
+			goal = claim_block(goal < 0 ? shard_start(inode_group(n), n) : goal + 1);
+			if (goal < 0) {
+				fprintf(stderr, "No room for %s\n", files[i].path);
+				return false;
+			}
+			in->blocks[b] = goal;
+		}
+	}
+	return true;
+}
+
+/* reads a file into its place in the window, the end of its last block zeroed */
+static void read_file(build_file * f, bool * failed) {
+	int64_t done = 0;
+	ssize_t got = 0;
+	int b, fd = open(f->path, O_RDONLY);
+	if (fd >= 0) {
+		while (done < f->size && (got = pread(fd, f->data + done, f->size - done, done)) > 0)
+			done += got;
+		close(fd);
+	}
+	if (fd < 0 || done < f->size) {
+		fprintf(stderr, "Unable to read %s\n", f->path);
+		__atomic_store_n(failed, true, __ATOMIC_RELAXED);
+	}
+	memset(f->data + done, 0, (size_t)f->in->no_blocks * BLOCK_SIZE_BYTES - done);
+	if (sb.data_checksums) {
+		for (b = 0; b < f->in->no_blocks; b++)
+			f->in->block_csums[b] = crc32c(0, f->data + (size_t)b * BLOCK_SIZE_BYTES, BLOCK_SIZE_BYTES);
+	}
+}
+
+static void * reader(void * arg) {
+	window * w = arg;
+	int i;
+	while ((i = __atomic_fetch_add(&w->next, 1, __ATOMIC_RELAXED)) < w->count)
+		read_file(&w->files[i], &w->failed);
+	return NULL;
+}
+
+/* starts the readers on the files from the first that fit in buf together, returns how many */
+static int start_window(window * w, build_file * files, int count, char * buf) {
+	int t, bytes = 0, size;
+	w->files = files;
+	w->count = w->blocks = w->next = 0;
+	w->failed = false;
+	while (w->count < count) {
+		size = files[w->count].in->no_blocks * BLOCK_SIZE_BYTES;
+		if (w->count > 0 && bytes + size > BUILD_WINDOW)
+			break;
+		files[w->count++].data = buf + bytes;
+		w->blocks += size / BLOCK_SIZE_BYTES;
+		bytes += size;
+	}
+	for (t = 0; t < w->num_threads && w->count > 0; t++)
+		pthread_create(&w->threads[t], NULL, reader, w);
+	return w->count;
+}
+
+static bool finish_window(window * w) {
+	int t;
+	for (t = 0; t < w->num_threads && w->count > 0; t++)
+		pthread_join(w->threads[t], NULL);
+	return !w->failed;
+}
+
+/* the blocks of the window's files are in a row on disk as in memory, they go out in large writes */
+static void write_window(window * w) {
+	block_io * ios = malloc(w->blocks * sizeof(block_io));
+	int i, b, n = 0;
+	for (i = 0; i < w->count; i++) {
+		for (b = 0; b < w->files[i].in->no_blocks; b++)
+			ios[n++] = (block_io){ w->files[i].in->blocks[b], 0, BLOCK_SIZE_BYTES,
+				w->files[i].data + (size_t)b * BLOCK_SIZE_BYTES };
+	}
+	write_blocks(ios, n);
+	free(ios);
+}
+
+/* reads the files with threads while the window read before is written */
+static bool copy_data(build_file * files, int count, int threads) {
+	window w[2];
+	char * bufs[2] = { malloc(BUILD_WINDOW), malloc(BUILD_WINDOW) };
+	int cur = 0, first, i;
+	bool ok = true;
+	for (i = 0; i < 2; i++) {
+		w[i].num_threads = threads;
+		w[i].threads = malloc(threads * sizeof(pthread_t));
+	}
+	first = start_window(&w[0], files, count, bufs[0]);
+	while (w[cur].count > 0) {
+		if (!(ok = finish_window(&w[cur])))
+			break;
+		first += start_window(&w[!cur], files + first, count - first, bufs[!cur]);
+		write_window(&w[cur]);
+		cur = !cur;
+	}
+	for (i = 0; i < 2; i++) {
+		free(w[i].threads);
+		free(bufs[i]);
+	}
+	return ok;
+}
+
+/* the table blocks the files are in, neighbouring blocks in one write */
+static void write_inode_table(char * table, int used) {
+	int k, run;
+	for (k = 0; k < used; k += run) {
+		for (run = 1; k + run < used && run < BUILD_WINDOW / BLOCK_SIZE_BYTES
+				&& inode_map[k + run] == inode_map[k] + run; run++)
+			;
+		disk_meta_write(inode_map[k] * (off_t)BLOCK_SIZE_BYTES, table + (size_t)k * BLOCK_SIZE_BYTES,
+			run * BLOCK_SIZE_BYTES);
+	}
+}
+
+/*
+   Loads the directory bottom up from the sorted entries, in blocks after
+   those in use, and frees the empty root format left
+*/
+static bool load_dir(build_file * files, int count) {
+	size_t w, words = (size_t)sb.num_groups * BIT_MAP_SIZE;
+	BIT_FIELD * used = malloc(words * sizeof(BIT_FIELD));
+	BIT_FIELD * avoid = calloc(words, sizeof(BIT_FIELD));
+	dir_entry * entries = calloc(count, sizeof(dir_entry));
+	DISK_LBA empty = sb.dir_root, b;
+	bool ok;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		entries[i].hash = dir_hash(files[i].name);
+		entries[i].inode_number = files[i].inode_number;
+		strcpy(entries[i].file_name, files[i].name);
+	}
+	qsort(entries, count, sizeof(dir_entry), by_key);
+	memcpy(used, bit_map, words * sizeof(BIT_FIELD));
+	if ((ok = rebuild_dir(entries, count, used, avoid))) {
+		//the tree's blocks are counted like any others
+		for (w = 0; w < words; w++) {
+			for (b = w * BITS_PER_FIELD; used[w] != bit_map[w] && b < (w + 1) * BITS_PER_FIELD; b++) {
+				if (USED(used, b) && !block_in_use(b))
+					allocate_block(b);
+			}
+		}
+		free_block(empty);
+	}
+	free(used);
+	free(avoid);
+	free(entries);
+	return ok;
+}
+
+/*
+   The data goes first, then the inodes that point at it and then the
+   directory, so an image left by a build that failed part way has no
+   file with missing data. The bitmap and the superblock are written by
+   the unmount.
+*/
+int u_build(format_options * opts, char * disk, const char * from, int threads) {
+	build_file * files = NULL;
+	char * table = NULL;
+	uint64_t start = stats_now(), bytes = 0;
+	double seconds;
+	int count = 0, used, i;
+	bool ok;
+
+	if (threads < 1)
+		threads = 1;
+	if (!scan_source(from, opts->block_size, &files, &count))
+		return 0;
+	if (!u_format(opts, disk) || !u_mount(disk)) {
+		free(files);
+		return 0;
+	}
+	ok = (used = assign_inodes(files, count)) >= 0;
+	if (ok) {
+		table = calloc(used ? used : 1, BLOCK_SIZE_BYTES);
+		ok = plan_blocks(files, count, table) && copy_data(files, count, threads);
+	}
+	if (ok) {
+		for (i = 0; i < count; i++) {
+			files[i].in->checksum = crc32c_sealed(files[i].in, sizeof(inode), &files[i].in->checksum);
+			bytes += files[i].size;
+		}
+		write_inode_table(table, used);
+		ok = count == 0 || load_dir(files, count);
+	}
+	u_unmount();
+
+	seconds = (stats_now() - start) / 1e9;
+	if (ok)
+		fprintf(stderr, "Built %d files, %lu bytes, from %s in %.3f seconds with %d reader threads\n",
+			count, bytes, from, seconds, threads);
+	else
+		fprintf(stderr, "The image in %s is incomplete\n", disk);
+	for (i = 0; i < count; i++)
+		free(files[i].path);
+	free(files);
+	free(table);
+	return ok;
+}
@@ -0,0 +1,19 @@
+#ifndef U_BUILD
+#define U_BUILD
+
+#include "util.h"
+
+#define DEFAULT_BUILD_THREADS 4
+#define BUILD_WINDOW (32 * 1024 * 1024) //bytes of file data read while the last lot is written
+
+/*
+   Formats disk as opts describes and fills it with the regular files at
+   the top of the host directory from, like mkfs -d. The files are laid
+   out back to back in the order of their names and threads read them
+   from the host, so the data, the inode table and the bitmap each go to
+   the image in a few large writes and the directory is built bottom up.
+   Returns 1, or 0 when the files do not fit or one cannot be read.
+*/
+int u_build(format_options * opts, char * disk, const char * from, int threads);
+
+#endif
@@ -1,6 +1,50 @@
+#include <string.h>
+#include <time.h>
 #include "crash.h"
 #include "sb.h"
 
+pthread_t crash_thread;
+int crash_mode = CRASH_OFF;
+uint64_t crash_writes;
+
+/* every crash_point() in the engine, NULL terminated */
+const char * crash_points[] = {
+	"create:inode_written",
+	"grow:inodes_written",
+	"grow:map_written",
+	"create:dir_updated",
+	"write:data_written",
+	"write:inode_written",
+	"truncate:inode_written",
+	"truncate:orphan_written",
+	"unlink:inode_freed",
+	"unlink:orphan_written",
+	"unlink:dir_written",
+	"rename:new_linked",
+	"rename:dir_updated",
+	"dir:split_parent_written",
+	"cow:inode_block_linked",
+	"snapshot:roots_copied",
+	"snapshot:deleted",
+	"defrag:data_copied",
+	"defrag:inode_written",
+	"reclaim:inode_written",
+	"resize:groups_written",
+	"resize:data_copied",
+	"resize:blocks_moved",
+	"resize:superblock_written",
+	NULL
+};
+
+static int crash_now;
+static uint64_t crash_target;
+static uint64_t crash_point_hits;
+static const char * crash_point_name;
+static void (*crash_handler)();
+
+/* 
+   Crashes on the first write after a random sleep of up to 50 seconds
+*/
 void init_crasher()
 {
 
@@ -8,8 +52,8 @@ void init_crasher()
 	long crash_sleep = 1+(int) (50.0*rand()/(RAND_MAX+1.0));
 
 	crash_now = false;
+	__atomic_store_n(&crash_mode, CRASH_TIMER, __ATOMIC_RELEASE);
 
-	pthread_mutex_init(&(crash_mutex), NULL);
 	if (pthread_create(&(crash_thread), NULL, crash_return, 
 			   (void *)(crash_sleep)) != 0) {
 		fprintf(stderr,"Didn't init crasher thread\n");
@@ -17,22 +61,85 @@ void init_crasher()
 	pthread_detach(crash_thread);
 }
 
-int crash_write(int vdisk, const void * buf, int num_bytes)
+void init_crash_at(int mode, uint64_t target)
+{
+	crash_writes = 0;
+	crash_target = target;
+	__atomic_store_n(&crash_mode, mode, __ATOMIC_RELEASE);
+}
+
+void init_crash_point(const char * name, uint64_t occurrence)
+{
+	crash_point_hits = 0;
+	crash_point_name = name;
+	init_crash_at(CRASH_AT_POINT, occurrence);
+}
+
+void crash_set_handler(void (*handler)())
 {
-	pthread_mutex_lock(&(crash_mutex));
-	if (false == crash_now){
-		pthread_mutex_unlock(&(crash_mutex));
-		return write(vdisk, buf, num_bytes);
-	} else {
-		pthread_mutex_unlock(&(crash_mutex));
-		fprintf(stderr, "SUPERBLOCK: %i\n", sb.clean_shutdown);
-		fprintf(stderr, "CRASH!!!!!\n");
-		exit(-1);
+	crash_handler = handler;
+}
+
+/* Dies without any cleanup, as if the machine went away */
+void crash()
+{
+	if (crash_handler != NULL)
+		crash_handler();
+	fprintf(stderr, "SUPERBLOCK: %i\n", sb.clean_shutdown);
+	fprintf(stderr, "CRASH!!!!!\n");
+	exit(-1);
+}
+
+#ifndef NO_CRASH_INJECTION
+/* counts a write, returns what to do with it: CRASH_OFF to do it, or the mode to act on */
+static int write_action()
+{
+	uint64_t n = __atomic_add_fetch(&crash_writes, 1, __ATOMIC_RELAXED);
+
+	switch (crash_mode) {
+	case CRASH_TIMER:
+		if (__atomic_load_n(&crash_now, __ATOMIC_ACQUIRE))
+			return CRASH_AT_WRITE;
+		break;
+	case CRASH_AT_WRITE:
+	case CRASH_TEAR_WRITE:
+	case CRASH_DROP_WRITE:
+		if (n == crash_target)
+			return crash_mode;
+		break;
 	}
-	pthread_mutex_unlock(&(crash_mutex));
-	return 0;
+	return CRASH_OFF;
 }
 
+int crash_injected_write(int vdisk, const void * buf, int num_bytes, off_t at)
+{
+	switch (write_action()) {
+	case CRASH_AT_WRITE:
+		crash();
+		break;
+	case CRASH_TEAR_WRITE:
+		pwrite(vdisk, buf, num_bytes / 2, at);
+		crash();
+		break;
+	case CRASH_DROP_WRITE:
+		return num_bytes;
+	}
+	return pwrite(vdisk, buf, num_bytes, at);
+}
+
+int crash_injected_count()
+{
+	return write_action();
+}
+
+void crash_injected_point(const char * name)
+{
+	if (strcmp(name, crash_point_name) == 0
+			&& __atomic_add_fetch(&crash_point_hits, 1, __ATOMIC_RELAXED) == crash_target)
+		crash();
+}
+#endif
+
 void * crash_return(void * args) {
 	long crash_sleep = (long)args;
 	fprintf(stderr, "crash sleeping for %lu\n", 
@@ -40,10 +147,7 @@ void * crash_return(void * args) {
 
 	sleep(crash_sleep * CRASHES_IN_100);
 	
-	pthread_mutex_lock(&(crash_mutex));
-	crash_now = true;
-	pthread_mutex_unlock(&(crash_mutex));
+	__atomic_store_n(&crash_now, true, __ATOMIC_RELEASE);
 
 	return NULL;
 }
-
@@ -7,17 +7,77 @@
 #include <pthread.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 #define CRASHES_IN_100 1
 
+/* 
+   What crash_write does with each disk write. Everything except
+   CRASH_OFF counts writes; the deterministic modes act on write number
+   crash_target (counting from 1) or on a named crash_point.
+*/
+typedef enum crash_mode_e {
+	CRASH_OFF,
+	CRASH_TIMER,	//crash on the first write after a random sleep
+	CRASH_COUNT,	//only count writes
+	CRASH_AT_WRITE,	//crash instead of doing write crash_target
+	CRASH_TEAR_WRITE,	//write half of write crash_target, then crash
+	CRASH_DROP_WRITE,	//silently skip write crash_target and carry on
+	CRASH_AT_POINT,	//crash at occurrence crash_target of a named point
+} crash_mode_t;
 
-pthread_t crash_thread;
-pthread_mutex_t crash_mutex;
-int crash_now;
+extern pthread_t crash_thread;
+extern int crash_mode;
+extern uint64_t crash_writes;
+extern const char * crash_points[];
 
 void init_crasher();
-int crash_write(int vdisk, const void * buf, int num_bytes);
+void init_crash_at(int mode, uint64_t target);
+void init_crash_point(const char * name, uint64_t occurrence);
+void crash_set_handler(void (*handler)());
+void crash();
 void * crash_return(void * args);
 
+/* 
+   Building with NO_CRASH_INJECTION turns every hook into a plain write,
+   otherwise a disabled crasher costs one relaxed load per write.
+*/
+#ifdef NO_CRASH_INJECTION
+static inline int crash_write(int vdisk, const void * buf, int num_bytes, off_t at) {
+	return pwrite(vdisk, buf, num_bytes, at);
+}
+#define crash_point(name) ((void)0)
+static inline int crash_count_write() {
+	return CRASH_OFF;
+}
+#else
+int crash_injected_write(int vdisk, const void * buf, int num_bytes, off_t at);
+void crash_injected_point(const char * name);
+int crash_injected_count();
+
+/* pwrite(2) of num_bytes at byte at of vdisk, or what the crasher does instead */
+static inline int crash_write(int vdisk, const void * buf, int num_bytes, off_t at) {
+	if (__builtin_expect(__atomic_load_n(&crash_mode, __ATOMIC_RELAXED) == CRASH_OFF, 1))
+		return pwrite(vdisk, buf, num_bytes, at);
+	return crash_injected_write(vdisk, buf, num_bytes, at);
+}
+
+/*
+   Counts a write for a caller that hands it to another thread to do, so
+   writes are counted in the order they were asked for. Returns what to
+   do with it, CRASH_OFF to do it as usual. The thread doing it then
+   writes with pwrite(2), not crash_write.
+*/
+static inline int crash_count_write() {
+	if (__builtin_expect(__atomic_load_n(&crash_mode, __ATOMIC_RELAXED) == CRASH_OFF, 1))
+		return CRASH_OFF;
+	return crash_injected_count();
+}
+
+static inline void crash_point(const char * name) {
+	if (__builtin_expect(__atomic_load_n(&crash_mode, __ATOMIC_RELAXED) == CRASH_AT_POINT, 0))
+		crash_injected_point(name);
+}
 #endif
 
+#endif
@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include "crc.h"
+
+/*
+   CRC32C (Castagnoli), the polynomial of the SSE4.2 crc32 instruction.
+   Without it eight tables let the loop take 8 bytes per step. A crc of
+   0 starts a new checksum, passing the result back in continues it.
+*/
+#define CRC32C_POLY 0x82F63B78
+
+uint64_t checksum_failures;
+
+static uint32_t table[8][256];
+static bool use_hw;
+
+__attribute__((constructor))
+static void init_crc32c() {
+	uint32_t i, c;
+	int k;
+	for (i = 0; i < 256; i++) {
+		c = i;
+		for (k = 0; k < 8; k++)
+			c = c & 1 ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+		table[0][i] = c;
+	}
+	for (i = 0; i < 256; i++) {
+		for (k = 1; k < 8; k++)
+			table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+	}
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	use_hw = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+/* slicing by 8, the words are read little endian */
+uint32_t crc32c_sw(uint32_t crc, const void * data, size_t len) {
+	const unsigned char * p = data;
+	uint32_t lo, hi;
+	crc = ~crc;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&lo, p, 4);
+		memcpy(&hi, p + 4, 4);
+		lo ^= crc;
+		crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff]
+			^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24]
+			^ table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff]
+			^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+	}
+	while (len--)
+		crc = (crc >> 8) ^ table[0][(crc ^ *p++) & 0xff];
+	return ~crc;
+}
+
+#if defined(__x86_64__)
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void * data, size_t len) {
+	const unsigned char * p = data;
+	uint64_t c = ~crc, word;
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&word, p, 8);
+		c = __builtin_ia32_crc32di(c, word);
+	}
+	while (len--)
+		c = __builtin_ia32_crc32qi((uint32_t)c, *p++);
+	return ~(uint32_t)c;
+}
+#endif
+
+/* whether the crc32 instruction is used */
+bool crc32c_hw() {
+	return use_hw;
+}
+
+uint32_t crc32c(uint32_t crc, const void * data, size_t len) {
+#if defined(__x86_64__)
+	if (use_hw)
+		return crc32c_sse42(crc, data, len);
+#endif
+	return crc32c_sw(crc, data, len);
+}
+
+/* checksum of a structure that holds its own, taken as if field were zero */
+uint32_t crc32c_sealed(const void * data, size_t len, const uint32_t * field) {
+	size_t at = (const char *)field - (const char *)data;
+	uint32_t zero = 0, crc;
+	crc = crc32c(0, data, at);
+	crc = crc32c(crc, &zero, sizeof(zero));
+	return crc32c(crc, (const char *)(field + 1), len - at - sizeof(zero));
+}
+
+/* reports a block, inode or structure whose checksum does not match */
+void checksum_failed(const char * what, int64_t where) {
+	__atomic_add_fetch(&checksum_failures, 1, __ATOMIC_RELAXED);
+	fprintf(stderr, "Checksum mismatch in %s %ld\n", what, where);
+}
@@ -0,0 +1,17 @@
+#ifndef U_CRC
+#define U_CRC
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+/* mismatches found since the engine started, shown in the stats file */
+extern uint64_t checksum_failures;
+
+uint32_t crc32c(uint32_t crc, const void * data, size_t len);
+uint32_t crc32c_sw(uint32_t crc, const void * data, size_t len);
+uint32_t crc32c_sealed(const void * data, size_t len, const uint32_t * field);
+bool crc32c_hw();
+void checksum_failed(const char * what, int64_t where);
+
+#endif
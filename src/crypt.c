@@ -0,0 +1,812 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/random.h>
+#if defined(__x86_64__)
+#include <wmmintrin.h>
+#include <emmintrin.h>
+#include <immintrin.h>
+#endif
+#include "sb.h"
+#include "crypt.h"
+
+#define AES_ROUNDS 14 //of AES-256
+
+/*
+   Expanded keys, k1 enciphers the data and k2 the tweak. The round keys
+   are in the byte order of FIPS-197, which is also the one the AES-NI
+   instructions take. keys are those of the disk mounted.
+*/
+typedef struct xts_keys_s {
+	bool on;
+	unsigned char k1[AES_ROUNDS + 1][16];
+	unsigned char k2[AES_ROUNDS + 1][16];
+	unsigned char d1[AES_ROUNDS + 1][16]; //k1 for aesdec, in reverse with InvMixColumns applied
+} xts_keys;
+
+static xts_keys keys;
+
+static unsigned char sbox[256], inv_sbox[256];
+static unsigned char mul[15][256]; //mul[b][a] is a times b in GF(2^8), for the factors of (Inv)MixColumns
+static bool use_hw;
+static bool use_vaes; //four blocks an instruction, with VAES and AVX-512
+
+static unsigned char rotl8(unsigned char x, int n) {
+	return x << n | x >> (8 - n);
+}
+
+static unsigned char gmul(unsigned char a, unsigned char b) {
+	unsigned char r = 0;
+	while (b) {
+		if (b & 1)
+			r ^= a;
+		a = a << 1 ^ (a & 0x80 ? 0x1b : 0);
+		b >>= 1;
+	}
+	return r;
+}
+
+/* the S-box from the inverses in GF(2^8), walking 3^i and 3^-i together */
+__attribute__((constructor))
+static void init_aes() {
+	unsigned char p = 1, q = 1;
+	int i, b;
+	do {
+		p = p ^ (p << 1) ^ (p & 0x80 ? 0x1b : 0);
+		q ^= q << 1;
+		q ^= q << 2;
+		q ^= q << 4;
+		if (q & 0x80)
+			q ^= 0x09;
+		sbox[p] = q ^ rotl8(q, 1) ^ rotl8(q, 2) ^ rotl8(q, 3) ^ rotl8(q, 4) ^ 0x63;
+	} while (p != 1);
+	sbox[0] = 0x63;
+	for (i = 0; i < 256; i++) {
+		inv_sbox[sbox[i]] = i;
+		for (b = 0; b < 15; b++)
+			mul[b][i] = gmul(i, b);
+	}
+#if defined(__x86_64__)
+	__builtin_cpu_init();
+	use_hw = __builtin_cpu_supports("aes") && __builtin_cpu_supports("sse2");
+	use_vaes = use_hw && __builtin_cpu_supports("vaes") && __builtin_cpu_supports("avx512f");
+#endif
+}
+
+/* whether the AES-NI instructions are used */
+bool aes_hw() {
+	return use_hw;
+}
+
+bool aes_vaes() {
+	return use_vaes;
+}
+
+/* FIPS-197 key expansion of a 32 byte key, with the S-box table */
+static void expand_key_sw(const unsigned char * key, unsigned char rk[AES_ROUNDS + 1][16]) {
+	unsigned char * w = &rk[0][0], t[4], rcon = 1, x;
+	int i;
+	memcpy(w, key, 32);
+	for (i = 8; i < 4 * (AES_ROUNDS + 1); i++) {
+		memcpy(t, w + 4 * (i - 1), 4);
+		if (i % 8 == 0) {
+			x = t[0];
+			t[0] = sbox[t[1]] ^ rcon;
+			t[1] = sbox[t[2]];
+			t[2] = sbox[t[3]];
+			t[3] = sbox[x];
+			rcon = rcon << 1 ^ (rcon & 0x80 ? 0x1b : 0);
+		} else if (i % 8 == 4) {
+			t[0] = sbox[t[0]];
+			t[1] = sbox[t[1]];
+			t[2] = sbox[t[2]];
+			t[3] = sbox[t[3]];
+		}
+		w[4 * i] = w[4 * (i - 8)] ^ t[0];
+		w[4 * i + 1] = w[4 * (i - 8) + 1] ^ t[1];
+		w[4 * i + 2] = w[4 * (i - 8) + 2] ^ t[2];
+		w[4 * i + 3] = w[4 * (i - 8) + 3] ^ t[3];
+	}
+}
+
+static void add_round_key(unsigned char * s, const unsigned char * k) {
+	int i;
+	for (i = 0; i < 16; i++)
+		s[i] ^= k[i];
+}
+
+/* the state is column after column, byte r of column c at s[r + 4c] */
+static void aes_encrypt_sw(const unsigned char rk[AES_ROUNDS + 1][16], unsigned char * s) {
+	unsigned char t[16], a0, a1, a2, a3;
+	int round, r, c;
+	add_round_key(s, rk[0]);
+	for (round = 1; round <= AES_ROUNDS; round++) {
+		for (c = 0; c < 4; c++) {
+			for (r = 0; r < 4; r++)
+				t[r + 4 * c] = sbox[s[r + 4 * ((c + r) % 4)]];
+		}
+		if (round < AES_ROUNDS) {
+			for (c = 0; c < 4; c++) {
+				a0 = t[4 * c]; a1 = t[4 * c + 1]; a2 = t[4 * c + 2]; a3 = t[4 * c + 3];
+				t[4 * c] = mul[2][a0] ^ mul[3][a1] ^ a2 ^ a3;
+				t[4 * c + 1] = a0 ^ mul[2][a1] ^ mul[3][a2] ^ a3;
+				t[4 * c + 2] = a0 ^ a1 ^ mul[2][a2] ^ mul[3][a3];
+				t[4 * c + 3] = mul[3][a0] ^ a1 ^ a2 ^ mul[2][a3];
+			}
+		}
+		memcpy(s, t, 16);
+		add_round_key(s, rk[round]);
+	}
+}
+
+static void aes_decrypt_sw(const unsigned char rk[AES_ROUNDS + 1][16], unsigned char * s) {
+	unsigned char t[16], a0, a1, a2, a3;
+	int round, r, c;
+	add_round_key(s, rk[AES_ROUNDS]);
+	for (round = AES_ROUNDS - 1; round >= 0; round--) {
+		for (c = 0; c < 4; c++) {
+			for (r = 0; r < 4; r++)
+				t[r + 4 * ((c + r) % 4)] = inv_sbox[s[r + 4 * c]];
+		}
+		add_round_key(t, rk[round]);
+		if (round > 0) {
+			for (c = 0; c < 4; c++) {
+				a0 = t[4 * c]; a1 = t[4 * c + 1]; a2 = t[4 * c + 2]; a3 = t[4 * c + 3];
+				t[4 * c] = mul[14][a0] ^ mul[11][a1] ^ mul[13][a2] ^ mul[9][a3];
+				t[4 * c + 1] = mul[9][a0] ^ mul[14][a1] ^ mul[11][a2] ^ mul[13][a3];
+				t[4 * c + 2] = mul[13][a0] ^ mul[9][a1] ^ mul[14][a2] ^ mul[11][a3];
+				t[4 * c + 3] = mul[11][a0] ^ mul[13][a1] ^ mul[9][a2] ^ mul[14][a3];
+			}
+		}
+		memcpy(s, t, 16);
+	}
+}
+
+/* the next tweak, times x in GF(2^128) with the bytes little endian */
+static void next_tweak(unsigned char * t) {
+	int carry = t[15] >> 7, i;
+	for (i = 15; i > 0; i--)
+		t[i] = t[i] << 1 | t[i - 1] >> 7;
+	t[0] = t[0] << 1 ^ (carry ? 0x87 : 0);
+}
+
+static void xts_sw(const xts_keys * ks, uint64_t unit, const unsigned char * in, unsigned char * p, size_t len, bool decrypt) {
+	unsigned char t[16];
+	int i, j;
+	for (; len >= CRYPT_UNIT; len -= CRYPT_UNIT, unit++) {
+		memset(t, 0, sizeof(t));
+		for (i = 0; i < 8; i++)
+			t[i] = unit >> (8 * i);
+		aes_encrypt_sw(ks->k2, t);
+		for (i = 0; i < CRYPT_UNIT; i += 16, in += 16, p += 16) {
+			for (j = 0; j < 16; j++)
+				p[j] = in[j] ^ t[j];
+			if (decrypt)
+				aes_decrypt_sw(ks->k1, p);
+			else
+				aes_encrypt_sw(ks->k1, p);
+			for (j = 0; j < 16; j++)
+				p[j] ^= t[j];
+			next_tweak(t);
+		}
+	}
+}
+
+void xts_encrypt_sw(uint64_t unit, void * data, size_t len) {
+	xts_sw(&keys, unit, data, data, len, false);
+}
+
+void xts_decrypt_sw(uint64_t unit, void * data, size_t len) {
+	xts_sw(&keys, unit, data, data, len, true);
+}
+
+#if defined(__x86_64__)
+#define XTS_LANES 8 //blocks of a unit in flight at once, to hide the latency of aesenc
+
+__attribute__((target("aes,sse2")))
+static inline __m128i next_tweak_hw(__m128i t) {
+	//the top bit of each 32 bit lane carries into the next, the top of all of them wraps to 0x87
+	__m128i carry = _mm_and_si128(_mm_srai_epi32(t, 31), _mm_set_epi32(0x87, 1, 1, 1));
+	return _mm_xor_si128(_mm_add_epi32(t, t), _mm_shuffle_epi32(carry, 0x93));
+}
+
+__attribute__((target("aes,sse2")))
+static void xts_hw(const xts_keys * ks, uint64_t unit, const unsigned char * in, unsigned char * p, size_t len, bool decrypt) {
+	__m128i k[AES_ROUNDS + 1], k2[AES_ROUNDS + 1], t, tw[XTS_LANES], x[XTS_LANES];
+	int i, j, r;
+	for (r = 0; r <= AES_ROUNDS; r++) {
+		k[r] = _mm_loadu_si128((const __m128i *)(decrypt ? ks->d1[r] : ks->k1[r]));
+		k2[r] = _mm_loadu_si128((const __m128i *)ks->k2[r]);
+	}
+	for (; len >= CRYPT_UNIT; len -= CRYPT_UNIT, unit++) {
+		t = _mm_xor_si128(_mm_set_epi64x(0, unit), k2[0]);
+		for (r = 1; r < AES_ROUNDS; r++)
+			t = _mm_aesenc_si128(t, k2[r]);
+		t = _mm_aesenclast_si128(t, k2[AES_ROUNDS]);
+		for (i = 0; i < CRYPT_UNIT / 16; i += XTS_LANES, in += 16 * XTS_LANES, p += 16 * XTS_LANES) {
+			for (j = 0; j < XTS_LANES; j++) {
+				tw[j] = t;
+				t = next_tweak_hw(t);
+				x[j] = _mm_xor_si128(_mm_loadu_si128((const __m128i *)(in + 16 * j)), _mm_xor_si128(tw[j], k[0]));
+			}
+			if (decrypt) {
+				for (r = 1; r < AES_ROUNDS; r++) {
+					for (j = 0; j < XTS_LANES; j++)
+						x[j] = _mm_aesdec_si128(x[j], k[r]);
+				}
+				for (j = 0; j < XTS_LANES; j++)
+					x[j] = _mm_aesdeclast_si128(x[j], k[AES_ROUNDS]);
+			} else {
+				for (r = 1; r < AES_ROUNDS; r++) {
+					for (j = 0; j < XTS_LANES; j++)
+						x[j] = _mm_aesenc_si128(x[j], k[r]);
+				}
+				for (j = 0; j < XTS_LANES; j++)
+					x[j] = _mm_aesenclast_si128(x[j], k[AES_ROUNDS]);
+			}
+			for (j = 0; j < XTS_LANES; j++)
+				_mm_storeu_si128((__m128i *)(p + 16 * j), _mm_xor_si128(x[j], tw[j]));
+		}
+	}
+}
+
+#define XTS_VLANES (CRYPT_UNIT / 64) //a whole unit in flight, four blocks in each lane
+
+/*
+   The tweaks of blocks 4j to 4j + 3 of a unit whose tweaks of blocks 0
+   to 3 are in t, t times x^4j in each lane. The 4j bits shifted out of
+   the top come back in times x^128 = x^7 + x^2 + x + 1.
+*/
+__attribute__((target("aes,vaes,avx512f")))
+static inline __m512i tweaks_vaes(__m512i t, int j) {
+	__m512i left = _mm512_sll_epi64(t, _mm_cvtsi32_si128(4 * j));
+	__m512i out = _mm512_srl_epi64(t, _mm_cvtsi32_si128(64 - 4 * j));
+	//the bits out of the low half go into the high one, those out of the high one wrap to the low
+	__m512i across = _mm512_shuffle_epi32(out, 0x4E);
+	__m512i wrap = _mm512_maskz_mov_epi64(0x55, across);
+	__m512i carry = _mm512_maskz_mov_epi64(0xAA, across);
+	wrap = _mm512_xor_si512(_mm512_xor_si512(wrap, _mm512_slli_epi64(wrap, 1)),
+		_mm512_xor_si512(_mm512_slli_epi64(wrap, 2), _mm512_slli_epi64(wrap, 7)));
+	return _mm512_xor_si512(left, _mm512_xor_si512(carry, wrap));
+}
+
+/* as xts_hw, each unit enciphered at once, four blocks to an instruction, with the tweaks of four units at once */
+__attribute__((target("aes,vaes,avx512f")))
+static void xts_vaes(const xts_keys * ks, uint64_t unit, const unsigned char * in, unsigned char * p, size_t len, bool decrypt) {
+	__m512i k[AES_ROUNDS + 1], tw[XTS_VLANES], x[XTS_VLANES], units;
+	__m128i t[4], t1, t2, t3;
+	int u, j, r;
+	for (r = 0; r <= AES_ROUNDS; r++)
+		k[r] = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)(decrypt ? ks->d1[r] : ks->k1[r])));
+	for (u = 4; len >= CRYPT_UNIT; len -= CRYPT_UNIT, unit++, in += CRYPT_UNIT, p += CRYPT_UNIT, u++) {
+		if (u == 4) {
+			units = _mm512_set_epi64(0, unit + 3, 0, unit + 2, 0, unit + 1, 0, unit);
+			units = _mm512_xor_si512(units, _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)ks->k2[0])));
+			for (r = 1; r < AES_ROUNDS; r++)
+				units = _mm512_aesenc_epi128(units, _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)ks->k2[r])));
+			units = _mm512_aesenclast_epi128(units, _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i *)ks->k2[AES_ROUNDS])));
+			t[0] = _mm512_extracti32x4_epi32(units, 0);
+			t[1] = _mm512_extracti32x4_epi32(units, 1);
+			t[2] = _mm512_extracti32x4_epi32(units, 2);
+			t[3] = _mm512_extracti32x4_epi32(units, 3);
+			u = 0;
+		}
+		t1 = next_tweak_hw(t[u]);
+		t2 = next_tweak_hw(t1);
+		t3 = next_tweak_hw(t2);
+		tw[0] = _mm512_inserti32x4(_mm512_inserti32x4(_mm512_inserti32x4(_mm512_castsi128_si512(t[u]),
+			t1, 1), t2, 2), t3, 3);
+		for (j = 1; j < XTS_VLANES; j++)
+			tw[j] = tweaks_vaes(tw[0], j);
+		for (j = 0; j < XTS_VLANES; j++)
+			x[j] = _mm512_xor_si512(_mm512_loadu_si512(in + 64 * j), _mm512_xor_si512(tw[j], k[0]));
+		if (decrypt) {
+			for (r = 1; r < AES_ROUNDS; r++) {
+				for (j = 0; j < XTS_VLANES; j++)
+					x[j] = _mm512_aesdec_epi128(x[j], k[r]);
+			}
+			for (j = 0; j < XTS_VLANES; j++)
+				x[j] = _mm512_aesdeclast_epi128(x[j], k[AES_ROUNDS]);
+		} else {
+			for (r = 1; r < AES_ROUNDS; r++) {
+				for (j = 0; j < XTS_VLANES; j++)
+					x[j] = _mm512_aesenc_epi128(x[j], k[r]);
+			}
+			for (j = 0; j < XTS_VLANES; j++)
+				x[j] = _mm512_aesenclast_epi128(x[j], k[AES_ROUNDS]);
+		}
+		for (j = 0; j < XTS_VLANES; j++)
+			_mm512_storeu_si512(p + 64 * j, _mm512_xor_si512(x[j], tw[j]));
+	}
+}
+
+/* the round keys of the equivalent inverse cipher that aesdec takes */
+__attribute__((target("aes,sse2")))
+static void decrypt_keys_hw(xts_keys * ks) {
+	int r;
+	memcpy(ks->d1[0], ks->k1[AES_ROUNDS], 16);
+	for (r = 1; r < AES_ROUNDS; r++)
+		_mm_storeu_si128((__m128i *)ks->d1[r],
+			_mm_aesimc_si128(_mm_loadu_si128((const __m128i *)ks->k1[AES_ROUNDS - r])));
+	memcpy(ks->d1[AES_ROUNDS], ks->k1[0], 16);
+}
+
+/* the previous round key a with each word the xor of those up to it and of the word b holds in every lane */
+__attribute__((target("aes,sse2")))
+static inline __m128i next_round_key(__m128i a, __m128i b) {
+	a = _mm_xor_si128(a, _mm_slli_si128(a, 4));
+	a = _mm_xor_si128(a, _mm_slli_si128(a, 8));
+	return _mm_xor_si128(a, b);
+}
+
+//round key i from the two before it, the even ones RotWord, SubWord and rcon the last word, the odd ones SubWord it
+#define KEY_EVEN(i, rcon) w[i] = next_round_key(w[i - 2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(w[i - 1], rcon), 0xff))
+#define KEY_ODD(i) w[i] = next_round_key(w[i - 2], _mm_shuffle_epi32(_mm_aeskeygenassist_si128(w[i - 1], 0), 0xaa))
+
+/* expand_key_sw with aeskeygenassist, no table is looked up with the key */
+__attribute__((target("aes,sse2")))
+static void expand_key_hw(const unsigned char * key, unsigned char rk[AES_ROUNDS + 1][16]) {
+	__m128i w[AES_ROUNDS + 1];
+	int r;
+	w[0] = _mm_loadu_si128((const __m128i *)key);
+	w[1] = _mm_loadu_si128((const __m128i *)(key + 16));
+	KEY_EVEN(2, 0x01); KEY_ODD(3);
+	KEY_EVEN(4, 0x02); KEY_ODD(5);
+	KEY_EVEN(6, 0x04); KEY_ODD(7);
+	KEY_EVEN(8, 0x08); KEY_ODD(9);
+	KEY_EVEN(10, 0x10); KEY_ODD(11);
+	KEY_EVEN(12, 0x20); KEY_ODD(13);
+	KEY_EVEN(14, 0x40);
+	for (r = 0; r <= AES_ROUNDS; r++)
+		_mm_storeu_si128((__m128i *)rk[r], w[r]);
+	memset(w, 0, sizeof(w));
+}
+#endif
+
+static void xts(uint64_t unit, const void * in, void * out, size_t len, bool decrypt) {
+#if defined(__x86_64__)
+	if (use_vaes) {
+		xts_vaes(&keys, unit, in, out, len, decrypt);
+		return;
+	}
+	if (use_hw) {
+		xts_hw(&keys, unit, in, out, len, decrypt);
+		return;
+	}
+#endif
+	//no disk is enciphered without AES-NI, see crypt_usable, only the bench gets here
+	xts_sw(&keys, unit, in, out, len, decrypt);
+}
+
+/* len bytes of data from unit on, a whole number of units, in place */
+void xts_encrypt(uint64_t unit, void * data, size_t len) {
+	xts(unit, data, data, len, false);
+}
+
+void xts_decrypt(uint64_t unit, void * data, size_t len) {
+	xts(unit, data, data, len, true);
+}
+
+/* as xts_encrypt, into to and leaving from as it is */
+void xts_encrypt_to(uint64_t unit, const void * from, void * to, size_t len) {
+	xts(unit, from, to, len, false);
+}
+
+/* SHA-256 (FIPS 180-4), for PBKDF2 and the key check */
+typedef struct sha256_s {
+	uint32_t h[8];
+	uint64_t bytes;
+	unsigned char buf[64];
+} sha256_ctx;
+
+static const uint32_t sha_k[64] = {
+	0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+	0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+	0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+	0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+	0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+	0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+	0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+	0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ROTR(x, n) ((x) >> (n) | (x) << (32 - (n)))
+
+static void sha256_block(uint32_t * h, const unsigned char * p) {
+	uint32_t w[64], a, b, c, d, e, f, g, k, t1, t2;
+	int i;
+	for (i = 0; i < 16; i++)
+		w[i] = (uint32_t)p[4 * i] << 24 | p[4 * i + 1] << 16 | p[4 * i + 2] << 8 | p[4 * i + 3];
+	for (; i < 64; i++)
+		w[i] = w[i - 16] + (ROTR(w[i - 15], 7) ^ ROTR(w[i - 15], 18) ^ w[i - 15] >> 3)
+			+ w[i - 7] + (ROTR(w[i - 2], 17) ^ ROTR(w[i - 2], 19) ^ w[i - 2] >> 10);
+	a = h[0]; b = h[1]; c = h[2]; d = h[3]; e = h[4]; f = h[5]; g = h[6]; k = h[7];
+	for (i = 0; i < 64; i++) {
+		t1 = k + (ROTR(e, 6) ^ ROTR(e, 11) ^ ROTR(e, 25)) + ((e & f) ^ (~e & g)) + sha_k[i] + w[i];
+		t2 = (ROTR(a, 2) ^ ROTR(a, 13) ^ ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+		k = g; g = f; f = e; e = d + t1;
+		d = c; c = b; b = a; a = t1 + t2;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e; h[5] += f; h[6] += g; h[7] += k;
+}
+
+static void sha256_init(sha256_ctx * c) {
+	static const uint32_t h0[8] = {
+		0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+	};
+	memcpy(c->h, h0, sizeof(h0));
+	c->bytes = 0;
+}
+
+static void sha256_update(sha256_ctx * c, const void * data, size_t len) {
+	const unsigned char * p = data;
+	size_t fill = c->bytes % 64, n;
+	c->bytes += len;
+	while (len > 0) {
+		n = 64 - fill < len ? 64 - fill : len;
+		memcpy(c->buf + fill, p, n);
+		fill += n;
+		p += n;
+		len -= n;
+		if (fill == 64) {
+			sha256_block(c->h, c->buf);
+			fill = 0;
+		}
+	}
+}
+
+static void sha256_final(sha256_ctx * c, unsigned char * out) {
+	unsigned char pad[72] = { 0x80 };
+	uint64_t bits = c->bytes * 8;
+	size_t n = 64 - (c->bytes + 8) % 64, i;
+	for (i = 0; i < 8; i++)
+		pad[n + i] = bits >> (56 - 8 * i);
+	sha256_update(c, pad, n + 8);
+	for (i = 0; i < 8; i++) {
+		out[4 * i] = c->h[i] >> 24;
+		out[4 * i + 1] = c->h[i] >> 16;
+		out[4 * i + 2] = c->h[i] >> 8;
+		out[4 * i + 3] = c->h[i];
+	}
+}
+
+/*
+   PBKDF2-HMAC-SHA256 (RFC 8018). The states after the padded key are
+   kept, so every iteration is two compressions.
+*/
+static void pbkdf2(const char * pass, const unsigned char * salt, int salt_len, int iterations,
+		unsigned char * out, int out_len) {
+	unsigned char key[64], pad[64], u[32], t[32], count[4];
+	sha256_ctx inner, outer, c;
+	int i, j, block, n;
+	size_t len = strlen(pass);
+
+	memset(key, 0, sizeof(key));
+	if (len > 64) {
+		sha256_init(&c);
+		sha256_update(&c, pass, len);
+		sha256_final(&c, key);
+	} else {
+		memcpy(key, pass, len);
+	}
+	for (i = 0; i < 64; i++)
+		pad[i] = key[i] ^ 0x36;
+	sha256_init(&inner);
+	sha256_update(&inner, pad, 64);
+	for (i = 0; i < 64; i++)
+		pad[i] = key[i] ^ 0x5c;
+	sha256_init(&outer);
+	sha256_update(&outer, pad, 64);
+
+	for (block = 1; out_len > 0; block++) {
+		count[0] = block >> 24; count[1] = block >> 16; count[2] = block >> 8; count[3] = block;
+		c = inner;
+		sha256_update(&c, salt, salt_len);
+		sha256_update(&c, count, 4);
+		sha256_final(&c, u);
+		c = outer;
+		sha256_update(&c, u, 32);
+		sha256_final(&c, u);
+		memcpy(t, u, 32);
+		for (i = 1; i < iterations; i++) {
+			c = inner;
+			sha256_update(&c, u, 32);
+			sha256_final(&c, u);
+			c = outer;
+			sha256_update(&c, u, 32);
+			sha256_final(&c, u);
+			for (j = 0; j < 32; j++)
+				t[j] ^= u[j];
+		}
+		n = out_len < 32 ? out_len : 32;
+		memcpy(out, t, n);
+		out += n;
+		out_len -= n;
+	}
+	memset(key, 0, sizeof(key));
+	memset(pad, 0, sizeof(pad));
+}
+
+static char * passphrase;
+
+/* the key last derived from the passphrase, a remount of the same disk does not derive it again */
+static struct {
+	bool valid;
+	unsigned char salt[CRYPT_SALT_BYTES];
+	int iterations;
+	unsigned char key[CRYPT_KEY_BYTES];
+} derived;
+
+/*
+   NULL forgets the passphrase once the disk is mounted. The passphrase
+   it replaces and the key derived from it are wiped, the keys of a
+   mounted disk stay until crypt_stop.
+*/
+void crypt_set_passphrase(const char * text) {
+	if (passphrase != NULL)
+		memset(passphrase, 0, strlen(passphrase));
+	memset(&derived, 0, sizeof(derived));
+	free(passphrase);
+	passphrase = text != NULL ? strdup(text) : NULL;
+}
+
+static const char * get_passphrase() {
+	char * text;
+	if (passphrase == NULL && (text = getenv("USERFS_PASSPHRASE")) != NULL)
+		crypt_set_passphrase(text);
+	if (passphrase == NULL && isatty(STDIN_FILENO) && (text = getpass("Passphrase: ")) != NULL) {
+		crypt_set_passphrase(text);
+		memset(text, 0, strlen(text));
+	}
+	return passphrase;
+}
+
+/* the keys for the passphrase and the salt and iterations in the superblock, with their check */
+static bool derive(unsigned char * key, unsigned char * check) {
+	const char * text = get_passphrase();
+	unsigned char digest[32];
+	sha256_ctx c;
+	if (text == NULL) {
+		fprintf(stderr, "The disk is encrypted, a passphrase is needed\n");
+		return false;
+	}
+	if (!derived.valid || derived.iterations != sb.crypt_iterations
+			|| memcmp(derived.salt, sb.crypt_salt, CRYPT_SALT_BYTES) != 0) {
+		memcpy(derived.salt, sb.crypt_salt, CRYPT_SALT_BYTES);
+		derived.iterations = sb.crypt_iterations;
+		pbkdf2(text, sb.crypt_salt, CRYPT_SALT_BYTES, sb.crypt_iterations, derived.key, CRYPT_KEY_BYTES);
+		derived.valid = true;
+	}
+	memcpy(key, derived.key, CRYPT_KEY_BYTES);
+	sha256_init(&c);
+	sha256_update(&c, "userfs key check", 16);
+	sha256_update(&c, key, CRYPT_KEY_BYTES);
+	sha256_final(&c, digest);
+	memcpy(check, digest, CRYPT_CHECK_BYTES);
+	return true;
+}
+
+/* the keys into ks, with the tables of the software cipher unless hw */
+static void expand_keys(xts_keys * ks, const unsigned char * key, bool hw) {
+#if defined(__x86_64__)
+	if (hw) {
+		expand_key_hw(key, ks->k1);
+		expand_key_hw(key + 32, ks->k2);
+		decrypt_keys_hw(ks);
+		ks->on = true;
+		return;
+	}
+#endif
+	expand_key_sw(key, ks->k1);
+	expand_key_sw(key + 32, ks->k2);
+	ks->on = true;
+}
+
+static void set_keys(unsigned char * key) {
+	expand_keys(&keys, key, true);
+	memset(key, 0, CRYPT_KEY_BYTES);
+}
+
+/* hex into len bytes of out */
+static void from_hex(const char * hex, unsigned char * out, int len) {
+	int i;
+	for (i = 0; i < len; i++)
+		sscanf(hex + 2 * i, "%2hhx", &out[i]);
+}
+
+static bool known(const char * what, const unsigned char * got, const char * hex, int len) {
+	unsigned char want[64];
+	from_hex(hex, want, len);
+	if (memcmp(got, want, len) == 0)
+		return true;
+	fprintf(stderr, "crypt self test: %s gives the wrong answer\n", what);
+	return false;
+}
+
+static bool test_sha256() {
+	static const char * vectors[][2] = {
+		//FIPS 180-2 appendix B and the empty message
+		{ "", "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855" },
+		{ "abc", "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+		{ "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq",
+			"248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+	};
+	unsigned char out[32], a[1000];
+	sha256_ctx c;
+	bool ok = true;
+	int i;
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		sha256_init(&c);
+		sha256_update(&c, vectors[i][0], strlen(vectors[i][0]));
+		sha256_final(&c, out);
+		ok = known("SHA-256", out, vectors[i][1], 32) && ok;
+	}
+	//a million times 'a', a thousand at a time
+	memset(a, 'a', sizeof(a));
+	sha256_init(&c);
+	for (i = 0; i < 1000; i++)
+		sha256_update(&c, a, sizeof(a));
+	sha256_final(&c, out);
+	return known("SHA-256", out, "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0", 32) && ok;
+}
+
+static bool test_pbkdf2() {
+	static const struct {
+		const char * pass, * salt;
+		int iterations, len;
+		const char * key;
+	} vectors[] = {
+		//RFC 7914 section 11
+		{ "passwd", "salt", 1, 64, "55ac046e56e3089fec1691c22544b605f94185216dde0465e68b9d57c20dacbc"
+			"49ca9cccf179b645991664b39d77ef317c71b845b1e30bd509112041d3a19783" },
+		//the RFC 6070 inputs with SHA-256
+		{ "password", "salt", 1, 32, "120fb6cffcf8b32c43e7225256c4f837a86548c92ccc35480805987cb70be17b" },
+		{ "password", "salt", 2, 32, "ae4d0c95af6b46d32d0adff928f06dd02a303f8ef3c251dfd6e2d85a95474c43" },
+		{ "password", "salt", 4096, 32, "c5e478d59288c841aa530db6845c4c8d962893a001ce4e11a4963873aa98134a" },
+		{ "passwordPASSWORDpassword", "saltSALTsaltSALTsaltSALTsaltSALTsalt", 4096, 40,
+			"348c89dbcbd32b2f32d814b8116e84cf2b17347ebc1800181c4e2a1fb8dd53e1c635518c7dac47e9" },
+		//a passphrase longer than a block is hashed first
+		{ "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx",
+			"salt", 2, 32, "d43a18cd77bafc1a4b0c6025dbbf29c7e6d67acce6ad02a736d4a3003b6a3c26" },
+	};
+	unsigned char out[64];
+	bool ok = true;
+	int i;
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		pbkdf2(vectors[i].pass, (const unsigned char *)vectors[i].salt, strlen(vectors[i].salt),
+			vectors[i].iterations, out, vectors[i].len);
+		ok = known("PBKDF2-HMAC-SHA256", out, vectors[i].key, vectors[i].len) && ok;
+	}
+	return ok;
+}
+
+typedef void (*xts_fn)(const xts_keys *, uint64_t, const unsigned char *, unsigned char *, size_t, bool);
+
+/*
+   IEEE 1619-2007 vectors 10 to 14, AES-256 on the bytes 0 to 255 twice.
+   The units are enciphered in a run with one before each, to go through
+   the paths that do several at once, and checked by the SHA-256 of their
+   ciphertext, then deciphered back.
+*/
+static bool test_xts(const char * name, xts_fn fn, bool hw) {
+	static const struct {
+		uint64_t unit;
+		const char * digest;
+	} vectors[] = {
+		{ 0xff, "e97e974fa393af794f7a4684395814cf820de60a01eaec677d87b452e316b364" },
+		{ 0xffff, "def4fad29e95dfe1a24b1ad4620f86d7be094cced5b19e0b121aa82d9e6baf98" },
+		{ 0xffffff, "8bf44861a081dd660d91ce615b5cdfb4d5df9d72c3025c12e67cc0ae097fa5d5" },
+		{ 0xffffffff, "c706140a11affda7402234f5e6331eacbfeb687d8e80d83962691823bb3636f0" },
+		{ 0xffffffffffULL, "afba71abc4e95b186d89a63a5437c1bafcfd1a18ca273970c534aba4f8d05282" },
+	};
+	static unsigned char plain[6 * CRYPT_UNIT], data[6 * CRYPT_UNIT], back[6 * CRYPT_UNIT];
+	unsigned char key[CRYPT_KEY_BYTES], out[32];
+	char what[64];
+	xts_keys ks;
+	sha256_ctx c;
+	bool ok = true;
+	int i, u;
+	from_hex("27182818284590452353602874713526624977572470936999595749669676273141592653589793238462643383279502884197169399375105820974944592", key, CRYPT_KEY_BYTES);
+	expand_keys(&ks, key, hw);
+	for (i = 0; i < sizeof(plain); i++)
+		plain[i] = i;
+	snprintf(what, sizeof(what), "AES-256-XTS %s", name);
+	for (i = 0; i < sizeof(vectors) / sizeof(vectors[0]); i++) {
+		//the unit before and the four after take the run to six, past the four units the VAES path does at once
+		fn(&ks, vectors[i].unit - 1, plain, data, sizeof(data), false);
+		sha256_init(&c);
+		sha256_update(&c, data + CRYPT_UNIT, CRYPT_UNIT);
+		sha256_final(&c, out);
+		ok = known(what, out, vectors[i].digest, 32) && ok;
+		//in place as the disk does it
+		memcpy(back, data, sizeof(back));
+		fn(&ks, vectors[i].unit - 1, back, back, sizeof(back), true);
+		for (u = 0; u < 6; u++) {
+			if (memcmp(back + u * CRYPT_UNIT, plain + u * CRYPT_UNIT, CRYPT_UNIT) != 0) {
+				fprintf(stderr, "crypt self test: %s does not decipher what it enciphered\n", what);
+				ok = false;
+				break;
+			}
+		}
+	}
+	memset(&ks, 0, sizeof(ks));
+	return ok;
+}
+
+/*
+   Known answer tests of every cipher path this processor can take, and
+   of SHA-256 and PBKDF2. Prints what fails, true when nothing does.
+*/
+bool crypt_self_test() {
+	bool ok = test_sha256();
+	ok = test_pbkdf2() && ok;
+	ok = test_xts("software", xts_sw, false) && ok;
+#if defined(__x86_64__)
+	if (use_hw)
+		ok = test_xts("AES-NI", xts_hw, true) && ok;
+	if (use_vaes)
+		ok = test_xts("VAES", xts_vaes, true) && ok;
+#endif
+	return ok;
+}
+
+/*
+   Only the AES instructions run in a time that does not depend on the
+   key and the data, the software cipher looks its tables up with them,
+   which a process sharing the cache can time. It is kept for the tests.
+*/
+static bool crypt_usable() {
+	static int tested; //1 passed, -1 failed
+	if (!use_hw) {
+		fprintf(stderr, "Encryption needs a processor with AES-NI\n");
+		return false;
+	}
+	if (tested == 0)
+		tested = crypt_self_test() ? 1 : -1;
+	if (tested < 0)
+		fprintf(stderr, "The cipher failed its self test, nothing is encrypted with it\n");
+	return tested > 0;
+}
+
+/* a new disk, called once the superblock is laid out and before anything is written */
+bool crypt_format() {
+	unsigned char key[CRYPT_KEY_BYTES];
+	if (!crypt_usable())
+		return false;
+	sb.encrypted = true;
+	sb.crypt_iterations = CRYPT_ITERATIONS;
+	if (getrandom(sb.crypt_salt, CRYPT_SALT_BYTES, 0) != CRYPT_SALT_BYTES) {
+		perror("getrandom");
+		return false;
+	}
+	if (!derive(key, sb.crypt_check))
+		return false;
+	set_keys(key);
+	return true;
+}
+
+/* once the superblock is read, false when the passphrase is missing or wrong */
+bool crypt_mount() {
+	unsigned char key[CRYPT_KEY_BYTES], check[CRYPT_CHECK_BYTES];
+	crypt_stop();
+	if (!sb.encrypted)
+		return true;
+	if (!crypt_usable() || !derive(key, check))
+		return false;
+	if (memcmp(check, sb.crypt_check, CRYPT_CHECK_BYTES) != 0) {
+		fprintf(stderr, "Wrong passphrase\n");
+		memset(key, 0, sizeof(key));
+		return false;
+	}
+	set_keys(key);
+	return true;
+}
+
+void crypt_stop() {
+	memset(&keys, 0, sizeof(keys));
+}
+
+bool crypt_on() {
+	return keys.on;
+}
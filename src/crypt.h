@@ -0,0 +1,37 @@
+#ifndef U_CRYPT
+#define U_CRYPT
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define CRYPT_UNIT 512 //bytes enciphered as one XTS data unit, a sector, its number is the tweak
+#define CRYPT_KEY_BYTES 64 //two AES-256 keys, for the data and for the tweak
+#define CRYPT_SALT_BYTES 16
+#define CRYPT_CHECK_BYTES 16
+#define CRYPT_ITERATIONS 200000 //of PBKDF2-HMAC-SHA256 for a new disk
+
+/*
+   Encryption at rest, AES-256-XTS (IEEE 1619) of every sector but those
+   of the superblock, with VAES or AES-NI. A processor without AES-NI
+   cannot format or mount an encrypted disk, and the cipher has to pass
+   crypt_self_test before the first one is. The keys come from a passphrase through PBKDF2 with the salt and the
+   iteration count in the superblock, next to a hash of them that tells a
+   wrong passphrase. The passphrase is the one set, else $USERFS_PASSPHRASE,
+   else it is asked for on the terminal.
+*/
+void crypt_set_passphrase(const char * passphrase);
+bool crypt_format();
+bool crypt_mount();
+void crypt_stop();
+bool crypt_on();
+bool aes_hw();
+bool aes_vaes();
+bool crypt_self_test();
+void xts_encrypt(uint64_t unit, void * data, size_t len);
+void xts_decrypt(uint64_t unit, void * data, size_t len);
+void xts_encrypt_to(uint64_t unit, const void * from, void * to, size_t len);
+void xts_encrypt_sw(uint64_t unit, void * data, size_t len);
+void xts_decrypt_sw(uint64_t unit, void * data, size_t len);
+
+#endif
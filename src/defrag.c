@@ -0,0 +1,152 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "userfs.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "group.h"
+#include "inode.h"
+#include "dir.h"
+#include "sb.h"
+#include "crash.h"
+#include "stats.h"
+#include "defrag.h"
+
+/* a file and how many extents it was in when the pass started */
+typedef struct candidate_s {
+	int inode_number;
+	int extents;
+} candidate;
+
+typedef struct candidates_s {
+	candidate * files;
+	int count;
+	int cap;
+	defrag_report * report;
+} candidates;
+
+int extent_count(const inode * in) {
+	int b, extents = 0;
+	for (b = 0; b < in->no_blocks; b++)
+		extents += b == 0 || in->blocks[b] != in->blocks[b - 1] + 1;
+	return extents;
+}
+
+/* 
+   Moves one file into a run of free blocks in the group it starts in, or
+   the first group after it with one. Returns the blocks moved, 0 when
+   the file is in one extent already or there is no run for it.
+*/
+int defrag_file(int inode_number) {
+	static char data[MAX_BLOCKS_PER_FILE * MAX_BLOCK_SIZE];
+	block_io ios[MAX_BLOCKS_PER_FILE];
+	inode in, old;
+	DISK_LBA run;
+	int b;
+
+	//an orphan's blocks are about to be freed
+	if (!read_inode(inode_number, &in) || !in.in_use || in.orphan || extent_count(&in) <= 1)
+		return 0;
+	//an inode a snapshot shares is copied first, the snapshot keeps the old blocks
+	if (!own_inode(inode_number, true) || !read_inode(inode_number, &in))
+		return 0;
+	if ((run = find_free_run(group_of(in.blocks[0]), in.no_blocks)) < 0)
+		return 0;
+	old = in;
+	for (b = 0; b < in.no_blocks; b++) {
+		allocate_block(run + b);
+		ios[b] = (block_io){ in.blocks[b], 0, BLOCK_SIZE_BYTES, data + (size_t)b * BLOCK_SIZE_BYTES };
+	}
+	read_blocks(ios, in.no_blocks);
+	for (b = 0; b < in.no_blocks; b++)
+		ios[b].block = in.blocks[b] = run + b;
+	write_blocks(ios, in.no_blocks);
+	crash_point("defrag:data_copied");
+
+	//the contents and their checksums are the same, and so is the time
+	in.last_modified = inode_time(inode_number, &old);
+	update_inode(inode_number, &old, &in);
+	crash_point("defrag:inode_written");
+	for (b = 0; b < old.no_blocks; b++)
+		release_block(old.blocks[b]);
+	write_bitmap();
+	return in.no_blocks;
+}
+
+static int add_candidate(const dir_entry * e, void * arg) {
+	candidates * c = arg;
+	inode in;
+	int extents;
+	if (!read_inode(e->inode_number, &in) || !in.in_use || in.no_blocks == 0 || in.orphan)
+		return 0;
+	extents = extent_count(&in);
+	c->report->files++;
+	c->report->extents_before += extents;
+	if (extents <= 1)
+		return 0;
+	c->report->fragmented++;
+	if (c->count == c->cap) {
+		c->cap = c->cap ? c->cap * 2 : 64;
+		c->files = realloc(c->files, c->cap * sizeof(candidate));
+	}
+	c->files[c->count++] = (candidate){ e->inode_number, extents };
+	return 0;
+}
+
+static int most_extents(const void * a, const void * b) {
+	return ((const candidate *)b)->extents - ((const candidate *)a)->extents;
+}
+
+/* sleeps until moving blocks since start at blocks_per_sec would be due */
+static void throttle(uint64_t start, int64_t blocks, int blocks_per_sec) {
+	uint64_t due, now = stats_now();
+	struct timespec wait;
+	if (blocks_per_sec <= 0)
+		return;
+	due = start + (uint64_t)(blocks * 1000000000.0 / blocks_per_sec);
+	if (due <= now)
+		return;
+	wait.tv_sec = (due - now) / 1000000000;
+	wait.tv_nsec = (due - now) % 1000000000;
+	nanosleep(&wait, NULL);
+}
+
+void defrag_pass(defrag_report * r, int blocks_per_sec, pthread_rwlock_t * lock, const bool * stop) {
+	candidates c = { NULL, 0, 0, r };
+	uint64_t start = stats_now();
+	int i, moved;
+
+	memset(r, 0, sizeof(*r));
+	if (lock != NULL)
+		pthread_rwlock_wrlock(lock);
+	dir_for_each(add_candidate, &c);
+	if (lock != NULL)
+		pthread_rwlock_unlock(lock);
+	r->extents_after = r->extents_before;
+	qsort(c.files, c.count, sizeof(candidate), most_extents);
+
+	for (i = 0; i < c.count && !(stop != NULL && __atomic_load_n(stop, __ATOMIC_RELAXED)); i++) {
+		if (lock != NULL)
+			pthread_rwlock_wrlock(lock);
+		moved = defrag_file(c.files[i].inode_number);
+		if (lock != NULL)
+			pthread_rwlock_unlock(lock);
+		//a file changed since the pass started is counted as it was
+		if (moved > 0) {
+			r->moved++;
+			r->blocks_moved += moved;
+			r->extents_after -= c.files[i].extents - 1;
+		}
+		throttle(start, r->blocks_moved, blocks_per_sec);
+	}
+	free(c.files);
+	r->ns = stats_now() - start;
+}
+
+int defrag_report_json(const defrag_report * r, char * buf, int size) {
+	return snprintf(buf, size, "{\"files\":%d,\"fragmented\":%d,\"moved\":%d,\"blocks_moved\":%ld,"
+		"\"extents_before\":%ld,\"extents_after\":%ld,\"seconds\":%.6f}\n",
+		r->files, r->fragmented, r->moved, r->blocks_moved,
+		r->extents_before, r->extents_after, r->ns / 1e9);
+}
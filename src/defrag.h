@@ -0,0 +1,34 @@
+#ifndef U_DEFRAG
+#define U_DEFRAG
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "userfs.h"
+#include "inode.h"
+
+/* what a defragmentation pass found and did, extents are runs of neighbouring blocks */
+typedef struct defrag_report_s {
+	int files; //with at least one block
+	int fragmented; //in more than one extent
+	int moved; //now in one extent
+	int64_t blocks_moved;
+	int64_t extents_before;
+	int64_t extents_after;
+	uint64_t ns;
+} defrag_report;
+
+/* 
+   Moves fragmented files, the most fragmented first, into runs of free
+   blocks. A file's data is copied to the run before its inode is
+   switched over, the old blocks are freed last. blocks_per_sec limits
+   how fast blocks are copied, 0 for no limit. With a lock, the engine
+   is only held while one file is moved, and with stop the pass ends
+   early once it is set.
+*/
+int extent_count(const inode * in);
+int defrag_file(int inode_number);
+void defrag_pass(defrag_report * r, int blocks_per_sec, pthread_rwlock_t * lock, const bool * stop);
+int defrag_report_json(const defrag_report * r, char * buf, int size);
+
+#endif
@@ -1,95 +1,791 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
-#include <assert.h>
+#include <errno.h>
 #include "userfs.h"
 #include "blocks.h"
+#include "bitmap.h"
+#include "group.h"
+#include "crash.h"
 #include "file.h"
 #include "dir.h"
 #include "inode.h"
+#include "sb.h"
+#include "crc.h"
+#include "reclaim.h"
+#include "dirview.h"
 
-void init_dir() {
-	int i;
-	root_dir.no_files = 0;
-	for (i=0; i< MAX_FILES_PER_DIRECTORY; i++) {
-		root_dir.u_file[i].free = 5;
+/* the nodes from the root down to a leaf and the child taken at each level */
+typedef struct dir_path_s {
+	int depth; //block[depth] is the leaf
+	DISK_LBA block[DIR_MAX_DEPTH];
+	int slot[DIR_MAX_DEPTH];
+} dir_path;
+
+static dir_entry * entries_of(dir_node * n) {
+	return (dir_entry *)(n + 1);
+}
+
+static dir_index * index_of(dir_node * n) {
+	return (dir_index *)(n + 1);
+}
+
+/* 64 bit FNV-1a */
+uint64_t dir_hash(const char * name) {
+	uint64_t h = 14695981039346656037ULL;
+	while (*name) {
+		h ^= (unsigned char)*name++;
+		h *= 1099511628211ULL;
 	}
+	return h;
+}
+
+static int key_cmp(uint64_t h1, const char * n1, uint64_t h2, const char * n2) {
+	if (h1 != h2)
+		return h1 < h2 ? -1 : 1;
+	return strcmp(n1, n2);
+}
+
+/* a lost node write reads back as zeros, whose child 0 must not be followed into the superblock */
+static bool valid_node_block(DISK_LBA b) {
+	return b >= 0 && b < sb.disk_size_blocks && b >= group_first_data_block(group_of(b));
+}
+
+static dir_node * new_node(int leaf) {
+	dir_node * n = calloc(1, BLOCK_SIZE_BYTES);
+	n->leaf = leaf;
+	n->first = -1;
+	return n;
+}
+
+static int node_bytes(dir_node * n) {
+	return sizeof(dir_node) + n->count * (n->leaf ? sizeof(dir_entry) : sizeof(dir_index));
+}
+
+/* false, with the node reported, when its checksum does not match */
+static bool read_node(DISK_LBA b, dir_node * n) {
+	read_block(b, n, BLOCK_SIZE_BYTES);
+	if (n->count < 0 || n->count > (n->leaf ? LEAF_ENTRIES : INDEX_ENTRIES)) {
+		n->count = 0;
+	} else if (crc32c_sealed(n, node_bytes(n), &n->checksum) == n->checksum) {
+		return true;
+	}
+	checksum_failed("directory node", b);
+	return false;
 }
 
-void write_dir() {
-	write_block(DIRECTORY_BLOCK, &root_dir, sizeof(dir_struct));
+/* writes the header and the entries in use, the rest of the block is left alone */
+static void write_node(DISK_LBA b, dir_node * n) {
+	n->checksum = crc32c_sealed(n, node_bytes(n), &n->checksum);
+	write_block(b, n, node_bytes(n));
 }
 
 /* 
-	Finds a free file and allocates it
-	sets the free file's inode and name
+   Writes the sectors with the header and the entries from first on, for
+   an entry added or taken out at first. The header goes last.
 */
-void dir_allocate_file(int inode, const char * name) {
-	int i;
-	for(i=0; i<MAX_FILES_PER_DIRECTORY; i++){
-		if(root_dir.u_file[i].free){
-			root_dir.u_file[i].inode_number = inode;
-			strcpy(root_dir.u_file[i].file_name, name);
-			root_dir.u_file[i].free = false;
-			root_dir.no_files++;
+static void write_node_from(DISK_LBA b, dir_node * n, int first) {
+	uint64_t dirty[SECTOR_WORDS] = { 0 };
+	int size = n->leaf ? sizeof(dir_entry) : sizeof(dir_index);
+	n->checksum = crc32c_sealed(n, node_bytes(n), &n->checksum);
+	mark_sectors(dirty, 0, sizeof(dir_node));
+	mark_sectors(dirty, sizeof(dir_node) + first * size, (n->count - first) * size);
+	write_sectors(b, n, dirty);
+}
+
+static DISK_LBA new_node_block() {
+	return claim_block(group_start(group_of(sb.dir_root)));
+}
+
+/* the child of an interior node to follow for a key, -1 for first */
+static int child_slot(dir_node * n, uint64_t h, const char * name) {
+	dir_index * ix = index_of(n);
+	int lo = 0, hi = n->count, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (key_cmp(ix[mid].hash, ix[mid].file_name, h, name) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+static DISK_LBA child_at(dir_node * n, int slot) {
+	return slot < 0 ? n->first : index_of(n)[slot].child;
+}
+
+/* position of the first leaf entry that is not below the key */
+static int leaf_slot(dir_node * n, uint64_t h, const char * name) {
+	dir_entry * e = entries_of(n);
+	int lo = 0, hi = n->count, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (key_cmp(e[mid].hash, e[mid].file_name, h, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+static void set_child(dir_node * n, int slot, DISK_LBA b) {
+	if (slot < 0)
+		n->first = b;
+	else
+		index_of(n)[slot].child = b;
+}
+
+/*
+   Moves every node on the path that a snapshot shares to a new block,
+   from the root down, so the path can be changed in place. A copy is
+   linked into its parent, or made the root, once it is on disk, and the
+   old node is left to the snapshot. Returns false when the disk is full.
+*/
+static bool own_path(dir_path * p) {
+	static char data[MAX_BLOCK_SIZE];
+	dir_node * parent = (dir_node *)data;
+	DISK_LBA copy;
+	int level;
+	for (level = 0; level <= p->depth; level++) {
+		if (!block_shared(p->block[level]))
+			continue;
+		if ((copy = new_node_block()) < 0)
+			return false;
+		read_block(p->block[level], data, BLOCK_SIZE_BYTES);
+		write_block(copy, data, BLOCK_SIZE_BYTES);
+		if (level == 0) {
+			sb.dir_root = copy;
+			write_superblock();
+		} else {
+			//the whole parent is written again, its checksum covers the pointer
+			read_node(p->block[level - 1], parent);
+			set_child(parent, p->slot[level - 1], copy);
+			write_node(p->block[level - 1], parent);
+		}
+		p->block[level] = copy;
+	}
+	return true;
+}
+
+/* reads the nodes from the root to the leaf for a key, leaves the leaf in n */
+static bool descend_from(DISK_LBA b, uint64_t h, const char * name, dir_path * p, dir_node * n) {
+	for (p->depth = 0; ; p->depth++) {
+		if (!valid_node_block(b) || p->depth == DIR_MAX_DEPTH) {
+			fprintf(stderr, "Directory node %ld is out of range\n", b);
+			return false;
+		}
+		if (!read_node(b, n))
+			return false;
+		p->block[p->depth] = b;
+		if (n->leaf)
+			return true;
+		p->slot[p->depth] = child_slot(n, h, name);
+		b = child_at(n, p->slot[p->depth]);
+	}
+}
+
+static bool descend(uint64_t h, const char * name, dir_path * p, dir_node * n) {
+	return descend_from(sb.dir_root, h, name, p, n);
+}
+
+/* moves the path and n on to the next leaf, false after the last one */
+static bool next_leaf(dir_path * p, dir_node * n) {
+	int level = p->depth - 1;
+	DISK_LBA b;
+	for (; level >= 0; level--) {
+		if (!read_node(p->block[level], n))
+			return false;
+		if (p->slot[level] + 1 < n->count)
 			break;
+	}
+	if (level < 0)
+		return false;
+	b = child_at(n, ++p->slot[level]);
+	//then down the leftmost children
+	for (level++; ; level++) {
+		if (!valid_node_block(b) || level == DIR_MAX_DEPTH || !read_node(b, n))
+			return false;
+		p->block[level] = b;
+		if (n->leaf) {
+			p->depth = level;
+			return true;
 		}
+		p->slot[level] = -1;
+		b = n->first;
 	}
 }
 
-bool is_dir_full() {
-	if(root_dir.no_files>MAX_FILES_PER_DIRECTORY)
-		return true;
-	else return false;
+/*
+   Formats an empty directory, a single leaf in group 0
+*/
+int init_dir() {
+	dir_node * root = new_node(1);
+	sb.dir_root = -1;
+	sb.dir_entries = 0;
+	if ((sb.dir_root = claim_block(0)) < 0) {
+		free(root);
+		return 0;
+	}
+	write_node(sb.dir_root, root);
+	free(root);
+	dirview_rebuild(NULL, 0);
+	return 1;
 }
 
-/* 
+/* reads the tree into the version lookups and listings see, at mount */
+void dir_load() {
+	int64_t count;
+	dir_entry * entries = collect_dir(&count, NULL, NULL);
+	dirview_load(entries, count);
+	free(entries);
+}
+
+void dir_unload() {
+	dirview_unload();
+}
+
+/*
    Finds the file specified by name
    sets the file parameter to the file that was found
+   Once the disk is mounted this takes no lock and reads no block, the
+   tree is only read when nothing loaded it.
 */
 bool find_file(const char * name, file_struct * file) {
+	uint64_t h;
+	dir_node * n;
+	dir_entry * e;
+	dir_path p;
+	bool found = false;
 	int i;
-	for(i=0; i<MAX_FILES_PER_DIRECTORY; i++){
-		if(!root_dir.u_file[i].free && !strcmp(root_dir.u_file[i].file_name, name)){
-			*file = root_dir.u_file[i];
-			//memcpy(file, &root_dir.u_file[i], sizeof(file_struct));
-			//printf("FIND_FILE INODE: %i\n", file->inode_number);
-			return true;
+	if ((i = dirview_find(name, file)) >= 0)
+		return i;
+	h = dir_hash(name);
+	n = malloc(BLOCK_SIZE_BYTES);
+	e = entries_of(n);
+	if (descend(h, name, &p, n)) {
+		i = leaf_slot(n, h, name);
+		if (i < n->count && key_cmp(e[i].hash, e[i].file_name, h, name) == 0) {
+			file->inode_number = e[i].inode_number;
+			strcpy(file->file_name, e[i].file_name);
+			found = true;
 		}
 	}
-	return false;
+	free(n);
+	return found;
 }
 
-/* 
+/*
+   Adds a key pointing at right to the interior node at level of path,
+   splitting nodes up to the root as needed. The new right node is
+   written before its parent and the parent before the node it was split
+   from, so after a crash every key can still be reached from the root.
+*/
+static bool insert_index(dir_path * p, int level, uint64_t h, const char * name, DISK_LBA right) {
+	dir_node * n, * r;
+	dir_index * ix, * all;
+	DISK_LBA rb;
+	int pos, total, m;
+	bool ok;
+
+	if (level < 0) {
+		//the root split, the tree grows a level
+		if ((rb = new_node_block()) < 0)
+			return false;
+		n = new_node(0);
+		n->first = sb.dir_root;
+		n->count = 1;
+		index_of(n)[0].hash = h;
+		strcpy(index_of(n)[0].file_name, name);
+		index_of(n)[0].child = right;
+		write_node(rb, n);
+		free(n);
+		sb.dir_root = rb;
+		write_superblock();
+		return true;
+	}
+
+	n = malloc(BLOCK_SIZE_BYTES);
+	read_node(p->block[level], n);
+	ix = index_of(n);
+	pos = p->slot[level] + 1;
+	if (n->count < INDEX_ENTRIES) {
+		memmove(ix + pos + 1, ix + pos, (n->count - pos) * sizeof(dir_index));
+		ix[pos].hash = h;
+		strcpy(ix[pos].file_name, name);
+		ix[pos].child = right;
+		n->count++;
+		write_node_from(p->block[level], n, pos);
+		free(n);
+		return true;
+	}
+
+	total = n->count + 1;
+	all = malloc(total * sizeof(dir_index));
+	memcpy(all, ix, pos * sizeof(dir_index));
+	all[pos].hash = h;
+	strcpy(all[pos].file_name, name);
+	all[pos].child = right;
+	memcpy(all + pos + 1, ix + pos, (n->count - pos) * sizeof(dir_index));
+
+	//the middle key moves up, its child becomes the first of the new node
+	m = total / 2;
+	ok = (rb = new_node_block()) >= 0;
+	if (ok) {
+		r = new_node(0);
+		r->first = all[m].child;
+		r->count = total - m - 1;
+		memcpy(index_of(r), all + m + 1, r->count * sizeof(dir_index));
+		write_node(rb, r);
+		free(r);
+		ok = insert_index(p, level - 1, all[m].hash, all[m].file_name, rb);
+		if (ok) {
+			n->count = m;
+			memcpy(ix, all, m * sizeof(dir_index));
+			write_node(p->block[level], n);
+		} else {
+			free_block(rb);
+		}
+	}
+	free(all);
+	free(n);
+	return ok;
+}
+
+/*
+	Adds an entry for name, which must not be in the directory yet.
+	Returns 0, or -ENOSPC when a full leaf could not be split.
+*/
+int dir_allocate_file(int inode, const char * name) {
+	uint64_t h = dir_hash(name);
+	dir_node * n = malloc(BLOCK_SIZE_BYTES), * r;
+	dir_entry * e = entries_of(n), * all;
+	dir_path p;
+	DISK_LBA rb;
+	int pos, total, m, res = 0;
+
+	if (!descend(h, name, &p, n)) {
+		free(n);
+		return -EIO;
+	}
+	if (!own_path(&p)) {
+		free(n);
+		return -ENOSPC;
+	}
+	pos = leaf_slot(n, h, name);
+	if (n->count < LEAF_ENTRIES) {
+		memmove(e + pos + 1, e + pos, (n->count - pos) * sizeof(dir_entry));
+		e[pos].hash = h;
+		e[pos].inode_number = inode;
+		strcpy(e[pos].file_name, name);
+		n->count++;
+		write_node_from(p.block[p.depth], n, pos);
+		sb.dir_entries++;
+		dirview_insert(&e[pos]);
+		free(n);
+		return 0;
+	}
+
+	total = n->count + 1;
+	all = malloc(total * sizeof(dir_entry));
+	memcpy(all, e, pos * sizeof(dir_entry));
+	all[pos].hash = h;
+	all[pos].inode_number = inode;
+	strcpy(all[pos].file_name, name);
+	memcpy(all + pos + 1, e + pos, (n->count - pos) * sizeof(dir_entry));
+
+	m = total / 2;
+	if ((rb = new_node_block()) < 0) {
+		res = -ENOSPC;
+	} else {
+		r = new_node(1);
+		r->count = total - m;
+		memcpy(entries_of(r), all + m, r->count * sizeof(dir_entry));
+		write_node(rb, r);
+		free(r);
+		if (insert_index(&p, p.depth - 1, all[m].hash, all[m].file_name, rb)) {
+			crash_point("dir:split_parent_written");
+			n->count = m;
+			memcpy(e, all, m * sizeof(dir_entry));
+			write_node(p.block[p.depth], n);
+			sb.dir_entries++;
+			dirview_insert(&all[pos]);
+		} else {
+			free_block(rb);
+			res = -ENOSPC;
+		}
+	}
+	free(all);
+	free(n);
+	return res;
+}
+
+/* copies the nodes on the path to name that a snapshot shares, false when there is no room */
+static bool own_name(const char * name) {
+	dir_node * n = malloc(BLOCK_SIZE_BYTES);
+	dir_path p;
+	bool owned = descend(dir_hash(name), name, &p, n) && own_path(&p);
+	free(n);
+	return owned;
+}
+
+/* takes name out of its leaf, leaves are never merged */
+bool dir_remove_entry(const char * name) {
+	uint64_t h = dir_hash(name);
+	dir_node * n = malloc(BLOCK_SIZE_BYTES);
+	dir_entry * e = entries_of(n);
+	dir_path p;
+	bool found = false;
+	int i;
+	if (descend(h, name, &p, n) && own_path(&p)) {
+		i = leaf_slot(n, h, name);
+		if (i < n->count && key_cmp(e[i].hash, e[i].file_name, h, name) == 0) {
+			memmove(e + i, e + i + 1, (n->count - i - 1) * sizeof(dir_entry));
+			n->count--;
+			write_node_from(p.block[p.depth], n, i);
+			sb.dir_entries--;
+			dirview_remove(name);
+			found = true;
+		}
+	}
+	free(n);
+	return found;
+}
+
+/*
    Free file's blocks
    Free file's inode
    Free file
+   The inode and the directory path are copied first when a snapshot
+   shares them, returns -ENOSPC without changing anything when that
+   does not fit, or -EIO when the inode fails its checksum.
 */
-void dir_remove_file(file_struct file) {
+int dir_remove_file(file_struct file) {
 	int i;
 	inode inode;
-	read_inode(file.inode_number, &inode);
-	//free blocks
+	if (!own_inode(file.inode_number, false) || !own_name(file.file_name))
+		return -ENOSPC;
+	//its block pointers cannot be trusted to free
+	if (!read_inode(file.inode_number, &inode))
+		return -EIO;
+	//free blocks, unless a snapshot still has them
 	for(i=0;i<inode.no_blocks;i++){
-		free_block(inode.blocks[i]);
+		release_block(inode.blocks[i]);
 	}
 	//free the inode
-	inode.free=true;
-	write_inode(file.inode_number, &inode);
+	release_inode(file.inode_number, &inode);
+	crash_point("unlink:inode_freed");
 	//free file
-	for(i=0; i<MAX_FILES_PER_DIRECTORY; i++){
-		if(root_dir.u_file[i].inode_number == file.inode_number){
-			root_dir.no_files--;
-			root_dir.u_file[i].free = true;
+	dir_remove_entry(file.file_name);
+	return 0;
+}
+
+/*
+   Unlinks file leaving its blocks and inode to the reclaimer. The inode
+   goes on the orphan list before the entry goes, after a crash in between
+   recovery finishes the unlink. Returns like dir_remove_file.
+*/
+int dir_orphan_file(file_struct file) {
+	inode in, old;
+	if (!own_inode(file.inode_number, true) || !own_name(file.file_name))
+		return -ENOSPC;
+	if (!read_inode(file.inode_number, &in))
+		return -EIO;
+	old = in;
+	if (!orphan_inode(file.inode_number, &old, &in, ORPHAN_UNLINKED))
+		return -ENOSPC;
+	crash_point("unlink:orphan_written");
+	dir_remove_entry(file.file_name);
+	return 0;
+}
+
+/*
+   The new name is linked before the old one is removed, a crash in
+   between leaves two names for one inode and fsck keeps one of them
+*/
+int dir_rename_file(const char * old, const char * new) {
+	file_struct file;
+	int res;
+	if (!find_file(old, &file))
+		return -ENOENT;
+	if (strcmp(old, new) == 0)
+		return 0;
+	//the new name's splits only add nodes of their own, the old path stays owned
+	if (!own_name(old))
+		return -ENOSPC;
+	if ((res = dir_allocate_file(file.inode_number, new)) != 0)
+		return res;
+	crash_point("rename:new_linked");
+	dir_remove_entry(old);
+	return 0;
+}
+
+/*
+   Calls fn on every entry whose hash is at least from in key order, one
+   leaf after the other, stops at the first non zero result and returns it.
+   Once the disk is mounted the entries are those of one version, fn may
+   change the directory.
+*/
+int dir_for_each_from(uint64_t from, int (*fn)(const dir_entry *, void *), void * arg) {
+	dir_node * n;
+	dir_entry * e;
+	dir_path p;
+	int i, res = 0;
+	if (dirview_for_each_from(from, fn, arg, &res))
+		return res;
+	n = malloc(BLOCK_SIZE_BYTES);
+	e = entries_of(n);
+	if (descend(from, "", &p, n)) {
+		i = leaf_slot(n, from, "");
+		for (;;) {
+			for (; i < n->count && res == 0; i++)
+				res = fn(&e[i], arg);
+			if (res != 0 || !next_leaf(&p, n))
+				break;
+			i = 0;
 		}
 	}
-		
+	free(n);
+	return res;
 }
 
-void dir_rename_file(const char * old, const char * new) {
-	int i;
-	for(i=0; i<MAX_FILES_PER_DIRECTORY; i++){
-		if(strcmp(root_dir.u_file[i].file_name, old)==0)
-			strcpy(root_dir.u_file[i].file_name, new);
+int dir_for_each(int (*fn)(const dir_entry *, void *), void * arg) {
+	return dir_for_each_from(0, fn, arg);
+}
+
+/*
+   Readdir offsets are built from the name hash, so they stay valid
+   while other files come and go. The top 62 bits are kept so cookies
+   are positive and leave room for the entries before the files. Names
+   whose hashes agree in those bits share a cookie, and a listing that
+   pages out between them skips the rest, as with ext4 hashed directories.
+*/
+int64_t dir_cookie(const dir_entry * entry) {
+	return (int64_t)(entry->hash >> 2) + DIR_FIRST_COOKIE;
+}
+
+/* smallest hash of the entries after the one with the given cookie, false when there are none */
+bool dir_cookie_next(int64_t cookie, uint64_t * from) {
+	if (cookie < DIR_FIRST_COOKIE) {
+		*from = 0;
+		return true;
+	}
+	if ((uint64_t)(cookie - DIR_FIRST_COOKIE) >= UINT64_MAX >> 2)
+		return false;
+	*from = ((uint64_t)(cookie - DIR_FIRST_COOKIE) + 1) << 2;
+	return true;
+}
+
+/*
+   Walks the tree under b. Leaf entries outside the keys [lo, hi) the
+   parents give the leaf are left over from an interrupted split and are
+   skipped. A node whose checksum fails counts as a problem, which makes
+   fsck write a new tree. Marks every node in nodes when it is given, appends the
+   entries to *out when it is given and returns how many problems were
+   found.
+*/
+static int walk(DISK_LBA b, int depth, const dir_index * lo, const dir_index * hi,
+		BIT_FIELD * nodes, dir_entry ** out, int64_t * count, int64_t * cap, bool report) {
+	dir_node * n;
+	dir_entry * e;
+	dir_index * ix;
+	int i, problems = 0;
+
+	if (!valid_node_block(b) || depth == DIR_MAX_DEPTH || (nodes && USED(nodes, b))) {
+		if (report)
+			fprintf(stderr, "verify: directory node %ld is out of range or reached twice\n", b);
+		return 1;
+	}
+	if (nodes)
+		SET_USED(nodes, b);
+	n = malloc(BLOCK_SIZE_BYTES);
+	//a torn write fails the checksum, fsck still takes the keys that are in order
+	if (!read_node(b, n)) {
+		if (report)
+			fprintf(stderr, "verify: directory node %ld checksum does not match\n", b);
+		problems++;
+	}
+	e = entries_of(n);
+	ix = index_of(n);
+
+	if (n->leaf) {
+		for (i = 0; i < n->count; i++) {
+			if ((lo && key_cmp(e[i].hash, e[i].file_name, lo->hash, lo->file_name) < 0)
+					|| (hi && key_cmp(e[i].hash, e[i].file_name, hi->hash, hi->file_name) >= 0)
+					|| (i > 0 && key_cmp(e[i - 1].hash, e[i - 1].file_name, e[i].hash, e[i].file_name) >= 0)
+					|| e[i].hash != dir_hash(e[i].file_name)) {
+				if (report)
+					fprintf(stderr, "verify: leaf %ld entry '%.*s' is out of order\n", b,
+						MAX_FILE_NAME_SIZE, e[i].file_name);
+				problems++;
+				continue;
+			}
+			if (out) {
+				if (*count == *cap) {
+					*cap = *cap ? *cap * 2 : 1024;
+					*out = realloc(*out, *cap * sizeof(dir_entry));
+				}
+				(*out)[(*count)++] = e[i];
+			} else {
+				(*count)++;
+			}
+		}
+	} else {
+		for (i = 0; i < n->count; i++) {
+			if ((lo && key_cmp(ix[i].hash, ix[i].file_name, lo->hash, lo->file_name) < 0)
+					|| (hi && key_cmp(ix[i].hash, ix[i].file_name, hi->hash, hi->file_name) >= 0)
+					|| (i > 0 && key_cmp(ix[i - 1].hash, ix[i - 1].file_name, ix[i].hash, ix[i].file_name) >= 0)) {
+				if (report)
+					fprintf(stderr, "verify: directory node %ld keys are out of order\n", b);
+				problems++;
+			}
+		}
+		problems += walk(n->first, depth + 1, lo, n->count ? &ix[0] : hi,
+			nodes, out, count, cap, report);
+		for (i = 0; i < n->count; i++) {
+			problems += walk(ix[i].child, depth + 1, &ix[i], i + 1 < n->count ? &ix[i + 1] : hi,
+				nodes, out, count, cap, report);
+		}
+	}
+	free(n);
+	return problems;
+}
+
+/* sets the bits of every directory node in map */
+void mark_dir_nodes(BIT_FIELD * map) {
+	BIT_FIELD * nodes = calloc((size_t)sb.num_groups * BIT_MAP_SIZE, sizeof(BIT_FIELD));
+	int64_t count = 0;
+	size_t i;
+	walk(sb.dir_root, 0, NULL, NULL, nodes, NULL, &count, NULL, false);
+	for (i = 0; i < (size_t)sb.num_groups * BIT_MAP_SIZE; i++)
+		map[i] |= nodes[i];
+	free(nodes);
+}
+
+/*
+   Returns the entries reachable from root in key order and how many
+   there are in *count, marks the nodes they were read from in nodes.
+   Nodes and entries that had to be skipped are counted in *problems
+   unless it is NULL.
+*/
+dir_entry * collect_tree(DISK_LBA root, int64_t * count, BIT_FIELD * nodes, int * problems) {
+	dir_entry * out = NULL;
+	int64_t cap = 0;
+	int skipped;
+	*count = 0;
+	skipped = walk(root, 0, NULL, NULL, nodes, &out, count, &cap, false);
+	if (problems)
+		*problems = skipped;
+	return out;
+}
+
+dir_entry * collect_dir(int64_t * count, BIT_FIELD * nodes, int * problems) {
+	return collect_tree(sb.dir_root, count, nodes, problems);
+}
+
+/* next block that is neither used nor to be avoided, marks it used */
+static DISK_LBA take_block(DISK_LBA * cursor, BIT_FIELD * used, BIT_FIELD * avoid) {
+	for (; *cursor < sb.disk_size_blocks; (*cursor)++) {
+		if (!USED(used, *cursor) && !USED(avoid, *cursor)) {
+			SET_USED(used, *cursor);
+			return (*cursor)++;
+		}
+	}
+	return -1;
+}
+
+/*
+   Builds a new tree holding the sorted entries in blocks that are in
+   neither used nor avoid, marks them in used and switches the superblock
+   to it. The old tree is left as it was until the switch. Nodes are
+   filled to three quarters so the next inserts do not split at once.
+*/
+int rebuild_dir(dir_entry * entries, int64_t count, BIT_FIELD * used, BIT_FIELD * avoid) {
+	int leaf_fill = LEAF_ENTRIES * 3 / 4 > 0 ? LEAF_ENTRIES * 3 / 4 : 1;
+	int index_fill = INDEX_ENTRIES * 3 / 4 > 1 ? INDEX_ENTRIES * 3 / 4 : 2;
+	int64_t nodes = count ? (count + leaf_fill - 1) / leaf_fill : 1;
+	int64_t i, j, up;
+	DISK_LBA cursor = 0;
+	DISK_LBA * blocks = malloc(nodes * sizeof(DISK_LBA));
+	dir_index * keys = malloc(nodes * sizeof(dir_index));
+	dir_node * n = malloc(BLOCK_SIZE_BYTES);
+
+	for (i = 0; i < nodes; i++) {
+		if ((blocks[i] = take_block(&cursor, used, avoid)) < 0)
+			goto full;
+	}
+	for (i = 0; i < nodes; i++) {
+		memset(n, 0, sizeof(dir_node));
+		n->leaf = 1;
+		n->first = -1;
+		n->count = count - i * leaf_fill < leaf_fill ? count - i * leaf_fill : leaf_fill;
+		memcpy(entries_of(n), entries + i * leaf_fill, n->count * sizeof(dir_entry));
+		if (n->count > 0) {
+			keys[i].hash = entries[i * leaf_fill].hash;
+			strcpy(keys[i].file_name, entries[i * leaf_fill].file_name);
+		}
+		keys[i].child = blocks[i];
+		write_node(blocks[i], n);
+	}
+
+	//every level holds the first key of each node below it
+	while (nodes > 1) {
+		up = (nodes + index_fill) / (index_fill + 1);
+		for (i = 0, j = 0; i < up; i++) {
+			DISK_LBA b = take_block(&cursor, used, avoid);
+			int take = (nodes - j) / (up - i);
+			if (b < 0)
+				goto full;
+			memset(n, 0, sizeof(dir_node));
+			n->first = keys[j].child;
+			n->count = take - 1;
+			memcpy(index_of(n), keys + j + 1, n->count * sizeof(dir_index));
+			write_node(b, n);
+			keys[i] = keys[j];
+			keys[i].child = b;
+			j += take;
+		}
+		nodes = up;
+	}
+
+	sb.dir_root = keys[0].child;
+	sb.dir_entries = count;
+	write_superblock();
+	dirview_rebuild(entries, count);
+	free(blocks);
+	free(keys);
+	free(n);
+	return 1;
+full:
+	fprintf(stderr, "No room to rebuild the directory\n");
+	free(blocks);
+	free(keys);
+	free(n);
+	return 0;
+}
+
+/*
+   Read only check of the tree: key order, the key ranges of the parents
+   and the entry count, and that a mounted disk's readers see the same
+   entries. Returns how many problems there are.
+*/
+int verify_dir() {
+	int64_t count = 0;
+	int problems;
+	BIT_FIELD * nodes = calloc((size_t)sb.num_groups * BIT_MAP_SIZE, sizeof(BIT_FIELD));
+	dir_entry * entries;
+
+	problems = walk(sb.dir_root, 0, NULL, NULL, nodes, NULL, &count, NULL, true);
+	if (count != sb.dir_entries) {
+		fprintf(stderr, "verify: directory counts %ld files but holds %ld\n", sb.dir_entries, count);
+		problems++;
+	}
+	if (dirview_loaded()) {
+		entries = collect_dir(&count, NULL, NULL);
+		problems += dirview_verify(entries, count);
+		free(entries);
 	}
+	free(nodes);
+	return problems;
 }
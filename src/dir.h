@@ -1,24 +1,65 @@
 #ifndef U_DIR
 #define U_DIR
 
-#define MAX_FILES_PER_DIRECTORY 100
-#define DIRECTORY_BLOCK 2
-
+#include <stdint.h>
+#include <stdbool.h>
+#include "userfs.h"
 #include "file.h"
+#include "bitmap.h"
 
-typedef struct dir_struct_s{
-	int no_files;
-	file_struct u_file[MAX_FILES_PER_DIRECTORY];
-} dir_struct;
+#define DIR_MAX_DEPTH 16
 
-void init_dir();
-void dir_allocate_file(int, const char *);
-void write_dir();
-bool dir_full();
-bool find_file(const char *, file_struct *);
-void dir_remove_file(file_struct);
-void dir_rename_file(const char *, const char *);
+/* readdir offsets below this are ".", "..", the stats file and the control file */
+#define DIR_FIRST_COOKIE 5
+
+/* 
+   The root directory is a B+tree of dir_nodes keyed by the hash of the
+   file name, then the name itself. Leaves hold the entries, interior
+   nodes hold the first key of every child but the leftmost. Leaves are
+   not chained, so a leaf copied away from a snapshot only changes its
+   parent. Lookups and listings on a mounted disk read a copy of the
+   entries in memory instead, see dirview.h.
+*/
+typedef struct dir_node_s {
+	int leaf;
+	int count;
+	DISK_LBA first; //interior: child holding the keys below the first entry
+	uint32_t checksum; //of the header, zeroed here, and the entries in use
+} dir_node;
+
+typedef struct dir_entry_s {
+	uint64_t hash;
+	int inode_number;
+	char file_name[MAX_FILE_NAME_SIZE+1];
+} dir_entry;
 
-dir_struct root_dir;
+typedef struct dir_index_s {
+	uint64_t hash;
+	char file_name[MAX_FILE_NAME_SIZE+1];
+	DISK_LBA child; //keys from this one up to the next entry's
+} dir_index;
+
+#define LEAF_ENTRIES ((int)((BLOCK_SIZE_BYTES - sizeof(dir_node)) / sizeof(dir_entry)))
+#define INDEX_ENTRIES ((int)((BLOCK_SIZE_BYTES - sizeof(dir_node)) / sizeof(dir_index)))
+
+uint64_t dir_hash(const char *);
+int init_dir();
+void dir_load();
+void dir_unload();
+int dir_allocate_file(int, const char *);
+bool find_file(const char *, file_struct *);
+int dir_remove_file(file_struct);
+int dir_orphan_file(file_struct);
+bool dir_remove_entry(const char *);
+int dir_rename_file(const char *, const char *);
+int dir_for_each(int (*fn)(const dir_entry *, void *), void * arg);
+int dir_for_each_from(uint64_t from, int (*fn)(const dir_entry *, void *), void * arg);
+int64_t dir_cookie(const dir_entry * entry);
+bool dir_cookie_next(int64_t cookie, uint64_t * from);
+void mark_dir_nodes(BIT_FIELD * map);
+dir_entry * collect_dir(int64_t * count, BIT_FIELD * nodes, int * problems);
+dir_entry * collect_tree(DISK_LBA root, int64_t * count, BIT_FIELD * nodes, int * problems);
+int rebuild_dir(dir_entry * entries, int64_t count, BIT_FIELD * used, BIT_FIELD * avoid);
+int verify_dir();
 
 #endif
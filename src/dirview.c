@@ -0,0 +1,369 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include "userfs.h"
+#include "dir.h"
+#include "epoch.h"
+#include "dirview.h"
+
+#define VIEW_FILL (VIEW_FANOUT * 3 / 4) //of the nodes a load builds
+
+static dir_view * current;
+static uint64_t versions;
+
+static int key_cmp(uint64_t h1, const char * n1, uint64_t h2, const char * n2) {
+	if (h1 != h2)
+		return h1 < h2 ? -1 : 1;
+	return strcmp(n1, n2);
+}
+
+static view_node * new_node(int leaf) {
+	view_node * n = malloc(sizeof(view_node));
+	n->leaf = leaf;
+	n->count = 0;
+	return n;
+}
+
+/* a private copy of n that can be changed before it is published */
+static view_node * copy_node(const view_node * n) {
+	view_node * c = malloc(sizeof(view_node));
+	size_t used = n->leaf ? n->count * sizeof(dir_entry) : n->count * sizeof(view_kid);
+	memcpy(c, n, offsetof(view_node, entries) + used);
+	return c;
+}
+
+/* the smallest key of the non empty node n */
+static void first_key(const view_node * n, uint64_t * hash, const char ** name) {
+	if (n->leaf) {
+		*hash = n->entries[0].hash;
+		*name = n->entries[0].file_name;
+	} else {
+		*hash = n->kids[0].hash;
+		*name = n->kids[0].file_name;
+	}
+}
+
+static void set_kid(view_kid * k, view_node * child) {
+	const char * name;
+	first_key(child, &k->hash, &name);
+	strcpy(k->file_name, name);
+	k->child = child;
+}
+
+/* position of the first leaf entry that is not below the key */
+static int leaf_slot(const view_node * n, uint64_t h, const char * name) {
+	int lo = 0, hi = n->count, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (key_cmp(n->entries[mid].hash, n->entries[mid].file_name, h, name) < 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* the child of an interior node to follow for a key, the first for keys below all of them */
+static int kid_slot(const view_node * n, uint64_t h, const char * name) {
+	int lo = 1, hi = n->count, mid;
+	while (lo < hi) {
+		mid = (lo + hi) / 2;
+		if (key_cmp(n->kids[mid].hash, n->kids[mid].file_name, h, name) <= 0)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo - 1;
+}
+
+/* frees every node under n, none of them may be reachable by a reader */
+static void free_tree(view_node * n) {
+	int i;
+	if (!n->leaf) {
+		for (i = 0; i < n->count; i++)
+			free_tree(n->kids[i].child);
+	}
+	free(n);
+}
+
+/* retires every node under n, for a tree replaced as a whole */
+static void retire_tree(view_node * n) {
+	int i;
+	if (!n->leaf) {
+		for (i = 0; i < n->count; i++)
+			retire_tree(n->kids[i].child);
+	}
+	epoch_retire(n);
+}
+
+/* makes root the version readers see and retires the one they saw */
+static void publish(view_node * root, int64_t entries) {
+	dir_view * v = malloc(sizeof(dir_view)), * old = current;
+	v->root = root;
+	v->entries = entries;
+	v->version = ++versions;
+	__atomic_store_n(&current, v, __ATOMIC_SEQ_CST);
+	if (old != NULL)
+		epoch_retire(old);
+	epoch_reclaim();
+}
+
+/* leaves of the sorted entries filled to three quarters, then the levels above them */
+static view_node * build(const dir_entry * entries, int64_t count) {
+	int64_t nodes = count ? (count + VIEW_FILL - 1) / VIEW_FILL : 1, up, i, j;
+	view_node ** level = malloc(nodes * sizeof(view_node *)), * n;
+	int take;
+
+	for (i = 0; i < nodes; i++) {
+		n = level[i] = new_node(1);
+		n->count = count - i * VIEW_FILL < VIEW_FILL ? count - i * VIEW_FILL : VIEW_FILL;
+		//an empty directory is a leaf of nothing, there may be no entries to copy from
+		if (n->count > 0)
+			memcpy(n->entries, entries + i * VIEW_FILL, n->count * sizeof(dir_entry));
+	}
+	while (nodes > 1) {
+		up = (nodes + VIEW_FILL - 1) / VIEW_FILL;
+		for (i = 0, j = 0; i < up; i++) {
+			n = new_node(0);
+			for (take = (nodes - j) / (up - i); take > 0; take--)
+				set_kid(&n->kids[n->count++], level[j++]);
+			level[i] = n;
+		}
+		nodes = up;
+	}
+	n = level[0];
+	free(level);
+	return n;
+}
+
+/*
+   Builds a version from the sorted entries and publishes it, at mount.
+   The tree is read once, the view is kept up to date from then on.
+*/
+void dirview_load(const dir_entry * entries, int64_t count) {
+	dirview_unload();
+	publish(build(entries, count), count);
+}
+
+/* for a tree written again from the entries, nothing to do without a view */
+void dirview_rebuild(const dir_entry * entries, int64_t count) {
+	if (current == NULL)
+		return;
+	retire_tree(current->root);
+	publish(build(entries, count), count);
+}
+
+/* publishes no version and frees the last one, at unmount when nobody reads any more */
+void dirview_unload() {
+	dir_view * old = current;
+	if (old == NULL)
+		return;
+	__atomic_store_n(&current, NULL, __ATOMIC_SEQ_CST);
+	free_tree(old->root);
+	free(old);
+	epoch_drain();
+}
+
+bool dirview_loaded() {
+	return __atomic_load_n(&current, __ATOMIC_ACQUIRE) != NULL;
+}
+
+/*
+   Looks name up in the current version without a lock. Returns 1 and
+   fills in file when it is there, 0 when it is not and -1 without a view.
+*/
+int dirview_find(const char * name, file_struct * file) {
+	uint64_t h = dir_hash(name);
+	int slot = epoch_enter(), i, found = -1;
+	dir_view * v = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+	view_node * n;
+	if (v != NULL) {
+		for (n = v->root; !n->leaf; n = n->kids[kid_slot(n, h, name)].child)
+			;
+		i = leaf_slot(n, h, name);
+		found = i < n->count && key_cmp(n->entries[i].hash, n->entries[i].file_name, h, name) == 0;
+		if (found) {
+			file->inode_number = n->entries[i].inode_number;
+			strcpy(file->file_name, n->entries[i].file_name);
+		}
+	}
+	epoch_leave(slot);
+	return found;
+}
+
+static int each_from(const view_node * n, uint64_t from, int (*fn)(const dir_entry *, void *), void * arg) {
+	int i, res = 0;
+	if (n->leaf) {
+		for (i = leaf_slot(n, from, ""); i < n->count && res == 0; i++)
+			res = fn(&n->entries[i], arg);
+		return res;
+	}
+	//the children after the first hold nothing below from
+	for (i = kid_slot(n, from, ""); i < n->count && res == 0; i++)
+		res = each_from(n->kids[i].child, from, fn, arg);
+	return res;
+}
+
+/*
+   Calls fn on every entry of the current version whose hash is at least
+   from, as dir_for_each_from does, and leaves the result in *res. The
+   version stays the same while fn runs, whatever fn or other threads
+   change. Returns false without a view.
+*/
+bool dirview_for_each_from(uint64_t from, int (*fn)(const dir_entry *, void *), void * arg, int * res) {
+	int slot = epoch_enter();
+	dir_view * v = __atomic_load_n(&current, __ATOMIC_ACQUIRE);
+	if (v != NULL)
+		*res = each_from(v->root, from, fn, arg);
+	epoch_leave(slot);
+	return v != NULL;
+}
+
+/* splits the full node c, returns its right half */
+static view_node * split(view_node * c) {
+	view_node * r = new_node(c->leaf);
+	int m = c->count / 2;
+	r->count = c->count - m;
+	if (c->leaf)
+		memcpy(r->entries, c->entries + m, r->count * sizeof(dir_entry));
+	else
+		memcpy(r->kids, c->kids + m, r->count * sizeof(view_kid));
+	c->count = m;
+	return r;
+}
+
+/*
+   Returns a copy of n with e added under it and retires n. A copy that
+   fills up is split, its right half is left in *right.
+*/
+static view_node * insert(view_node * n, const dir_entry * e, view_node ** right) {
+	view_node * c = copy_node(n), * half = NULL;
+	int i;
+	if (n->leaf) {
+		i = leaf_slot(n, e->hash, e->file_name);
+		memmove(c->entries + i + 1, c->entries + i, (c->count - i) * sizeof(dir_entry));
+		c->entries[i] = *e;
+		c->count++;
+	} else {
+		i = kid_slot(n, e->hash, e->file_name);
+		set_kid(&c->kids[i], insert(n->kids[i].child, e, &half));
+		if (half != NULL) {
+			memmove(c->kids + i + 2, c->kids + i + 1, (c->count - i - 1) * sizeof(view_kid));
+			set_kid(&c->kids[i + 1], half);
+			c->count++;
+		}
+	}
+	epoch_retire(n);
+	*right = c->count == VIEW_FANOUT ? split(c) : NULL;
+	return c;
+}
+
+/* publishes a version with entry added, it must not be there yet */
+void dirview_insert(const dir_entry * entry) {
+	view_node * root, * right, * top;
+	if (current == NULL)
+		return;
+	root = insert(current->root, entry, &right);
+	if (right != NULL) {
+		top = new_node(0);
+		set_kid(&top->kids[top->count++], root);
+		set_kid(&top->kids[top->count++], right);
+		root = top;
+	}
+	publish(root, current->entries + 1);
+}
+
+/*
+   Returns a copy of n without the key and retires n, or n itself when
+   the key is not under it. NULL once nothing is left, the copy is freed
+   then as no reader has seen it.
+*/
+static view_node * drop(view_node * n, uint64_t h, const char * name, bool * found) {
+	view_node * c, * kid;
+	int i;
+	if (n->leaf) {
+		i = leaf_slot(n, h, name);
+		if (!(*found = i < n->count && key_cmp(n->entries[i].hash, n->entries[i].file_name, h, name) == 0))
+			return n;
+		c = copy_node(n);
+		memmove(c->entries + i, c->entries + i + 1, (c->count - i - 1) * sizeof(dir_entry));
+		c->count--;
+	} else {
+		i = kid_slot(n, h, name);
+		kid = drop(n->kids[i].child, h, name, found);
+		if (!*found)
+			return n;
+		c = copy_node(n);
+		if (kid != NULL) {
+			set_kid(&c->kids[i], kid);
+		} else {
+			memmove(c->kids + i, c->kids + i + 1, (c->count - i - 1) * sizeof(view_kid));
+			c->count--;
+		}
+	}
+	epoch_retire(n);
+	if (c->count == 0) {
+		free(c);
+		return NULL;
+	}
+	return c;
+}
+
+/* publishes a version without name, when it is there */
+void dirview_remove(const char * name) {
+	view_node * root, * only;
+	bool found;
+	if (current == NULL)
+		return;
+	root = drop(current->root, dir_hash(name), name, &found);
+	if (!found)
+		return;
+	if (root == NULL)
+		root = new_node(1);
+	//a root left with one child is not needed, the copy was never published
+	while (!root->leaf && root->count == 1) {
+		only = root->kids[0].child;
+		free(root);
+		root = only;
+	}
+	publish(root, current->entries - 1);
+}
+
+typedef struct view_check_s {
+	const dir_entry * entries;
+	int64_t count;
+	int64_t at;
+	int problems;
+} view_check;
+
+static int check_entry(const dir_entry * e, void * arg) {
+	view_check * c = arg;
+	const dir_entry * d = c->at < c->count ? &c->entries[c->at] : NULL;
+	if (d == NULL || d->hash != e->hash || strcmp(d->file_name, e->file_name) != 0
+			|| d->inode_number != e->inode_number) {
+		fprintf(stderr, "verify: the directory readers see has '%.*s' where the disk has '%.*s'\n",
+			MAX_FILE_NAME_SIZE, e->file_name, MAX_FILE_NAME_SIZE, d ? d->file_name : "");
+		c->problems++;
+		return 1;
+	}
+	c->at++;
+	return 0;
+}
+
+/* compares the current version with the sorted entries of the tree on disk, returns the problems */
+int dirview_verify(const dir_entry * entries, int64_t count) {
+	view_check c = { entries, count, 0, 0 };
+	int res;
+	if (!dirview_for_each_from(0, check_entry, &c, &res))
+		return 0;
+	if (c.problems == 0 && c.at != count) {
+		fprintf(stderr, "verify: the directory readers see holds %ld of the %ld files on disk\n", c.at, count);
+		c.problems++;
+	}
+	if (c.problems == 0 && current->entries != count) {
+		fprintf(stderr, "verify: the directory readers see counts %ld files but holds %ld\n", current->entries, count);
+		c.problems++;
+	}
+	return c.problems;
+}
@@ -0,0 +1,55 @@
+#ifndef U_DIRVIEW
+#define U_DIRVIEW
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "userfs.h"
+#include "file.h"
+#include "dir.h"
+
+#define VIEW_FANOUT 64 //entries of a leaf, children of an interior node
+
+/*
+   The directory as lookups and listings see it while the disk is
+   mounted: an in memory B+tree of the entries, published as a version
+   through one pointer. Nodes are never changed once published. An
+   insert or a removal copies the nodes from the leaf up to the root,
+   publishes a version with the new root and retires the nodes it
+   replaced, which are freed once no reader can still be in them. Readers
+   take no lock, so lookups do not wait on creates and unlinks. The tree
+   on disk is still changed in place by the writers, which take turns.
+*/
+typedef struct view_node_s view_node;
+
+typedef struct view_kid_s {
+	uint64_t hash; //smallest key under child
+	char file_name[MAX_FILE_NAME_SIZE+1];
+	view_node * child;
+} view_kid;
+
+struct view_node_s {
+	int leaf;
+	int count;
+	union {
+		dir_entry entries[VIEW_FANOUT];
+		view_kid kids[VIEW_FANOUT];
+	};
+};
+
+typedef struct dir_view_s {
+	view_node * root;
+	int64_t entries;
+	uint64_t version;
+} dir_view;
+
+void dirview_load(const dir_entry * entries, int64_t count);
+void dirview_rebuild(const dir_entry * entries, int64_t count);
+void dirview_unload();
+bool dirview_loaded();
+int dirview_find(const char * name, file_struct * file);
+bool dirview_for_each_from(uint64_t from, int (*fn)(const dir_entry *, void *), void * arg, int * res);
+void dirview_insert(const dir_entry * entry);
+void dirview_remove(const char * name);
+int dirview_verify(const dir_entry * entries, int64_t count);
+
+#endif
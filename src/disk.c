@@ -0,0 +1,582 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <linux/falloc.h>
+#include "userfs.h"
+#include "crash.h"
+#include "sb.h"
+#include "blocks.h"
+#include "stats.h"
+#include "crc.h"
+#include "crypt.h"
+#include "disk.h"
+
+/*
+   Byte at of the disk is in chunk at / chunk_bytes, chunk c is on member
+   c % members at chunk c / members of it. A chunk is a whole number of
+   blocks, so a block never spans members. With several members each
+   one has a worker thread, and the pieces of a batch go to the workers
+   of their members at once. The workers start with the first batch of
+   the process using the disk, a mount forks after opening it and only
+   the process that called fork is copied.
+*/
+typedef struct member_s {
+	int fd;
+	pthread_t worker;
+	bool dirty; //written since the last sync
+} member;
+
+static member members[MAX_DISK_MEMBERS];
+static int num_members;
+static int64_t chunk_bytes = MAX_BLOCK_SIZE; //the superblock is in the first chunk whatever its size
+
+/* the image --meta-disk gave, all but file data goes there, in the same place as it would on the disk */
+static char * meta_name;
+static int meta_fd = -1;
+static bool meta_dirty;
+
+/* the batch the workers are on, a new generation wakes them */
+static pthread_mutex_t hand_lock = PTHREAD_MUTEX_INITIALIZER; //writers sharing the engine hand out one batch at a time
+static pthread_mutex_t batch_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t batch_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t batch_done = PTHREAD_COND_INITIALIZER;
+static block_io * batch;
+static int batch_count;
+static bool batch_write;
+static uint64_t batch_generation;
+static int batch_pending;
+static bool stopping;
+static pid_t workers_pid; //the process the workers run in, 0 while none do
+static __thread bool worker; //its writes were counted by whoever handed out the batch
+
+/* written past the last chunk of every member of a striped disk */
+#define STRIPE_MAGIC 0x45504952545355ULL //"USTRIPE"
+typedef struct stripe_label_s {
+	uint64_t magic;
+	uint64_t stripe_id; //the same in the superblock and every member
+	int member;
+	int members;
+	int chunk_bytes;
+	uint32_t checksum;
+} stripe_label;
+
+/* the member holding byte at of the disk, with where it is in that member */
+static int locate(off_t at, off_t * member_at) {
+	off_t chunk = at / chunk_bytes;
+	*member_at = chunk / num_members * chunk_bytes + at % chunk_bytes;
+	return chunk % num_members;
+}
+
+static int member_write(int fd, const void * data, int size, off_t at) {
+	return worker ? pwrite(fd, data, size, at) : crash_write(fd, data, size, at);
+}
+
+/* reads or writes size bytes from at, a piece per chunk */
+static void member_transfer(off_t at, void * data, int size, bool write) {
+	off_t member_at;
+	int m, n;
+	//nothing happens once the disk is closed
+	while (size > 0 && num_members > 0) {
+		m = locate(at, &member_at);
+		n = chunk_bytes - at % chunk_bytes;
+		if (n > size)
+			n = size;
+		if (write) {
+			member_write(members[m].fd, data, n, member_at);
+			stats_count_write(n);
+			members[m].dirty = true;
+		} else {
+			pread(members[m].fd, data, n, member_at);
+		}
+		at += n;
+		data = (char *)data + n;
+		size -= n;
+	}
+}
+
+static void meta_transfer(off_t at, void * data, int size, bool write) {
+	if (write) {
+		crash_write(meta_fd, data, size, at);
+		stats_count_write(size);
+		meta_dirty = true;
+	} else {
+		pread(meta_fd, data, size, at);
+	}
+}
+
+/*
+   On an encrypted disk every sector after the superblock's block is
+   enciphered on its own, its number is the tweak. A piece that does not
+   cover whole sectors reads the sectors at its ends first. A sector of
+   zeros is one that was never written or was punched out, it reads as
+   zeros. Pieces larger than the buffer go a buffer at a time.
+*/
+#define CRYPT_BUFFER (64 * 1024)
+
+static bool zero_unit(const unsigned char * p) {
+	uint64_t head;
+	//a sector enciphered is zeros once in 2^4096, its first word tells almost every time
+	memcpy(&head, p, sizeof(head));
+	//a sector equal to itself shifted by a word is its first word over and over
+	return head == 0 && memcmp(p, p + sizeof(head), CRYPT_UNIT - sizeof(head)) == 0;
+}
+
+/* the sectors between two of zeros go to the cipher in one call */
+static void decipher(off_t at, unsigned char * p, int size) {
+	int n, from = 0;
+	for (n = 0; n <= size; n += CRYPT_UNIT) {
+		if (n < size && !zero_unit(p + n))
+			continue;
+		if (n > from)
+			xts_decrypt((at + from) / CRYPT_UNIT, p + from, n - from);
+		from = n + CRYPT_UNIT;
+	}
+}
+
+static void sealed_transfer(off_t at, void * data, int size, bool write,
+		void (*raw)(off_t, void *, int, bool)) {
+	static __thread unsigned char buf[CRYPT_BUFFER];
+	off_t first, end;
+	int n;
+	if (!crypt_on() || at + size <= BLOCK_SIZE_BYTES) {
+		raw(at, data, size, write);
+		return;
+	}
+	if (at < BLOCK_SIZE_BYTES) {
+		n = BLOCK_SIZE_BYTES - at;
+		raw(at, data, n, write);
+		at += n;
+		data = (char *)data + n;
+		size -= n;
+	}
+	while (size > 0) {
+		first = at / CRYPT_UNIT * CRYPT_UNIT;
+		n = CRYPT_BUFFER - (at - first);
+		if (n > size)
+			n = size;
+		end = (at + n + CRYPT_UNIT - 1) / CRYPT_UNIT * CRYPT_UNIT;
+		if (!write && at == first && end == at + n) {
+			//whole sectors are read and deciphered in place
+			raw(at, data, n, false);
+			decipher(at, data, n);
+		} else if (!write) {
+			raw(first, buf, end - first, false);
+			decipher(first, buf, end - first);
+			memcpy(data, buf + (at - first), n);
+		} else if (at == first && end == at + n) {
+			//whole sectors are enciphered on their way into the buffer
+			xts_encrypt_to(first / CRYPT_UNIT, data, buf, n);
+			raw(first, buf, n, true);
+		} else {
+			if (at != first) {
+				raw(first, buf, CRYPT_UNIT, false);
+				decipher(first, buf, CRYPT_UNIT);
+			}
+			if (at + n != end && (end - CRYPT_UNIT != first || at == first)) {
+				raw(end - CRYPT_UNIT, buf + (end - CRYPT_UNIT - first), CRYPT_UNIT, false);
+				decipher(end - CRYPT_UNIT, buf + (end - CRYPT_UNIT - first), CRYPT_UNIT);
+			}
+			memcpy(buf + (at - first), data, n);
+			xts_encrypt(first / CRYPT_UNIT, buf, end - first);
+			raw(first, buf, end - first, true);
+		}
+		at += n;
+		data = (char *)data + n;
+		size -= n;
+	}
+}
+
+static void transfer(off_t at, void * data, int size, bool write) {
+	sealed_transfer(at, data, size, write, member_transfer);
+}
+
+static off_t io_at(const block_io * io) {
+	return (off_t)BLOCK_SIZE_BYTES * io->block + io->offset;
+}
+
+static void run_io(block_io * io, bool write) {
+	uint64_t start = stats_now();
+	bool whole = io->offset == 0 && io->size % BLOCK_SIZE_BYTES == 0;
+	transfer(io_at(io), io->data, io->size, write);
+	if (write)
+		stats_record(whole ? S_WRITE_BLOCK : S_WRITE_BLOCK_OFFSET, start);
+	else
+		stats_record(whole ? S_READ_BLOCK : S_READ_BLOCK_OFFSET, start);
+}
+
+/* does the pieces of every batch that are on its member */
+static void * member_worker(void * arg) {
+	int m = (long)arg, i;
+	uint64_t seen = 0;
+	off_t member_at;
+	worker = true;
+	pthread_mutex_lock(&batch_lock);
+	for (;;) {
+		while (batch_generation == seen && !stopping)
+			pthread_cond_wait(&batch_ready, &batch_lock);
+		if (stopping)
+			break;
+		seen = batch_generation;
+		pthread_mutex_unlock(&batch_lock);
+		for (i = 0; i < batch_count; i++) {
+			if (locate(io_at(&batch[i]), &member_at) == m)
+				run_io(&batch[i], batch_write);
+		}
+		pthread_mutex_lock(&batch_lock);
+		if (--batch_pending == 0)
+			pthread_cond_signal(&batch_done);
+	}
+	pthread_mutex_unlock(&batch_lock);
+	return NULL;
+}
+
+/*
+   Opens the members of a comma separated list of image files, flags are
+   those of open(2). Returns 0 and leaves nothing open when one fails.
+*/
+int disk_open(const char * names, int flags) {
+	char * list = strdup(names), * rest = list, * name;
+	disk_close();
+	while ((name = strsep(&rest, ",")) != NULL) {
+		if (num_members == MAX_DISK_MEMBERS) {
+			fprintf(stderr, "A disk has at most %d members\n", MAX_DISK_MEMBERS);
+			break;
+		}
+		if ((members[num_members].fd = open(name, flags, S_IRUSR | S_IWUSR)) < 0) {
+			fprintf(stderr, "Unable to open disk member %s\n", name);
+			break;
+		}
+		members[num_members++].dirty = false;
+	}
+	free(list);
+	if (name == NULL && meta_name != NULL && (meta_fd = open(meta_name, flags, S_IRUSR | S_IWUSR)) < 0) {
+		fprintf(stderr, "Unable to open metadata disk %s\n", meta_name);
+		name = meta_name;
+	}
+	if (name != NULL) {
+		disk_close();
+		return 0;
+	}
+	return 1;
+}
+
+/* starts a worker per member in this process, the ones of a process it was forked from are not here */
+static void start_workers() {
+	long m;
+	//nobody waits on them here, copies of the ones a forked process waited on would hang
+	pthread_mutex_init(&batch_lock, NULL);
+	pthread_cond_init(&batch_ready, NULL);
+	pthread_cond_init(&batch_done, NULL);
+	stopping = false;
+	batch_generation = 0;
+	for (m = 0; m < num_members; m++)
+		pthread_create(&members[m].worker, NULL, member_worker, (void *)m);
+	workers_pid = getpid();
+}
+
+void disk_close() {
+	int m;
+	if (workers_pid == getpid()) {
+		pthread_mutex_lock(&batch_lock);
+		stopping = true;
+		pthread_cond_broadcast(&batch_ready);
+		pthread_mutex_unlock(&batch_lock);
+		for (m = 0; m < num_members; m++)
+			pthread_join(members[m].worker, NULL);
+	}
+	for (m = 0; m < num_members; m++)
+		close(members[m].fd);
+	if (meta_fd >= 0)
+		close(meta_fd);
+	meta_fd = -1;
+	meta_dirty = false;
+	num_members = 0;
+	chunk_bytes = MAX_BLOCK_SIZE;
+	crypt_stop();
+	workers_pid = 0;
+}
+
+int disk_members() {
+	return num_members;
+}
+
+/* the metadata image disk_open opens from now on, NULL for none */
+void disk_set_meta(const char * name) {
+	free(meta_name);
+	meta_name = name != NULL ? strdup(name) : NULL;
+}
+
+bool disk_has_meta() {
+	return meta_fd >= 0;
+}
+
+void disk_set_chunk(int bytes) {
+	chunk_bytes = bytes;
+}
+
+/* how much of each member a disk of disk_bytes takes, its label goes right after */
+int64_t disk_member_bytes(int64_t disk_bytes) {
+	int64_t chunks = (disk_bytes + chunk_bytes - 1) / chunk_bytes;
+	if (num_members == 1)
+		return disk_bytes;
+	return (chunks + num_members - 1) / num_members * chunk_bytes;
+}
+
+/* cuts every member back to nothing and out to its share, so it reads as zeros */
+bool disk_truncate(int64_t disk_bytes) {
+	int m;
+	bool ok = true;
+	for (m = 0; m < num_members; m++) {
+		ok = ftruncate(members[m].fd, 0) == 0 && ok;
+		ok = ftruncate(members[m].fd, disk_member_bytes(disk_bytes)) == 0 && ok;
+	}
+	//the metadata image is as big as the disk, and as sparse as the data image is
+	if (meta_fd >= 0) {
+		ok = ftruncate(meta_fd, 0) == 0 && ok;
+		ok = ftruncate(meta_fd, disk_bytes) == 0 && ok;
+	}
+	return ok;
+}
+
+/*
+   Sets every member to its share of a disk of disk_bytes, with room for
+   its label after it, and the metadata image to the size of the disk.
+   What a grown member held stays, the new space reads as zeros.
+*/
+bool disk_resize(int64_t disk_bytes) {
+	int64_t bytes = disk_member_bytes(disk_bytes) + (num_members > 1 ? sizeof(stripe_label) : 0);
+	int m;
+	bool ok = true;
+	for (m = 0; m < num_members; m++)
+		ok = ftruncate(members[m].fd, bytes) == 0 && ok;
+	if (meta_fd >= 0)
+		ok = ftruncate(meta_fd, disk_bytes) == 0 && ok;
+	return ok;
+}
+
+void disk_write(off_t at, const void * data, int size) {
+	transfer(at, (void *)data, size, true);
+}
+
+void disk_read(off_t at, void * data, int size) {
+	transfer(at, data, size, false);
+}
+
+/* 
+   Punches a hole over bytes [at, at + size) of the disk, on the metadata
+   image too, so the host gets the space back. They read as zeros after.
+*/
+void disk_discard(off_t at, int64_t size) {
+	off_t member_at;
+	int64_t n;
+	int m;
+	stats_count_discard(size);
+	if (meta_fd >= 0)
+		fallocate(meta_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, size);
+	if (num_members == 1) {
+		fallocate(members[0].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, at, size);
+		return;
+	}
+	while (size > 0 && num_members > 0) {
+		m = locate(at, &member_at);
+		n = chunk_bytes - at % chunk_bytes;
+		if (n > size)
+			n = size;
+		fallocate(members[m].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, member_at, n);
+		at += n;
+		size -= n;
+	}
+}
+
+/* metadata, on the metadata image when there is one */
+void disk_meta_write(off_t at, const void * data, int size) {
+	if (meta_fd < 0) {
+		transfer(at, (void *)data, size, true);
+		return;
+	}
+	sealed_transfer(at, (void *)data, size, true, meta_transfer);
+}
+
+void disk_meta_read(off_t at, void * data, int size) {
+	if (meta_fd < 0) {
+		transfer(at, data, size, false);
+		return;
+	}
+	sealed_transfer(at, data, size, false, meta_transfer);
+}
+
+/* hands the pieces to the member workers and waits for all of them */
+static void hand_out(block_io * ios, int count, bool write) {
+	if (count == 0)
+		return;
+	pthread_mutex_lock(&hand_lock);
+	if (workers_pid != getpid())
+		start_workers();
+	pthread_mutex_lock(&batch_lock);
+	batch = ios;
+	batch_count = count;
+	batch_write = write;
+	batch_pending = num_members;
+	batch_generation++;
+	pthread_cond_broadcast(&batch_ready);
+	while (batch_pending > 0)
+		pthread_cond_wait(&batch_done, &batch_lock);
+	pthread_mutex_unlock(&batch_lock);
+	pthread_mutex_unlock(&hand_lock);
+}
+
+/* 
+   Runs the batch. On one member, pieces next to each other on disk and
+   in memory, the blocks of a file in one extent, go as one transfer.
+   On several the workers do it, the writes are counted for the crasher
+   here, one a piece in batch order, so --crash-at picks the same write
+   every run. The pieces before one it acts on are done first.
+*/
+static void run_batch(block_io * ios, int count, bool write) {
+	block_io run;
+	int i, j;
+	if (num_members == 1 || count == 1) {
+		for (i = 0; i < count; i = j) {
+			run = ios[i];
+			for (j = i + 1; j < count && io_at(&ios[j]) == io_at(&run) + run.size
+					&& ios[j].data == (char *)run.data + run.size; j++)
+				run.size += ios[j].size;
+			run_io(&run, write);
+		}
+		return;
+	}
+	for (i = 0, j = 0; write && i < count; i++) {
+		switch (crash_count_write()) {
+		case CRASH_AT_WRITE:
+			hand_out(ios + j, i - j, true);
+			crash();
+			break;
+		case CRASH_TEAR_WRITE:
+			hand_out(ios + j, i - j, true);
+			run = ios[i];
+			run.size /= 2;
+			run_io(&run, true);
+			crash();
+			break;
+		case CRASH_DROP_WRITE:
+			hand_out(ios + j, i - j, true);
+			j = i + 1;
+			break;
+		}
+	}
+	hand_out(ios + j, count - j, write);
+}
+
+/* the pieces are independent, they are written in no particular order */
+void disk_write_batch(block_io * ios, int count) {
+	run_batch(ios, count, true);
+}
+
+void disk_read_batch(block_io * ios, int count) {
+	run_batch(ios, count, false);
+}
+
+/* only the images written since the last sync, metadata alone does not wait for the data image */
+void disk_sync() {
+	int m;
+	for (m = 0; m < num_members; m++) {
+		if (members[m].dirty)
+			fsync(members[m].fd);
+		members[m].dirty = false;
+	}
+	if (meta_dirty)
+		fsync(meta_fd);
+	meta_dirty = false;
+}
+
+static off_t label_at() {
+	return disk_member_bytes((int64_t)sb.disk_size_blocks * BLOCK_SIZE_BYTES);
+}
+
+/* writes the label of every member of a striped disk, sb has its final size */
+void disk_write_labels() {
+	stripe_label label;
+	int m;
+	if (num_members == 1)
+		return;
+	for (m = 0; m < num_members; m++) {
+		memset(&label, 0, sizeof(label));
+		label.magic = STRIPE_MAGIC;
+		label.stripe_id = sb.stripe_id;
+		label.member = m;
+		label.members = num_members;
+		label.chunk_bytes = chunk_bytes;
+		label.checksum = crc32c_sealed(&label, sizeof(label), &label.checksum);
+		crash_write(members[m].fd, &label, sizeof(label), label_at());
+		stats_count_write(sizeof(label));
+	}
+}
+
+/* 
+   Punches out the labels of a disk of disk_bytes, once the disk has grown
+   past them and the superblock no longer says it is that size. The space
+   is free blocks now and reads as zeros, enciphered or not.
+*/
+void disk_drop_labels(int64_t disk_bytes) {
+	int m;
+	for (m = 0; num_members > 1 && m < num_members; m++)
+		fallocate(members[m].fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, disk_member_bytes(disk_bytes), sizeof(stripe_label));
+}
+
+/*
+   Takes the stripe geometry from the superblock just read, and checks
+   that the members given are those of the disk in the order it was
+   formatted with. Reports the first problem.
+*/
+bool disk_check_stripe() {
+	stripe_label label;
+	int m;
+	if (sb.stripe_members != num_members) {
+		fprintf(stderr, "The disk has %d members, %d were given\n", sb.stripe_members, num_members);
+		return false;
+	}
+	if (sb.stripe_chunk_bytes < BLOCK_SIZE_BYTES || sb.stripe_chunk_bytes % BLOCK_SIZE_BYTES != 0) {
+		fprintf(stderr, "Stripe chunk of %d bytes is not a whole number of blocks\n", sb.stripe_chunk_bytes);
+		return false;
+	}
+	chunk_bytes = sb.stripe_chunk_bytes;
+	for (m = 0; num_members > 1 && m < num_members; m++) {
+		memset(&label, 0, sizeof(label));
+		pread(members[m].fd, &label, sizeof(label), label_at());
+		if (label.magic != STRIPE_MAGIC || crc32c_sealed(&label, sizeof(label), &label.checksum) != label.checksum
+				|| label.stripe_id != sb.stripe_id) {
+			fprintf(stderr, "Disk member %d does not belong to this disk\n", m);
+			return false;
+		}
+		if (label.member != m || label.members != num_members || label.chunk_bytes != chunk_bytes) {
+			fprintf(stderr, "Disk member %d was member %d of %d with %d byte chunks\n",
+				m, label.member, label.members, label.chunk_bytes);
+			return false;
+		}
+	}
+	return true;
+}
+
+/* 
+   The data image keeps the superblock it was formatted with, which says
+   whether the metadata is on an image of its own. Checks that it is given
+   when it is, and that it was formatted with the data image.
+*/
+bool disk_check_meta() {
+	superblock data_sb;
+	if (meta_fd < 0) {
+		if (sb.meta_disk)
+			fprintf(stderr, "The disk keeps its metadata on another image, give it with --meta-disk\n");
+		return !sb.meta_disk;
+	}
+	memset(&data_sb, 0, sizeof(data_sb));
+	transfer(SUPERBLOCK_BLOCK * (off_t)BLOCK_SIZE_BYTES, &data_sb, sizeof(data_sb), false);
+	if (!sb.meta_disk || !data_sb.meta_disk || data_sb.stripe_id != sb.stripe_id) {
+		fprintf(stderr, "The metadata disk does not belong to this disk\n");
+		return false;
+	}
+	return true;
+}
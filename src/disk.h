@@ -0,0 +1,40 @@
+#ifndef U_DISK
+#define U_DISK
+
+#include <stdbool.h>
+#include <sys/types.h>
+#include "userfs.h"
+#include "blocks.h"
+
+#define MAX_DISK_MEMBERS 16
+#define DEFAULT_STRIPE_CHUNK (64 * 1024)
+
+/*
+   The disk is one image file, or several that the blocks are striped
+   over a chunk at a time, RAID-0 style. --disk takes them as a comma
+   separated list, in order. With --meta-disk everything but file data
+   is on a metadata image of its own instead.
+*/
+int disk_open(const char * names, int flags);
+void disk_close();
+int disk_members();
+void disk_set_chunk(int chunk_bytes);
+void disk_set_meta(const char * name);
+bool disk_has_meta();
+int64_t disk_member_bytes(int64_t disk_bytes);
+bool disk_truncate(int64_t disk_bytes);
+bool disk_resize(int64_t disk_bytes);
+void disk_write(off_t at, const void * data, int size);
+void disk_read(off_t at, void * data, int size);
+void disk_meta_write(off_t at, const void * data, int size);
+void disk_meta_read(off_t at, void * data, int size);
+void disk_discard(off_t at, int64_t size);
+void disk_write_batch(block_io * ios, int count);
+void disk_read_batch(block_io * ios, int count);
+void disk_sync();
+void disk_write_labels();
+void disk_drop_labels(int64_t disk_bytes);
+bool disk_check_stripe();
+bool disk_check_meta();
+
+#endif
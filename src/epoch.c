@@ -0,0 +1,111 @@
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <sched.h>
+#include <pthread.h>
+#include "epoch.h"
+
+/* the epoch a reader entered in, 0 while the slot is free, one cache line each */
+typedef struct epoch_slot_s {
+	uint64_t epoch;
+	char pad[64 - sizeof(uint64_t)];
+} epoch_slot;
+
+typedef struct retired_s {
+	void * p;
+	uint64_t epoch; //0 until the version that dropped it is published
+	struct retired_s * next;
+} retired;
+
+static uint64_t global = 1;
+static epoch_slot slots[EPOCH_SLOTS];
+static pthread_mutex_t retire_lock = PTHREAD_MUTEX_INITIALIZER;
+static retired * pending; //newest first, the tagged ones behind the untagged
+static int threads; //that have entered, for where the next one starts looking
+static __thread int hint = -1;
+
+/*
+   Takes a free slot for the current epoch and returns it. The epoch is
+   read before the slot is taken, a writer that bumps it in between has
+   published its version already, which the reader then loads.
+*/
+int epoch_enter() {
+	uint64_t e, empty;
+	int i, s;
+	//every thread starts looking at a slot of its own
+	if (hint < 0)
+		hint = __atomic_fetch_add(&threads, 1, __ATOMIC_RELAXED) % EPOCH_SLOTS;
+	for (;;) {
+		for (i = 0; i < EPOCH_SLOTS; i++) {
+			s = (hint + i) % EPOCH_SLOTS;
+			empty = 0;
+			e = __atomic_load_n(&global, __ATOMIC_SEQ_CST);
+			if (__atomic_compare_exchange_n(&slots[s].epoch, &empty, e, false,
+					__ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+				hint = s;
+				return s;
+			}
+		}
+		sched_yield();
+	}
+}
+
+void epoch_leave(int slot) {
+	__atomic_store_n(&slots[slot].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* p is freed once no reader can reach it, call after it is unlinked but before epoch_reclaim */
+void epoch_retire(void * p) {
+	retired * r = malloc(sizeof(retired));
+	r->p = p;
+	r->epoch = 0;
+	pthread_mutex_lock(&retire_lock);
+	r->next = pending;
+	pending = r;
+	pthread_mutex_unlock(&retire_lock);
+}
+
+/*
+   Called once the version dropping what was retired is published. Tags
+   it with the current epoch and moves the epoch on, then frees whatever
+   was tagged before the oldest epoch a reader is still inside.
+*/
+void epoch_reclaim() {
+	retired * r, ** link, * next;
+	uint64_t e, oldest = UINT64_MAX, s;
+	int i;
+	pthread_mutex_lock(&retire_lock);
+	e = __atomic_fetch_add(&global, 1, __ATOMIC_SEQ_CST);
+	for (r = pending; r != NULL && r->epoch == 0; r = r->next)
+		r->epoch = e;
+	for (i = 0; i < EPOCH_SLOTS; i++) {
+		s = __atomic_load_n(&slots[i].epoch, __ATOMIC_SEQ_CST);
+		if (s != 0 && s < oldest)
+			oldest = s;
+	}
+	//the tags only go down along the list, everything after the first one to go goes too
+	for (link = &pending; *link != NULL && (*link)->epoch >= oldest; link = &(*link)->next)
+		;
+	r = *link;
+	*link = NULL;
+	pthread_mutex_unlock(&retire_lock);
+	for (; r != NULL; r = next) {
+		next = r->next;
+		free(r->p);
+		free(r);
+	}
+}
+
+/* frees everything retired, for when no reader is left */
+void epoch_drain() {
+	retired * r, * next;
+	pthread_mutex_lock(&retire_lock);
+	r = pending;
+	pending = NULL;
+	pthread_mutex_unlock(&retire_lock);
+	for (; r != NULL; r = next) {
+		next = r->next;
+		free(r->p);
+		free(r);
+	}
+}
@@ -0,0 +1,21 @@
+#ifndef U_EPOCH
+#define U_EPOCH
+
+#define EPOCH_SLOTS 128 //readers inside at once, one more waits for a slot
+
+/*
+   Epoch based reclamation for structures readers reach through a single
+   pointer. A reader enters, loads the pointer, uses whatever it reaches
+   without taking a lock and leaves. A writer swaps in a new version, has
+   what only the old one reached retired, then calls epoch_reclaim, which
+   frees what was retired before every reader still inside entered.
+   Writers take turns, the engine has them do so already. A reader may
+   enter again before it leaves, which takes a second slot.
+*/
+int epoch_enter();
+void epoch_leave(int slot);
+void epoch_retire(void * p);
+void epoch_reclaim();
+void epoch_drain();
+
+#endif
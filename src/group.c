@@ -0,0 +1,218 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include "userfs.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "inode.h"
+#include "sb.h"
+#include "group.h"
+#include "crc.h"
+
+/* 
+   Group g covers blocks [g*BLOCKS_PER_GROUP, (g+1)*BLOCKS_PER_GROUP) and
+   starts with its bitmap block and its fresh map block, followed by its
+   slice of the inode table. Group 0 also holds the superblock, the group
+   descriptor table and the root of the inode map in front of those. The
+   inode slice is only where the table starts out, its blocks are found
+   through the inode map and move when a snapshot shares them.
+*/
+group_desc * groups;
+
+int group_of(DISK_LBA block) {
+	return block / BLOCKS_PER_GROUP;
+}
+
+DISK_LBA group_start(int group) {
+	return group * BLOCKS_PER_GROUP;
+}
+
+/* one past the last block of the group */
+DISK_LBA group_end(int group) {
+	DISK_LBA end = (group + 1) * BLOCKS_PER_GROUP;
+	return end < sb.disk_size_blocks ? end : sb.disk_size_blocks;
+}
+
+/* the first block past the group's bitmap and fresh map */
+DISK_LBA group_first_data_block(int group) {
+	return groups[group].inode_table;
+}
+
+/* 
+   Sets the bits of a group's metadata, and of blocks past the end of the
+   disk in the last group, in map so they are never handed out
+*/
+void mark_group_metadata(int group, BIT_FIELD * map) {
+	DISK_LBA b;
+	DISK_LBA last = group_start(group) + BLOCKS_PER_GROUP;
+	for (b = group_start(group); b < group_first_data_block(group); b++)
+		SET_USED(map, b);
+	for (b = group_end(group); b < last; b++)
+		SET_USED(map, b);
+}
+
+/* where the group's metadata goes, fixed by the geometry in sb */
+static void layout_group(int group) {
+	DISK_LBA meta = group == 0 ? sb.inode_root + sb.inode_root_blocks : group_start(group);
+	groups[group].bitmap_block = meta;
+	groups[group].fresh_block = meta + 1;
+	groups[group].inode_table = meta + 2;
+}
+
+/* 
+   Lays out the groups for a new file system described by sb, returns 0
+   when the disk is too small for the metadata of its first group
+*/
+int init_groups() {
+	int g;
+
+	free(groups);
+	groups = calloc(sb.num_groups, sizeof(group_desc));
+	for (g = 0; g < sb.num_groups; g++) {
+		layout_group(g);
+		groups[g].free_inodes = sb.inodes_per_group;
+		groups[g].free_blocks = group_end(g) - group_first_data_block(g) - INODE_BLOCKS_PER_GROUP;
+		if (groups[g].free_blocks <= 0) {
+			if (g == 0)
+				return 0;
+			//the last group is too small to hold any data, leave it off the disk
+			sb.num_groups = g;
+			sb.disk_size_blocks = group_start(g);
+			break;
+		}
+		sb.num_free_blocks += groups[g].free_blocks;
+	}
+	return 1;
+}
+
+static DISK_LBA min_lba(DISK_LBA x, DISK_LBA y) {
+	return x < y ? x : y;
+}
+
+/*
+   Extends the groups to count on a disk of blocks blocks, before sb says
+   so. The blocks of the last group up to the new end are freed and the
+   groups after it laid out as on a new disk, without an inode slice, the
+   inode table grows into them when it needs to. The maps and the inode
+   lists must have room for count groups. Returns the blocks added.
+*/
+DISK_LBA extend_groups(int count, DISK_LBA blocks) {
+	int g, last = sb.num_groups - 1;
+	DISK_LBA b, end, added;
+
+	groups = realloc(groups, count * sizeof(group_desc));
+	memset(groups + sb.num_groups, 0, (count - sb.num_groups) * sizeof(group_desc));
+	//the blocks past the old end were marked used so they were never handed out
+	end = min_lba(group_start(last) + BLOCKS_PER_GROUP, blocks);
+	for (b = sb.disk_size_blocks; b < end; b++)
+		__atomic_fetch_and(&bit_map[b / BITS_PER_FIELD], ~(1U << (b % BITS_PER_FIELD)), __ATOMIC_RELAXED);
+	added = end - sb.disk_size_blocks;
+	__atomic_add_fetch(&groups[last].free_blocks, added, __ATOMIC_RELAXED);
+	mark_bitmap_dirty(last);
+	for (g = sb.num_groups; g < count; g++) {
+		layout_group(g);
+		//nothing in the group is held by a snapshot, its fresh map is current and empty
+		groups[g].fresh_gen = sb.generation;
+		end = min_lba(group_start(g) + BLOCKS_PER_GROUP, blocks);
+		groups[g].free_blocks = end - group_first_data_block(g);
+		added += groups[g].free_blocks;
+		for (b = group_start(g); b < group_first_data_block(g); b++)
+			SET_USED(bit_map, b);
+		for (b = end; b < group_start(g) + BLOCKS_PER_GROUP; b++)
+			SET_USED(bit_map, b);
+		mark_bitmap_dirty(g);
+	}
+	return added;
+}
+
+/*
+   Cuts the groups back to count on a disk of blocks blocks, once nothing
+   uses a block from there on. The rest of the new last group is marked
+   used and its free blocks counted again. Returns the disk's free count.
+*/
+DISK_LBA cut_groups(int count, DISK_LBA blocks) {
+	int g, last = count - 1;
+	DISK_LBA b, total = 0;
+	for (b = blocks; b < group_start(last) + BLOCKS_PER_GROUP; b++)
+		SET_USED(bit_map, b);
+	groups[last].free_blocks = 0;
+	for (b = group_start(last); b < blocks; b++)
+		groups[last].free_blocks += !block_in_use(b);
+	mark_bitmap_dirty(last);
+	for (g = 0; g < count; g++)
+		total += groups[g].free_blocks;
+	return total;
+}
+
+static uint32_t group_checksum(int group) {
+	return crc32c_sealed(&groups[group], sizeof(group_desc), &groups[group].checksum);
+}
+
+/*
+   A descriptor whose checksum does not match gets its layout back from
+   the geometry and counts that fsck sets right. Its fresh map is taken
+   as out of date, so it is not read.
+*/
+int read_groups() {
+	int g;
+	free(groups);
+	groups = calloc(sb.num_groups, sizeof(group_desc));
+	for (g = 0; g < sb.num_groups; g += GROUP_DESCS_PER_BLOCK) {
+		int n = sb.num_groups - g < GROUP_DESCS_PER_BLOCK ? sb.num_groups - g : GROUP_DESCS_PER_BLOCK;
+		read_block(GDT_BLOCK + g / GROUP_DESCS_PER_BLOCK, &groups[g], n * sizeof(group_desc));
+	}
+	for (g = 0; g < sb.num_groups; g++) {
+		if (group_checksum(g) != groups[g].checksum) {
+			checksum_failed("group descriptor", g);
+			memset(&groups[g], 0, sizeof(group_desc));
+			layout_group(g);
+			groups[g].fresh_gen = sb.generation - 1;
+		}
+	}
+	return 1;
+}
+
+/* writes the descriptors of count groups from first on, which share a descriptor block */
+void write_groups(int first, int count) {
+	int g;
+	for (g = first; g < first + count; g++)
+		groups[g].checksum = group_checksum(g);
+	write_block_offset(GDT_BLOCK + first / GROUP_DESCS_PER_BLOCK, &groups[first], count * sizeof(group_desc),
+		(first % GROUP_DESCS_PER_BLOCK) * sizeof(group_desc));
+}
+
+/*
+   Reads the descriptors back with the bitmap and fresh map blocks they
+   hold checksums for, returns how many fail
+*/
+int verify_groups() {
+	group_desc * disk = malloc(BLOCK_SIZE_BYTES);
+	char * map = malloc(BLOCK_SIZE_BYTES);
+	int g, problems = 0;
+	for (g = 0; g < sb.num_groups; g++) {
+		group_desc * d = &disk[g % GROUP_DESCS_PER_BLOCK];
+		if (g % GROUP_DESCS_PER_BLOCK == 0)
+			read_block(GDT_BLOCK + g / GROUP_DESCS_PER_BLOCK, disk, BLOCK_SIZE_BYTES);
+		if (crc32c_sealed(d, sizeof(group_desc), &d->checksum) != d->checksum) {
+			fprintf(stderr, "verify: group %d descriptor checksum does not match\n", g);
+			problems++;
+			continue;
+		}
+		read_block(d->bitmap_block, map, sizeof(BIT_FIELD) * BIT_MAP_SIZE);
+		if (crc32c(0, map, sizeof(BIT_FIELD) * BIT_MAP_SIZE) != d->bitmap_csum) {
+			fprintf(stderr, "verify: group %d bitmap checksum does not match\n", g);
+			problems++;
+		}
+		if (sb.num_snapshots > 0 && d->fresh_gen == sb.generation) {
+			read_block(d->fresh_block, map, sizeof(BIT_FIELD) * BIT_MAP_SIZE);
+			if (crc32c(0, map, sizeof(BIT_FIELD) * BIT_MAP_SIZE) != d->fresh_csum) {
+				fprintf(stderr, "verify: group %d fresh map checksum does not match\n", g);
+				problems++;
+			}
+		}
+	}
+	free(disk);
+	free(map);
+	return problems;
+}
@@ -0,0 +1,37 @@
+#ifndef U_GROUP
+#define U_GROUP
+
+#include "userfs.h"
+#include "bitmap.h"
+
+/* a group is as many blocks as one bitmap block can describe */
+#define BLOCKS_PER_GROUP ((DISK_LBA)BIT_MAP_SIZE * BITS_PER_FIELD)
+#define GROUP_DESCS_PER_BLOCK (BLOCK_SIZE_BYTES / sizeof(group_desc))
+
+typedef struct group_desc_s {
+	DISK_LBA bitmap_block;
+	DISK_LBA fresh_block; //blocks allocated since the newest snapshot
+	DISK_LBA inode_table; //where the group's inode slice was laid out
+	uint32_t fresh_gen; //the fresh map is empty unless this is sb.generation
+	int free_blocks;
+	int free_inodes;
+	uint32_t bitmap_csum; //crc32c of the bitmap block
+	uint32_t fresh_csum; //and of the fresh map block, when fresh_gen is current
+	uint32_t checksum; //of the descriptor with this field zeroed
+} group_desc;
+
+extern group_desc * groups;
+
+int group_of(DISK_LBA block);
+DISK_LBA group_start(int group);
+DISK_LBA group_end(int group);
+DISK_LBA group_first_data_block(int group);
+void mark_group_metadata(int group, BIT_FIELD * map);
+int init_groups();
+DISK_LBA extend_groups(int count, DISK_LBA blocks);
+DISK_LBA cut_groups(int count, DISK_LBA blocks);
+int read_groups();
+void write_groups(int first, int count);
+int verify_groups();
+
+#endif
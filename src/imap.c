@@ -0,0 +1,439 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include "userfs.h"
+#include "sb.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "group.h"
+#include "inode.h"
+#include "crash.h"
+#include "trace.h"
+#include "imap.h"
+#include "crc.h"
+#include "epoch.h"
+
+/*
+   inode_map[k] is the disk block of inode table block k, so finding an
+   inode is one array lookup however large the table grows. read_inode
+   looks it up without the engine, a map that grows is copied and the
+   old one retired, and entries change between inode_change_begin and
+   inode_change_end.
+*/
+DISK_LBA * inode_map;
+group_inodes * group_itable;
+
+static int map_cap;
+static int itable_groups;
+static DISK_LBA * map_blocks; //the root blocks, map block j lists inode table blocks [j*IMAP_ENTRIES, (j+1)*IMAP_ENTRIES)
+static int * block_pos; //position of inode table block k in its group's list
+static bool map_unsealed; //a map or root block failed its checksum when the map was read
+
+static int min(int x, int y){
+	return x < y ? x : y;
+}
+
+static int num_map_blocks(int inodeBlocks) {
+	return (inodeBlocks + IMAP_ENTRIES - 1) / IMAP_ENTRIES;
+}
+
+/* root blocks needed to map maxInodeBlocks inode table blocks */
+int imap_root_blocks(int64_t maxInodeBlocks) {
+	int64_t maps = (maxInodeBlocks + IMAP_ENTRIES - 1) / IMAP_ENTRIES;
+	return (maps + IMAP_ENTRIES - 1) / IMAP_ENTRIES;
+}
+
+static void init_map() {
+	int g;
+	for (g = 0; g < itable_groups; g++)
+		free(group_itable[g].blocks);
+	free(group_itable);
+	free(inode_map);
+	free(block_pos);
+	free(map_blocks);
+	itable_groups = sb.num_groups;
+	group_itable = calloc(sb.num_groups, sizeof(group_inodes));
+	inode_map = NULL;
+	block_pos = NULL;
+	map_cap = 0;
+	map_blocks = calloc((size_t)sb.inode_root_blocks * IMAP_ENTRIES, sizeof(DISK_LBA));
+}
+
+/* room for the inode lists of count groups, the new ones empty, before sb.num_groups is raised */
+void grow_inode_groups(int count) {
+	group_itable = realloc(group_itable, count * sizeof(group_inodes));
+	memset(group_itable + itable_groups, 0, (count - itable_groups) * sizeof(group_inodes));
+	itable_groups = count;
+}
+
+/* adds inode table block k, stored in block, to the in memory map */
+static void map_add(int k, DISK_LBA block) {
+	group_inodes * gi = &group_itable[group_of(block)];
+	DISK_LBA * map;
+	int cap;
+	if (k >= map_cap) {
+		cap = k >= 2 * map_cap ? k + 1024 : 2 * map_cap;
+		map = malloc(cap * sizeof(DISK_LBA));
+		if (inode_map != NULL) {
+			memcpy(map, inode_map, map_cap * sizeof(DISK_LBA));
+			epoch_retire(inode_map);
+		}
+		__atomic_store_n(&inode_map, map, __ATOMIC_RELEASE);
+		epoch_reclaim();
+		map_cap = cap;
+		block_pos = realloc(block_pos, map_cap * sizeof(int));
+	}
+	if (gi->count == gi->cap) {
+		gi->cap = gi->cap ? gi->cap * 2 : 16;
+		gi->blocks = realloc(gi->blocks, gi->cap * sizeof(int));
+	}
+	inode_change_begin();
+	inode_map[k] = block;
+	inode_change_end();
+	block_pos[k] = gi->count;
+	gi->blocks[gi->count++] = k;
+}
+
+/* the root blocks in use for a table of inodeBlocks blocks */
+int imap_used_roots(int inodeBlocks) {
+	return (num_map_blocks(inodeBlocks) + IMAP_ENTRIES - 1) / IMAP_ENTRIES;
+}
+
+/* takes inode table block k out of its group's list */
+static void map_remove(int k) {
+	group_inodes * gi = &group_itable[group_of(inode_map[k])];
+	int p;
+	for (p = block_pos[k]; p + 1 < gi->count; p++) {
+		gi->blocks[p] = gi->blocks[p + 1];
+		block_pos[gi->blocks[p]] = p;
+	}
+	gi->count--;
+	if (block_pos[k] < gi->hint)
+		gi->hint--;
+}
+
+/* writes n entries to a map or root block, zeroes the others and seals it */
+static void write_map_block(DISK_LBA b, const DISK_LBA * entries, int n) {
+	DISK_LBA * data = calloc(IMAP_ENTRIES + 1, sizeof(DISK_LBA));
+	memcpy(data, entries, n * sizeof(DISK_LBA));
+	data[IMAP_ENTRIES] = crc32c(0, data, IMAP_ENTRIES * sizeof(DISK_LBA));
+	write_block(b, data, BLOCK_SIZE_BYTES);
+	free(data);
+}
+
+/* reads a whole map or root block into data, false when its checksum does not match */
+static bool read_map_block(DISK_LBA b, DISK_LBA * data) {
+	read_block(b, data, BLOCK_SIZE_BYTES);
+	if (data[IMAP_ENTRIES] == crc32c(0, data, IMAP_ENTRIES * sizeof(DISK_LBA)))
+		return true;
+	checksum_failed("inode map block", b);
+	return false;
+}
+
+/* writes the root blocks holding the entries of map blocks [first, last) */
+static void write_root(int first, int last) {
+	int r;
+	for (r = first / IMAP_ENTRIES; r * IMAP_ENTRIES < last; r++)
+		write_map_block(sb.inode_root + r, map_blocks + (size_t)r * IMAP_ENTRIES, IMAP_ENTRIES);
+}
+
+/*
+   Maps the inode slices laid out by init_groups and writes the map and
+   root blocks of a new file system. The group metadata has to be marked
+   in the bitmap already, the map blocks are allocated from group 0.
+*/
+int format_inode_map() {
+	int g, b, j, k = 0;
+	DISK_LBA block;
+
+	init_map();
+	for (g = 0; g < sb.num_groups; g++)
+		for (b = 0; b < INODE_BLOCKS_PER_GROUP; b++)
+			map_add(k++, groups[g].inode_table + b);
+	sb.num_inode_blocks = k;
+
+	for (j = 0; j < num_map_blocks(k); j++) {
+		if ((block = claim_block(0)) < 0)
+			return 0;
+		map_blocks[j] = block;
+		write_map_block(block, inode_map + (size_t)j * IMAP_ENTRIES, min(IMAP_ENTRIES, k - j * IMAP_ENTRIES));
+	}
+	write_root(0, num_map_blocks(k));
+	return 1;
+}
+
+/*
+   Loads the map. A block whose checksum does not match is still used
+   when its entries are in range, a torn write leaves one entry old or
+   new and the superblock count says which are in the table.
+   seal_inode_map writes such blocks again once fsck is done.
+*/
+int read_inode_map() {
+	int j, i, n, maps = num_map_blocks(sb.num_inode_blocks);
+	DISK_LBA * entries = malloc(BLOCK_SIZE_BYTES);
+
+	init_map();
+	map_unsealed = false;
+	//times kept back for the inodes of a disk opened before are no use here
+	drop_inode_times();
+	if (sb.num_inode_blocks <= 0 || maps > sb.inode_root_blocks * IMAP_ENTRIES) {
+		fprintf(stderr, "Inode table of %d blocks does not fit its map\n", sb.num_inode_blocks);
+		free(entries);
+		return 0;
+	}
+	for (j = 0; j < maps; j += IMAP_ENTRIES) {
+		if (!read_map_block(sb.inode_root + j / IMAP_ENTRIES, entries))
+			map_unsealed = true;
+		memcpy(map_blocks + j, entries, min(IMAP_ENTRIES, maps - j) * sizeof(DISK_LBA));
+	}
+	for (j = 0; j < maps; j++) {
+		n = min(IMAP_ENTRIES, sb.num_inode_blocks - j * IMAP_ENTRIES);
+		if (map_blocks[j] < 0 || map_blocks[j] >= sb.disk_size_blocks) {
+			fprintf(stderr, "Inode map block %d is out of range\n", j);
+			free(entries);
+			return 0;
+		}
+		if (!read_map_block(map_blocks[j], entries))
+			map_unsealed = true;
+		for (i = 0; i < n; i++) {
+			if (entries[i] < 0 || entries[i] >= sb.disk_size_blocks) {
+				fprintf(stderr, "Inode table block %d is out of range\n", j * IMAP_ENTRIES + i);
+				free(entries);
+				return 0;
+			}
+			map_add(j * IMAP_ENTRIES + i, entries[i]);
+		}
+	}
+	free(entries);
+	return 1;
+}
+
+/* writes the map and root blocks again when one failed its checksum on mount */
+void seal_inode_map() {
+	int j, k = sb.num_inode_blocks;
+	if (!map_unsealed)
+		return;
+	for (j = 0; j < num_map_blocks(k); j++)
+		write_map_block(map_blocks[j], inode_map + (size_t)j * IMAP_ENTRIES, min(IMAP_ENTRIES, k - j * IMAP_ENTRIES));
+	write_root(0, num_map_blocks(k));
+	map_unsealed = false;
+}
+
+/* reads the map and root blocks back and returns how many fail their checksum */
+int verify_inode_map() {
+	int j, problems = 0, maps = num_map_blocks(sb.num_inode_blocks);
+	DISK_LBA * data = malloc(BLOCK_SIZE_BYTES);
+	for (j = 0; j < imap_used_roots(sb.num_inode_blocks); j++)
+		problems += !read_map_block(sb.inode_root + j, data);
+	for (j = 0; j < maps; j++)
+		problems += !read_map_block(map_blocks[j], data);
+	free(data);
+	return problems;
+}
+
+/* 
+   Points map entry k at block. A map block a snapshot shares is copied
+   first and the copy linked into the root, which no snapshot shares.
+   Returns 0 when there is no room for the copy.
+*/
+static int set_map_entry(int k, DISK_LBA block) {
+	static DISK_LBA entries[MAX_BLOCK_SIZE / sizeof(DISK_LBA)];
+	int j = k / IMAP_ENTRIES;
+	int n = min(IMAP_ENTRIES, sb.num_inode_blocks - j * IMAP_ENTRIES);
+	DISK_LBA copy;
+
+	//k may be the entry past the end of the table, which is being grown
+	memcpy(entries, inode_map + (size_t)j * IMAP_ENTRIES, n * sizeof(DISK_LBA));
+	entries[k % IMAP_ENTRIES] = block;
+	if (k % IMAP_ENTRIES >= n)
+		n = k % IMAP_ENTRIES + 1;
+	if (!block_shared(map_blocks[j])) {
+		write_map_block(map_blocks[j], entries, n);
+		return 1;
+	}
+	if ((copy = claim_block(map_blocks[j])) < 0)
+		return 0;
+	write_map_block(copy, entries, n);
+	map_blocks[j] = copy;
+	write_root(j, j + 1);
+	return 1;
+}
+
+/*
+   Adds a block of free inodes to the table, in the given group when it
+   has room, and returns its index in the inode map or -1. The new block
+   is written first, then its map entry, and the superblock count last so
+   a crash in between leaves only unreferenced blocks for fsck to free.
+*/
+int grow_inode_table(int group) {
+	static const char zeros[MAX_BLOCK_SIZE];
+	int k = sb.num_inode_blocks;
+	int j = k / IMAP_ENTRIES;
+	DISK_LBA block, map = -1;
+
+	if (!sb.grow_inodes || (int64_t)(k + 1) * INODES_PER_BLOCK > INT_MAX
+			|| j >= sb.inode_root_blocks * IMAP_ENTRIES)
+		return -1;
+	if ((block = claim_block(group_start(group))) < 0)
+		return -1;
+	if (k % IMAP_ENTRIES == 0 && (map = claim_block(block)) < 0) {
+		free_block(block);
+		return -1;
+	}
+
+	//zeroed inodes are free
+	write_block(block, zeros, BLOCK_SIZE_BYTES);
+	crash_point("grow:inodes_written");
+	if (map >= 0) {
+		write_map_block(map, &block, 1);
+		map_blocks[j] = map;
+		write_root(j, j + 1);
+	} else if (!set_map_entry(k, block)) {
+		free_block(block);
+		return -1;
+	}
+	crash_point("grow:map_written");
+	sb.num_inode_blocks++;
+	write_superblock();
+
+	map_add(k, block);
+	groups[group_of(block)].free_inodes += INODES_PER_BLOCK;
+	mark_group_dirty(group_of(block));
+	TRACE(TRACE_OP, T_GROW_INODES, k * INODES_PER_BLOCK, 0, 0, block);
+	return k;
+}
+
+/*
+   Moves inode table block k, which a snapshot shares, to a copy before
+   an inode in it is written. slot is that inode and in_use what it is
+   about to become. The copy is linked into the map only once it is on
+   disk, the old block stays with the snapshot. Returns 0 when there is
+   no room for the copy.
+*/
+int cow_inode_block(int k, int slot, bool in_use) {
+	static inode slice[MAX_BLOCK_SIZE / sizeof(inode)];
+	DISK_LBA old = inode_map[k], copy;
+	int i, free_inodes = 0, from = group_of(old), to;
+
+	if ((copy = claim_block(old)) < 0)
+		return 0;
+	read_block(old, slice, INODES_PER_BLOCK * sizeof(inode));
+	write_block(copy, slice, INODES_PER_BLOCK * sizeof(inode));
+	if (!set_map_entry(k, copy)) {
+		free_block(copy);
+		return 0;
+	}
+	crash_point("cow:inode_block_linked");
+
+	to = group_of(copy);
+	if (to != from) {
+		//the free inodes go with the block, the one being taken is already counted
+		for (i = 0; i < INODES_PER_BLOCK; i++)
+			free_inodes += !slice[i].in_use;
+		if (!slice[slot].in_use && in_use)
+			free_inodes--;
+		map_remove(k);
+		groups[from].free_inodes -= free_inodes;
+		groups[to].free_inodes += free_inodes;
+		mark_group_dirty(from);
+		mark_group_dirty(to);
+		map_add(k, copy);
+	} else {
+		inode_change_begin();
+		inode_map[k] = copy;
+		inode_change_end();
+	}
+	return 1;
+}
+
+/*
+   Moves the inode table and map blocks at end and past it to free blocks
+   before it, for a disk about to be cut back to end blocks whose free
+   blocks from end on are all marked used. Table blocks move as they do
+   away from a snapshot, then the map blocks listing them. The old blocks
+   stay allocated. Returns 0 when there is no room.
+*/
+int move_inode_map(DISK_LBA end) {
+	int k, j;
+	DISK_LBA copy;
+	for (k = 0; k < sb.num_inode_blocks; k++) {
+		//no inode is being taken, the free ones go with the block
+		if (inode_map[k] >= end && !cow_inode_block(k, 0, false))
+			return 0;
+	}
+	for (j = 0; j < num_map_blocks(sb.num_inode_blocks); j++) {
+		if (map_blocks[j] < end)
+			continue;
+		if ((copy = claim_block(0)) < 0)
+			return 0;
+		write_map_block(copy, inode_map + (size_t)j * IMAP_ENTRIES, min(IMAP_ENTRIES, sb.num_inode_blocks - j * IMAP_ENTRIES));
+		map_blocks[j] = copy;
+		write_root(j, j + 1);
+	}
+	return 1;
+}
+
+/*
+   Reads the inode map under count root blocks starting at root, sets the
+   bits of the root, map and table blocks in mark and returns the table
+   blocks, or NULL when the map is damaged
+*/
+DISK_LBA * load_inode_map(DISK_LBA root, int inodeBlocks, BIT_FIELD * mark) {
+	int j, maps = num_map_blocks(inodeBlocks), roots = imap_used_roots(inodeBlocks);
+	DISK_LBA * maplist = malloc((size_t)roots * IMAP_ENTRIES * sizeof(DISK_LBA));
+	DISK_LBA * table = malloc((size_t)maps * IMAP_ENTRIES * sizeof(DISK_LBA));
+	DISK_LBA * data = malloc(BLOCK_SIZE_BYTES);
+
+	//blocks that fail their checksum are only reported, snapshots stay as they were taken
+	for (j = 0; j < roots; j++) {
+		if (root + j < 0 || root + j >= sb.disk_size_blocks)
+			goto damaged;
+		SET_USED(mark, root + j);
+		read_map_block(root + j, data);
+		memcpy(maplist + (size_t)j * IMAP_ENTRIES, data, IMAP_ENTRIES * sizeof(DISK_LBA));
+	}
+	for (j = 0; j < maps; j++) {
+		if (maplist[j] < 0 || maplist[j] >= sb.disk_size_blocks)
+			goto damaged;
+		SET_USED(mark, maplist[j]);
+		read_map_block(maplist[j], data);
+		memcpy(table + (size_t)j * IMAP_ENTRIES, data,
+			min(IMAP_ENTRIES, inodeBlocks - j * IMAP_ENTRIES) * sizeof(DISK_LBA));
+	}
+	for (j = 0; j < inodeBlocks; j++) {
+		if (table[j] < 0 || table[j] >= sb.disk_size_blocks)
+			goto damaged;
+		SET_USED(mark, table[j]);
+	}
+	free(maplist);
+	free(data);
+	return table;
+damaged:
+	free(maplist);
+	free(table);
+	free(data);
+	return NULL;
+}
+
+/* an inode of table block k was freed, searches have to look at it again */
+void inode_block_freed(int k) {
+	group_inodes * gi = &group_itable[group_of(inode_map[k])];
+	if (block_pos[k] < gi->hint)
+		gi->hint = block_pos[k];
+}
+
+void reset_inode_hints() {
+	int g;
+	for (g = 0; g < sb.num_groups; g++)
+		group_itable[g].hint = 0;
+}
+
+/* sets the bits of every inode table and map block in map */
+void mark_inode_map(BIT_FIELD * map) {
+	int k;
+	for (k = 0; k < sb.num_inode_blocks; k++)
+		SET_USED(map, inode_map[k]);
+	for (k = 0; k < num_map_blocks(sb.num_inode_blocks); k++)
+		SET_USED(map, map_blocks[k]);
+}
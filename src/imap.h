@@ -0,0 +1,43 @@
+#ifndef U_IMAP
+#define U_IMAP
+
+#include <stdbool.h>
+#include "userfs.h"
+#include "bitmap.h"
+
+/* 
+   The inode table is a list of blocks, block k holds inodes
+   [k*INODES_PER_BLOCK, (k+1)*INODES_PER_BLOCK). On disk the list is
+   kept in map blocks whose addresses are in the root blocks reserved
+   after the group descriptors. The last slot of a map or root block
+   holds the crc32c of the entries, the unused ones are zero.
+*/
+#define IMAP_ENTRIES ((int)(BLOCK_SIZE_BYTES / sizeof(DISK_LBA)) - 1)
+
+/* the inode table blocks of one group, in inode order */
+typedef struct group_inodes_s {
+	int * blocks; //indexes into inode_map
+	int count;
+	int cap;
+	int hint; //no free inode in blocks before this position
+} group_inodes;
+
+extern DISK_LBA * inode_map;
+extern group_inodes * group_itable;
+
+int imap_root_blocks(int64_t maxInodeBlocks);
+int imap_used_roots(int inodeBlocks);
+int format_inode_map();
+int read_inode_map();
+void seal_inode_map();
+int verify_inode_map();
+int grow_inode_table(int group);
+void inode_block_freed(int k);
+void reset_inode_hints();
+void mark_inode_map(BIT_FIELD * map);
+int cow_inode_block(int k, int slot, bool in_use);
+void grow_inode_groups(int count);
+int move_inode_map(DISK_LBA end);
+DISK_LBA * load_inode_map(DISK_LBA root, int inodeBlocks, BIT_FIELD * mark);
+
+#endif
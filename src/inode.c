@@ -1,48 +1,259 @@
 #include <time.h>
+#include <string.h>
 #include <stdbool.h>
 #include <assert.h>
+#include <sched.h>
+#include <pthread.h>
 #include "userfs.h"
 #include "crash.h"
 #include "blocks.h"
 #include "inode.h"
+#include "group.h"
+#include "imap.h"
+#include "stats.h"
+#include "crc.h"
+#include "disk.h"
+#include "recover.h"
+#include "epoch.h"
 
-int compute_inode_loc(int inode_number) {
-	int whichInodeBlock;
-	int whichInodeInBlock;
+/* the group of the block holding the inode */
+int inode_group(int inode_number) {
+	return group_of(inode_map[inode_number / INODES_PER_BLOCK]);
+}
+
+/* byte offset of an inode, looked up in the inode map */
+off_t compute_inode_loc(int inode_number) {
+	int whichInodeBlock = inode_number/INODES_PER_BLOCK;
+	int whichInodeInBlock = inode_number%INODES_PER_BLOCK;
+	//a reader without the engine may see the map replaced, the old one stays until it leaves
+	DISK_LBA * map = __atomic_load_n(&inode_map, __ATOMIC_ACQUIRE);
+
+	return map[whichInodeBlock] * (off_t)BLOCK_SIZE_BYTES
+		+ whichInodeInBlock*sizeof(inode);
+}
+
+/*
+   getattr and readdir read inodes without the engine. Every write of an
+   inode and every change to the map between two changes of inode_seq,
+   odd while one is under way, so a reader tries again when it moved.
+   Writers sharing the engine take turns with change_lock, an enciphered
+   inode is written with the rest of its sector, which holds others.
+*/
+static uint64_t inode_seq;
+static pthread_mutex_t change_lock = PTHREAD_MUTEX_INITIALIZER;
+
+void inode_change_begin() {
+	pthread_mutex_lock(&change_lock);
+	__atomic_add_fetch(&inode_seq, 1, __ATOMIC_SEQ_CST);
+}
+
+void inode_change_end() {
+	__atomic_add_fetch(&inode_seq, 1, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&change_lock);
+}
+
+/* 
+   Makes the block holding an inode writable in place, copying it when a
+   snapshot shares it. in_use is what the inode is about to become.
+   Returns 0 when there is no room for the copy.
+*/
+int own_inode(int inode_number, bool in_use) {
+	int k = inode_number / INODES_PER_BLOCK;
+	if (!block_shared(inode_map[k]))
+		return 1;
+	return cow_inode_block(k, inode_number % INODES_PER_BLOCK, in_use);
+}
+
+/* 
+   Inodes whose time is all that changed, written together by
+   flush_inode_times. A crash loses the time, nothing else.
+*/
+#define LAZY_TIMES 64
+static struct {
+	int inode_number;
+	time_t time;
+} lazy_times[LAZY_TIMES];
+static int num_lazy;
+//writers sharing the engine change them, inode_time reads them without it
+static pthread_mutex_t times_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int find_lazy(int inode_number) {
+	int i;
+	for (i = 0; i < num_lazy; i++) {
+		if (lazy_times[i].inode_number == inode_number)
+			return i;
+	}
+	return -1;
+}
+
+/* the inode is written with a newer time, or freed */
+static void forget_time(int inode_number) {
+	int i;
+	pthread_mutex_lock(&times_lock);
+	if ((i = find_lazy(inode_number)) >= 0)
+		lazy_times[i] = lazy_times[--num_lazy];
+	pthread_mutex_unlock(&times_lock);
+}
+
+/* 
+   Keeps the time back, returns false when there is no room for it.
+   Flushing the others to make room would write inodes that writers
+   sharing the engine have in hand, the caller writes its own instead.
+*/
+static bool touch_inode(int inode_number, time_t when) {
+	int i;
+	pthread_mutex_lock(&times_lock);
+	if ((i = find_lazy(inode_number)) < 0 && num_lazy < LAZY_TIMES) {
+		i = num_lazy++;
+		lazy_times[i].inode_number = inode_number;
+	}
+	if (i >= 0)
+		lazy_times[i].time = when;
+	pthread_mutex_unlock(&times_lock);
+	return i >= 0;
+}
 
-	whichInodeBlock = inode_number/INODES_PER_BLOCK;
-	whichInodeInBlock = inode_number%INODES_PER_BLOCK;
+void drop_inode_times() {
+	pthread_mutex_lock(&times_lock);
+	num_lazy = 0;
+	pthread_mutex_unlock(&times_lock);
+}
 
-	return (INODE_BLOCK + whichInodeBlock) *BLOCK_SIZE_BYTES + whichInodeInBlock*sizeof(inode);
+/* the time of an inode read from disk, or the newer one not written yet */
+time_t inode_time(int inode_number, const inode * in) {
+	time_t when;
+	int i;
+	pthread_mutex_lock(&times_lock);
+	i = find_lazy(inode_number);
+	when = i < 0 ? in->last_modified : lazy_times[i].time;
+	pthread_mutex_unlock(&times_lock);
+	return when;
 }
 
+/* 
+   Writes the bytes of the inode at loc in the sectors where in differs
+   from old, neighbouring sectors in one write
+*/
+static void write_changed(off_t loc, const inode * old, const inode * in) {
+	const char * a = (const char *)old, * b = (const char *)in;
+	int at = 0, run = -1, end;
+	while (at < sizeof(inode)) {
+		end = (loc + at) / SECTOR_SIZE * SECTOR_SIZE + SECTOR_SIZE - loc;
+		if (end > sizeof(inode))
+			end = sizeof(inode);
+		if (memcmp(a + at, b + at, end - at) != 0) {
+			if (run < 0)
+				run = at;
+		} else if (run >= 0) {
+			disk_meta_write(loc + run, b + run, at - run);
+			run = -1;
+		}
+		at = end;
+	}
+	if (run >= 0)
+		disk_meta_write(loc + run, b + run, sizeof(inode) - run);
+}
+
+/* returns 0 without writing when the inode's block is shared and cannot be copied */
 int write_inode(int inode_number, inode * in) {
-	int inodeLocation;
+	off_t inodeLocation;
+	uint64_t start = stats_now();
 	assert(inode_number < MAX_INODES);
+	if (!own_inode(inode_number, in->in_use))
+		return 0;
 
 	inodeLocation = compute_inode_loc(inode_number);
   	in->last_modified = time(NULL);
-	lseek(virtual_disk, inodeLocation, SEEK_SET);
+	in->checksum = crc32c_sealed(in, sizeof(inode), &in->checksum);
+	inode_change_begin();
+	disk_meta_write(inodeLocation, in, sizeof(inode));
+	inode_change_end();
+	forget_time(inode_number);
+
+	stats_record(S_WRITE_INODE, start);
+	return 1;
+}
+
+/* 
+   Writes in over old, what the inode was read as, sector by sector as
+   they changed. When only the time would change it is kept for
+   flush_inode_times instead, while there is room. Returns 0 like
+   write_inode.
+*/
+int update_inode(int inode_number, const inode * old, inode * in) {
+	inode same;
+	uint64_t start = stats_now();
+	assert(inode_number < MAX_INODES);
+	if (!own_inode(inode_number, in->in_use))
+		return 0;
 
-	crash_write(virtual_disk, in, sizeof(inode));
-  
-	sync();
+	in->last_modified = time(NULL);
+	memcpy(&same, old, sizeof(inode));
+	same.last_modified = in->last_modified;
+	same.checksum = in->checksum;
+	if (memcmp(&same, in, sizeof(inode)) == 0) {
+		in->last_modified = old->last_modified;
+		if (touch_inode(inode_number, same.last_modified))
+			return 1;
+		in->last_modified = same.last_modified;
+	}
+	in->checksum = crc32c_sealed(in, sizeof(inode), &in->checksum);
+	inode_change_begin();
+	write_changed(compute_inode_loc(inode_number), old, in);
+	inode_change_end();
+	forget_time(inode_number);
 
+	stats_record(S_WRITE_INODE, start);
 	return 1;
 }
 
+/* writes the times touch_inode kept back, returns how many */
+int flush_inode_times() {
+	inode old, in;
+	int i, written = 0;
+	for (i = 0; i < num_lazy; i++) {
+		int n = lazy_times[i].inode_number;
+		if (!read_inode(n, &old) || !old.in_use || !own_inode(n, true))
+			continue;
+		memcpy(&in, &old, sizeof(inode));
+		in.last_modified = lazy_times[i].time;
+		in.checksum = crc32c_sealed(&in, sizeof(inode), &in.checksum);
+		inode_change_begin();
+		write_changed(compute_inode_loc(n), &old, &in);
+		inode_change_end();
+		written++;
+	}
+	drop_inode_times();
+	return written;
+}
+
+
+/* whether an inode read from disk is free or matches its checksum, reports it when not */
+bool inode_sealed(int inode_number, const inode * in) {
+	if (!in->in_use || crc32c_sealed(in, sizeof(inode), &in->checksum) == in->checksum)
+		return true;
+	checksum_failed("inode", inode_number);
+	return false;
+}
 
+/* returns 0 when the inode is in use and its checksum does not match, in is filled in anyway */
 int read_inode(int inode_number, inode * in) {
-	int inodeLocation;
+	uint64_t start = stats_now(), seq;
+	int slot;
 	assert(inode_number < MAX_INODES);
 
-	inodeLocation = compute_inode_loc(inode_number);
+	//read again when the engine wrote an inode or changed the map meanwhile
+	do {
+		while ((seq = __atomic_load_n(&inode_seq, __ATOMIC_ACQUIRE)) & 1)
+			sched_yield();
+		slot = epoch_enter();
+		disk_meta_read(compute_inode_loc(inode_number), in, sizeof(inode));
+		epoch_leave(slot);
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while (__atomic_load_n(&inode_seq, __ATOMIC_RELAXED) != seq);
 
-  
-	lseek(virtual_disk, inodeLocation, SEEK_SET);
-	read(virtual_disk, in, sizeof(inode));
-  
-	return 1;
+	stats_record(S_READ_INODE, start);
+	return inode_sealed(inode_number, in);
 }
 
 /* 
@@ -51,20 +262,64 @@ int read_inode(int inode_number, inode * in) {
 void allocate_inode(inode * in, int blocks, int size) {
 	in->no_blocks = blocks;
 	in->file_size_bytes = size;
-	in->free = false;
+	in->orphan = 0;
+	in->next_orphan = 0;
+	in->in_use = true;
 }
 
 /* 
-   Returns the next free inode.
+   Returns the next free inode, looking in the given group first, and
+   takes it out of its group's free count. When every group is full the
+   inode table grows by a block. Returns -1 when there is no inode left.
 */
-int free_inode() {
-	inode dummyNode;
-	int i;
-	for(i=0; i<MAX_INODES; i++){
-		read_inode(i, &dummyNode);
-		if(dummyNode.free)
-			return i;
+int free_inode(int group) {
+	inode block[INODES_PER_BLOCK];
+	group_inodes * gi;
+	int g, tries, p, i, k;
+	for (tries = 0, g = group; tries < sb.num_groups; tries++, g = (g + 1) % sb.num_groups) {
+		if (groups[g].free_inodes <= 0)
+			continue;
+		gi = &group_itable[g];
+		for (p = gi->hint; p < gi->count; p++) {
+			k = gi->blocks[p];
+			read_block(inode_map[k], block, sizeof(block));
+			for (i = 0; i < INODES_PER_BLOCK; i++) {
+				if (!block[i].in_use) {
+					gi->hint = p;
+					//the block may move to another group when a snapshot shares it
+					if (!own_inode(k * INODES_PER_BLOCK + i, false))
+						return -1;
+					g = inode_group(k * INODES_PER_BLOCK + i);
+					groups[g].free_inodes--;
+					mark_group_dirty(g);
+					return k * INODES_PER_BLOCK + i;
+				}
+			}
+		}
+		//the count was off, fsck sets it right
+		gi->hint = p;
+		groups[g].free_inodes = 0;
 	}
-	return -1;
+	if ((k = grow_inode_table(group)) < 0)
+		return -1;
+	g = group_of(inode_map[k]);
+	groups[g].free_inodes--;
+	return k * INODES_PER_BLOCK;
 }
 
+/* 
+   Marks an inode free on disk and gives it back to its group
+*/
+void release_inode(int inode_number, inode * in) {
+	int group;
+	in->in_use = false;
+	in->orphan = 0;
+	in->next_orphan = 0;
+	write_inode(inode_number, in);
+	recovery_released(inode_number);
+	//after the write, which may have moved the inode's block
+	group = inode_group(inode_number);
+	inode_block_freed(inode_number / INODES_PER_BLOCK);
+	groups[group].free_inodes++;
+	mark_group_dirty(group);
+}
@@ -1,29 +1,49 @@
 #ifndef U_INODE
 #define U_INODE
 
-#define INODE_BLOCK 3
 #define MAX_BLOCKS_PER_FILE	100
-#define INODES_PER_BLOCK (BLOCK_SIZE_BYTES/sizeof(inode))
-#define MAX_INODES (INODES_PER_BLOCK * NUM_INODE_BLOCKS)
-#define NUM_INODE_BLOCKS 5
+#define INODES_PER_BLOCK ((int)(BLOCK_SIZE_BYTES/sizeof(inode)))
+#define DEFAULT_BYTES_PER_INODE (64 * 1024)
+#define MIN_BYTES_PER_INODE 1024
+#define INODE_BLOCKS_PER_GROUP (sb.inodes_per_group / INODES_PER_BLOCK) //laid out at format, the table grows from there
+#define MAX_INODES (sb.num_inode_blocks * INODES_PER_BLOCK)
+
+/* what is left to do for an inode on the orphan list */
+#define ORPHAN_TRUNCATED 1 //free the blocks past its size
+#define ORPHAN_UNLINKED 2 //free all its blocks and then the inode, no entry names it
 
 #include <time.h>
-#include "inode.h"
+#include <stdbool.h>
+#include <sys/types.h>
 #include "userfs.h"
+#include "sb.h"
 
 typedef struct i_node{
 	int no_blocks;
 	int file_size_bytes;
 	time_t last_modified; // optional add other information
 	DISK_LBA blocks[MAX_BLOCKS_PER_FILE];
-	bool free;
+	uint32_t block_csums[MAX_BLOCKS_PER_FILE]; //crc32c of each block, with sb.data_checksums
+	int orphan; //ORPHAN_ while its blocks wait for the reclaimer, 0 otherwise
+	int next_orphan; //the inode after it on the orphan list plus one, 0 at the end
+	bool in_use; //zeroed inodes are free
+	uint32_t checksum; //of the inode with this field zeroed, free inodes are not checked
 }inode;
 
-int compute_inode_loc(int);
+off_t compute_inode_loc(int);
+void inode_change_begin();
+void inode_change_end();
+int inode_group(int);
+int own_inode(int, bool);
 int write_inode(int , inode *);
+int update_inode(int, const inode * old, inode *);
+int flush_inode_times();
+void drop_inode_times();
+time_t inode_time(int, const inode *);
 int read_inode(int , inode *);
+bool inode_sealed(int, const inode *);
 void allocate_inode(inode *, int, int);
-int free_inode();
+int free_inode(int group);
+void release_inode(int, inode *);
 
 #endif
-
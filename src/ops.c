@@ -0,0 +1,721 @@
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include "userfs.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "file.h"
+#include "dir.h"
+#include "inode.h"
+#include "sb.h"
+#include "group.h"
+#include "util.h"
+#include "trace.h"
+#include "stats.h"
+#include "crash.h"
+#include "snap.h"
+#include "crc.h"
+#include "disk.h"
+#include "recover.h"
+#include "reclaim.h"
+#include "resize.h"
+#include "ops.h"
+
+static int min(int x, int y){
+	return x < y ? x : y;
+}
+
+static int max(int x, int y){
+	return x > y ? x : y;
+}
+
+/* set when a snapshot is mounted, nothing may change then */
+static bool read_only;
+
+/* finds the file for path, checking its inode first while recovery has not got to it */
+static bool lookup(const char * path, file_struct * file) {
+	return find_file(path, file) && recovery_check(file->inode_number);
+}
+
+/* the stats and control files are not in the directory */
+static bool special_file(const char * path) {
+	return strcmp(path, STATS_FILE) == 0 || strcmp(path, CTL_FILE) == 0;
+}
+
+/* 
+   Opens the disk, recovering it if it was not shut down cleanly,
+   and marks it dirty until u_unmount
+*/
+int u_mount(char * disk) {
+	if (!recover_file_system(disk))
+		return 0;
+	//lookups read the entries in memory from now on
+	dir_load();
+	//We are not clean
+	sb.clean_shutdown = 0;
+	write_superblock();
+	sync_blocks();
+	//orphans a mount with a reclaimer left, nothing else would free them
+	if (!reclaim_background())
+		reclaim_all();
+	return 1;
+}
+
+/* mounts the named snapshot of disk read only */
+int u_mount_snapshot(char * disk, const char * name) {
+	if (!mount_snapshot(disk, name))
+		return 0;
+	dir_load();
+	read_only = true;
+	return 1;
+}
+
+int u_unmount() {
+	dir_unload();
+	if (read_only) {
+		read_only = false;
+		disk_close();
+		return 0;
+	}
+	return u_clean_shutdown();
+}
+
+int u_snapshot(const char * name) {
+	if (read_only)
+		return -EROFS;
+	//a snapshot keeps what the bitmap says, so it waits for recovery and the reclaimer
+	recovery_finish();
+	reclaim_all();
+	return snapshot_create(name);
+}
+
+int u_delete_snapshot(const char * name) {
+	return read_only ? -EROFS : snapshot_delete(name);
+}
+
+int u_grow(int64_t bytes) {
+	return read_only ? -EROFS : resize_grow(bytes);
+}
+
+/* only with nothing else using the engine, the pass holds it from start to end */
+int u_shrink(int64_t bytes) {
+	return read_only ? -EROFS : resize_shrink(bytes);
+}
+
+/*
+   Commands written to the control file, one per write:
+   	snapshot NAME	takes a snapshot called NAME
+   	delete NAME	deletes it again
+   	grow SIZE	grows the disk to SIZE bytes, with a K, M, G or T suffix
+*/
+static int ctl_command(const char * buf, size_t size) {
+	char line[64];
+	int res;
+	if (size >= sizeof(line))
+		return -EINVAL;
+	memcpy(line, buf, size);
+	line[size] = '\0';
+	if (size > 0 && line[size - 1] == '\n')
+		line[size - 1] = '\0';
+	if (strncmp(line, "snapshot ", 9) == 0)
+		res = u_snapshot(line + 9);
+	else if (strncmp(line, "delete ", 7) == 0)
+		res = u_delete_snapshot(line + 7);
+	else if (strncmp(line, "grow ", 5) == 0)
+		res = u_grow(parse_size(line + 5));
+	else if (strcmp(line, "trim") == 0)
+		res = u_trim();
+	else
+		res = -EINVAL;
+	return res < 0 ? res : (int)size;
+}
+
+/* attributes of a regular file, stbuf has to be zeroed */
+static void file_stat(int inode_number, const inode * in, struct stat * stbuf) {
+	stbuf->st_ino = inode_number + 1;
+	stbuf->st_mode = S_IFREG | 0666;
+	stbuf->st_nlink = 1;
+	//a time only write leaves the newest time in memory for a while
+	stbuf->st_mtime = inode_time(inode_number, in);
+	stbuf->st_ctime = stbuf->st_mtime;
+	stbuf->st_size = in->file_size_bytes;
+}
+
+int u_getattr(const char * path, struct stat * stbuf)
+{
+	int res = 0;
+	file_struct dummyFile;
+	memset(stbuf, 0, sizeof(struct stat));
+	if (strcmp(path, "/") == 0) {
+		stbuf->st_mode = S_IFDIR | 0755;
+		stbuf->st_nlink = 2;
+		stbuf->st_mtime = time(NULL);
+		stbuf->st_ctime = time(NULL);
+	}
+	else if (strcmp(path, STATS_FILE) == 0) {
+		char text[STATS_RENDER_SIZE];
+		stbuf->st_mode = S_IFREG | 0444;
+		stbuf->st_nlink = 1;
+		stbuf->st_mtime = time(NULL);
+		stbuf->st_ctime = time(NULL);
+		stbuf->st_size = stats_render(text, sizeof(text));
+	}
+	else if (strcmp(path, CTL_FILE) == 0) {
+		char text[SNAPSHOT_LIST_SIZE];
+		stbuf->st_mode = S_IFREG | (read_only ? 0444 : 0644);
+		stbuf->st_nlink = 1;
+		stbuf->st_mtime = time(NULL);
+		stbuf->st_ctime = time(NULL);
+		stbuf->st_size = snapshot_list(text, sizeof(text));
+	}
+	else if(lookup(path, &dummyFile)){
+		inode dummyInode;
+		if (!read_inode(dummyFile.inode_number, &dummyInode))
+			return -EIO;
+		file_stat(dummyFile.inode_number, &dummyInode, stbuf);
+	}
+	else {
+		res = -ENOENT;
+	}
+	
+	return res;
+}
+
+typedef struct fill_args_s {
+	void * buf;
+	u_fill_dir_t filler;
+} fill_args;
+
+/* hands one entry and its attributes to the filler, non zero once the buffer is full */
+static int fill_entry(const dir_entry * entry, void * arg) {
+	fill_args * fill = arg;
+	struct stat st;
+	inode in;
+	memset(&st, 0, sizeof(st));
+	//an entry of an inode recovery finds free is dropped once it finishes
+	if (!recovery_check(entry->inode_number))
+		return 0;
+	//getattr has EIO for an inode failing its checksum, its bytes are not listed either
+	if (!read_inode(entry->inode_number, &in))
+		return 0;
+	file_stat(entry->inode_number, &in, &st);
+	//skip the leading slash
+	return fill->filler(fill->buf, entry->file_name + 1, &st, dir_cookie(entry));
+}
+
+/* Reads the files in path after offset into buf using the filler function
+   int (*u_fill_dir_t)(void *buffer, char* filename, struct stat *, off_t next);
+   	filler adds a file and its attributes to the result buffer (buf) and
+   	returns 1 once it is full. Every entry is passed the offset to resume
+   	the listing after it, so large directories are read a page at a time
+   	and nobody has to getattr each name afterwards.
+*/
+int u_readdir(const char * path, void * buf, u_fill_dir_t filler, off_t offset)
+{
+	fill_args fill = { buf, filler };
+	struct stat st;
+	uint64_t from;
+
+	if (strcmp(path, "/") != 0)
+		return -ENOENT;
+
+	if (offset < DIR_FIRST_COOKIE - 1) {
+		u_getattr("/", &st);
+		if (offset < 1 && filler(buf, ".", &st, 1))
+			return 0;
+		if (offset < 2 && filler(buf, "..", &st, 2))
+			return 0;
+		u_getattr(STATS_FILE, &st);
+		if (offset < 3 && filler(buf, STATS_FILE + 1, &st, 3))
+			return 0;
+		u_getattr(CTL_FILE, &st);
+		if (filler(buf, CTL_FILE + 1, &st, 4))
+			return 0;
+	}
+	if (dir_cookie_next(offset, &from))
+		dir_for_each_from(from, fill_entry, &fill);
+	return 0;
+}
+
+/* Create a empty file named path 
+   
+   Find a free inode
+   Mark it as allocated
+   Allocate file as our inode in root dir
+   Writes relevent blocks
+*/
+int u_create(const char * path, mode_t mode) {
+	file_struct file;
+	
+	if(strlen(path) > MAX_FILE_NAME_SIZE) {
+		return -ENAMETOOLONG;
+	}
+	
+	//an entry left by an inode recovery finds free would hide the name
+	recovery_finish();
+	if(special_file(path) || find_file(path, &file)) {
+		return -EEXIST;
+	}
+	if (read_only) {
+		return -EROFS;
+	}
+	
+	inode writing_inode, old_inode;
+	
+	//spread new files over the groups
+	static int next_group;
+	//a shrink, or another disk mounted since, can leave it past the last group
+	next_group %= sb.num_groups;
+	int freeinode = free_inode(next_group);
+	//the inodes of unlinked files come back once their blocks are freed
+	if (freeinode < 0 && sb.orphan_head != 0) {
+		reclaim_all();
+		freeinode = free_inode(next_group);
+	}
+	
+	if(freeinode < 0){
+		TRACE(TRACE_ERR, T_NO_INODE, -1, 0, 0, -1);
+		return -ENOSPC;
+	}
+	next_group = (inode_group(freeinode) + 1) % sb.num_groups;
+	read_inode(freeinode, &writing_inode);
+	old_inode = writing_inode;
+	allocate_inode(&writing_inode, 0, 0);
+	
+	update_inode(freeinode, &old_inode, &writing_inode);
+	TRACE(TRACE_OP, T_CREATE, freeinode, 0, 0, -1);
+	crash_point("create:inode_written");
+	if (dir_allocate_file(freeinode, path) != 0) {
+		release_inode(freeinode, &writing_inode);
+		return -ENOSPC;
+	}
+	crash_point("create:dir_updated");
+	
+	return 0;
+}
+
+/* Checks that a file can be opened */
+int u_open(const char * path)
+{
+	file_struct file;
+	
+	if (special_file(path) || lookup(path, &file)) {
+		return 0;
+	}
+	return -ENOENT;
+}
+
+/* Reads the contents of file into buf
+   man 3 read
+   
+   finds the file for path
+   reads contents of file into buf starting at offset, one block at a time
+   returns the number of bytes read, short at the end of the file
+*/
+int u_read(const char * path, char * buf, size_t size, off_t offset)
+{
+	block_io ios[MAX_BLOCKS_PER_FILE];
+	char * blocks = NULL;
+	int read_bytes, n, i;
+	inode inode;
+	file_struct file;
+	
+	if (strcmp(path, STATS_FILE) == 0) {
+		char text[STATS_RENDER_SIZE];
+		int len = stats_render(text, sizeof(text));
+		if (offset >= len)
+			return 0;
+		len = min(len - offset, size);
+		memcpy(buf, text + offset, len);
+		return len;
+	}
+	if (strcmp(path, CTL_FILE) == 0) {
+		char text[SNAPSHOT_LIST_SIZE];
+		int len = snapshot_list(text, sizeof(text));
+		if (offset >= len)
+			return 0;
+		len = min(len - offset, size);
+		memcpy(buf, text + offset, len);
+		return len;
+	}
+	if (!lookup(path, &file)) {
+		return -ENOENT;
+	}
+	
+	if (!read_inode(file.inode_number, &inode)) {
+		return -EIO;
+	}
+	
+	if (offset >= inode.file_size_bytes) {
+		return 0;
+	}
+	size = min(size, inode.file_size_bytes - offset);
+	
+	//the whole blocks are read to check them
+	if (sb.data_checksums)
+		blocks = malloc((size_t)inode.no_blocks * BLOCK_SIZE_BYTES);
+	
+	read_bytes = 0;
+	n = 0;
+	while (read_bytes < size) {
+		//Offset inside the current block
+		int offset_in_block = (offset + read_bytes) % BLOCK_SIZE_BYTES;
+		int blockindex = (offset + read_bytes) / BLOCK_SIZE_BYTES;
+		int bytes_to_read = min(BLOCK_SIZE_BYTES - offset_in_block, size - read_bytes);
+		
+		TRACE(TRACE_OP, T_READ, file.inode_number, offset + read_bytes, bytes_to_read, inode.blocks[blockindex]);
+		if (sb.data_checksums) {
+			ios[n] = (block_io){ inode.blocks[blockindex], 0, BLOCK_SIZE_BYTES, blocks + (size_t)n * BLOCK_SIZE_BYTES };
+		} else {
+			ios[n] = (block_io){ inode.blocks[blockindex], offset_in_block, bytes_to_read, buf + read_bytes };
+		}
+		n++;
+		read_bytes += bytes_to_read;
+	}
+	//all at once, from every member of a striped disk in parallel
+	read_blocks(ios, n);
+	
+	if (sb.data_checksums) {
+		for (i = 0; i < n; i++) {
+			if (crc32c(0, ios[i].data, BLOCK_SIZE_BYTES) != inode.block_csums[offset / BLOCK_SIZE_BYTES + i]) {
+				checksum_failed("data block", ios[i].block);
+				free(blocks);
+				return -EIO;
+			}
+		}
+		memcpy(buf, blocks + offset % BLOCK_SIZE_BYTES, read_bytes);
+		free(blocks);
+	}
+	
+	return read_bytes;
+}
+
+/* 
+   Writes buf into the file at offset, claiming the blocks it grows by,
+   then the inode and the bitmap. The caller has checked the file can
+   take it and owns the inode, read as in.
+*/
+static int write_file(int inode_number, inode * in, const char * buf, size_t size, off_t offset) {
+	static const char zeros[MAX_BLOCK_SIZE];
+	char block[MAX_BLOCK_SIZE];
+	block_io ios[MAX_BLOCKS_PER_FILE];
+	inode old = *in;
+	int written, n;
+	
+	written = 0;
+	n = 0;
+	while (written < size) {
+		//Offset inside the current block
+		int offset_in_block = (offset + written) % BLOCK_SIZE_BYTES;
+		int blockindex = (offset + written) / BLOCK_SIZE_BYTES;
+		int bytes_to_write = min(BLOCK_SIZE_BYTES - offset_in_block, size - written);
+		
+		//extend the inode up to and including this block
+		while (in->no_blocks <= blockindex) {
+			//the file grows from its last block, it starts in its inode's home shard
+			DISK_LBA goal = in->no_blocks ? in->blocks[in->no_blocks - 1] + 1
+				: shard_start(inode_group(inode_number), inode_number);
+			DISK_LBA freeblock = claim_block(goal);
+			if (freeblock == -1) {
+				TRACE(TRACE_ERR, T_NO_BLOCK, inode_number, offset, size, -1);
+				break;
+			}
+			in->blocks[in->no_blocks++] = freeblock;
+			//a reused block may hold stale data that a partial write would expose
+			if (in->no_blocks - 1 < blockindex || bytes_to_write < BLOCK_SIZE_BYTES) {
+				write_data_block(freeblock, zeros, BLOCK_SIZE_BYTES);
+				in->block_csums[in->no_blocks - 1] = crc32c(0, zeros, BLOCK_SIZE_BYTES);
+			}
+		}
+		if (in->no_blocks <= blockindex)
+			break;
+		//a block a snapshot shares is written to a copy, partial writes keep the rest of it
+		if (block_shared(in->blocks[blockindex])) {
+			DISK_LBA copy = copy_block(in->blocks[blockindex], bytes_to_write < BLOCK_SIZE_BYTES);
+			if (copy == -1) {
+				TRACE(TRACE_ERR, T_NO_BLOCK, inode_number, offset, size, -1);
+				break;
+			}
+			in->blocks[blockindex] = copy;
+		}
+		
+		//the checksum is of the whole block, a partial write reads the rest of it first
+		if (sb.data_checksums) {
+			if (bytes_to_write < BLOCK_SIZE_BYTES)
+				read_data_block(in->blocks[blockindex], block, BLOCK_SIZE_BYTES);
+			memcpy(block + offset_in_block, buf + written, bytes_to_write);
+			in->block_csums[blockindex] = crc32c(0, block, BLOCK_SIZE_BYTES);
+		}
+		
+		TRACE(TRACE_OP, T_WRITE, inode_number, offset + written, bytes_to_write, in->blocks[blockindex]);
+		ios[n++] = (block_io){ in->blocks[blockindex], offset_in_block, bytes_to_write, (char *)buf + written };
+		written += bytes_to_write;
+	}
+	//the data goes out together, to every member of a striped disk in parallel
+	write_blocks(ios, n);
+	
+	in->file_size_bytes = max(offset + written, in->file_size_bytes);
+	
+	crash_point("write:data_written");
+	//an overwrite in place only changes the time, which is written lazily
+	update_inode(inode_number, &old, in);
+	crash_point("write:inode_written");
+	
+	write_bitmap();
+	
+	return written ? written : -ENOSPC;
+}
+
+/* Writes contents of buf to file
+   man 3 write
+   
+   find file for path
+   writes contents of buf into file starting at offset
+      figure out how many blocks you need
+      for each required block
+      	find a free block
+      	update inode to have new block
+		write buf to blocks
+	write relevent blocks
+*/
+int u_write(const char * path, const char * buf, size_t size, off_t offset) {
+	inode inode;
+	file_struct file;
+	
+	if (strcmp(path, STATS_FILE) == 0) {
+		return -EACCES;
+	}
+	if (strcmp(path, CTL_FILE) == 0) {
+		return ctl_command(buf, size);
+	}
+	if (!lookup(path, &file)) {
+		return -ENOENT;
+	}
+	if (read_only) {
+		return -EROFS;
+	}
+	//an inode a snapshot shares is copied before any of its blocks change
+	if (!own_inode(file.inode_number, true)) {
+		return -ENOSPC;
+	}
+	
+	if (!read_inode(file.inode_number, &inode)) {
+		return -EIO;
+	}
+	//a file truncated before grows into blocks of its own, those past its size are freed first
+	if (inode.orphan == ORPHAN_TRUNCATED && !reclaim_tail(file.inode_number, &inode)) {
+		return -ENOSPC;
+	}
+	
+	int new_blockno = (offset + size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+	
+	if (!valid_file_size(new_blockno)) {
+		return -EFBIG;
+	}
+	
+	//blocks the reclaimer has not got to yet are not free
+	if (new_blockno - inode.no_blocks > u_quota()) {
+		reclaim_all();
+	}
+	if (new_blockno - inode.no_blocks > u_quota()) {
+		return -ENOSPC;
+	}
+	
+	return write_file(file.inode_number, &inode, buf, size, offset);
+}
+
+/* writers to the same file take turns, picked by inode number */
+#define FILE_LOCKS 64
+static pthread_mutex_t file_locks[FILE_LOCKS] = { [0 ... FILE_LOCKS - 1] = PTHREAD_MUTEX_INITIALIZER };
+
+/* 
+   u_write for a caller that shares the engine with other writers, only
+   for a write that needs nothing but blocks of its own. Those come from
+   claim_block, which takes them without a lock, each file from its own
+   shard. Returns -EAGAIN when the write needs the engine to itself: with
+   snapshots, while recovery is active, for a truncated orphan, or when
+   the orphans have to be reclaimed to make room. u_write does it then.
+*/
+int u_write_shared(const char * path, const char * buf, size_t size, off_t offset) {
+	pthread_mutex_t * lock;
+	inode inode;
+	file_struct file;
+	int res;
+	
+	if (special_file(path) || read_only || sb.num_snapshots > 0 || recovery_active()) {
+		return -EAGAIN;
+	}
+	if (!lookup(path, &file)) {
+		return -ENOENT;
+	}
+	lock = &file_locks[file.inode_number % FILE_LOCKS];
+	pthread_mutex_lock(lock);
+	if (!read_inode(file.inode_number, &inode)) {
+		res = -EIO;
+	} else if (inode.orphan == ORPHAN_TRUNCATED) {
+		res = -EAGAIN;
+	} else {
+		int new_blockno = (offset + size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+		if (!valid_file_size(new_blockno))
+			res = -EFBIG;
+		else if (new_blockno - inode.no_blocks > u_quota())
+			res = -EAGAIN;
+		else
+			res = write_file(file.inode_number, &inode, buf, size, offset);
+	}
+	pthread_mutex_unlock(lock);
+	return res;
+}
+
+/* Trims file to offset length
+   figure out which blocks to free
+   free relevent blocks
+   update inode
+*/
+int u_truncate(const char * path, off_t offset) {
+	inode inode, old;
+	int i;
+	int blocknumber;
+	file_struct file;
+	
+	//truncating the stats file resets the counters
+	if (strcmp(path, STATS_FILE) == 0) {
+		stats_reset();
+		return 0;
+	}
+	//commands are written from the start, opening it with O_TRUNC is fine
+	if (strcmp(path, CTL_FILE) == 0) {
+		return 0;
+	}
+	if (!lookup(path, &file)) {
+		return -ENOENT;
+	}
+	if (read_only) {
+		return -EROFS;
+	}
+	
+	if (!read_inode(file.inode_number, &inode)) {
+		return -EIO;
+	}
+	if (offset >= inode.file_size_bytes) {
+		return 0;
+	}
+	old = inode;
+	if (!own_inode(file.inode_number, true)) {
+		return -ENOSPC;
+	}
+	blocknumber = (offset + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+	TRACE(TRACE_OP, T_TRUNCATE, file.inode_number, offset, 0, blocknumber);
+	//the blocks past the new size are left to the reclaimer
+	if (reclaim_deferred() && blocknumber < inode.no_blocks) {
+		inode.file_size_bytes = offset;
+		if (!orphan_inode(file.inode_number, &old, &inode, ORPHAN_TRUNCATED))
+			return -ENOSPC;
+		crash_point("truncate:orphan_written");
+		return 0;
+	}
+	for(i=blocknumber; i<inode.no_blocks; i++){
+		release_block(inode.blocks[i]);
+	}
+	inode.no_blocks = blocknumber;
+	inode.file_size_bytes = offset;
+	update_inode(file.inode_number, &old, &inode);
+	crash_point("truncate:inode_written");
+	write_bitmap();
+	return 0;
+}
+
+/* Remove file 
+   Save relevent blocks
+*/
+int u_unlink(const char * path) {
+	file_struct file;
+	int res;
+	if (special_file(path)) {
+		return -EPERM;
+	}
+	if (lookup(path, &file)) {
+		if (read_only) {
+			return -EROFS;
+		}
+		TRACE(TRACE_OP, T_UNLINK, file.inode_number, 0, 0, -1);
+		res = reclaim_deferred() ? dir_orphan_file(file) : dir_remove_file(file);
+		crash_point("unlink:dir_written");
+		write_bitmap();
+		return res;
+	}
+	return -ENOENT;
+}
+
+int u_rename(const char * oldpath, const char * newpath) {
+	file_struct file;
+	
+	if(strlen(newpath) > MAX_FILE_NAME_SIZE) {
+		return -ENAMETOOLONG;
+	}
+	if (special_file(oldpath) || special_file(newpath)) {
+		return -EPERM;
+	}
+	recovery_finish();
+	
+	if (find_file(oldpath, &file)) {
+		file_struct target;
+		int res;
+		if (read_only) {
+			return -EROFS;
+		}
+		//renaming over an existing file replaces it
+		if (strcmp(oldpath, newpath) != 0 && find_file(newpath, &target)) {
+			res = reclaim_deferred() ? dir_orphan_file(target) : dir_remove_file(target);
+			write_bitmap();
+			if (res != 0)
+				return res;
+		}
+		res = dir_rename_file(oldpath, newpath);
+		crash_point("rename:dir_updated");
+		write_bitmap();
+		return res;
+	}
+	return -ENOENT;
+}
+
+/* writes the times still held in memory and waits for everything to reach the disk */
+int u_fsync(const char * path) {
+	file_struct file;
+	if (special_file(path)) {
+		return 0;
+	}
+	if (!lookup(path, &file)) {
+		return -ENOENT;
+	}
+	if (!read_only) {
+		flush_inode_times();
+		write_bitmap();
+		sync_blocks();
+		//the blocks freed before are free on disk now
+		discard_blocks(false);
+	}
+	return 0;
+}
+
+/* gives the host back the space of every free block, also those freed before the last mount */
+int u_trim() {
+	if (read_only) {
+		return -EROFS;
+	}
+	//unchecked inodes may use blocks the bitmap still has free
+	recovery_finish();
+	flush_inode_times();
+	write_bitmap();
+	sync_blocks();
+	discard_blocks(true);
+	return 0;
+}
+
+DISK_LBA u_quota() {
+	return sb.num_free_blocks;
+}
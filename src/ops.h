@@ -0,0 +1,43 @@
+#ifndef U_OPS
+#define U_OPS
+
+/* 
+   Public interface of the filesystem engine, everything fuse calls in fs.c
+   goes through these so the engine can be driven without a mount.
+   Return values follow fuse: 0 or a byte count on success, -errno on failure.
+*/
+
+#include <sys/types.h>
+#include <sys/stat.h>
+#include "userfs.h"
+
+/* write "snapshot NAME", "delete NAME", "grow SIZE" or "trim" to it, read it for the list of snapshots */
+#define CTL_FILE "/.userfs_ctl"
+
+typedef int (*u_fill_dir_t)(void * buf, const char * name, const struct stat * stbuf, off_t offset);
+
+int u_mount(char * disk);
+int u_mount_snapshot(char * disk, const char * name);
+int u_unmount();
+
+int u_snapshot(const char * name);
+int u_delete_snapshot(const char * name);
+int u_grow(int64_t bytes);
+int u_shrink(int64_t bytes);
+
+int u_getattr(const char * path, struct stat * stbuf);
+int u_readdir(const char * path, void * buf, u_fill_dir_t filler, off_t offset);
+int u_open(const char * path);
+int u_read(const char * path, char * buf, size_t size, off_t offset);
+int u_write(const char * path, const char * buf, size_t size, off_t offset);
+int u_write_shared(const char * path, const char * buf, size_t size, off_t offset);
+int u_create(const char * path, mode_t mode);
+int u_truncate(const char * path, off_t offset);
+int u_unlink(const char * path);
+int u_rename(const char * oldpath, const char * newpath);
+int u_fsync(const char * path);
+int u_trim();
+
+DISK_LBA u_quota();
+
+#endif
@@ -0,0 +1,162 @@
+#include <stdio.h>
+#include <errno.h>
+#include <time.h>
+#include <sched.h>
+#include "userfs.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "inode.h"
+#include "sb.h"
+#include "crash.h"
+#include "crc.h"
+#include "recover.h"
+#include "reclaim.h"
+
+static bool background;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake = PTHREAD_COND_INITIALIZER;
+static bool woken; //an orphan came along since the reclaimer last looked
+
+void reclaim_set_background(bool on) {
+	background = on;
+}
+
+bool reclaim_background() {
+	return background;
+}
+
+/*
+   Whether unlink and truncate leave their blocks to the reclaimer now.
+   Not while recovery is active, it frees the inodes no entry names and
+   would take them off the list behind its back.
+*/
+bool reclaim_deferred() {
+	return background && !recovery_active();
+}
+
+static int blocks_for(int size) {
+	return (size + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+}
+
+/*
+   Writes in, an inode the caller owns and read as old, as an orphan with
+   what left to do. An inode already on the list stays where it is.
+   Returns 0 like update_inode.
+*/
+int orphan_inode(int inode_number, const inode * old, inode * in, int what) {
+	if (!old->orphan)
+		in->next_orphan = sb.orphan_head;
+	in->orphan = what;
+	if (!update_inode(inode_number, old, in))
+		return 0;
+	if (!old->orphan)
+		sb.orphan_head = inode_number + 1;
+	reclaim_wake();
+	return 1;
+}
+
+/*
+   Frees the blocks past the size of a truncated orphan the caller owns
+   and writes it, before the file grows into them. It stays on the list,
+   the reclaimer finds nothing left to do. Returns 0 like update_inode.
+*/
+int reclaim_tail(int inode_number, inode * in) {
+	inode old = *in;
+	int keep = blocks_for(in->file_size_bytes);
+	if (in->no_blocks <= keep)
+		return 1;
+	in->last_modified = inode_time(inode_number, &old);
+	while (in->no_blocks > keep)
+		release_block(in->blocks[--in->no_blocks]);
+	if (!update_inode(inode_number, &old, in))
+		return 0;
+	write_bitmap();
+	return 1;
+}
+
+/*
+   Frees up to blocks blocks of the orphan at the head of the list, and
+   the orphan itself once nothing is left. Returns whether there is more
+   to do, false also when nothing can be done now.
+*/
+bool reclaim_step(int blocks) {
+	inode in, old;
+	int ino, keep;
+	if (sb.orphan_head == 0 || recovery_active())
+		return false;
+	ino = sb.orphan_head - 1;
+	if (ino >= MAX_INODES || !read_inode(ino, &in) || !in.in_use || !in.orphan) {
+		//the rest of the list is lost, the failure has the next mount run recovery, which finds the orphans by their flag
+		checksum_failed("orphan list", ino);
+		sb.orphan_head = 0;
+		return false;
+	}
+	//there is no room to copy an inode block a snapshot shares, it waits for some
+	if (!own_inode(ino, true))
+		return false;
+	old = in;
+	//the time is the file's, not the reclaimer's
+	in.last_modified = inode_time(ino, &old);
+	keep = in.orphan == ORPHAN_UNLINKED ? 0 : blocks_for(in.file_size_bytes);
+	for (; blocks > 0 && in.no_blocks > keep; blocks--)
+		release_block(in.blocks[--in.no_blocks]);
+	if (in.no_blocks > keep) {
+		update_inode(ino, &old, &in);
+	} else {
+		sb.orphan_head = in.next_orphan;
+		if (in.orphan == ORPHAN_UNLINKED) {
+			release_inode(ino, &in);
+		} else {
+			in.orphan = 0;
+			in.next_orphan = 0;
+			update_inode(ino, &old, &in);
+		}
+	}
+	crash_point("reclaim:inode_written");
+	write_bitmap();
+	return sb.orphan_head != 0;
+}
+
+/* frees everything on the list, for when the space or the inodes are needed now */
+void reclaim_all() {
+	while (reclaim_step(MAX_BLOCKS_PER_FILE))
+		;
+}
+
+/* wakes the reclaimer, a wake before it waits is kept for it */
+void reclaim_wake() {
+	pthread_mutex_lock(&wake_lock);
+	woken = true;
+	pthread_cond_signal(&wake);
+	pthread_mutex_unlock(&wake_lock);
+}
+
+/*
+   The background thread, it holds lock for each step and lets go of it
+   to wait for new orphans, or a second at a time while recovery holds
+   them back
+*/
+void reclaim_run(pthread_rwlock_t * lock, const bool * stop) {
+	struct timespec until;
+	pthread_rwlock_wrlock(lock);
+	while (!__atomic_load_n(stop, __ATOMIC_RELAXED)) {
+		if (reclaim_step(RECLAIM_STEP_BLOCKS)) {
+			//the operations waiting get the engine between the steps
+			pthread_rwlock_unlock(lock);
+			sched_yield();
+			pthread_rwlock_wrlock(lock);
+			continue;
+		}
+		pthread_rwlock_unlock(lock);
+		clock_gettime(CLOCK_REALTIME, &until);
+		until.tv_sec++;
+		pthread_mutex_lock(&wake_lock);
+		while (!woken && !__atomic_load_n(stop, __ATOMIC_RELAXED)
+				&& pthread_cond_timedwait(&wake, &wake_lock, &until) != ETIMEDOUT)
+			;
+		woken = false;
+		pthread_mutex_unlock(&wake_lock);
+		pthread_rwlock_wrlock(lock);
+	}
+	pthread_rwlock_unlock(lock);
+}
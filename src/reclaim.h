@@ -0,0 +1,32 @@
+#ifndef U_RECLAIM
+#define U_RECLAIM
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "userfs.h"
+#include "inode.h"
+
+#define RECLAIM_STEP_BLOCKS 32 //blocks freed for each hold of the engine
+
+/*
+   Unlink and truncate leave the blocks they drop to a reclaimer. The
+   inode goes on the orphan list, linked through the inodes from the
+   superblock, and the call returns. The reclaimer frees the blocks of
+   the inode at the head of the list a batch at a time, from the last,
+   writing the inode after each batch, then frees the inode of an
+   unlinked file or takes a truncated one off the list. New orphans go on
+   at the head, so only the head ever leaves the list. The head is written
+   with the superblock at unmount. After a crash the list is not trusted,
+   recovery finishes every inode flagged as an orphan instead.
+*/
+void reclaim_set_background(bool on);
+bool reclaim_background();
+bool reclaim_deferred();
+int orphan_inode(int inode_number, const inode * old, inode * in, int what);
+int reclaim_tail(int inode_number, inode * in);
+bool reclaim_step(int blocks);
+void reclaim_all();
+void reclaim_wake();
+void reclaim_run(pthread_rwlock_t * lock, const bool * stop);
+
+#endif
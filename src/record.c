@@ -0,0 +1,73 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <time.h>
+#include "stats.h"
+#include "record.h"
+
+#define RECORD_BUFFER (1024 * 1024)
+
+bool recording = false;
+
+static FILE * record_file;
+static uint64_t record_start;
+static pthread_mutex_t record_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int record_open(const char * file_name) {
+	record_file_header header;
+
+	if ((record_file = fopen(file_name, "wb")) == NULL) {
+		fprintf(stderr, "Unable to open record file %s\n", file_name);
+		return 0;
+	}
+	setvbuf(record_file, NULL, _IOFBF, RECORD_BUFFER);
+
+	header.magic = RECORD_MAGIC;
+	header.start_time = time(NULL);
+	fwrite(&header, sizeof(header), 1, record_file);
+
+	record_start = stats_now();
+	recording = true;
+	return 1;
+}
+
+/* 
+   Appends one request to the trace. Requests from different fuse threads
+   are serialized by the mutex, which is only taken while recording.
+*/
+void record_op(int op, const char * path, const char * new_path, off_t offset, size_t size,
+		uint64_t start_ns, int result) {
+	record rec;
+	uint64_t now = stats_now();
+
+	memset(&rec, 0, sizeof(rec));
+	rec.start_ns = start_ns - record_start;
+	rec.duration_ns = now - start_ns;
+	rec.offset = offset;
+	rec.size = size;
+	rec.result = result;
+	rec.op = op;
+	rec.path_len = path ? strnlen(path, UINT8_MAX) : 0;
+	rec.new_path_len = new_path ? strnlen(new_path, UINT8_MAX) : 0;
+
+	pthread_mutex_lock(&record_mutex);
+	if (record_file != NULL) {
+		fwrite(&rec, sizeof(rec), 1, record_file);
+		fwrite(path, 1, rec.path_len, record_file);
+		fwrite(new_path, 1, rec.new_path_len, record_file);
+	}
+	pthread_mutex_unlock(&record_mutex);
+}
+
+void record_close() {
+	pthread_mutex_lock(&record_mutex);
+	recording = false;
+	if (record_file != NULL) {
+		fclose(record_file);
+		record_file = NULL;
+	}
+	pthread_mutex_unlock(&record_mutex);
+}
@@ -0,0 +1,39 @@
+#ifndef U_RECORD
+#define U_RECORD
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <sys/types.h>
+
+#define RECORD_MAGIC 0x31434552534655ULL //"UFSREC1"
+
+/* 
+   An operation trace is a record_file_header followed by one record per
+   fuse request, each followed by path_len bytes of path and new_path_len
+   bytes of the rename target. Paths are not NUL terminated.
+*/
+typedef struct record_file_header_s {
+	uint64_t magic;
+	uint64_t start_time; //wall clock seconds when recording started
+} record_file_header;
+
+typedef struct record_s {
+	uint64_t start_ns; //since recording started
+	int64_t offset;
+	uint32_t duration_ns;
+	uint32_t size;
+	int32_t result;
+	uint8_t op; //a stat_id from stats.h
+	uint8_t path_len;
+	uint8_t new_path_len;
+	uint8_t pad;
+} record;
+
+extern bool recording;
+
+int record_open(const char * file_name);
+void record_op(int op, const char * path, const char * new_path, off_t offset, size_t size,
+	uint64_t start_ns, int result);
+void record_close();
+
+#endif
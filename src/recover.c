@@ -0,0 +1,390 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "userfs.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "group.h"
+#include "imap.h"
+#include "inode.h"
+#include "dir.h"
+#include "snap.h"
+#include "sb.h"
+#include "stats.h"
+#include "trace.h"
+#include "util.h"
+#include "recover.h"
+
+static bool background;
+
+/* what recovery knows so far, only while it is active */
+static struct {
+	bool active;
+	bool prepared;
+	bool busy; //in recovery itself, its own allocations do not finish it again
+	int next; //inode table blocks before this one are checked
+	int left; //inode table blocks not checked yet
+	bool * checked; //of each inode table block
+	bool * live; //inodes in use, as checked or since released
+	int * cut; //blocks a file keeps, -1 when it keeps them all
+	BIT_FIELD * reserved; //metadata and directory nodes as they were at the mount
+	BIT_FIELD * owned; //the blocks of the inodes checked and those handed out since
+	uint64_t start_ns;
+	int repaired;
+} rec;
+
+void recovery_set_background(bool on) {
+	background = on;
+}
+
+bool recovery_background() {
+	return background;
+}
+
+bool recovery_active() {
+	return rec.active;
+}
+
+/*
+   Called by the mount instead of u_fsck. The group free inode counts are
+   rebuilt from the table as it is checked, the rest waits for the first
+   call that needs it.
+*/
+void recovery_start() {
+	int g, i;
+	memset(&rec, 0, sizeof(rec));
+	rec.active = true;
+	rec.left = sb.num_inode_blocks;
+	rec.checked = calloc(sb.num_inode_blocks, sizeof(bool));
+	rec.live = calloc(MAX_INODES, sizeof(bool));
+	rec.cut = malloc(MAX_INODES * sizeof(int));
+	for (i = 0; i < MAX_INODES; i++)
+		rec.cut[i] = -1;
+	for (g = 0; g < sb.num_groups; g++) {
+		groups[g].free_inodes = 0;
+		mark_group_dirty(g);
+	}
+	rec.start_ns = stats_now();
+}
+
+/*
+   The blocks no file can use, read when they are first needed. Those and
+   the snapshots' blocks are set in the bitmap at once, which may have
+   lost them, and a snapshot's block is not written in place.
+*/
+static void prepare() {
+	size_t w, words = (size_t)sb.num_groups * BIT_MAP_SIZE;
+	BIT_FIELD * held;
+	DISK_LBA b;
+	if (rec.prepared)
+		return;
+	rec.busy = true;
+	rec.reserved = metadata_map();
+	mark_dir_nodes(rec.reserved);
+	rec.owned = calloc(words, sizeof(BIT_FIELD));
+	held = calloc(words, sizeof(BIT_FIELD));
+	mark_snapshots(held);
+	//a word at a time, the blocks of almost every word are as they should be
+	for (w = 0; w < words; w++) {
+		if (((rec.reserved[w] | held[w]) & ~bit_map[w]) == 0 && (held[w] & fresh_map[w]) == 0)
+			continue;
+		for (b = w * BITS_PER_FIELD; b < (w + 1) * BITS_PER_FIELD; b++) {
+			//a group's own metadata and the blocks past the end of the disk are not counted, a map
+			//lost while the disk was resized has their bits clear
+			if (b < group_first_data_block(group_of(b)) || b >= sb.disk_size_blocks) {
+				SET_USED(bit_map, b);
+				continue;
+			}
+			if ((USED(rec.reserved, b) || USED(held, b)) && !block_in_use(b))
+				allocate_block(b);
+			if (USED(held, b) && block_fresh(b))
+				set_fresh(b, false);
+		}
+	}
+	free(held);
+	rec.prepared = true;
+	rec.busy = false;
+}
+
+/*
+   Checks the inodes of table block k as fsck does: a block out of range,
+   metadata or already another file's cuts the file off before it, which
+   is done once the whole table is checked. The blocks kept are set in the
+   bitmap, which may have lost them. Orphans are finished on the way.
+*/
+static void check_block(int k) {
+	inode slice[MAX_BLOCK_SIZE / sizeof(inode)];
+	int i, j, ino, keep, free_count = 0;
+	bool sealed;
+	DISK_LBA blk;
+
+	rec.busy = true;
+	read_block(inode_map[k], slice, BLOCK_SIZE_BYTES);
+	for (i = 0; i < INODES_PER_BLOCK; i++) {
+		inode * in = &slice[i];
+		ino = k * INODES_PER_BLOCK + i;
+		if (!in->in_use) {
+			free_count++;
+			continue;
+		}
+		sealed = inode_sealed(ino, in);
+		//an unlink the crash cut short is finished, an entry still naming the inode is dropped
+		if (sealed && in->orphan == ORPHAN_UNLINKED) {
+			fprintf(stderr, "Inode %d was being unlinked, freed\n", ino);
+			release_inode(ino, in);
+			rec.repaired++;
+			continue;
+		}
+		rec.live[ino] = true;
+		if (in->no_blocks < 0 || in->no_blocks > MAX_BLOCKS_PER_FILE)
+			in->no_blocks = 0;
+		keep = in->no_blocks;
+		//and so is a truncate, the blocks past the size are not kept
+		if (sealed && in->orphan == ORPHAN_TRUNCATED && in->file_size_bytes >= 0
+				&& (in->file_size_bytes + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES < keep)
+			keep = (in->file_size_bytes + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+		for (j = 0; j < keep; j++) {
+			blk = in->blocks[j];
+			if (blk < 0 || blk >= sb.disk_size_blocks || USED(rec.reserved, blk) || USED(rec.owned, blk))
+				break;
+			SET_USED(rec.owned, blk);
+			if (!block_in_use(blk)) {
+				TRACE(TRACE_DEBUG, T_FSCK_BLOCK_USED, ino, 0, 0, blk);
+				allocate_block(blk);
+			}
+		}
+		if (j < in->no_blocks || in->file_size_bytes > j * BLOCK_SIZE_BYTES
+				|| in->file_size_bytes < 0 || !sealed || in->orphan) {
+			fprintf(stderr, "Inode %d kept to %d blocks\n", ino, j);
+			rec.cut[ino] = j;
+			rec.repaired++;
+		}
+	}
+	groups[group_of(inode_map[k])].free_inodes += free_count;
+	mark_group_dirty(group_of(inode_map[k]));
+	rec.checked[k] = true;
+	rec.left--;
+	rec.busy = false;
+}
+
+/* checks the rest of the table, which is safe in the middle of an operation */
+static void check_all() {
+	int k;
+	prepare();
+	for (k = 0; k < sb.num_inode_blocks && rec.left > 0; k++) {
+		if (!rec.checked[k])
+			check_block(k);
+	}
+}
+
+/*
+   Writes an inode whose blocks could not all be kept cut short, which
+   only drops references and can be done at any time. The blocks cut off
+   are freed with the others nothing uses.
+*/
+static void cut_inode(int inode_number) {
+	inode in;
+	int keep = rec.cut[inode_number];
+	rec.cut[inode_number] = -1;
+	read_inode(inode_number, &in);
+	if (!in.in_use)
+		return;
+	in.no_blocks = keep;
+	if (in.file_size_bytes > keep * BLOCK_SIZE_BYTES || in.file_size_bytes < 0)
+		in.file_size_bytes = keep * BLOCK_SIZE_BYTES;
+	//the orphan list was dropped at the mount
+	in.orphan = 0;
+	in.next_orphan = 0;
+	write_inode(inode_number, &in);
+}
+
+/*
+   Drops the entries of freed inodes and the second name of an inode,
+   then frees the inodes no entry names. Returns the entries kept, or -1
+   when the directory itself is damaged.
+*/
+static int64_t settle_names() {
+	int64_t e, count, kept = 0;
+	bool * named = calloc(MAX_INODES, sizeof(bool));
+	dir_entry * entries;
+	int problems, i, j;
+	inode in;
+
+	entries = collect_dir(&count, NULL, &problems);
+	if (problems) {
+		free(entries);
+		free(named);
+		return -1;
+	}
+	for (e = 0; e < count; e++) {
+		i = entries[e].inode_number;
+		if (i < 0 || i >= MAX_INODES || !rec.live[i] || named[i]) {
+			fprintf(stderr, "File '%s' has a bad, free or shared inode. Deleting.\n", entries[e].file_name);
+			dir_remove_entry(entries[e].file_name);
+			rec.repaired++;
+			continue;
+		}
+		named[i] = true;
+		kept++;
+	}
+	for (i = 0; i < MAX_INODES; i++) {
+		if (!rec.live[i] || named[i] || !read_inode(i, &in) || !in.in_use)
+			continue;
+		//its blocks are freed with the others nothing uses
+		for (j = 0; j < in.no_blocks; j++) {
+			if (in.blocks[j] >= 0 && in.blocks[j] < sb.disk_size_blocks)
+				rec.owned[in.blocks[j] / BITS_PER_FIELD] &= ~(1U << (in.blocks[j] % BITS_PER_FIELD));
+		}
+		TRACE(TRACE_DEBUG, T_FSCK_INODE_FREED, i, 0, 0, -1);
+		release_inode(i, &in);
+		rec.repaired++;
+	}
+	free(entries);
+	free(named);
+	return kept;
+}
+
+/*
+   Frees the blocks in use that nothing uses, keeps the snapshots' blocks,
+   and counts the free blocks of every group again
+*/
+static void settle_blocks() {
+	size_t w, words = (size_t)sb.num_groups * BIT_MAP_SIZE;
+	BIT_FIELD * held = calloc(words, sizeof(BIT_FIELD));
+	BIT_FIELD * live = metadata_map();
+	DISK_LBA b;
+	int g;
+
+	mark_snapshots(held);
+	mark_dir_nodes(live);
+	for (w = 0; w < words; w++)
+		live[w] |= rec.owned[w];
+	if (sb.num_snapshots > 0)
+		set_fresh_map(live, held);
+	for (g = 0; g < sb.num_groups; g++) {
+		mark_bitmap_dirty(g);
+		for (b = group_first_data_block(g); b < group_end(g); b++) {
+			if (block_in_use(b) && !USED(live, b) && !USED(held, b)) {
+				TRACE(TRACE_DEBUG, T_FSCK_BLOCK_FREED, -1, 0, 0, b);
+				free_block(b);
+				rec.repaired++;
+			}
+			//blocks the bitmap lost are set already, the snapshots' are kept
+			if (USED(held, b) && !block_in_use(b))
+				allocate_block(b);
+		}
+	}
+	//free_block and allocate_block counted from counts that were off
+	sb.num_free_blocks = 0;
+	for (g = 0; g < sb.num_groups; g++) {
+		groups[g].free_blocks = 0;
+		for (b = group_first_data_block(g); b < group_end(g); b++)
+			groups[g].free_blocks += !block_in_use(b);
+		sb.num_free_blocks += groups[g].free_blocks;
+	}
+	free(held);
+	free(live);
+}
+
+/*
+   Checks the rest of the table and puts right what it found. It changes
+   the directory and inodes other than the caller's, so it is only called
+   between operations or before an operation has read anything.
+*/
+void recovery_finish() {
+	int64_t kept;
+	int i;
+	if (!rec.active || rec.busy)
+		return;
+	check_all();
+	for (i = 0; i < MAX_INODES; i++) {
+		if (rec.cut[i] >= 0)
+			cut_inode(i);
+	}
+	rec.busy = true;
+	if ((kept = settle_names()) < 0) {
+		//a damaged directory is rebuilt by the full check, which needs nothing from here
+		fprintf(stderr, "The directory is damaged, u_fsck in progress......\n");
+		rec.active = false;
+		u_fsck();
+	} else {
+		sb.dir_entries = kept;
+		settle_blocks();
+		reset_inode_hints();
+		write_bitmap();
+		seal_inode_map();
+		write_superblock();
+	}
+	note_checked_failures();
+	fprintf(stderr, "Recovery complete in the background, %d repairs in %.3f seconds\n",
+		rec.repaired, (stats_now() - rec.start_ns) / 1e9);
+	free(rec.checked);
+	free(rec.live);
+	free(rec.cut);
+	free(rec.reserved);
+	free(rec.owned);
+	memset(&rec, 0, sizeof(rec));
+}
+
+/*
+   Before an operation uses an inode it reached by a name. Checks the
+   inode's block of the table when that has not been done and cuts the
+   inode short when it has to be, returns whether the inode is a file.
+   The directory is left alone, the caller may be walking it.
+*/
+bool recovery_check(int inode_number) {
+	if (!rec.active || rec.busy)
+		return true;
+	if (inode_number < 0 || inode_number >= MAX_INODES)
+		return false;
+	prepare();
+	if (!rec.checked[inode_number / INODES_PER_BLOCK])
+		check_block(inode_number / INODES_PER_BLOCK);
+	if (rec.cut[inode_number] >= 0)
+		cut_inode(inode_number);
+	return rec.live[inode_number];
+}
+
+/* blocks are only handed out once no unchecked inode can be using them */
+void recovery_allocating() {
+	if (rec.active && !rec.busy && rec.left > 0)
+		check_all();
+}
+
+/* a block handed out while recovery is active is not one nothing uses */
+void recovery_taken(DISK_LBA block) {
+	if (rec.active && rec.owned != NULL)
+		SET_USED(rec.owned, block);
+}
+
+void recovery_released(int inode_number) {
+	if (rec.active)
+		rec.live[inode_number] = false;
+}
+
+/* checks up to blocks more blocks of the table, finishing after the last, returns whether there is more */
+bool recovery_step(int blocks) {
+	if (!rec.active)
+		return false;
+	prepare();
+	for (; blocks > 0 && rec.next < sb.num_inode_blocks; rec.next++) {
+		if (!rec.checked[rec.next]) {
+			check_block(rec.next);
+			blocks--;
+		}
+	}
+	if (rec.left == 0)
+		recovery_finish();
+	return rec.active;
+}
+
+/* the background thread, it takes lock for each step so the operations go on in between */
+void recovery_run(pthread_rwlock_t * lock, const bool * stop) {
+	bool more = true;
+	while (more && !__atomic_load_n(stop, __ATOMIC_RELAXED)) {
+		pthread_rwlock_wrlock(lock);
+		more = recovery_step(RECOVERY_STEP_BLOCKS);
+		pthread_rwlock_unlock(lock);
+	}
+}
@@ -0,0 +1,32 @@
+#ifndef U_RECOVER
+#define U_RECOVER
+
+#include <stdbool.h>
+#include <pthread.h>
+#include "userfs.h"
+
+#define RECOVERY_STEP_BLOCKS 64 //inode table blocks checked for each hold of the engine
+
+/*
+   Recovery after an unclean shutdown without holding up the mount. The
+   inode table is checked a few blocks at a time in the background, and
+   an operation on a file whose inode has not been checked yet checks
+   its block of the table first. Nothing is allocated until the whole
+   table has been checked, the first allocation finishes the check
+   itself, because an unchecked inode may use a block the bitmap on
+   disk says is free. What is left, orphaned inodes, entries of freed
+   inodes and blocks nothing uses, is put right once the table is done.
+*/
+void recovery_set_background(bool on);
+bool recovery_background();
+void recovery_start();
+bool recovery_active();
+bool recovery_check(int inode_number);
+void recovery_allocating();
+void recovery_taken(DISK_LBA block);
+void recovery_released(int inode_number);
+bool recovery_step(int blocks);
+void recovery_finish();
+void recovery_run(pthread_rwlock_t * lock, const bool * stop);
+
+#endif
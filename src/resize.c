@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "userfs.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "group.h"
+#include "inode.h"
+#include "imap.h"
+#include "dir.h"
+#include "sb.h"
+#include "disk.h"
+#include "crash.h"
+#include "recover.h"
+#include "reclaim.h"
+#include "resize.h"
+
+/* the groups a disk of blocks blocks has, a last group too small for any data is left off as at format */
+static int groups_for(DISK_LBA * blocks) {
+	int count = (*blocks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+	//a group's bitmap and fresh map come first, group 0 has more in front of them
+	DISK_LBA first = count == 1 ? group_first_data_block(0) : group_start(count - 1) + 2;
+	if (count > 1 && *blocks <= first)
+		*blocks = group_start(--count);
+	return count;
+}
+
+/*
+   Grows the mounted disk to disk_bytes. The caller holds the engine, the
+   maps move while the groups are added. Once the free counts are raised
+   claim_block hands out the new blocks, the superblock is written after
+   the bitmaps and descriptors of the new groups, so a crash before it
+   leaves the disk its old size.
+*/
+int resize_grow(int64_t disk_bytes) {
+	DISK_LBA end = disk_bytes / BLOCK_SIZE_BYTES, old_end = sb.disk_size_blocks, added;
+	int count = groups_for(&end);
+
+	if (end <= old_end)
+		return -EINVAL;
+	if (count > (int64_t)sb.gdt_blocks * GROUP_DESCS_PER_BLOCK) {
+		fprintf(stderr, "The disk was formatted to grow to %ld groups, %d would not fit\n",
+			(int64_t)sb.gdt_blocks * GROUP_DESCS_PER_BLOCK, count);
+		return -EFBIG;
+	}
+	//recovery keeps maps the size of the disk
+	recovery_finish();
+	if (!disk_resize((int64_t)end * BLOCK_SIZE_BYTES))
+		return -EIO;
+
+	grow_bit_map(count);
+	grow_inode_groups(count);
+	added = extend_groups(count, end);
+	__atomic_store_n(&sb.disk_size_blocks, end, __ATOMIC_RELEASE);
+	__atomic_store_n(&sb.num_groups, count, __ATOMIC_RELEASE);
+	__atomic_add_fetch(&sb.num_free_blocks, added, __ATOMIC_RELAXED);
+
+	write_bitmap();
+	crash_point("resize:groups_written");
+	disk_write_labels();
+	write_superblock();
+	sync_blocks();
+	disk_drop_labels((int64_t)old_end * BLOCK_SIZE_BYTES);
+	return 0;
+}
+
+/*
+   Copies the blocks of a file at end and past it to free blocks before
+   it, near the blocks it has there, and writes the inode. The old blocks
+   stay allocated. Returns 0 when there is no room.
+*/
+static int move_file(int inode_number, DISK_LBA end) {
+	static char data[MAX_BLOCKS_PER_FILE * MAX_BLOCK_SIZE];
+	block_io ios[MAX_BLOCKS_PER_FILE];
+	inode in, old;
+	DISK_LBA goal = 0;
+	int b, n = 0;
+
+	if (!read_inode(inode_number, &in) || !in.in_use)
+		return 1;
+	old = in;
+	for (b = 0; b < in.no_blocks; b++) {
+		if (in.blocks[b] >= end) {
+			if ((in.blocks[b] = claim_block(goal)) < 0) {
+				while (--b >= 0) {
+					if (old.blocks[b] >= end)
+						free_block(in.blocks[b]);
+				}
+				return 0;
+			}
+			ios[n] = (block_io){ old.blocks[b], 0, BLOCK_SIZE_BYTES, data + (size_t)n * BLOCK_SIZE_BYTES };
+			n++;
+		}
+		goal = in.blocks[b] + 1;
+	}
+	if (n == 0)
+		return 1;
+	read_blocks(ios, n);
+	for (b = 0, n = 0; b < in.no_blocks; b++) {
+		if (old.blocks[b] >= end)
+			ios[n++].block = in.blocks[b];
+	}
+	write_blocks(ios, n);
+	crash_point("resize:data_copied");
+
+	//the contents and their checksums are the same, and so is the time
+	in.last_modified = inode_time(inode_number, &old);
+	return update_inode(inode_number, &old, &in);
+}
+
+/*
+   Builds the directory again in free blocks before end when a node of it
+   is at end or past it, then frees the old nodes before end
+*/
+static int move_dir(DISK_LBA end) {
+	size_t words = (size_t)sb.num_groups * BIT_MAP_SIZE;
+	BIT_FIELD * nodes = calloc(words, sizeof(BIT_FIELD)), * used;
+	dir_entry * entries;
+	int64_t count;
+	DISK_LBA b;
+	int ok = 1;
+
+	entries = collect_dir(&count, nodes, NULL);
+	for (b = end; b < sb.disk_size_blocks && !USED(nodes, b); b++)
+		;
+	if (b < sb.disk_size_blocks) {
+		used = malloc(words * sizeof(BIT_FIELD));
+		memcpy(used, bit_map, words * sizeof(BIT_FIELD));
+		if ((ok = rebuild_dir(entries, count, used, nodes))) {
+			for (b = 0; b < sb.disk_size_blocks; b++) {
+				if (USED(used, b) && !block_in_use(b))
+					allocate_block(b);
+				else if (USED(nodes, b) && b < end)
+					free_block(b);
+			}
+		}
+		free(used);
+	}
+	free(entries);
+	free(nodes);
+	return ok;
+}
+
+/* marks the free blocks from end on used, in fence too, so nothing moved lands there */
+static void fence_tail(DISK_LBA end, BIT_FIELD * fence) {
+	DISK_LBA b;
+	for (b = end; b < sb.disk_size_blocks; b++) {
+		if (!block_in_use(b)) {
+			SET_USED(fence, b);
+			SET_USED(bit_map, b);
+		}
+	}
+}
+
+static void drop_fence(BIT_FIELD * fence) {
+	size_t w;
+	for (w = 0; w < (size_t)sb.num_groups * BIT_MAP_SIZE; w++)
+		bit_map[w] &= ~fence[w];
+}
+
+/*
+   Shrinks the unmounted disk to disk_bytes. Every block in use from the
+   new end on is copied before it: inode table and map blocks, directory
+   nodes and file data, each linked in once it is written, as defrag and
+   copy on write do. The superblock with the new size goes after the
+   bitmaps, the image files are cut back last. A crash on the way leaves
+   the disk its old size, with copies recovery frees.
+*/
+int resize_shrink(int64_t disk_bytes) {
+	DISK_LBA end = disk_bytes / BLOCK_SIZE_BYTES, old_end = sb.disk_size_blocks;
+	int count = groups_for(&end), i, ok;
+	BIT_FIELD * fence;
+
+	if (end >= old_end || end <= group_first_data_block(0))
+		return -EINVAL;
+	//a snapshot holds blocks where they are
+	if (sb.num_snapshots > 0)
+		return -EBUSY;
+	recovery_finish();
+	reclaim_all();
+
+	fence = calloc((size_t)sb.num_groups * BIT_MAP_SIZE, sizeof(BIT_FIELD));
+	fence_tail(end, fence);
+	ok = move_inode_map(end) && move_dir(end);
+	for (i = 0; ok && i < MAX_INODES; i++)
+		ok = move_file(i, end);
+	if (!ok) {
+		//what moved stays moved, the disk keeps its size
+		drop_fence(fence);
+		free(fence);
+		write_bitmap();
+		return -ENOSPC;
+	}
+	free(fence);
+	write_bitmap();
+	crash_point("resize:blocks_moved");
+
+	sb.num_groups = count;
+	sb.disk_size_blocks = end;
+	sb.num_free_blocks = cut_groups(count, end);
+	write_bitmap();
+	disk_write_labels();
+	write_superblock();
+	sync_blocks();
+	crash_point("resize:superblock_written");
+	disk_resize((int64_t)end * BLOCK_SIZE_BYTES);
+	return 0;
+}
@@ -0,0 +1,20 @@
+#ifndef U_RESIZE
+#define U_RESIZE
+
+#include <stdint.h>
+#include "userfs.h"
+
+/*
+   A mounted disk grows in place: the image files are extended, the last
+   group gets the blocks up to the new end and new groups are laid out
+   after it, with descriptors in the table blocks reserved at format.
+   Allocation sees the new space as soon as the free counts are raised,
+   the superblock with the new size is written last. A disk is shrunk
+   unmounted, with no snapshots: everything at the new end or past it is
+   copied to free blocks before it first, then the groups are cut back
+   and the image files after the superblock. Both return 0 or -errno.
+*/
+int resize_grow(int64_t disk_bytes);
+int resize_shrink(int64_t disk_bytes);
+
+#endif
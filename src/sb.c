@@ -1,34 +1,95 @@
 #include <stdbool.h>
 #include <time.h>
+#include <limits.h>
 #include "userfs.h"
 #include "blocks.h"
 #include "inode.h"
 #include "file.h"
 #include "dir.h"
+#include "group.h"
+#include "imap.h"
 #include "sb.h"
+#include "crc.h"
 #include "stdbool.h"
 
+superblock sb;
+
 int superblockMatchesCode() {
-	return   (sb.size_of_super_block == sizeof(superblock))
-		&& (sb.size_of_directory == sizeof (dir_struct))
+	//the block size has to be checked first, the geometry below depends on it
+	return   valid_block_size(sb.block_size_bytes)
+		&& (sb.size_of_super_block == sizeof(superblock))
+		&& (sb.size_of_directory == sizeof (dir_entry))
 		&& (sb.size_of_inode == sizeof(inode))
-		&& (sb.block_size_bytes == BLOCK_SIZE_BYTES)
+		&& (sb.size_of_group_desc == sizeof(group_desc))
 		&& (sb.max_file_name_size == MAX_FILE_NAME_SIZE)
-		&& (sb.max_blocks_per_file == MAX_BLOCKS_PER_FILE);
+		&& (sb.max_blocks_per_file == MAX_BLOCKS_PER_FILE)
+		&& (sb.blocks_per_group == BLOCKS_PER_GROUP);
 }
 
-void init_superblock(int diskSizeBytes) {
+/* 
+   Fills in the sizes and the group layout, init_groups finishes the
+   layout and the free counts once the group descriptors exist
+*/
+void init_superblock(int64_t diskSizeBytes, int blockSize, int bytesPerInode, bool growInodes, int64_t maxSizeBytes) {
+	int64_t inodeBlocks, maxInodeBlocks, maxGroups;
+
+	sb.block_size_bytes = blockSize;
 	sb.disk_size_blocks  = diskSizeBytes/BLOCK_SIZE_BYTES;
-	sb.num_free_blocks = u_quota();
+	sb.num_free_blocks = 0;
 	
 	//changed temporarily because this clean_shutdown thing doesn't work correctly
 	sb.clean_shutdown = 1;
 
 	sb.size_of_super_block = sizeof(superblock);
-	sb.size_of_directory = sizeof (dir_struct);
+	sb.size_of_directory = sizeof (dir_entry);
 	sb.size_of_inode = sizeof(inode);
+	sb.size_of_group_desc = sizeof(group_desc);
 
-	sb.block_size_bytes = BLOCK_SIZE_BYTES;
 	sb.max_file_name_size = MAX_FILE_NAME_SIZE;
 	sb.max_blocks_per_file = MAX_BLOCKS_PER_FILE;
+
+	sb.data_checksums = false;
+	sb.meta_disk = false;
+	sb.orphan_head = 0;
+
+	//no snapshots, so no fresh maps are kept
+	sb.generation = 0;
+	sb.num_snapshots = 0;
+
+	sb.blocks_per_group = BLOCKS_PER_GROUP;
+	sb.num_groups = (sb.disk_size_blocks + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+	sb.gdt_blocks = (sb.num_groups + GROUP_DESCS_PER_BLOCK - 1) / GROUP_DESCS_PER_BLOCK;
+	//descriptor blocks for the groups of a disk grown to maxSizeBytes are reserved now, the inode map root follows them
+	maxGroups = (maxSizeBytes / blockSize + BLOCKS_PER_GROUP - 1) / BLOCKS_PER_GROUP;
+	if (maxGroups > (int64_t)(sb.gdt_blocks + MAX_GROW_GDT_BLOCKS) * GROUP_DESCS_PER_BLOCK)
+		maxGroups = (int64_t)(sb.gdt_blocks + MAX_GROW_GDT_BLOCKS) * GROUP_DESCS_PER_BLOCK;
+	if (maxGroups > sb.num_groups)
+		sb.gdt_blocks = (maxGroups + GROUP_DESCS_PER_BLOCK - 1) / GROUP_DESCS_PER_BLOCK;
+
+	//every group starts with an equal share of the inodes, at least a block
+	sb.bytes_per_inode = bytesPerInode;
+	sb.grow_inodes = growInodes;
+	inodeBlocks = (diskSizeBytes / bytesPerInode + INODES_PER_BLOCK - 1) / INODES_PER_BLOCK;
+	inodeBlocks = sb.num_groups ? (inodeBlocks + sb.num_groups - 1) / sb.num_groups : 1;
+	sb.inodes_per_group = (inodeBlocks > 0 ? inodeBlocks : 1) * INODES_PER_BLOCK;
+
+	//the root has room to map a table filling the disk, or INT_MAX inodes
+	maxInodeBlocks = sb.disk_size_blocks < INT_MAX / INODES_PER_BLOCK ? sb.disk_size_blocks : INT_MAX / INODES_PER_BLOCK;
+	sb.inode_root = GDT_BLOCK + sb.gdt_blocks;
+	sb.inode_root_blocks = imap_root_blocks(maxInodeBlocks);
+}
+
+/* reads the superblock, false when its checksum does not match */
+bool read_superblock() {
+	read_block(SUPERBLOCK_BLOCK, &sb, sizeof(superblock));
+	if (crc32c_sealed(&sb, sizeof(superblock), &sb.checksum) != sb.checksum) {
+		checksum_failed("superblock", SUPERBLOCK_BLOCK);
+		return false;
+	}
+	return true;
+}
+
+void write_superblock() {
+	sb.checksum = crc32c_sealed(&sb, sizeof(superblock), &sb.checksum);
+	write_block(SUPERBLOCK_BLOCK, &sb, sizeof(superblock));
 }
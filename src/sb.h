@@ -1,28 +1,94 @@
 #ifndef U_SB
 #define U_SB
 
+#include <stdbool.h>
+#include <time.h>
+#include "userfs.h"
+#include "crypt.h"
+
 #define SUPERBLOCK_BLOCK 0
+#define GDT_BLOCK 1 //group descriptor table follows the superblock
+#define MAX_SNAPSHOTS 16
+#define SNAPSHOT_NAME_SIZE 16
+#define GROW_FACTOR 1024 //times its size a disk can grow to, unless formatted with a limit
+#define MAX_GROW_GDT_BLOCKS 1024 //descriptor blocks reserved for growing at most
+
+/* a read only image of the file system, the roots it had when it was taken */
+typedef struct snapshot_desc_s {
+	char name[SNAPSHOT_NAME_SIZE];
+	uint32_t generation;
+	time_t created;
+	DISK_LBA dir_root;
+	int64_t dir_entries;
+	DISK_LBA inode_root; //copies of the inode map root blocks
+	int num_inode_blocks;
+} snapshot_desc;
 
 typedef struct superblock_s {
 	int size_of_super_block;
 	int size_of_directory;
 	int size_of_inode;
+	int size_of_group_desc;
 
-	int disk_size_blocks;
-	int num_free_blocks;
+	DISK_LBA disk_size_blocks;
+	DISK_LBA num_free_blocks;
 
 	int block_size_bytes;
 	int max_file_name_size;
 	int max_blocks_per_file;
 
+	/* block groups, each with its own bitmap block and inode slice */
+	int blocks_per_group;
+	int inodes_per_group;
+	int num_groups;
+	int gdt_blocks; //with room for the groups the disk can grow to
+
+	/* inode table, listed block by block in the inode map */
+	int bytes_per_inode;
+	int num_inode_blocks;
+	DISK_LBA inode_root;
+	int inode_root_blocks;
+	bool grow_inodes;
+
+	/* root of the directory B+tree, the count is exact after a clean shutdown or fsck */
+	DISK_LBA dir_root;
+	int64_t dir_entries;
+
+	/* snapshots share every block that was in use when they were taken */
+	uint32_t generation; //bumped by every snapshot
+	int num_snapshots;
+	snapshot_desc snapshots[MAX_SNAPSHOTS];
+
+	/* metadata is always checksummed, file data when formatted with data_checksums */
+	bool data_checksums;
+
+	/* the disk is striped over this many image files, a chunk at a time */
+	int stripe_members;
+	int stripe_chunk_bytes;
+	uint64_t stripe_id; //also in the label of every member
+
+	/* everything but file data is on a metadata image, the data image only has a copy of this from format time */
+	bool meta_disk;
+
+	/* every block but this one is enciphered with keys from a passphrase */
+	bool encrypted;
+	unsigned char crypt_salt[CRYPT_SALT_BYTES];
+	int crypt_iterations; //of PBKDF2
+	unsigned char crypt_check[CRYPT_CHECK_BYTES]; //a hash of the keys, to tell a wrong passphrase
+
+	/* files whose blocks the reclaimer has still to free, linked through their inodes */
+	int orphan_head; //the first inode on the list plus one, 0 when it is empty, only trusted after a clean shutdown
+
 	bool clean_shutdown; //if true can assume numFreeBlocks is valid
+	uint32_t checksum; //crc32c of the superblock with this field zeroed
 
 } superblock;
 
-superblock sb;
+extern superblock sb;
 
 int superblockMatchesCode();
-void init_superblock();
+void init_superblock(int64_t diskSizeBytes, int blockSize, int bytesPerInode, bool growInodes, int64_t maxSizeBytes);
+bool read_superblock();
+void write_superblock();
 
 #endif
-
@@ -0,0 +1,233 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include "userfs.h"
+#include "blocks.h"
+#include "bitmap.h"
+#include "group.h"
+#include "imap.h"
+#include "inode.h"
+#include "dir.h"
+#include "sb.h"
+#include "crypt.h"
+#include "crash.h"
+#include "trace.h"
+#include "disk.h"
+#include "snap.h"
+
+//the engine changes the list, getattr of the control file renders it without the engine
+static pthread_mutex_t list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static bool valid_snapshot_name(const char * name) {
+	size_t len = strlen(name);
+	return len > 0 && len < SNAPSHOT_NAME_SIZE && strpbrk(name, "/ \t\n") == NULL;
+}
+
+/* index of the snapshot called name or -1 */
+int snapshot_find(const char * name) {
+	int i;
+	for (i = 0; i < sb.num_snapshots; i++) {
+		if (strncmp(sb.snapshots[i].name, name, SNAPSHOT_NAME_SIZE) == 0)
+			return i;
+	}
+	return -1;
+}
+
+/*
+   Sets the bits of every block one view of the file system uses in map:
+   its inode map, directory nodes and the blocks of its files, and
+   returns how many files it has. Entries a lost write damaged before
+   the view was taken are skipped.
+*/
+static int64_t mark_view(DISK_LBA dir_root, DISK_LBA inode_root, int inode_blocks, BIT_FIELD * map) {
+	DISK_LBA * table = load_inode_map(inode_root, inode_blocks, map);
+	dir_entry * entries;
+	int64_t e, count;
+	inode in;
+	int j, ino;
+
+	if (table == NULL) {
+		fprintf(stderr, "snapshot: inode map under block %ld is damaged\n", inode_root);
+		return 0;
+	}
+	entries = collect_tree(dir_root, &count, map, NULL);
+	for (e = 0; e < count; e++) {
+		ino = entries[e].inode_number;
+		if (ino < 0 || ino >= inode_blocks * INODES_PER_BLOCK)
+			continue;
+		read_block_offset(table[ino / INODES_PER_BLOCK], &in, sizeof(inode),
+			(ino % INODES_PER_BLOCK) * sizeof(inode));
+		if (!in.in_use || in.no_blocks < 0 || in.no_blocks > MAX_BLOCKS_PER_FILE)
+			continue;
+		for (j = 0; j < in.no_blocks; j++) {
+			if (in.blocks[j] >= 0 && in.blocks[j] < sb.disk_size_blocks)
+				SET_USED(map, in.blocks[j]);
+		}
+	}
+	free(entries);
+	free(table);
+	return count;
+}
+
+/* 
+   Sets the bits of every block a snapshot holds in map. The file counts
+   are set to what the snapshots hold, a count taken from a live file
+   system that was not shut down cleanly can be off. Nothing else in a
+   snapshot is repaired, it stays as it was taken.
+*/
+void mark_snapshots(BIT_FIELD * map) {
+	int i;
+	for (i = 0; i < sb.num_snapshots; i++) {
+		snapshot_desc * s = &sb.snapshots[i];
+		s->dir_entries = mark_view(s->dir_root, s->inode_root, s->num_inode_blocks, map);
+	}
+}
+
+/*
+   Takes a snapshot of the live file system. Only the inode map root
+   blocks are copied, the directory root and everything below it are
+   shared by bumping the generation, which empties every group's fresh
+   map without touching it. Returns 0 or -errno.
+*/
+int snapshot_create(const char * name) {
+	snapshot_desc * s;
+	int i, roots = imap_used_roots(sb.num_inode_blocks);
+	DISK_LBA root;
+	char * data;
+
+	if (!valid_snapshot_name(name))
+		return -EINVAL;
+	if (snapshot_find(name) >= 0)
+		return -EEXIST;
+	//the snapshot gets the times still held in memory
+	flush_inode_times();
+	if (sb.num_snapshots == MAX_SNAPSHOTS || (root = find_free_run(0, roots)) < 0)
+		return -ENOSPC;
+
+	data = malloc(BLOCK_SIZE_BYTES);
+	for (i = 0; i < roots; i++) {
+		allocate_block(root + i);
+		read_block(sb.inode_root + i, data, BLOCK_SIZE_BYTES);
+		write_block(root + i, data, BLOCK_SIZE_BYTES);
+	}
+	free(data);
+	crash_point("snapshot:roots_copied");
+
+	pthread_mutex_lock(&list_lock);
+	s = &sb.snapshots[sb.num_snapshots];
+	memset(s, 0, sizeof(snapshot_desc));
+	strcpy(s->name, name);
+	s->generation = ++sb.generation;
+	s->created = time(NULL);
+	s->dir_root = sb.dir_root;
+	s->dir_entries = sb.dir_entries;
+	s->inode_root = root;
+	s->num_inode_blocks = sb.num_inode_blocks;
+	sb.num_snapshots++;
+	pthread_mutex_unlock(&list_lock);
+	write_superblock();
+	write_bitmap();
+	TRACE(TRACE_OP, T_SNAPSHOT, -1, s->generation, roots, root);
+	return 0;
+}
+
+/*
+   Drops a snapshot, then frees the blocks neither the live file system
+   nor another snapshot uses and works out which blocks the remaining
+   snapshots still share. A crash after the superblock is written leaves
+   those blocks to fsck. Returns 0 or -errno.
+*/
+int snapshot_delete(const char * name) {
+	size_t words = (size_t)sb.num_groups * BIT_MAP_SIZE;
+	BIT_FIELD * live, * held;
+	DISK_LBA b;
+	int i, g;
+
+	if ((i = snapshot_find(name)) < 0)
+		return -ENOENT;
+	pthread_mutex_lock(&list_lock);
+	memmove(&sb.snapshots[i], &sb.snapshots[i + 1], (sb.num_snapshots - i - 1) * sizeof(snapshot_desc));
+	sb.num_snapshots--;
+	pthread_mutex_unlock(&list_lock);
+	write_superblock();
+	crash_point("snapshot:deleted");
+
+	live = calloc(words, sizeof(BIT_FIELD));
+	held = calloc(words, sizeof(BIT_FIELD));
+	for (g = 0; g < sb.num_groups; g++)
+		mark_group_metadata(g, live);
+	mark_view(sb.dir_root, sb.inode_root, sb.num_inode_blocks, live);
+	mark_snapshots(held);
+	for (g = 0; g < sb.num_groups; g++) {
+		for (b = group_first_data_block(g); b < group_end(g); b++) {
+			if (block_in_use(b) && !USED(live, b) && !USED(held, b))
+				free_block(b);
+		}
+	}
+	if (sb.num_snapshots > 0)
+		set_fresh_map(live, held);
+	write_bitmap();
+	TRACE(TRACE_OP, T_SNAPSHOT_DELETE, -1, 0, 0, -1);
+	free(live);
+	free(held);
+	return 0;
+}
+
+/* one line per snapshot: name, generation, creation time and files */
+int snapshot_list(char * buf, int size) {
+	int i, len = 0;
+	pthread_mutex_lock(&list_lock);
+	len += snprintf(buf + len, size - len, "# name generation created files\n");
+	for (i = 0; i < sb.num_snapshots && len < size; i++) {
+		snapshot_desc * s = &sb.snapshots[i];
+		len += snprintf(buf + len, size - len, "%s %u %ld %ld\n",
+			s->name, s->generation, (int64_t)s->created, s->dir_entries);
+	}
+	pthread_mutex_unlock(&list_lock);
+	return len < size ? len : size - 1;
+}
+
+/*
+   Opens the disk read only and makes the named snapshot the file system
+   the engine sees. Nothing is written, so the live file system does not
+   have to be clean.
+*/
+int mount_snapshot(char * disk, const char * name) {
+	int i;
+	dir_unload();
+	if (!disk_open(disk, O_RDONLY)) {
+		fprintf(stderr, "Unable to open virtual disk %s\n", disk);
+		return 0;
+	}
+	read_superblock();
+	if (!superblockMatchesCode()) {
+		fprintf(stderr, "Unable to mount: userfs appears to have been formatted with another code version\n");
+		disk_close();
+		return 0;
+	}
+	if (!disk_check_stripe() || !disk_check_meta() || !crypt_mount()) {
+		disk_close();
+		return 0;
+	}
+	if ((i = snapshot_find(name)) < 0) {
+		fprintf(stderr, "No snapshot named %s\n", name);
+		disk_close();
+		return 0;
+	}
+	read_groups();
+	sb.dir_root = sb.snapshots[i].dir_root;
+	sb.dir_entries = sb.snapshots[i].dir_entries;
+	sb.inode_root = sb.snapshots[i].inode_root;
+	sb.num_inode_blocks = sb.snapshots[i].num_inode_blocks;
+	if (!read_inode_map()) {
+		fprintf(stderr, "Unable to mount: the inode map of snapshot %s is damaged\n", name);
+		disk_close();
+		return 0;
+	}
+	return 1;
+}
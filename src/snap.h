@@ -0,0 +1,23 @@
+#ifndef U_SNAP
+#define U_SNAP
+
+#include <stdbool.h>
+#include "userfs.h"
+#include "bitmap.h"
+
+#define SNAPSHOT_LIST_SIZE 2048
+
+/* 
+   A snapshot keeps the directory root and a copy of the inode map root
+   blocks of the moment it was taken. Every block in use then is shared
+   with the live file system, which copies a shared block before it
+   changes it and leaves the original to the snapshot.
+*/
+int snapshot_find(const char * name);
+int snapshot_create(const char * name);
+int snapshot_delete(const char * name);
+int snapshot_list(char * buf, int size);
+void mark_snapshots(BIT_FIELD * map);
+int mount_snapshot(char * disk, const char * name);
+
+#endif
@@ -0,0 +1,145 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "stats.h"
+#include "crc.h"
+
+/* 
+   Counters are only ever touched with relaxed atomics, so recording never
+   blocks and a reader sees a slightly stale but never torn value.
+*/
+op_stats stats[S_NUM_STATS];
+uint64_t disk_writes;
+uint64_t disk_bytes_written;
+uint64_t disk_bytes_discarded;
+
+static const char * stat_names[S_NUM_STATS] = {
+	[S_GETATTR] = "getattr",
+	[S_READDIR] = "readdir",
+	[S_OPEN] = "open",
+	[S_READ] = "read",
+	[S_WRITE] = "write",
+	[S_CREATE] = "create",
+	[S_CHOWN] = "chown",
+	[S_CHMOD] = "chmod",
+	[S_UTIMENS] = "utimens",
+	[S_TRUNCATE] = "truncate",
+	[S_UNLINK] = "unlink",
+	[S_RENAME] = "rename",
+	[S_FSYNC] = "fsync",
+	[S_READ_BLOCK] = "read_block",
+	[S_READ_BLOCK_OFFSET] = "read_block_offset",
+	[S_WRITE_BLOCK] = "write_block",
+	[S_WRITE_BLOCK_OFFSET] = "write_block_offset",
+	[S_READ_INODE] = "read_inode",
+	[S_WRITE_INODE] = "write_inode",
+	[S_SYNC] = "sync",
+};
+
+const char * stats_name(int id) {
+	if (id < 0 || id >= S_NUM_STATS)
+		return "unknown";
+	return stat_names[id];
+}
+
+uint64_t stats_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+void stats_record(int id, uint64_t start_ns) {
+	uint64_t ns = stats_now() - start_ns;
+	op_stats * s = &stats[id];
+	int bucket = 63 - __builtin_clzll(ns | 1);
+	uint64_t max;
+
+	if (bucket >= STATS_BUCKETS)
+		bucket = STATS_BUCKETS - 1;
+	__atomic_fetch_add(&s->count, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->total_ns, ns, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&s->buckets[bucket], 1, __ATOMIC_RELAXED);
+
+	max = __atomic_load_n(&s->max_ns, __ATOMIC_RELAXED);
+	while (ns > max && !__atomic_compare_exchange_n(&s->max_ns, &max, ns, 1,
+			__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+void stats_count_write(int bytes) {
+	__atomic_add_fetch(&disk_writes, 1, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&disk_bytes_written, bytes, __ATOMIC_RELAXED);
+}
+
+void stats_count_discard(int64_t bytes) {
+	__atomic_add_fetch(&disk_bytes_discarded, bytes, __ATOMIC_RELAXED);
+}
+
+void stats_reset() {
+	int i, b;
+	__atomic_store_n(&disk_writes, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&disk_bytes_written, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&disk_bytes_discarded, 0, __ATOMIC_RELAXED);
+	for (i = 0; i < S_NUM_STATS; i++) {
+		__atomic_store_n(&stats[i].count, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats[i].total_ns, 0, __ATOMIC_RELAXED);
+		__atomic_store_n(&stats[i].max_ns, 0, __ATOMIC_RELAXED);
+		for (b = 0; b < STATS_BUCKETS; b++)
+			__atomic_store_n(&stats[i].buckets[b], 0, __ATOMIC_RELAXED);
+	}
+}
+
+/* upper bound of the bucket holding the given fraction of samples */
+static uint64_t percentile(const uint64_t * buckets, uint64_t count, double fraction) {
+	uint64_t seen = 0;
+	int b;
+	for (b = 0; b < STATS_BUCKETS; b++) {
+		seen += buckets[b];
+		if (seen >= count * fraction)
+			return 2ULL << b;
+	}
+	return 2ULL << (STATS_BUCKETS - 1);
+}
+
+/* 
+   Formats every counter as text into buf, one line per operation with
+   the non empty histogram buckets at the end as upper_ns:count pairs.
+   Returns the length of the text.
+*/
+int stats_render(char * buf, int size) {
+	int i, b, len = 0;
+	uint64_t buckets[STATS_BUCKETS];
+	uint64_t count, total, max;
+
+	len += snprintf(buf + len, size - len,
+		"# op count avg_ns max_ns p50_ns p90_ns p99_ns histogram\n");
+	for (i = 0; i < S_NUM_STATS && len < size; i++) {
+		count = __atomic_load_n(&stats[i].count, __ATOMIC_RELAXED);
+		total = __atomic_load_n(&stats[i].total_ns, __ATOMIC_RELAXED);
+		max = __atomic_load_n(&stats[i].max_ns, __ATOMIC_RELAXED);
+		for (b = 0; b < STATS_BUCKETS; b++)
+			buckets[b] = __atomic_load_n(&stats[i].buckets[b], __ATOMIC_RELAXED);
+
+		len += snprintf(buf + len, size - len, "%s %lu %lu %lu %lu %lu %lu",
+			stat_names[i], count, count ? total / count : 0, max,
+			count ? percentile(buckets, count, 0.5) : 0,
+			count ? percentile(buckets, count, 0.9) : 0,
+			count ? percentile(buckets, count, 0.99) : 0);
+		for (b = 0; b < STATS_BUCKETS && len < size; b++) {
+			if (buckets[b])
+				len += snprintf(buf + len, size - len, " %lu:%lu", 2UL << b, buckets[b]);
+		}
+		if (len < size)
+			len += snprintf(buf + len, size - len, "\n");
+	}
+	if (len < size)
+		len += snprintf(buf + len, size - len, "# disk_writes %lu disk_bytes_written %lu disk_bytes_discarded %lu\n",
+			__atomic_load_n(&disk_writes, __ATOMIC_RELAXED),
+			__atomic_load_n(&disk_bytes_written, __ATOMIC_RELAXED),
+			__atomic_load_n(&disk_bytes_discarded, __ATOMIC_RELAXED));
+	if (len < size)
+		len += snprintf(buf + len, size - len, "# checksum_failures %lu\n",
+			__atomic_load_n(&checksum_failures, __ATOMIC_RELAXED));
+	return len < size ? len : size - 1;
+}
@@ -0,0 +1,58 @@
+#ifndef U_STATS
+#define U_STATS
+
+#include <stdint.h>
+
+#define STATS_FILE "/.userfs_stats"
+#define STATS_BUCKETS 32 //bucket i counts latencies in [2^i, 2^(i+1)) ns, the last one everything above
+#define STATS_RENDER_SIZE 8192
+
+typedef enum stat_id_e {
+	/* fuse operations */
+	S_GETATTR,
+	S_READDIR,
+	S_OPEN,
+	S_READ,
+	S_WRITE,
+	S_CREATE,
+	S_CHOWN,
+	S_CHMOD,
+	S_UTIMENS,
+	S_TRUNCATE,
+	S_UNLINK,
+	S_RENAME,
+	S_FSYNC,
+	/* block layer */
+	S_READ_BLOCK,
+	S_READ_BLOCK_OFFSET,
+	S_WRITE_BLOCK,
+	S_WRITE_BLOCK_OFFSET,
+	S_READ_INODE,
+	S_WRITE_INODE,
+	S_SYNC,
+	S_NUM_STATS
+} stat_id;
+
+typedef struct op_stats_s {
+	uint64_t count;
+	uint64_t total_ns;
+	uint64_t max_ns;
+	uint64_t buckets[STATS_BUCKETS];
+} op_stats;
+
+extern op_stats stats[S_NUM_STATS];
+
+/* what went to the disk, every write call and its bytes, and the bytes of freed blocks given back to the host */
+extern uint64_t disk_writes;
+extern uint64_t disk_bytes_written;
+extern uint64_t disk_bytes_discarded;
+
+const char * stats_name(int id);
+uint64_t stats_now();
+void stats_record(int id, uint64_t start_ns);
+void stats_count_write(int bytes);
+void stats_count_discard(int64_t bytes);
+void stats_reset();
+int stats_render(char * buf, int size);
+
+#endif
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <unistd.h>
+#include <limits.h>
+#include "trace.h"
+
+/* 
+   Each thread owns one ring and is its only writer, so recording is a plain
+   store plus a release of the head counter. Rings are pushed onto a global
+   list with a CAS the first time a thread records and are never freed.
+*/
+typedef struct trace_ring_s {
+	uint64_t head;
+	uint32_t thread;
+	struct trace_ring_s * next;
+	trace_event events[TRACE_RING_EVENTS];
+} trace_ring;
+
+int trace_level = TRACE_OFF;
+
+static const char * trace_file;
+static trace_ring * rings;
+static uint32_t next_thread;
+static __thread trace_ring * my_ring;
+
+static const char * op_names[T_NUM_OPS] = {
+	[T_CREATE] = "create",
+	[T_READ] = "read",
+	[T_WRITE] = "write",
+	[T_TRUNCATE] = "truncate",
+	[T_UNLINK] = "unlink",
+	[T_NO_INODE] = "no_inode",
+	[T_NO_BLOCK] = "no_block",
+	[T_FSCK_INODE_FREED] = "fsck_inode_freed",
+	[T_FSCK_INODE_USED] = "fsck_inode_used",
+	[T_FSCK_BLOCK_FREED] = "fsck_block_freed",
+	[T_FSCK_BLOCK_USED] = "fsck_block_used",
+	[T_GROW_INODES] = "grow_inodes",
+	[T_SNAPSHOT] = "snapshot",
+	[T_SNAPSHOT_DELETE] = "snapshot_delete",
+};
+
+/* a relative file name is taken from the current directory now, a daemonized mount has left it by the dump */
+void trace_init(int level, const char * file_name) {
+	char dir[PATH_MAX];
+	char * path;
+	trace_level = level > TRACE_LEVEL ? TRACE_LEVEL : level;
+	trace_file = file_name;
+	if (file_name == NULL || file_name[0] == '/' || getcwd(dir, sizeof(dir)) == NULL)
+		return;
+	path = malloc(strlen(dir) + strlen(file_name) + 2);
+	sprintf(path, "%s/%s", dir, file_name);
+	trace_file = path;
+}
+
+const char * trace_op_name(int op) {
+	if (op < 0 || op >= T_NUM_OPS || op_names[op] == NULL)
+		return "unknown";
+	return op_names[op];
+}
+
+static trace_ring * new_ring() {
+	trace_ring * ring = calloc(1, sizeof(trace_ring));
+	if (ring == NULL)
+		return NULL;
+	ring->thread = __atomic_fetch_add(&next_thread, 1, __ATOMIC_RELAXED);
+	ring->next = __atomic_load_n(&rings, __ATOMIC_RELAXED);
+	while (!__atomic_compare_exchange_n(&rings, &ring->next, ring, false,
+			__ATOMIC_RELEASE, __ATOMIC_RELAXED))
+		;
+	return ring;
+}
+
+void trace_record(int level, int op, int inode, int64_t offset, uint32_t length, int64_t block) {
+	struct timespec now;
+	trace_ring * ring = my_ring;
+	trace_event * ev;
+
+	if (ring == NULL) {
+		if ((ring = my_ring = new_ring()) == NULL)
+			return;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	ev = &ring->events[ring->head & (TRACE_RING_EVENTS - 1)];
+	ev->timestamp_ns = (uint64_t)now.tv_sec * 1000000000ULL + now.tv_nsec;
+	ev->offset = offset;
+	ev->block = block;
+	ev->length = length;
+	ev->inode = inode;
+	ev->op = op;
+	ev->level = level;
+	__atomic_store_n(&ring->head, ring->head + 1, __ATOMIC_RELEASE);
+}
+
+/* 
+   Writes every ring to the trace file. Meant to be called once the
+   recording threads are quiet (unmount), a ring that is still being
+   written may have its oldest events overwritten while it is copied.
+*/
+int trace_dump() {
+	FILE * out;
+	trace_ring * ring;
+	trace_file_header header;
+	trace_ring_header ring_header;
+	uint64_t head, first, i;
+
+	if (trace_file == NULL || trace_level == TRACE_OFF)
+		return 0;
+	if ((out = fopen(trace_file, "wb")) == NULL) {
+		fprintf(stderr, "Unable to open trace file %s\n", trace_file);
+		return -1;
+	}
+
+	header.magic = TRACE_MAGIC;
+	header.event_size = sizeof(trace_event);
+	header.num_rings = 0;
+	for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next)
+		header.num_rings++;
+	fwrite(&header, sizeof(header), 1, out);
+
+	for (ring = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); ring != NULL; ring = ring->next) {
+		head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+		first = head > TRACE_RING_EVENTS ? head - TRACE_RING_EVENTS : 0;
+
+		ring_header.thread = ring->thread;
+		ring_header.num_events = head - first;
+		ring_header.dropped = first;
+		fwrite(&ring_header, sizeof(ring_header), 1, out);
+		for (i = first; i < head; i++)
+			fwrite(&ring->events[i & (TRACE_RING_EVENTS - 1)], sizeof(trace_event), 1, out);
+	}
+
+	fclose(out);
+	fprintf(stderr, "Trace written to %s\n", trace_file);
+	return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef U_TRACE
+#define U_TRACE
+
+#include <stdint.h>
+
+/* 
+   Levels above TRACE_LEVEL are compiled out entirely, levels above
+   trace_level are skipped at run time with a single load and branch.
+*/
+#ifndef TRACE_LEVEL
+#define TRACE_LEVEL TRACE_DEBUG
+#endif
+
+#define TRACE_OFF	0
+#define TRACE_ERR	1
+#define TRACE_OP	2
+#define TRACE_DEBUG	3
+
+#define TRACE_RING_EVENTS 4096 //per thread, must be a power of two
+#define TRACE_MAGIC 0x45434152544655ULL //"UFTRACE"
+
+typedef enum trace_op_e {
+	T_CREATE,
+	T_READ,
+	T_WRITE,
+	T_TRUNCATE,
+	T_UNLINK,
+	T_NO_INODE,
+	T_NO_BLOCK,
+	T_FSCK_INODE_FREED,
+	T_FSCK_INODE_USED,
+	T_FSCK_BLOCK_FREED,
+	T_FSCK_BLOCK_USED,
+	T_GROW_INODES,
+	T_SNAPSHOT,
+	T_SNAPSHOT_DELETE,
+	T_NUM_OPS
+} trace_op;
+
+/* fixed size binary event, 40 bytes */
+typedef struct trace_event_s {
+	uint64_t timestamp_ns;
+	int64_t offset;
+	int64_t block;
+	uint32_t length;
+	int32_t inode;
+	uint16_t op;
+	uint16_t level;
+	uint32_t pad;
+} trace_event;
+
+/* trace file: one header, then for each thread a ring header and its events oldest first */
+typedef struct trace_file_header_s {
+	uint64_t magic;
+	uint32_t event_size;
+	uint32_t num_rings;
+} trace_file_header;
+
+typedef struct trace_ring_header_s {
+	uint32_t thread;
+	uint32_t num_events;
+	uint64_t dropped;
+} trace_ring_header;
+
+extern int trace_level;
+
+void trace_init(int level, const char * file_name);
+void trace_record(int level, int op, int inode, int64_t offset, uint32_t length, int64_t block);
+int trace_dump();
+const char * trace_op_name(int op);
+
+#define TRACE(lvl, op, inode, offset, length, block) do { \
+	if ((lvl) <= TRACE_LEVEL && __builtin_expect((lvl) <= trace_level, 0)) \
+		trace_record((lvl), (op), (inode), (offset), (length), (block)); \
+	} while (0)
+
+#endif
@@ -1,9 +1,10 @@
 #ifndef UFS_H
 #define UFS_H
 
-int virtual_disk;
-int u_quota();
+#include <stdint.h>
 
-#define DISK_LBA int //basically the location within the file to seek too
+#define DISK_LBA int64_t //basically the location within the file to seek too, in blocks
+
+DISK_LBA u_quota();
 
 #endif
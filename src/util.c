@@ -4,42 +4,131 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 #include <assert.h>
 #include "sb.h"
 #include "inode.h"
 #include "userfs.h"
 #include "blocks.h"
 #include "bitmap.h"
+#include "group.h"
+#include "imap.h"
 #include "dir.h"
+#include "snap.h"
+#include "crc.h"
+#include "crash.h"
+#include "trace.h"
+#include "disk.h"
+#include "crypt.h"
+#include "recover.h"
+#include "util.h"
 
+/*
+ * Parses a size in bytes with an optional K, M, G or T suffix
+ */
+int64_t parse_size(const char * text)
+{
+	char * end;
+	int64_t size = strtoll(text, &end, 10);
+	switch (*end) {
+	case 'T': case 't': size *= 1024;
+	case 'G': case 'g': size *= 1024;
+	case 'M': case 'm': size *= 1024;
+	case 'K': case 'k': size *= 1024;
+	}
+	return size;
+}
+
+void init_format_options(format_options * opts, int64_t diskSizeBytes)
+{
+	opts->disk_size_bytes = diskSizeBytes;
+	opts->block_size = DEFAULT_BLOCK_SIZE;
+	opts->bytes_per_inode = DEFAULT_BYTES_PER_INODE;
+	opts->fixed_inodes = false;
+	opts->data_checksums = false;
+	opts->stripe_chunk = DEFAULT_STRIPE_CHUNK;
+	opts->encrypt = false;
+	opts->max_size_bytes = 0;
+}
 
 /*
- * Formats the virtual disk. Saves the superblock
- * bit map and the single level directory.
+ * Formats the virtual disk as opts describes. Saves the superblock, the
+ * group descriptors, every group's bit map, the inode map and the single
+ * level directory. The inode slices are zeroed, which marks them free.
  */
-int u_format(int diskSizeBytes, char* file_name)
+/* tells the image files of one format from those of another, even a format in the same second */
+static uint64_t new_disk_id() {
+	struct timespec now;
+	clock_gettime(CLOCK_REALTIME, &now);
+	return (uint64_t)now.tv_sec << 32 ^ (uint64_t)now.tv_nsec << 8 ^ (uint32_t)getpid();
+}
+
+int u_format(format_options * opts, char* file_name)
 {
-	int i;
+	int g, b;
 	int minimumBlocks;
-	inode curr_inode;
+	int64_t maxSize;
+	bool zeroed;
+
+	if (!valid_block_size(opts->block_size)) {
+		fprintf(stderr, "Block size must be a power of two from %d to %d bytes\n",
+			MIN_BLOCK_SIZE, MAX_BLOCK_SIZE);
+		return 0;
+	}
+	if (opts->bytes_per_inode < MIN_BYTES_PER_INODE) {
+		fprintf(stderr, "There must be at least %d bytes per inode\n", MIN_BYTES_PER_INODE);
+		return 0;
+	}
+
+	if (opts->stripe_chunk < opts->block_size || opts->stripe_chunk % opts->block_size != 0) {
+		fprintf(stderr, "The stripe chunk must be a whole number of blocks\n");
+		return 0;
+	}
 
-	/* create the virtual disk */
-	if ((virtual_disk = open(file_name, O_CREAT|O_RDWR, S_IRUSR|S_IWUSR)) < 0)
+	/* create the virtual disk, one image file or several to stripe over */
+	if (!disk_open(file_name, O_CREAT|O_RDWR))
 	{
 		fprintf(stderr, "Unable to create virtual disk file: %s\n", file_name);
 		return 0;
 	}
+	disk_set_chunk(opts->stripe_chunk);
+	//an image file is cut back to nothing so every block reads as zeros
+	zeroed = disk_truncate(opts->disk_size_bytes);
 
 
-	fprintf(stderr, "Formatting userfs of size %d bytes with %d block size in file %s\n",
-		diskSizeBytes, BLOCK_SIZE_BYTES, file_name);
+	fprintf(stderr, "Formatting userfs of size %ld bytes with %d block size in file %s\n",
+		opts->disk_size_bytes, opts->block_size, file_name);
+	if (disk_members() > 1)
+		fprintf(stderr, "\tStriped over %d files, %d bytes at a time\n", disk_members(), opts->stripe_chunk);
+	if (disk_has_meta())
+		fprintf(stderr, "\tMetadata is on an image file of its own\n");
 
-	minimumBlocks = 3+ NUM_INODE_BLOCKS+1;
-	if (diskSizeBytes/BLOCK_SIZE_BYTES < minimumBlocks){
+	maxSize = opts->max_size_bytes > 0 ? opts->max_size_bytes : opts->disk_size_bytes * GROW_FACTOR;
+	init_superblock(opts->disk_size_bytes, opts->block_size, opts->bytes_per_inode, !opts->fixed_inodes, maxSize);
+	sb.data_checksums = opts->data_checksums;
+	sb.stripe_members = disk_members();
+	sb.stripe_chunk_bytes = opts->stripe_chunk;
+	sb.stripe_id = new_disk_id();
+	sb.meta_disk = disk_has_meta();
+	sb.encrypted = false;
+	//before the first write, everything after the superblock is enciphered
+	if (opts->encrypt) {
+		if (!crypt_format()) {
+			disk_close();
+			return 0;
+		}
+		fprintf(stderr, "\tEncrypted with AES-256-XTS (%s)\n", aes_vaes() ? "VAES" : "AES-NI");
+	}
+	/* past the superblock, the descriptors reserved for growth and the
+	   inode map root: a bitmap, a fresh map, the inode slice, an inode map
+	   block, the directory root and at least one block for data */
+	minimumBlocks = sb.inode_root + sb.inode_root_blocks + 5 + INODE_BLOCKS_PER_GROUP;
+	if (sb.disk_size_blocks < minimumBlocks || !init_groups()){
 		fprintf(stderr, "Minimum size virtual disk is %d bytes %d blocks\n",
 			BLOCK_SIZE_BYTES*minimumBlocks, minimumBlocks);
-		fprintf(stderr, "Requested virtual disk size %d bytes results in %d bytes %d blocks of usable space\n",
-			diskSizeBytes, BLOCK_SIZE_BYTES*minimumBlocks, minimumBlocks);
+		disk_close();
 		return 0;
 	}
 
@@ -47,163 +136,575 @@ int u_format(int diskSizeBytes, char* file_name)
 	/*************************  BIT MAP **************************/
 
 	assert(sizeof(BIT_FIELD)* BIT_MAP_SIZE <= BLOCK_SIZE_BYTES);
-	fprintf(stderr, "%d blocks %d bytes reserved for bitmap (%lu bytes required)\n", 
-		1, BLOCK_SIZE_BYTES, sizeof(BIT_FIELD)* BIT_MAP_SIZE );
-	fprintf(stderr, "\tImplies Max size of disk is %lu blocks or %lu bytes\n",
-		BIT_MAP_SIZE*BITS_PER_FIELD, BIT_MAP_SIZE*BLOCK_SIZE_BYTES*BITS_PER_FIELD);
-  
-	if (diskSizeBytes >= BIT_MAP_SIZE* BLOCK_SIZE_BYTES){
-		fprintf(stderr, "Unable to format a userfs of size %d bytes\n",
-			diskSizeBytes);
-		return 0;
-	}
+	fprintf(stderr, "%d groups of %ld blocks, %d blocks reserved for group descriptors\n",
+		sb.num_groups, BLOCKS_PER_GROUP, sb.gdt_blocks);
+	fprintf(stderr, "\tThe disk can grow to %ld groups, %ld bytes\n", (int64_t)sb.gdt_blocks * GROUP_DESCS_PER_BLOCK,
+		(int64_t)sb.gdt_blocks * GROUP_DESCS_PER_BLOCK * BLOCKS_PER_GROUP * BLOCK_SIZE_BYTES);
+	fprintf(stderr, "\tEach group has 1 bitmap block, 1 fresh map block and starts with %d inode blocks\n",
+		INODE_BLOCKS_PER_GROUP);
 
 	init_bit_map();
-  
-	/* first three blocks will be taken with the 
-	   superblock, bitmap and directory */
-	allocate_block(BIT_MAP_BLOCK);
-	allocate_block(SUPERBLOCK_BLOCK);
-	allocate_block(DIRECTORY_BLOCK);
-	/* next NUM_INODE_BLOCKS will contain inodes */
-	for (i=3; i< 3+NUM_INODE_BLOCKS; i++){
-		allocate_block(i);
-	}
-  
-	write_bitmap();
-	
-	/***********************  DIRECTORY  ***********************/
-	assert(sizeof(dir_struct) <= BLOCK_SIZE_BYTES);
-
-	fprintf(stderr, "%d blocks %d bytes reserved for the userfs directory (%lu bytes required)\n", 
-		1, BLOCK_SIZE_BYTES, sizeof(dir_struct));
-	fprintf(stderr, "\tMax files per directory: %d\n",
-		MAX_FILES_PER_DIRECTORY);
-	fprintf(stderr,"Directory entries limit filesize to %d characters\n",
-		MAX_FILE_NAME_SIZE);
-
-	init_dir();
-	write_dir();
+	for (g = 0; g < sb.num_groups; g++){
+		/* superblock, descriptors, inode map root, directory,
+		   bitmaps and fresh maps are never free, the inode slices
+		   are ordinary blocks in use */
+		mark_group_metadata(g, bit_map);
+		for (b = 0; b < INODE_BLOCKS_PER_GROUP; b++)
+			SET_USED(bit_map, groups[g].inode_table + b);
+		mark_bitmap_dirty(g);
+	}
 
 	/***********************  INODES ***********************/
-	fprintf(stderr, "userfs will contain %lu inodes (directory limited to %d)\n",
-		MAX_INODES, MAX_FILES_PER_DIRECTORY);
+	if (!format_inode_map()) {
+		fprintf(stderr, "No room for the inode map\n");
+		disk_close();
+		return 0;
+	}
+	write_bitmap();
+
+	fprintf(stderr, "userfs will contain %d inodes, one per %d bytes\n",
+		MAX_INODES, sb.bytes_per_inode);
+	fprintf(stderr, "\t%d root blocks map up to %ld inode table blocks, %s\n",
+		sb.inode_root_blocks, (int64_t)sb.inode_root_blocks * IMAP_ENTRIES * IMAP_ENTRIES,
+		sb.grow_inodes ? "the table grows on demand" : "the table is fixed");
 	fprintf(stderr,"Inodes limit filesize to %d blocks or %d bytes\n",
 		MAX_BLOCKS_PER_FILE, 
 		MAX_BLOCKS_PER_FILE* BLOCK_SIZE_BYTES);
 
-	curr_inode.free = 1;
-	for (i=0; i< MAX_INODES; i++){
-		write_inode(i, &curr_inode);
+	if (!zeroed) {
+		char zeros[BLOCK_SIZE_BYTES];
+		memset(zeros, 0, sizeof(zeros));
+		for (g = 0; g < sb.num_groups; g++){
+			for (b = 0; b < INODE_BLOCKS_PER_GROUP; b++){
+				write_block(groups[g].inode_table + b, zeros, sizeof(zeros));
+			}
+		}
 	}
+	
+	/***********************  DIRECTORY  ***********************/
+	fprintf(stderr, "The userfs directory is a B+tree of %d entries per leaf, %d keys per interior node\n",
+		LEAF_ENTRIES, INDEX_ENTRIES);
+	fprintf(stderr,"Directory entries limit filesize to %d characters\n",
+		MAX_FILE_NAME_SIZE);
+
+	if (!init_dir()) {
+		fprintf(stderr, "No room for the directory\n");
+		disk_close();
+		return 0;
+	}
+	write_bitmap();
 
 	/***********************  SUPERBLOCK ***********************/
 	assert(sizeof(superblock) <= BLOCK_SIZE_BYTES);
 	fprintf(stderr, "%d blocks %d bytes reserved for superblock (%lu bytes required)\n", 
 		1, BLOCK_SIZE_BYTES, sizeof(superblock));
-	init_superblock(diskSizeBytes);
-	fprintf(stderr, "userfs will contain %d total blocks: %d free for data\n",
+	fprintf(stderr, "userfs will contain %ld total blocks: %ld free for data\n",
 		sb.disk_size_blocks, sb.num_free_blocks);
-	fprintf(stderr, "userfs contains %lu free inodes\n", MAX_INODES);
+	fprintf(stderr, "userfs contains %d free inodes\n", MAX_INODES);
 	
-	write_block(SUPERBLOCK_BLOCK, &sb, sizeof(superblock));
-	sync();
+	disk_write_labels();
+	write_superblock();
+	//the data image keeps the superblock as formatted, to say where the metadata is
+	if (sb.meta_disk)
+		write_data_block(SUPERBLOCK_BLOCK, &sb, sizeof(superblock));
+	sync_blocks();
 
 
 	/* when format complete there better be at 
 	   least one free data block */
-	assert( u_quota() >= 1);
+	if (u_quota() < 1) {
+		fprintf(stderr, "Minimum size virtual disk is %d bytes %d blocks\n",
+			BLOCK_SIZE_BYTES*minimumBlocks, minimumBlocks);
+		disk_close();
+		return 0;
+	}
 	fprintf(stderr,"Format complete!\n");
 	
-	close(virtual_disk);
+	disk_close();
 	return 1;
 }
 
+/* bitmap with only the metadata of every group and the inode table marked used */
+BIT_FIELD * metadata_map() {
+	int g;
+	BIT_FIELD * map = calloc((size_t)sb.num_groups * BIT_MAP_SIZE, sizeof(BIT_FIELD));
+	for (g = 0; g < sb.num_groups; g++)
+		mark_group_metadata(g, map);
+	mark_inode_map(map);
+	return map;
+}
 
-//This is where you recover your filesystem from an unclean shutdown
+/*
+ * This is where you recover your filesystem from an unclean shutdown.
+ * The directory is always rebuilt from the entries reachable from its
+ * root, which also drops what an interrupted split left behind. The
+ * bitmap is rebuilt before any inode is written, a write may have to
+ * copy an inode block a snapshot shares. Metadata that failed its
+ * checksum but passes the checks is written again, which seals it.
+ */
 int u_fsck() {
-	int i;
+	int i, g, k, free_count;
+	int64_t e, count, kept = 0;
+	size_t w, words = (size_t)sb.num_groups * BIT_MAP_SIZE;
+	DISK_LBA blk;
 	
-	bool allocated_inodes[MAX_INODES];
-	bool allocated_blocks[sb.num_free_blocks];
+	bool * allocated_inodes = calloc(MAX_INODES, sizeof(bool));
+	int * cut = malloc(MAX_INODES * sizeof(int));
+	BIT_FIELD * allocated_blocks = metadata_map();
+	BIT_FIELD * old_nodes = calloc(words, sizeof(BIT_FIELD));
+	BIT_FIELD * held = calloc(words, sizeof(BIT_FIELD));
+	BIT_FIELD * avoid = calloc(words, sizeof(BIT_FIELD));
+	BIT_FIELD * spare;
+	bool ok = true, sealed;
+	int skipped;
+	dir_entry * entries = collect_dir(&count, old_nodes, &skipped);
+	inode slice[INODES_PER_BLOCK];
 	
-	//initialize the allocated_inodes array.
-	for(i=0; i<MAX_INODES; i++){ 
-		allocated_inodes[i]=false;
+	for(i=0;i<MAX_INODES;i++)
+		cut[i] = -1;
+	for(e=0;e<count;e++){
+		inode inode_to_check;
+		dir_entry * file = &entries[e];
+		if(file->inode_number < 0 || file->inode_number >= MAX_INODES
+				|| allocated_inodes[file->inode_number]){
+			//a lost write can hand one inode to two files, the first keeps it
+			fprintf(stderr, "File '%s' has a bad or shared inode. Deleting.\n", file->file_name);
+			continue;
+		}
+		sealed = read_inode(file->inode_number, &inode_to_check);
+		if(!inode_to_check.in_use){
+			fprintf(stderr, "File '%s' has lost it's inode. Deleting.\n'", file->file_name);
+			continue;
+		}
+		//the crash came before the unlink took the name, the inode is freed with the orphaned ones
+		if(sealed && inode_to_check.orphan == ORPHAN_UNLINKED){
+			fprintf(stderr, "File '%s' was being unlinked. Deleting.\n", file->file_name);
+			continue;
+		}
+		entries[kept++] = *file;
+		allocated_inodes[file->inode_number] = true;
+		if(inode_to_check.no_blocks < 0 || inode_to_check.no_blocks > MAX_BLOCKS_PER_FILE)
+			inode_to_check.no_blocks = 0;
+		//the blocks past the size of a truncated orphan are left free
+		if(sealed && inode_to_check.orphan == ORPHAN_TRUNCATED && inode_to_check.file_size_bytes >= 0
+				&& inode_to_check.no_blocks * BLOCK_SIZE_BYTES >= inode_to_check.file_size_bytes + BLOCK_SIZE_BYTES)
+			inode_to_check.no_blocks = (inode_to_check.file_size_bytes + BLOCK_SIZE_BYTES - 1) / BLOCK_SIZE_BYTES;
+		int j;
+		for(j=0;j<inode_to_check.no_blocks; j++){
+			blk = inode_to_check.blocks[j];
+			//out of range, metadata or already owned: cut the file off before this block
+			if (blk < 0 || blk >= sb.disk_size_blocks || USED(allocated_blocks, blk) || USED(old_nodes, blk))
+				break;
+			SET_USED(allocated_blocks, blk);
+		}
+		if(j < inode_to_check.no_blocks || inode_to_check.file_size_bytes > j * BLOCK_SIZE_BYTES
+				|| inode_to_check.file_size_bytes < 0){
+			fprintf(stderr, "File '%s' truncated to %d blocks\n", file->file_name, j);
+			cut[file->inode_number] = j;
+		}
+		//an inode that passes the checks above is kept, writing it again seals it
+		if(!sealed){
+			fprintf(stderr, "File '%s' inode checksum does not match, keeping what checks out\n", file->file_name);
+			cut[file->inode_number] = j;
+		}
+		//writing it again also takes it off the orphan list, which is not kept
+		if(inode_to_check.orphan)
+			cut[file->inode_number] = j;
 	}
-	//initialize the allocated_blocks array.
-	for(i=0; i<sb.disk_size_blocks; i++){
-		allocated_blocks[i]=false;
+	//the new tree goes into blocks that are neither in use nor part of the old one or a snapshot
+	mark_snapshots(held);
+	for(w=0;w<words;w++)
+		avoid[w] = old_nodes[w] | held[w];
+	spare = malloc(words * sizeof(BIT_FIELD));
+	memcpy(spare, allocated_blocks, words * sizeof(BIT_FIELD));
+	if (!rebuild_dir(entries, kept, allocated_blocks, avoid)) {
+		memcpy(allocated_blocks, spare, words * sizeof(BIT_FIELD));
+		if (skipped == 0 && kept == count) {
+			//the disk is too full for a new tree, the old one needs no repair
+			fprintf(stderr, "Keeping the old directory\n");
+			for(w=0;w<words;w++)
+				allocated_blocks[w] |= old_nodes[w];
+			sb.dir_entries = count;
+			write_superblock();
+		} else {
+			//a crash before the new tree is complete loses the directory
+			fprintf(stderr, "Rebuilding the directory over its old nodes\n");
+			ok = rebuild_dir(entries, kept, allocated_blocks, held);
+		}
+	}
+	free(spare);
+	free(avoid);
+	if (!ok) {
+		free(allocated_inodes);
+		free(cut);
+		free(allocated_blocks);
+		free(old_nodes);
+		free(held);
+		free(entries);
+		return 0;
 	}
 	
-	
-	for(i=0;i<root_dir.no_files;i++){
-		inode inode_to_check;
-		read_inode(root_dir.u_file[i].inode_number, &inode_to_check);
-		if(inode_to_check.free){
-			fprintf(stderr, "File '%s' has lost it's inode. Deleting.\n'", root_dir.u_file[i].file_name);
-			dir_remove_file(root_dir.u_file[i]);
-		}
-		else{
-			allocated_inodes[root_dir.u_file[i].inode_number] = true;
-			int j;
-			for(j=0;j<inode_to_check.no_blocks; j++){
-				allocated_blocks[inode_to_check.blocks[j]] = true;
+	//blocks in use, live or in a snapshot, must be marked so they are never handed out twice
+	if (sb.num_snapshots > 0)
+		set_fresh_map(allocated_blocks, held);
+	for(w=0;w<words;w++)
+		allocated_blocks[w] |= held[w];
+	sb.num_free_blocks = 0;
+	for(g=0;g<sb.num_groups;g++){
+		groups[g].free_blocks = 0;
+		mark_bitmap_dirty(g);
+		for(blk=group_first_data_block(g); blk<group_end(g); blk++){
+			if(!USED(allocated_blocks, blk)){
+				if (block_in_use(blk))
+					TRACE(TRACE_DEBUG, T_FSCK_BLOCK_FREED, -1, 0, 0, blk);
+				groups[g].free_blocks++;
 			}
+			else TRACE(TRACE_DEBUG, T_FSCK_BLOCK_USED, -1, 0, 0, blk);
 		}
+		sb.num_free_blocks += groups[g].free_blocks;
 	}
-	//free up everything that isn't marked as allocated to remove orphaned blocks and inodes
+	memcpy(bit_map, allocated_blocks, words * sizeof(BIT_FIELD));
+	
 	for(i=0;i<MAX_INODES;i++){
-		if(!allocated_inodes[i]){
-			inode inodetofree;
-			read_inode(i, &inodetofree);
-			inodetofree.free = true;
-			write_inode(i, &inodetofree);
-			fprintf(stderr, "Freed Inode %i\n", i);
+		inode in;
+		if (cut[i] < 0)
+			continue;
+		read_inode(i, &in);
+		in.no_blocks = cut[i];
+		if(in.file_size_bytes > cut[i] * BLOCK_SIZE_BYTES || in.file_size_bytes < 0)
+			in.file_size_bytes = cut[i] * BLOCK_SIZE_BYTES;
+		in.orphan = 0;
+		in.next_orphan = 0;
+		write_inode(i, &in);
+	}
+	//free up everything that isn't marked as allocated to remove orphaned inodes
+	for(k=0;k<sb.num_inode_blocks;k++){
+		read_block(inode_map[k], slice, sizeof(slice));
+		for(i=0;i<INODES_PER_BLOCK;i++){
+			int ino = k*INODES_PER_BLOCK + i;
+			if(!allocated_inodes[ino] && slice[i].in_use){
+				slice[i].in_use = false;
+				slice[i].orphan = 0;
+				slice[i].next_orphan = 0;
+				//its block is shared with a snapshot and there is no room for a copy
+				if (!write_inode(ino, &slice[i])) {
+					fprintf(stderr, "Inode %d stays allocated, no room to copy its block\n", ino);
+					allocated_inodes[ino] = true;
+				}
+			}
 		}
-		else fprintf(stderr, "Inode %i is allocated\n", i);
 	}
-	
-	for(i=0; i<sb.num_free_blocks; i++){
-		if(!allocated_blocks[i+8]){
-			free_block(i+8);
-			fprintf(stderr, "Freed Block %i\n", i+8);
+	//counted once the writes are done, they may have moved inode blocks to other groups
+	for(g=0;g<sb.num_groups;g++)
+		groups[g].free_inodes = 0;
+	for(k=0;k<sb.num_inode_blocks;k++){
+		free_count = 0;
+		for(i=0;i<INODES_PER_BLOCK;i++){
+			int ino = k*INODES_PER_BLOCK + i;
+			if(!allocated_inodes[ino]){
+				free_count++;
+				TRACE(TRACE_DEBUG, T_FSCK_INODE_FREED, ino, 0, 0, -1);
+			}
+			else TRACE(TRACE_DEBUG, T_FSCK_INODE_USED, ino, 0, 0, -1);
 		}
-		else fprintf(stderr, "Block %i is allocated\n", i+8);
+		groups[group_of(inode_map[k])].free_inodes += free_count;
 	}
+	reset_inode_hints();
 	
 	write_bitmap();
+	seal_inode_map();
+	free(allocated_inodes);
+	free(cut);
+	free(allocated_blocks);
+	free(old_nodes);
+	free(held);
+	free(entries);
 	
 	return 1;
 }
 
+typedef struct verify_state_s {
+	bool * used_inodes;
+	BIT_FIELD * used_blocks;
+	int problems;
+} verify_state;
+
+/* checks the blocks of an inode in use and marks them */
+static void verify_blocks(verify_state * v, int inode_number, const inode * in) {
+	DISK_LBA b;
+	int j;
+	for (j = 0; j < in->no_blocks; j++) {
+		b = in->blocks[j];
+		if (b < 0 || b >= sb.disk_size_blocks) {
+			fprintf(stderr, "verify: inode %d block %ld out of range\n", inode_number, b);
+			v->problems++;
+			continue;
+		}
+		if (USED(v->used_blocks, b)) {
+			fprintf(stderr, "verify: block %ld is used twice or is metadata\n", b);
+			v->problems++;
+		}
+		if (!block_in_use(b)) {
+			fprintf(stderr, "verify: block %ld of inode %d is free in the bitmap\n", b, inode_number);
+			v->problems++;
+		}
+		SET_USED(v->used_blocks, b);
+	}
+}
+
+/* checks one directory entry and its inode, marks the inode and blocks it uses */
+static int verify_file(const dir_entry * file, void * arg) {
+	verify_state * v = arg;
+	inode in;
+
+	if (file->inode_number < 0 || file->inode_number >= MAX_INODES) {
+		fprintf(stderr, "verify: %s has bad inode %d\n", file->file_name, file->inode_number);
+		v->problems++;
+		return 0;
+	}
+	if (v->used_inodes[file->inode_number]) {
+		fprintf(stderr, "verify: inode %d is shared by two files\n", file->inode_number);
+		v->problems++;
+	}
+	v->used_inodes[file->inode_number] = true;
+
+	if (!read_inode(file->inode_number, &in)) {
+		fprintf(stderr, "verify: inode %d checksum does not match\n", file->inode_number);
+		v->problems++;
+	}
+	if (!in.in_use) {
+		fprintf(stderr, "verify: %s points to free inode %d\n", file->file_name, file->inode_number);
+		v->problems++;
+		return 0;
+	}
+	if (in.no_blocks < 0 || in.no_blocks > MAX_BLOCKS_PER_FILE
+			|| in.file_size_bytes < 0 || in.file_size_bytes > in.no_blocks * BLOCK_SIZE_BYTES) {
+		fprintf(stderr, "verify: inode %d has %d blocks for %d bytes\n",
+			file->inode_number, in.no_blocks, in.file_size_bytes);
+		v->problems++;
+		return 0;
+	}
+	if (in.orphan == ORPHAN_UNLINKED) {
+		fprintf(stderr, "verify: %s names inode %d, which is unlinked\n", file->file_name, file->inode_number);
+		v->problems++;
+	}
+	verify_blocks(v, file->inode_number, &in);
+	return 0;
+}
+
+/*
+   Walks the orphan list after the files, an unlinked orphan and its
+   blocks are still in use. Marks the inodes on it in listed.
+*/
+static void verify_orphans(verify_state * v, bool * listed) {
+	inode in;
+	int n, ino;
+	for (n = sb.orphan_head; n != 0; n = in.next_orphan) {
+		ino = n - 1;
+		if (ino < 0 || ino >= MAX_INODES || listed[ino]) {
+			fprintf(stderr, "verify: the orphan list is broken at inode %d\n", ino);
+			v->problems++;
+			return;
+		}
+		listed[ino] = true;
+		if (!read_inode(ino, &in) || !in.in_use || !in.orphan) {
+			fprintf(stderr, "verify: inode %d on the orphan list is not an orphan\n", ino);
+			v->problems++;
+			return;
+		}
+		if (in.orphan != ORPHAN_UNLINKED) {
+			if (!v->used_inodes[ino]) {
+				fprintf(stderr, "verify: truncated orphan %d is not in the directory\n", ino);
+				v->problems++;
+			}
+			continue;
+		}
+		if (in.no_blocks < 0 || in.no_blocks > MAX_BLOCKS_PER_FILE) {
+			fprintf(stderr, "verify: orphan %d has %d blocks\n", ino, in.no_blocks);
+			v->problems++;
+			continue;
+		}
+		v->used_inodes[ino] = true;
+		verify_blocks(v, ino, &in);
+	}
+}
+
+/*
+ * Read only consistency check of the mounted file system. Reports every
+ * problem on stderr and returns how many were found.
+ */
+int u_verify() {
+	int i, g, k, problems;
+	int free_count;
+	bool * used_inodes = calloc(MAX_INODES, sizeof(bool));
+	bool * listed = calloc(MAX_INODES, sizeof(bool));
+	int * free_inodes = calloc(sb.num_groups, sizeof(int));
+	BIT_FIELD * metadata = metadata_map();
+	BIT_FIELD * held = calloc((size_t)sb.num_groups * BIT_MAP_SIZE, sizeof(BIT_FIELD));
+	BIT_FIELD * used_blocks;
+	inode slice[INODES_PER_BLOCK];
+	DISK_LBA b, free_blocks = 0;
+	verify_state v;
+	superblock disk_sb;
+
+	//the superblock, descriptors, maps and inode map as they are on disk
+	read_block(SUPERBLOCK_BLOCK, &disk_sb, sizeof(superblock));
+	problems = crc32c_sealed(&disk_sb, sizeof(superblock), &disk_sb.checksum) != disk_sb.checksum;
+	if (problems)
+		fprintf(stderr, "verify: superblock checksum does not match\n");
+	problems += verify_groups();
+	if ((k = verify_inode_map()) > 0) {
+		fprintf(stderr, "verify: %d inode map blocks fail their checksum\n", k);
+		problems += k;
+	}
+
+	problems += verify_dir();
+	mark_snapshots(held);
+	mark_dir_nodes(metadata);
+	used_blocks = malloc((size_t)sb.num_groups * BIT_MAP_SIZE * sizeof(BIT_FIELD));
+	memcpy(used_blocks, metadata, (size_t)sb.num_groups * BIT_MAP_SIZE * sizeof(BIT_FIELD));
+
+	v.used_inodes = used_inodes;
+	v.used_blocks = used_blocks;
+	v.problems = 0;
+	dir_for_each(verify_file, &v);
+	verify_orphans(&v, listed);
+	problems += v.problems;
+
+	for (k = 0; k < sb.num_inode_blocks; k++) {
+		read_block(inode_map[k], slice, sizeof(slice));
+		for (i = 0; i < INODES_PER_BLOCK; i++) {
+			if (!slice[i].in_use)
+				free_inodes[group_of(inode_map[k])]++;
+			else if (!used_inodes[k * INODES_PER_BLOCK + i]) {
+				fprintf(stderr, "verify: inode %d is allocated but not in the directory\n", k * INODES_PER_BLOCK + i);
+				problems++;
+			}
+			if (slice[i].in_use && slice[i].orphan && !listed[k * INODES_PER_BLOCK + i]) {
+				fprintf(stderr, "verify: orphan %d is not on the orphan list\n", k * INODES_PER_BLOCK + i);
+				problems++;
+			}
+		}
+	}
+
+	for (g = 0; g < sb.num_groups; g++) {
+		if (free_inodes[g] != groups[g].free_inodes) {
+			fprintf(stderr, "verify: group %d counts %d free inodes but has %d\n",
+				g, groups[g].free_inodes, free_inodes[g]);
+			problems++;
+		}
+
+		free_count = 0;
+		for (b = group_start(g); b < group_end(g); b++) {
+			if (!USED(used_blocks, b) && !USED(held, b) && block_in_use(b)) {
+				fprintf(stderr, "verify: block %ld is allocated but unused\n", b);
+				problems++;
+			}
+			if (USED(held, b) && !block_in_use(b)) {
+				fprintf(stderr, "verify: block %ld of a snapshot is free in the bitmap\n", b);
+				problems++;
+			}
+			//a block a snapshot holds must be copied before the live file system changes it
+			if (USED(held, b) && sb.num_snapshots > 0 && block_fresh(b)) {
+				fprintf(stderr, "verify: block %ld of a snapshot is not shared\n", b);
+				problems++;
+			}
+			if (USED(metadata, b) && !block_in_use(b)) {
+				fprintf(stderr, "verify: metadata block %ld is free in the bitmap\n", b);
+				problems++;
+			}
+			if (!block_in_use(b))
+				free_count++;
+		}
+		if (free_count != groups[g].free_blocks) {
+			fprintf(stderr, "verify: group %d counts %d free blocks but has %d\n",
+				g, groups[g].free_blocks, free_count);
+			problems++;
+		}
+		free_blocks += free_count;
+	}
+	if (free_blocks != sb.num_free_blocks) {
+		fprintf(stderr, "verify: superblock counts %ld free blocks but there are %ld\n",
+			sb.num_free_blocks, free_blocks);
+		problems++;
+	}
+
+	free(used_inodes);
+	free(listed);
+	free(free_inodes);
+	free(metadata);
+	free(held);
+	free(used_blocks);
+	return problems;
+}
+
+/* checksum failures up to the last mount, any after it have fsck run on the next one */
+static uint64_t checked_failures;
+
+/* what failed its checksum so far has been put right */
+void note_checked_failures() {
+	checked_failures = checksum_failures;
+}
+
 /*
  * Attempts to recover a file system given the virtual disk name
  */
 int recover_file_system(char *file_name)
 {
+	uint64_t failures = checksum_failures;
 
-	if ((virtual_disk = open(file_name, O_RDWR)) < 0)
+	//the entries read from a disk opened before are stale
+	dir_unload();
+	if (!disk_open(file_name, O_RDWR))
 	{
 		printf("virtual disk open error\n");
 		return 0;
 	}
 
-	read_block(SUPERBLOCK_BLOCK, &sb, sizeof(superblock));
+	//a superblock that fails its checksum is still used once the geometry checks out
+	read_superblock();
 	fprintf(stderr, "SUPERBLOCK: %i\n", sb.clean_shutdown);
-	read_block(BIT_MAP_BLOCK, bit_map, sizeof(BIT_FIELD)*BIT_MAP_SIZE);
-	read_block(DIRECTORY_BLOCK, &root_dir, sizeof(dir_struct));
 
 	if (!superblockMatchesCode()){
 		fprintf(stderr,"Unable to recover: userfs appears to have been formatted with another code version\n");
 		return 0;
 	}
-	if (!sb.clean_shutdown)
+	if (!disk_check_stripe()) {
+		fprintf(stderr, "Unable to recover: not every member of the disk is there\n");
+		return 0;
+	}
+	if (!disk_check_meta()) {
+		fprintf(stderr, "Unable to recover: the metadata disk does not go with the disk\n");
+		return 0;
+	}
+	if (!crypt_mount()) {
+		fprintf(stderr, "Unable to recover: the disk cannot be deciphered\n");
+		return 0;
+	}
+	read_groups();
+	read_bitmap();
+	if (!read_inode_map()) {
+		fprintf(stderr, "Unable to recover: the inode map is damaged\n");
+		return 0;
+	}
+
+	if (checksum_failures != failures)
+		fprintf(stderr, "Metadata checksums do not match\n");
+	if (!sb.clean_shutdown || checksum_failures != failures)
 	{
+		//the orphan list may be out of date, recovery finishes the orphans it finds on the way
+		sb.orphan_head = 0;
+		//the mount goes ahead and the check runs behind it
+		if (recovery_background()) {
+			fprintf(stderr, "Recovering in the background\n");
+			recovery_start();
+			return 1;
+		}
 		/* Try to recover your file system */
 		fprintf(stderr, "u_fsck in progress......\n");
 		if (u_fsck()){
 			fprintf(stderr, "Recovery complete\n");
+			checked_failures = checksum_failures;
 			return 1;
 		}else {
 			fprintf(stderr, "Recovery failed\n");
@@ -212,6 +713,7 @@ int recover_file_system(char *file_name)
 	}
 	else{
 		fprintf(stderr, "Clean shutdown detected\n");
+		checked_failures = checksum_failures;
 		return 1;
 	}
 }
@@ -220,15 +722,17 @@ int u_clean_shutdown()
 {
 	/* write code for cleanly shutting down the file system
 	   return 1 for success, 0 for failure */
-	sb.num_free_blocks = u_quota();
+	flush_inode_times();
+	write_bitmap();
 	
-	sb.clean_shutdown = 1;
+	//a recovery that did not finish starts again at the next mount
+	sb.clean_shutdown = checksum_failures == checked_failures && !recovery_active();
 
-	lseek(virtual_disk, BLOCK_SIZE_BYTES* SUPERBLOCK_BLOCK, SEEK_SET);
-	crash_write(virtual_disk, &sb, sizeof(superblock));
-	sync();
+	write_superblock();
+	sync_blocks();
+	discard_blocks(false);
 
-	close(virtual_disk);
+	disk_close();
 	/* is this all that needs to be done on clean shutdown? */
 	return !sb.clean_shutdown;
 }
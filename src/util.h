@@ -1,8 +1,30 @@
 #ifndef U_UTIL
 #define U_UTIL
 
-int u_format(int diskSizeBytes, char* file_name);
+#include <stdint.h>
+#include <stdbool.h>
+#include "bitmap.h"
+
+/* how u_format lays out a disk, init_format_options fills in the defaults */
+typedef struct format_options_s {
+	int64_t disk_size_bytes;
+	int block_size;
+	int bytes_per_inode;
+	bool fixed_inodes;
+	bool data_checksums;
+	int stripe_chunk; //bytes of each member between the next, with several image files
+	bool encrypt; //with keys from the passphrase crypt_set_passphrase gave
+	int64_t max_size_bytes; //the disk can be grown to, 0 for GROW_FACTOR times its size
+} format_options;
+
+int64_t parse_size(const char * text);
+void init_format_options(format_options * opts, int64_t diskSizeBytes);
+int u_format(format_options * opts, char* file_name);
 int recover_file_system(char *file_name);
+int u_fsck();
+BIT_FIELD * metadata_map();
+void note_checked_failures();
+int u_verify();
 int u_clean_shutdown();
 
 #endif
@@ -0,0 +1,305 @@
+/*
+  Crash consistency harness. Runs a fixed workload against the engine
+  once to count its disk writes, then for every write crashes before it,
+  tears it and drops it, and crashes at every occurrence of every named
+  crash point. After each crash the image is recovered with
+  recover_file_system and checked with u_verify. With --background-fsck
+  the recovery is left to run while files are read and written, as a
+  mount does, and finished before the check. With --async-reclaim unlink
+  and truncate leave their blocks on the orphan list, the workload frees
+  a few of them and recovery finishes the rest. The workload ends by
+  growing the disk by a group and shrinking it below its first size.
+
+  crashloop [--dir dir] [--size bytes] [--block-size bytes] [--data-checksums] [--encrypt] [--background-fsck] [--async-reclaim] [--jobs n] [--verbose]
+
+  Each case runs in a forked child so the crash loses all in-memory state,
+  cases are spread over --jobs worker processes with one image each.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+#include "../src/userfs.h"
+#include "../src/blocks.h"
+#include "../src/group.h"
+#include "../src/crash.h"
+#include "../src/util.h"
+#include "../src/stats.h"
+#include "../src/ops.h"
+#include "../src/dir.h"
+#include "../src/disk.h"
+#include "../src/defrag.h"
+#include "../src/recover.h"
+#include "../src/reclaim.h"
+#include "../src/crypt.h"
+
+#define CASE_COMPLETED 0
+#define CASE_CRASHED 3
+#define MAX_POINT_HITS 64
+
+static char * dir = "/tmp";
+static format_options format;
+static int jobs = 4;
+static bool verbose = false;
+static char * template;
+static int template_size;
+
+static const char * mode_names[] = {
+	[CRASH_AT_WRITE] = "crash",
+	[CRASH_TEAR_WRITE] = "tear",
+	[CRASH_DROP_WRITE] = "drop",
+	[CRASH_AT_POINT] = "point",
+};
+
+static void workload() {
+	char buf[3 * 4096 + 100];
+	char name[16];
+	defrag_report report;
+	int64_t size;
+	int i;
+
+	memset(buf, 'c', sizeof(buf));
+	for (i = 0; i < 6; i++) {
+		snprintf(name, sizeof(name), "/c%d", i);
+		u_create(name, 0666);
+		u_write(name, buf, 4096 * (i % 3 + 1), 0);
+	}
+	//everything below changes blocks a snapshot shares
+	u_snapshot("s1");
+	u_write("/c0", buf, 100, 8000);
+	u_truncate("/c1", 100);
+	u_unlink("/c2");
+	u_rename("/c3", "/r3");
+	u_rename("/c5", "/r3");
+	u_unlink("/c4");
+	//a batch of the reclaimer's, the snapshot below frees the rest
+	reclaim_step(1);
+	//the freed blocks are punched out of the image once on disk
+	u_fsync("/c0");
+	u_create("/c9", 0666);
+	u_write("/c9", buf, sizeof(buf), 0);
+	u_truncate("/c9", 5000);
+	//enough empty files to split a directory leaf
+	for (i = 0; i < LEAF_ENTRIES; i++) {
+		snprintf(name, sizeof(name), "/e%d", i);
+		u_create(name, 0666);
+	}
+	u_snapshot("s2");
+	u_unlink("/e7");
+	u_write("/c0", buf, 100, 0);
+	//two files grown a block at a time in turn, then each moved into a run
+	u_create("/d0", 0666);
+	u_create("/d1", 0666);
+	for (i = 0; i < 3; i++) {
+		u_write("/d0", buf, 100, i * BLOCK_SIZE_BYTES);
+		u_write("/d1", buf, 100, i * BLOCK_SIZE_BYTES);
+	}
+	defrag_pass(&report, 0, NULL, NULL);
+	u_delete_snapshot("s1");
+	//grown by a group, then cut back past where the files are, which moves them
+	size = (int64_t)sb.disk_size_blocks * BLOCK_SIZE_BYTES;
+	u_grow(size + BLOCKS_PER_GROUP * BLOCK_SIZE_BYTES);
+	u_write("/c0", buf, sizeof(buf), 0);
+	u_delete_snapshot("s2");
+	u_shrink(size - 16 * BLOCK_SIZE_BYTES);
+}
+
+static void restore(const char * image) {
+	int fd = open(image, O_CREAT | O_TRUNC | O_WRONLY, 0600);
+	write(fd, template, template_size);
+	close(fd);
+}
+
+static void crashed() {
+	_exit(CASE_CRASHED);
+}
+
+/* runs the workload in a child until it crashes, returns how the child ended */
+static int run_case(const char * image, int mode, uint64_t target, const char * point) {
+	int status;
+	pid_t pid;
+
+	restore(image);
+	if ((pid = fork()) == 0) {
+		crash_set_handler(crashed);
+		if (!u_mount((char *)image))
+			_exit(1);
+		if (mode == CRASH_AT_POINT)
+			init_crash_point(point, target);
+		else
+			init_crash_at(mode, target);
+		workload();
+		//never shut down cleanly, recovery always runs
+		_exit(CASE_COMPLETED);
+	}
+	waitpid(pid, &status, 0);
+	return WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+}
+
+/*
+   Uses the files the workload may have left while recovery has not
+   checked them: looks them up and reads them, writes one, which makes
+   recovery check the whole table, checks a little more in steps and then
+   creates a file, which finishes it.
+*/
+static void use_recovering() {
+	static const char * names[] = { "/c0", "/c1", "/c9", "/r3", "/d0", "/e3", "/e7" };
+	char buf[2 * 4096];
+	struct stat st;
+	int i;
+
+	for (i = 0; i < sizeof(names) / sizeof(names[0]); i++) {
+		if (u_getattr(names[i], &st) == 0)
+			u_read(names[i], buf, sizeof(buf), 0);
+	}
+	memset(buf, 'b', sizeof(buf));
+	u_write("/c1", buf, 100, 50);
+	recovery_step(1);
+	u_create("/bg", 0666);
+	u_write("/bg", buf, sizeof(buf), 0);
+}
+
+/* recovers the image left by a case and counts what is still inconsistent */
+static int check_case(const char * image, int mode, uint64_t target, const char * point) {
+	int problems;
+
+	if (!recover_file_system((char *)image)) {
+		printf("{\"mode\":\"%s\",\"target\":%lu,\"point\":\"%s\",\"error\":\"recovery failed\"}\n",
+			mode_names[mode], target, point ? point : "");
+		return 1;
+	}
+	if (recovery_active()) {
+		use_recovering();
+		recovery_finish();
+	}
+	problems = u_verify();
+	disk_close();
+	if (problems) {
+		printf("{\"mode\":\"%s\",\"target\":%lu,\"point\":\"%s\",\"problems\":%d}\n",
+			mode_names[mode], target, point ? point : "", problems);
+		fflush(stdout);
+	}
+	return problems ? 1 : 0;
+}
+
+/* worker job takes every jobs'th case, returns its failure and case counts */
+static void worker(int job, uint64_t writes, int out) {
+	char image[4096];
+	int counts[2] = { 0, 0 };
+	int mode, p, res;
+	uint64_t n, index = 0;
+
+	snprintf(image, sizeof(image), "%s/crashloop.%d.img", dir, job);
+	if (!verbose)
+		freopen("/dev/null", "w", stderr);
+
+	for (mode = CRASH_AT_WRITE; mode <= CRASH_DROP_WRITE; mode++) {
+		for (n = 1; n <= writes; n++) {
+			if (index++ % jobs != job)
+				continue;
+			res = run_case(image, mode, n, NULL);
+			if (res != CASE_CRASHED && res != CASE_COMPLETED) {
+				printf("{\"mode\":\"%s\",\"target\":%lu,\"error\":\"exit %d\"}\n", mode_names[mode], n, res);
+				counts[0]++;
+			} else {
+				counts[0] += check_case(image, mode, n, NULL);
+			}
+			counts[1]++;
+		}
+	}
+	for (p = 0; crash_points[p] != NULL; p++) {
+		if (index++ % jobs != job)
+			continue;
+		for (n = 1; n <= MAX_POINT_HITS; n++) {
+			res = run_case(image, CRASH_AT_POINT, n, crash_points[p]);
+			counts[0] += check_case(image, CRASH_AT_POINT, n, crash_points[p]);
+			counts[1]++;
+			if (res != CASE_CRASHED)
+				break;
+		}
+	}
+	unlink(image);
+	write(out, counts, sizeof(counts));
+	exit(0);
+}
+
+int main(int argc, char **argv) {
+	char image[4096];
+	int argi, j, fd, counts[2], failures = 0, cases = 0;
+	int pipes[2];
+	uint64_t writes, start;
+	double seconds;
+
+	//room for the snapshots in the workload to hold blocks without filling the disk
+	init_format_options(&format, 512 * 1024);
+	for (argi = 1; argi < argc; argi++) {
+		if (strcmp(argv[argi], "--dir") == 0 && argi + 1 < argc) {
+			dir = argv[++argi];
+		} else if (strcmp(argv[argi], "--size") == 0 && argi + 1 < argc) {
+			format.disk_size_bytes = parse_size(argv[++argi]);
+		} else if (strcmp(argv[argi], "--block-size") == 0 && argi + 1 < argc) {
+			format.block_size = parse_size(argv[++argi]);
+		} else if (strcmp(argv[argi], "--data-checksums") == 0) {
+			format.data_checksums = true;
+		} else if (strcmp(argv[argi], "--encrypt") == 0) {
+			format.encrypt = true;
+			crypt_set_passphrase("crashloop");
+		} else if (strcmp(argv[argi], "--background-fsck") == 0) {
+			recovery_set_background(true);
+		} else if (strcmp(argv[argi], "--async-reclaim") == 0) {
+			reclaim_set_background(true);
+		} else if (strcmp(argv[argi], "--jobs") == 0 && argi + 1 < argc) {
+			jobs = atoi(argv[++argi]);
+		} else if (strcmp(argv[argi], "--verbose") == 0) {
+			verbose = true;
+		} else {
+			fprintf(stderr, "Usage: %s [--dir dir] [--size bytes] [--block-size bytes] [--data-checksums] [--encrypt] [--background-fsck] [--async-reclaim] [--jobs n] [--verbose]\n", argv[0]);
+			return -1;
+		}
+	}
+
+	//format once, every case starts from a copy of this image
+	snprintf(image, sizeof(image), "%s/crashloop.template.img", dir);
+	unlink(image);
+	if (!u_format(&format, image))
+		return -1;
+	template = malloc(format.disk_size_bytes);
+	fd = open(image, O_RDONLY);
+	template_size = read(fd, template, format.disk_size_bytes);
+	close(fd);
+
+	//count the writes the workload does after mounting
+	if (!u_mount(image))
+		return -1;
+	init_crash_at(CRASH_COUNT, 0);
+	workload();
+	writes = crash_writes;
+	init_crash_at(CRASH_OFF, 0);
+	disk_close();
+	unlink(image);
+	fprintf(stderr, "workload does %lu writes\n", writes);
+
+	start = stats_now();
+	pipe(pipes);
+	for (j = 0; j < jobs; j++) {
+		if (fork() == 0)
+			worker(j, writes, pipes[1]);
+	}
+	for (j = 0; j < jobs; j++) {
+		read(pipes[0], counts, sizeof(counts));
+		failures += counts[0];
+		cases += counts[1];
+	}
+	while (wait(NULL) > 0)
+		;
+	seconds = (stats_now() - start) / 1e9;
+
+	printf("{\"writes\":%lu,\"cases\":%d,\"failures\":%d,\"seconds\":%.3f,\"cases_per_minute\":%.0f}\n",
+		writes, cases, failures, seconds, seconds > 0 ? cases * 60 / seconds : 0);
+	free(template);
+	return failures ? 1 : 0;
+}
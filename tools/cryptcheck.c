@@ -0,0 +1,21 @@
+/*
+  Runs the known answer tests of the cipher on this processor and prints
+  the paths it checked as JSON. Exits non zero when any answer is wrong.
+
+  cryptcheck
+
+  SHA-256 is checked against FIPS 180-2, PBKDF2-HMAC-SHA256 against RFC
+  7914 and the RFC 6070 inputs, and AES-256-XTS against IEEE 1619-2007
+  vectors 10 to 14 in software and with AES-NI and VAES when the
+  processor has them. A mount runs the same tests before it uses a key.
+*/
+#include <stdio.h>
+#include <stdbool.h>
+#include "../src/crypt.h"
+
+int main(int argc, char **argv) {
+	bool ok = crypt_self_test();
+	printf("{\"checked\":[\"sha256\",\"pbkdf2\",\"xts_sw\"%s%s],\"passed\":%s}\n",
+		aes_hw() ? ",\"xts_aesni\"" : "", aes_vaes() ? ",\"xts_vaes\"" : "", ok ? "true" : "false");
+	return ok ? 0 : 1;
+}
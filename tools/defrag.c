@@ -0,0 +1,49 @@
+/*
+  Defragments an unmounted image and prints what it did as JSON.
+
+  defrag [--rate blocks/s] [--meta-disk file] disk
+
+  Mounts the image with the engine in libuserfs.a, moves every file in
+  more than one extent into a run of free blocks, the most fragmented
+  first, and unmounts cleanly. --rate limits how many blocks a second
+  are copied. A mounted file system is defragmented in the background
+  with fuserfs --defrag instead.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/userfs.h"
+#include "../src/disk.h"
+#include "../src/ops.h"
+#include "../src/defrag.h"
+
+int main(int argc, char **argv) {
+	char json[256];
+	char * disk = NULL;
+	int argi, rate = 0;
+	defrag_report r;
+
+	for (argi = 1; argi < argc; argi++) {
+		if (strcmp(argv[argi], "--rate") == 0 && argi + 1 < argc) {
+			rate = atoi(argv[++argi]);
+		} else if (strcmp(argv[argi], "--meta-disk") == 0 && argi + 1 < argc) {
+			disk_set_meta(argv[++argi]);
+		} else if (disk == NULL && argv[argi][0] != '-') {
+			disk = argv[argi];
+		} else {
+			disk = NULL;
+			break;
+		}
+	}
+	if (disk == NULL) {
+		fprintf(stderr, "Usage: %s [--rate blocks/s] [--meta-disk file] disk\n", argv[0]);
+		return -1;
+	}
+	if (!u_mount(disk))
+		return -1;
+	defrag_pass(&r, rate, NULL, NULL);
+	u_unmount();
+	defrag_report_json(&r, json, sizeof(json));
+	fputs(json, stdout);
+	return 0;
+}
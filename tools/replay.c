@@ -0,0 +1,368 @@
+/*
+  Re-issues an operation trace recorded with fuserfs --record.
+
+  replay [--engine image | --mount dir] [--size bytes] [--block-size bytes] [--timed] [--threads n] tracefile
+
+  --engine formats a fresh image and calls the engine in libuserfs.a
+  directly, --mount issues the equivalent system calls against a mounted
+  fresh filesystem. By default requests are sent as fast as possible,
+  --timed keeps the recorded start times. Requests are split into
+  independent groups of files (a rename joins its two names) and groups
+  are replayed in parallel on --threads threads, each group in its
+  recorded order. One JSON object per operation type is printed.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "../src/blocks.h"
+#include "../src/stats.h"
+#include "../src/record.h"
+#include "../src/util.h"
+#include "../src/ops.h"
+
+typedef struct replay_op_s {
+	record rec;
+	char path[UINT8_MAX + 1];
+	char new_path[UINT8_MAX + 1];
+	int group;
+	uint64_t latency_ns;
+	int result;
+} replay_op;
+
+static replay_op * ops;
+static int num_ops;
+static int * parent; //union find over path ids, one id per distinct path
+static char ** paths;
+static int num_paths;
+
+static char * image = NULL;
+static char * mount_dir = NULL;
+static format_options format;
+static bool timed = false;
+static int num_threads = 1;
+static uint64_t replay_start;
+static size_t max_io;
+
+//calls into the engine take turns in it, writes share it with each other as they do in a mount
+static pthread_rwlock_t engine_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+static int path_id(const char * path) {
+	int i;
+	for (i = 0; i < num_paths; i++) {
+		if (strcmp(paths[i], path) == 0)
+			return i;
+	}
+	paths = realloc(paths, (num_paths + 1) * sizeof(char *));
+	parent = realloc(parent, (num_paths + 1) * sizeof(int));
+	paths[num_paths] = strdup(path);
+	parent[num_paths] = num_paths;
+	return num_paths++;
+}
+
+static int find(int id) {
+	while (parent[id] != id)
+		id = parent[id] = parent[parent[id]];
+	return id;
+}
+
+static int load(const char * file_name) {
+	FILE * in;
+	record_file_header header;
+	int cap = 0;
+	replay_op * op;
+
+	if ((in = fopen(file_name, "rb")) == NULL) {
+		fprintf(stderr, "Unable to open %s\n", file_name);
+		return 0;
+	}
+	if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != RECORD_MAGIC) {
+		fprintf(stderr, "%s is not a userfs operation trace\n", file_name);
+		fclose(in);
+		return 0;
+	}
+	for (;;) {
+		if (num_ops == cap) {
+			cap = cap ? cap * 2 : 4096;
+			ops = realloc(ops, cap * sizeof(replay_op));
+		}
+		op = &ops[num_ops];
+		memset(op, 0, sizeof(replay_op));
+		if (fread(&op->rec, sizeof(record), 1, in) != 1)
+			break;
+		if (fread(op->path, 1, op->rec.path_len, in) != op->rec.path_len
+				|| fread(op->new_path, 1, op->rec.new_path_len, in) != op->rec.new_path_len) {
+			fprintf(stderr, "Truncated trace, replaying %d requests\n", num_ops);
+			break;
+		}
+		if (op->rec.size > max_io)
+			max_io = op->rec.size;
+		num_ops++;
+	}
+	fclose(in);
+	return 1;
+}
+
+/* every path touched together ends up in the same group */
+static void group() {
+	int i, a, b;
+	for (i = 0; i < num_ops; i++) {
+		a = find(path_id(ops[i].path));
+		if (ops[i].rec.new_path_len) {
+			b = find(path_id(ops[i].new_path));
+			parent[b] = a;
+		}
+	}
+	for (i = 0; i < num_ops; i++)
+		ops[i].group = find(path_id(ops[i].path));
+}
+
+static int count_entry(void * buf, const char * name, const struct stat * stbuf, off_t offset) {
+	(*(int *)buf)++;
+	return 0;
+}
+
+static int engine_op(replay_op * op, char * buf) {
+	struct stat st;
+	int entries = 0;
+	int res;
+	record * rec = &op->rec;
+
+	if (rec->op == S_WRITE) {
+		pthread_rwlock_rdlock(&engine_lock);
+		res = u_write_shared(op->path, buf, rec->size, rec->offset);
+		pthread_rwlock_unlock(&engine_lock);
+		if (res != -EAGAIN)
+			return res;
+	}
+	pthread_rwlock_wrlock(&engine_lock);
+	switch (rec->op) {
+	case S_GETATTR:
+		res = u_getattr(op->path, &st);
+		break;
+	case S_READDIR:
+		res = u_readdir(op->path, &entries, count_entry, rec->offset);
+		break;
+	case S_OPEN:
+		res = u_open(op->path);
+		break;
+	case S_READ:
+		res = u_read(op->path, buf, rec->size, rec->offset);
+		break;
+	case S_WRITE:
+		res = u_write(op->path, buf, rec->size, rec->offset);
+		break;
+	case S_CREATE:
+		res = u_create(op->path, 0666);
+		break;
+	case S_TRUNCATE:
+		res = u_truncate(op->path, rec->offset);
+		break;
+	case S_UNLINK:
+		res = u_unlink(op->path);
+		break;
+	case S_RENAME:
+		res = u_rename(op->path, op->new_path);
+		break;
+	case S_FSYNC:
+		res = u_fsync(op->path);
+		break;
+	default: //chown, chmod and utimens do nothing
+		res = 0;
+	}
+	pthread_rwlock_unlock(&engine_lock);
+	return res;
+}
+
+static int mount_op(replay_op * op, char * buf) {
+	char path[PATH_MAX], new_path[PATH_MAX];
+	struct stat st;
+	record * rec = &op->rec;
+	DIR * dir;
+	int fd, res = 0;
+
+	snprintf(path, sizeof(path), "%s%s", mount_dir, op->path);
+	snprintf(new_path, sizeof(new_path), "%s%s", mount_dir, op->new_path);
+
+	switch (rec->op) {
+	case S_GETATTR:
+		res = stat(path, &st);
+		break;
+	case S_READDIR:
+		if ((dir = opendir(path)) == NULL)
+			return -errno;
+		while (readdir(dir) != NULL)
+			;
+		closedir(dir);
+		break;
+	case S_OPEN:
+		if ((fd = open(path, O_RDONLY)) < 0)
+			return -errno;
+		close(fd);
+		break;
+	case S_READ:
+		if ((fd = open(path, O_RDONLY)) < 0)
+			return -errno;
+		res = pread(fd, buf, rec->size, rec->offset);
+		close(fd);
+		break;
+	case S_WRITE:
+		if ((fd = open(path, O_WRONLY)) < 0)
+			return -errno;
+		res = pwrite(fd, buf, rec->size, rec->offset);
+		close(fd);
+		break;
+	case S_CREATE:
+		if ((fd = open(path, O_WRONLY | O_CREAT | O_EXCL, 0666)) < 0)
+			return -errno;
+		close(fd);
+		break;
+	case S_TRUNCATE:
+		res = truncate(path, rec->offset);
+		break;
+	case S_UNLINK:
+		res = unlink(path);
+		break;
+	case S_RENAME:
+		res = rename(path, new_path);
+		break;
+	case S_FSYNC:
+		if ((fd = open(path, O_WRONLY)) < 0)
+			return -errno;
+		res = fsync(fd);
+		close(fd);
+		break;
+	}
+	return res < 0 ? -errno : res;
+}
+
+static void wait_until(uint64_t start_ns) {
+	struct timespec delay;
+	uint64_t now = stats_now() - replay_start;
+	if (start_ns <= now)
+		return;
+	delay.tv_sec = (start_ns - now) / 1000000000ULL;
+	delay.tv_nsec = (start_ns - now) % 1000000000ULL;
+	nanosleep(&delay, NULL);
+}
+
+static void * replay_thread(void * arg) {
+	long thread = (long)arg;
+	char * buf = malloc(max_io ? max_io : 1);
+	uint64_t start;
+	int i;
+
+	memset(buf, 'r', max_io);
+	for (i = 0; i < num_ops; i++) {
+		replay_op * op = &ops[i];
+		if (op->group % num_threads != thread)
+			continue;
+		if (timed)
+			wait_until(op->rec.start_ns);
+		start = stats_now();
+		op->result = mount_dir ? mount_op(op, buf) : engine_op(op, buf);
+		op->latency_ns = stats_now() - start;
+	}
+	free(buf);
+	return NULL;
+}
+
+static int by_value(const void * a, const void * b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void report(double seconds) {
+	uint64_t * latencies = malloc(num_ops * sizeof(uint64_t));
+	uint64_t recorded;
+	int op, i, n, mismatches;
+
+	for (op = 0; op < S_READ_BLOCK; op++) {
+		n = mismatches = 0;
+		recorded = 0;
+		for (i = 0; i < num_ops; i++) {
+			if (ops[i].rec.op != op)
+				continue;
+			latencies[n++] = ops[i].latency_ns;
+			recorded += ops[i].rec.duration_ns;
+			if (ops[i].result != ops[i].rec.result)
+				mismatches++;
+		}
+		if (n == 0)
+			continue;
+		qsort(latencies, n, sizeof(uint64_t), by_value);
+		printf("{\"op\":\"%s\",\"count\":%d,\"result_mismatches\":%d,\"recorded_avg_us\":%.2f,"
+			"\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f}\n",
+			stats_name(op), n, mismatches, recorded / 1000.0 / n,
+			latencies[(n - 1) / 2] / 1000.0, latencies[(int)((n - 1) * 0.9)] / 1000.0,
+			latencies[(int)((n - 1) * 0.99)] / 1000.0, latencies[n - 1] / 1000.0);
+	}
+	printf("{\"op\":\"total\",\"count\":%d,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"threads\":%d,\"timed\":%s}\n",
+		num_ops, seconds, seconds > 0 ? num_ops / seconds : 0, num_threads, timed ? "true" : "false");
+	free(latencies);
+}
+
+int main(int argc, char **argv) {
+	pthread_t * threads;
+	char * trace = NULL;
+	int argi;
+	long t;
+
+	init_format_options(&format, 4 * 1024 * 1024 - 4096);
+	for (argi = 1; argi < argc; argi++) {
+		if (strcmp(argv[argi], "--engine") == 0 && argi + 1 < argc) {
+			image = argv[++argi];
+		} else if (strcmp(argv[argi], "--mount") == 0 && argi + 1 < argc) {
+			mount_dir = argv[++argi];
+		} else if (strcmp(argv[argi], "--size") == 0 && argi + 1 < argc) {
+			format.disk_size_bytes = parse_size(argv[++argi]);
+		} else if (strcmp(argv[argi], "--block-size") == 0 && argi + 1 < argc) {
+			format.block_size = parse_size(argv[++argi]);
+		} else if (strcmp(argv[argi], "--threads") == 0 && argi + 1 < argc) {
+			num_threads = atoi(argv[++argi]);
+		} else if (strcmp(argv[argi], "--timed") == 0) {
+			timed = true;
+		} else if (trace == NULL && argv[argi][0] != '-') {
+			trace = argv[argi];
+		} else {
+			trace = NULL;
+			break;
+		}
+	}
+	if (trace == NULL || (image == NULL) == (mount_dir == NULL) || num_threads < 1) {
+		fprintf(stderr, "Usage: %s [--engine image | --mount dir] [--size bytes] [--block-size bytes] [--timed] [--threads n] tracefile\n",
+			argv[0]);
+		return -1;
+	}
+
+	if (!load(trace))
+		return -1;
+	group();
+
+	if (image != NULL) {
+		unlink(image);
+		if (!u_format(&format, image) || !u_mount(image))
+			return -1;
+	}
+
+	threads = malloc(num_threads * sizeof(pthread_t));
+	replay_start = stats_now();
+	for (t = 0; t < num_threads; t++)
+		pthread_create(&threads[t], NULL, replay_thread, (void *)t);
+	for (t = 0; t < num_threads; t++)
+		pthread_join(threads[t], NULL);
+	report((stats_now() - replay_start) / 1e9);
+
+	if (image != NULL)
+		u_unmount();
+	free(threads);
+	return 0;
+}
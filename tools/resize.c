@@ -0,0 +1,53 @@
+/*
+  Grows or shrinks an unmounted image.
+
+  resize [--meta-disk file] disk size[K|M|G|T]
+
+  Mounts the image with the engine in libuserfs.a, resizes it and
+  unmounts cleanly. Shrinking copies every block in use past the new end
+  in front of it first, and needs a disk without snapshots. A mounted
+  file system is grown by writing "grow SIZE" to its control file.
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../src/userfs.h"
+#include "../src/blocks.h"
+#include "../src/disk.h"
+#include "../src/util.h"
+#include "../src/ops.h"
+
+int main(int argc, char **argv) {
+	char * disk = NULL, * size = NULL;
+	int64_t bytes, old_bytes;
+	int argi, res;
+
+	for (argi = 1; argi < argc; argi++) {
+		if (strcmp(argv[argi], "--meta-disk") == 0 && argi + 1 < argc) {
+			disk_set_meta(argv[++argi]);
+		} else if (disk == NULL && argv[argi][0] != '-') {
+			disk = argv[argi];
+		} else if (size == NULL && argv[argi][0] != '-') {
+			size = argv[argi];
+		} else {
+			size = NULL;
+			break;
+		}
+	}
+	if (size == NULL) {
+		fprintf(stderr, "Usage: %s [--meta-disk file] disk size[K|M|G|T]\n", argv[0]);
+		return -1;
+	}
+	bytes = parse_size(size);
+	if (!u_mount(disk))
+		return -1;
+	old_bytes = sb.disk_size_blocks * BLOCK_SIZE_BYTES;
+	res = bytes > old_bytes ? u_grow(bytes) : u_shrink(bytes);
+	if (res < 0)
+		fprintf(stderr, "Unable to resize %s to %ld bytes: %s\n", disk, bytes, strerror(-res));
+	else
+		printf("{\"old_bytes\":%ld,\"new_bytes\":%ld,\"free_blocks\":%ld}\n",
+			old_bytes, sb.disk_size_blocks * BLOCK_SIZE_BYTES, sb.num_free_blocks);
+	u_unmount();
+	return res < 0 ? -1 : 0;
+}
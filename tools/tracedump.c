@@ -0,0 +1,83 @@
+/*
+  Decodes a trace file written by fuserfs --trace into text, one event per
+  line, merged across threads in timestamp order.
+
+  tracedump [tracefile]
+*/
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include "../src/trace.h"
+
+typedef struct decoded_s {
+	trace_event ev;
+	uint32_t thread;
+} decoded;
+
+static int by_time(const void * a, const void * b) {
+	const decoded * x = a;
+	const decoded * y = b;
+	if (x->ev.timestamp_ns != y->ev.timestamp_ns)
+		return x->ev.timestamp_ns < y->ev.timestamp_ns ? -1 : 1;
+	return 0;
+}
+
+int main(int argc, char **argv) {
+	FILE * in;
+	trace_file_header header;
+	trace_ring_header ring_header;
+	decoded * all = NULL;
+	size_t count = 0, cap = 0;
+	uint32_t r, i;
+	uint64_t start;
+
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s [tracefile]\n", argv[0]);
+		return -1;
+	}
+	if ((in = fopen(argv[1], "rb")) == NULL) {
+		fprintf(stderr, "Unable to open %s\n", argv[1]);
+		return -1;
+	}
+	if (fread(&header, sizeof(header), 1, in) != 1 || header.magic != TRACE_MAGIC
+			|| header.event_size != sizeof(trace_event)) {
+		fprintf(stderr, "%s is not a userfs trace\n", argv[1]);
+		return -1;
+	}
+
+	for (r = 0; r < header.num_rings; r++) {
+		if (fread(&ring_header, sizeof(ring_header), 1, in) != 1) {
+			fprintf(stderr, "Truncated trace\n");
+			return -1;
+		}
+		if (ring_header.dropped)
+			fprintf(stderr, "thread %u: %" PRIu64 " older events overwritten\n",
+				ring_header.thread, ring_header.dropped);
+		for (i = 0; i < ring_header.num_events; i++) {
+			if (count == cap) {
+				cap = cap ? cap * 2 : 1024;
+				all = realloc(all, cap * sizeof(decoded));
+			}
+			if (fread(&all[count].ev, sizeof(trace_event), 1, in) != 1) {
+				fprintf(stderr, "Truncated trace\n");
+				return -1;
+			}
+			all[count].thread = ring_header.thread;
+			count++;
+		}
+	}
+	fclose(in);
+
+	qsort(all, count, sizeof(decoded), by_time);
+	start = count ? all[0].ev.timestamp_ns : 0;
+	printf("# usec thread op inode offset length block\n");
+	for (i = 0; i < count; i++) {
+		trace_event * ev = &all[i].ev;
+		printf("%12.3f %3u %-18s %6d %10" PRId64 " %8u %8" PRId64 "\n",
+			(ev->timestamp_ns - start) / 1000.0, all[i].thread,
+			trace_op_name(ev->op), ev->inode, ev->offset, ev->length, ev->block);
+	}
+	free(all);
+	return 0;
+}